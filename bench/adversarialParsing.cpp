@@ -0,0 +1,379 @@
+// Worst case cost of one received message: crafted families of hostile
+// messages (hundreds of tiny attributes, unknown comprehension-required
+// attributes, maximal lengths, credentials behind long attribute chains, a
+// CreatePermission full of peers) then a mutation search keeping the slowest
+// variants, for the codec alone (parse and attribute lookups) and for the
+// whole server path (classification, auth, TURN). Valid credentials are used
+// so that the search reaches the authenticated paths.
+//
+//   bench-adversarial-parsing [iterations=3000] [seed=1]
+//
+// The result is the worst ns per packet found, against a plain Binding
+// request; STUN_MAX_MESSAGE_SIZE and STUN_MAX_ATTRIBUTES bound it.
+
+#include "auth.hpp"
+#include "stunMessage.hpp"
+#include "stunServer.hpp"
+#include "worker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  // Largest datagram the UDP listeners take
+  constexpr std::size_t MAX_DATAGRAM = 2048;
+  constexpr unsigned SEARCH_REPS     = 40;
+  constexpr unsigned REPORT_REPS     = 400;
+
+  // Looked up by the server on the way of a request
+  const uint16_t LOOKUPS[] = {ATTR_REALM, ATTR_MESSAGE_INTEGRITY, ATTR_ACCESS_TOKEN, ATTR_USERNAME,
+      ATTR_NONCE, ATTR_REQUESTED_TRANSPORT, ATTR_LIFETIME, ATTR_CHANNEL_NUMBER, ATTR_XOR_PEER_ADDRESS};
+
+  const uint16_t METHODS[] = {METHOD_BINDING, METHOD_ALLOCATE, METHOD_REFRESH, METHOD_CREATE_PERMISSION,
+      METHOD_CHANNEL_BIND};
+
+  struct Attribute
+  {
+    uint16_t type;
+    std::vector<uint8_t> value;
+  };
+
+  struct Candidate
+  {
+    uint16_t method = METHOD_BINDING;
+    std::vector<Attribute> attributes;
+    bool sign = false; // MESSAGE-INTEGRITY with the test user key
+  };
+
+  class NullSender : public ClientSender {
+    public:
+      void sendToClient(const uint8_t*, std::size_t, const udp::endpoint&) override {}
+      std::shared_ptr<ClientSender> retain() override
+      {
+        return std::shared_ptr<ClientSender>(this, [](ClientSender*) {});
+      }
+  };
+
+  std::vector<uint8_t> bytes(const std::string& s) { return std::vector<uint8_t>(s.begin(), s.end()); }
+
+  std::vector<uint8_t> xorPeer(uint32_t address, const uint8_t trans_id[12])
+  {
+    std::vector<uint8_t> out;
+    StunMessageBuilder builder(out, BINDING_REQUEST, trans_id);
+    builder.addXorAddress(ATTR_XOR_PEER_ADDRESS, udp::endpoint(boost::asio::ip::address_v4(address), 3478));
+    return std::vector<uint8_t>(out.begin() + STUN_HEADER_SIZE + 4, out.end());
+  }
+
+  class Harness {
+    public:
+      Harness()
+          : _server(makeConfig())
+          , _worker(0)
+      {
+        std::memset(_transaction, 7, sizeof(_transaction));
+
+        const std::string input = "alice:test.org:secret";
+        unsigned length         = 0;
+        EVP_Digest(input.data(), input.size(), _key.bytes.data(), &length, EVP_md5(), nullptr);
+        _key.length = length;
+
+        // A nonce from a challenge, then an allocation for the TURN requests
+        Candidate allocate;
+        allocate.method = METHOD_ALLOCATE;
+        allocate.attributes.push_back({ATTR_REQUESTED_TRANSPORT, {17, 0, 0, 0}});
+        std::vector<uint8_t> msg = encode(allocate), resp;
+        RequestContext ctx       = context();
+        _server.handleMessage(ctx, msg.data(), msg.size(), resp);
+        StunMessage challenge;
+        StunAttribute nonce;
+        if (!challenge.parse(resp.data(), resp.size()) || !challenge.find(ATTR_NONCE, nonce))
+          throw std::runtime_error("no challenge from the server");
+        _nonce.assign(nonce.value, nonce.value + nonce.length);
+
+        msg = encode(credentials(allocate));
+        _server.handleMessage(ctx, msg.data(), msg.size(), resp);
+      }
+
+      const uint8_t* transaction() const { return _transaction; }
+
+      // Adds USERNAME, REALM, NONCE and signs
+      Candidate credentials(Candidate c) const
+      {
+        c.attributes.push_back({ATTR_USERNAME, bytes("alice")});
+        c.attributes.push_back({ATTR_REALM, bytes("test.org")});
+        c.attributes.push_back({ATTR_NONCE, _nonce});
+        c.sign = true;
+        return c;
+      }
+
+      std::vector<uint8_t> encode(const Candidate& c) const
+      {
+        std::vector<uint8_t> out;
+        StunMessageBuilder builder(out, messageType(c.method, CLASS_REQUEST), _transaction);
+        for (const auto& attr : c.attributes)
+          builder.addAttribute(attr.type, attr.value.data(), static_cast<uint16_t>(attr.value.size()));
+        if (c.sign)
+          LongTermAuth::sign(out, _key);
+        return out;
+      }
+
+      double codecNs(const std::vector<uint8_t>& msg, unsigned reps) const
+      {
+        return measure(reps, [&] {
+          StunMessage parsed;
+          if (!parsed.parse(msg.data(), msg.size()))
+            return;
+          StunAttribute attr;
+          for (const uint16_t type : LOOKUPS)
+            _sink += parsed.find(type, attr);
+        });
+      }
+
+      double serverNs(const std::vector<uint8_t>& msg, unsigned reps)
+      {
+        return measure(reps, [&] {
+          RequestContext ctx = context();
+          _sink += _server.handleMessage(ctx, msg.data(), msg.size(), _response);
+        });
+      }
+
+    private:
+      static ServerConfig makeConfig()
+      {
+        ServerConfig config;
+        ListenerConfig listener;
+        listener.address = boost::asio::ip::address_v4::loopback();
+        listener.port    = 0;
+        config.listeners.push_back(listener);
+        config.tenants[DEFAULT_TENANT].realm = "test.org";
+        config.tenants[DEFAULT_TENANT].users.emplace_back("alice", "secret");
+        config.turn.enabled         = true;
+        config.turn.relayAddress    = boost::asio::ip::address_v4::loopback();
+        config.turn.externalAddress = boost::asio::ip::make_address("192.0.2.1");
+        config.turn.virtualRelays   = true;
+        config.responseCacheEntries = 0; // every repetition goes the whole way
+        return config;
+      }
+
+      RequestContext context()
+      {
+        const udp::endpoint remote(boost::asio::ip::make_address("198.51.100.1"), 40000);
+        return RequestContext {_worker, Transport::Udp, remote, remote, &_sender, DEFAULT_TENANT};
+      }
+
+      // Best of a few batches, ns per call
+      template<typename F>
+      static double measure(unsigned reps, F f)
+      {
+        double best = 1e18;
+        for (int batch = 0; batch < 3; ++batch)
+        {
+          const auto start = std::chrono::steady_clock::now();
+          for (unsigned i = 0; i < reps; ++i)
+            f();
+          const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start).count();
+          best = std::min(best, double(ns) / reps);
+        }
+        return best;
+      }
+
+    private:
+      StunServer _server;
+      Worker _worker;
+      NullSender _sender;
+      uint8_t _transaction[12];
+      AuthKey _key;
+      std::vector<uint8_t> _nonce;
+      std::vector<uint8_t> _response;
+      mutable uint64_t _sink = 0;
+  };
+
+  // Fills the message with copies of attr, up to the largest datagram
+  Candidate fill(const Harness& harness, Candidate c, const Attribute& attr)
+  {
+    while (harness.encode(c).size() + 4 + attr.value.size() + 3 <= MAX_DATAGRAM)
+      c.attributes.insert(c.attributes.begin(), attr);
+    return c;
+  }
+
+  std::vector<std::pair<const char*, Candidate>> families(const Harness& harness)
+  {
+    std::vector<std::pair<const char*, Candidate>> out;
+    Candidate binding;
+    out.emplace_back("binding request", binding);
+    out.emplace_back("tiny attributes", fill(harness, binding, {0x8055, {}}));
+    out.emplace_back("unknown required", fill(harness, binding, {0x0055, {1, 2, 3, 4}}));
+
+    Candidate longest = binding;
+    longest.attributes.push_back({ATTR_SOFTWARE, std::vector<uint8_t>(MAX_DATAGRAM - STUN_HEADER_SIZE - 4, 'x')});
+    out.emplace_back("maximal length", longest);
+
+    Candidate allocate;
+    allocate.method = METHOD_ALLOCATE;
+    allocate.attributes.push_back({ATTR_REQUESTED_TRANSPORT, {17, 0, 0, 0}});
+    out.emplace_back("credentials last", fill(harness, harness.credentials(allocate), {0x8055, {}}));
+
+    // As many peers as fit, every one a new permission
+    Candidate permission;
+    permission.method = METHOD_CREATE_PERMISSION;
+    permission        = harness.credentials(permission);
+    for (uint32_t peer = 1; harness.encode(permission).size() + 12 <= MAX_DATAGRAM; ++peer)
+      permission.attributes.insert(permission.attributes.begin(),
+          {ATTR_XOR_PEER_ADDRESS, xorPeer(0xCB007100u + peer, harness.transaction())});
+    out.emplace_back("peer addresses", permission);
+    return out;
+  }
+
+  Candidate mutate(const Harness& harness, Candidate c, std::mt19937_64& rng)
+  {
+    auto pick = [&rng](std::size_t n) { return static_cast<std::size_t>(rng() % n); };
+    const auto position = [&] { return c.attributes.begin() + pick(c.attributes.size() + 1); };
+
+    switch (pick(6))
+    {
+      case 0: // a new attribute, tiny or not
+      {
+        const uint16_t type = pick(2) ? LOOKUPS[pick(sizeof(LOOKUPS) / sizeof(LOOKUPS[0]))]
+                                      : static_cast<uint16_t>(rng());
+        c.attributes.insert(position(), {type, std::vector<uint8_t>(pick(2) ? 0 : pick(64), 0x41)});
+        break;
+      }
+      case 1:
+        if (!c.attributes.empty())
+          c.attributes.erase(c.attributes.begin() + pick(c.attributes.size()));
+        break;
+      case 2: // runs of the same attribute
+        if (!c.attributes.empty())
+        {
+          const Attribute attr = c.attributes[pick(c.attributes.size())];
+          c.attributes.insert(c.attributes.begin() + pick(c.attributes.size() + 1), pick(16) + 1, attr);
+        }
+        break;
+      case 3:
+        if (!c.attributes.empty())
+          c.attributes[pick(c.attributes.size())].value.resize(pick(2) ? 0 : pick(512), 0x42);
+        break;
+      case 4:
+        c.method = METHODS[pick(sizeof(METHODS) / sizeof(METHODS[0]))];
+        break;
+      case 5:
+        c = pick(2) ? harness.credentials(c) : c;
+        c.sign = !c.sign;
+        break;
+    }
+
+    // Trimmed to what a datagram can carry
+    while (!c.attributes.empty() && harness.encode(c).size() > MAX_DATAGRAM)
+      c.attributes.erase(c.attributes.begin() + pick(c.attributes.size()));
+    return c;
+  }
+
+  template<typename Cost>
+  std::pair<Candidate, double> search(const Harness& harness, const Candidate& start, unsigned iterations,
+      std::mt19937_64& rng, Cost cost)
+  {
+    Candidate best  = start;
+    double bestCost = cost(harness.encode(best), SEARCH_REPS);
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+      const Candidate next = mutate(harness, best, rng);
+      const double nextCost = cost(harness.encode(next), SEARCH_REPS);
+      if (nextCost > bestCost)
+      {
+        best     = next;
+        bestCost = nextCost;
+      }
+    }
+    return {best, cost(harness.encode(best), REPORT_REPS)};
+  }
+
+  void printRow(const char* name, const Harness& harness, const Candidate& c, double codec, double server)
+  {
+    const auto msg = harness.encode(c);
+    StunMessage parsed;
+    std::printf("%-22s %6zu %6zu %8s %10.0f %10.0f\n", name, msg.size(), c.attributes.size() + c.sign,
+        parsed.parse(msg.data(), msg.size()) ? "yes" : "no", codec, server);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  spdlog::set_level(spdlog::level::off);
+
+  unsigned iterations = 3000;
+  uint64_t seed       = 1;
+  for (int i = 1; i < argc; ++i)
+  {
+    const char* arg = argv[i];
+    if (std::strncmp(arg, "iterations=", 11) == 0)
+      iterations = static_cast<unsigned>(std::strtoul(arg + 11, nullptr, 10));
+    else if (std::strncmp(arg, "seed=", 5) == 0)
+      seed = std::strtoull(arg + 5, nullptr, 10);
+    else
+    {
+      std::fprintf(stderr, "usage: %s [iterations=3000] [seed=1]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Harness harness;
+  std::mt19937_64 rng(seed);
+
+  std::printf("Limits: %zu bytes, %zu attributes\n\n", STUN_MAX_MESSAGE_SIZE, STUN_MAX_ATTRIBUTES);
+  std::printf("%-22s %6s %6s %8s %10s %10s\n", "message", "bytes", "attrs", "accepted", "codec ns", "server ns");
+
+  const auto seeds = families(harness);
+  double baseline = 0, worstCodec = 0, worstServer = 0;
+  for (const auto& family : seeds)
+  {
+    const auto msg      = harness.encode(family.second);
+    const double codec  = harness.codecNs(msg, REPORT_REPS);
+    const double server = harness.serverNs(msg, REPORT_REPS);
+    printRow(family.first, harness, family.second, codec, server);
+    if (baseline == 0)
+      baseline = server;
+    worstCodec  = std::max(worstCodec, codec);
+    worstServer = std::max(worstServer, server);
+  }
+
+  // Hill climbing from every family, each search gets its share of the iterations
+  const unsigned share = std::max(1u, iterations / static_cast<unsigned>(seeds.size()));
+  Candidate slowestCodec, slowestServer;
+  double codecFound = 0, serverFound = 0;
+  for (const auto& family : seeds)
+  {
+    auto found = search(harness, family.second, share / 2, rng,
+        [&](const std::vector<uint8_t>& msg, unsigned reps) { return harness.codecNs(msg, reps); });
+    if (found.second > codecFound)
+      std::tie(slowestCodec, codecFound) = found;
+
+    found = search(harness, family.second, share / 2, rng,
+        [&](const std::vector<uint8_t>& msg, unsigned reps) { return harness.serverNs(msg, reps); });
+    if (found.second > serverFound)
+      std::tie(slowestServer, serverFound) = found;
+  }
+  printRow("search, codec", harness, slowestCodec, codecFound, harness.serverNs(harness.encode(slowestCodec), REPORT_REPS));
+  printRow("search, server", harness, slowestServer, harness.codecNs(harness.encode(slowestServer), REPORT_REPS),
+      serverFound);
+
+  worstCodec  = std::max(worstCodec, codecFound);
+  worstServer = std::max(worstServer, serverFound);
+  std::printf("\nWorst case: codec %.0f ns, server %.0f ns per packet (%.1fx a Binding request)\n", worstCodec,
+      worstServer, worstServer / baseline);
+  return 0;
+}
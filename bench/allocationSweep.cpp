@@ -0,0 +1,124 @@
+// Sweep cost of the TURN allocation store: the struct-of-arrays
+// AllocationTable against objects holding every field (the former layout,
+// one heap object per allocation).
+//
+//   bench-allocation-sweep [allocations=1000000]
+
+#include "allocationTable.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace
+{
+  using BenchClock = std::chrono::steady_clock;
+
+  // Roughly the fields and size of a pooled TURN allocation
+  struct ObjectAllocation
+  {
+    void* sender;
+    std::array<uint8_t, 28> client;
+    uint32_t row;
+    int transport;
+    std::array<uint8_t, 28> peerLink;
+    std::array<uint8_t, 48> relay; // socket
+    std::array<uint8_t, 28> relayed;
+    uint32_t expiry;
+    uint32_t listExpiry;
+    uint64_t bytesToPeer;
+    uint64_t bytesToClient;
+    uint64_t bytesCollected;
+    uint16_t tenant;
+    PoolHandle permissions;
+    PoolHandle channels;
+  };
+
+  template<typename F>
+  double bestOf(int runs, F f)
+  {
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i)
+    {
+      const auto start = BenchClock::now();
+      f();
+      best = std::min(best, std::chrono::duration<double, std::micro>(BenchClock::now() - start).count());
+    }
+    return best;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const std::size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  const int runs          = 20;
+  const uint32_t now      = 1000;
+  const TenantId tenants  = 8;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> lifetime(now + 1, now + 600);
+
+  AllocationTable table;
+  std::vector<std::unique_ptr<ObjectAllocation>> objects;
+  objects.reserve(count);
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    const uint32_t expiry = lifetime(rng);
+    const auto tenant     = static_cast<TenantId>(i % tenants);
+    table.insert(rng() * 0x9E3779B97F4A7C15ull, PoolHandle {static_cast<uint32_t>(i), 1}, tenant, expiry);
+    table.addBytesToPeer(static_cast<uint32_t>(i), i);
+
+    std::unique_ptr<ObjectAllocation> object(new ObjectAllocation());
+    object->expiry      = expiry;
+    object->listExpiry  = AllocationTable::NONE;
+    object->tenant      = tenant;
+    object->bytesToPeer = i;
+    objects.push_back(std::move(object));
+  }
+  // Heap objects end up scattered after churn
+  std::shuffle(objects.begin(), objects.end(), rng);
+
+  std::vector<uint32_t> rows;
+  std::vector<uint64_t> perTenant(tenants);
+  std::size_t sink = 0;
+
+  const double tableExpiry = bestOf(runs, [&] {
+    table.collectExpired(now, rows);
+    table.collectListExpired(now, rows);
+    sink += rows.size();
+  });
+  const double tableBytes = bestOf(runs, [&] {
+    table.collectBytes(perTenant);
+    sink += perTenant[0];
+  });
+
+  const double objectExpiry = bestOf(runs, [&] {
+    rows.clear();
+    for (const auto& object : objects)
+    {
+      if (object->expiry <= now || object->listExpiry <= now)
+        rows.push_back(object->row);
+    }
+    sink += rows.size();
+  });
+  const double objectBytes = bestOf(runs, [&] {
+    for (const auto& object : objects)
+    {
+      const uint64_t total = object->bytesToPeer + object->bytesToClient;
+      perTenant[object->tenant] += total - object->bytesCollected;
+      object->bytesCollected = total;
+    }
+    sink += perTenant[0];
+  });
+
+  std::printf("%zu allocations, best of %d runs\n", count, runs);
+  std::printf("%-24s %12s %12s\n", "sweep", "table (us)", "objects (us)");
+  std::printf("%-24s %12.0f %12.0f\n", "expiry", tableExpiry, objectExpiry);
+  std::printf("%-24s %12.0f %12.0f\n", "byte accounting", tableBytes, objectBytes);
+  return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,399 @@
+// STUN over DTLS against an in-process server on loopback, one worker: full
+// and resumed handshakes, then a flood of ClientHellos without cookie from
+// many source ports, then pipelined Binding requests over one association
+// next to the same load on a plain UDP listener. The certificate is a
+// throwaway P-256 one written to temporary files.
+//
+//   bench-dtls [handshakes=1000] [spoofed=50000] [requests=200000] [window=32]
+//
+// Client and server share the machine: rates include both sides, the server
+// CPU per operation is the process CPU minus the client thread's.
+
+#include "memoryAccounting.hpp"
+#include "stunServer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ctime>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <spdlog/spdlog.h>
+
+#include <ustun/stunCodec.hpp>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  double cpu(clockid_t clock)
+  {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // Process CPU minus the client (this thread): the server worker
+  class ServerCpu {
+    public:
+      ServerCpu()
+          : _process(cpu(CLOCK_PROCESS_CPUTIME_ID))
+          , _thread(cpu(CLOCK_THREAD_CPUTIME_ID))
+      {
+      }
+
+      double elapsed() const
+      {
+        return (cpu(CLOCK_PROCESS_CPUTIME_ID) - _process) - (cpu(CLOCK_THREAD_CPUTIME_ID) - _thread);
+      }
+
+    private:
+      double _process;
+      double _thread;
+  };
+
+  struct TempFile
+  {
+    explicit TempFile(const char* pattern)
+        : path(pattern)
+    {
+      const int fd = mkstemp(&path[0]);
+      if (fd < 0)
+        throw std::runtime_error("cannot create " + path);
+      ::close(fd);
+    }
+    ~TempFile() { std::remove(path.c_str()); }
+
+    std::string path;
+  };
+
+  // Self-signed, valid for a day
+  void writeCertificate(const std::string& certPath, const std::string& keyPath)
+  {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert    = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("ustun"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    FILE* out = std::fopen(certPath.c_str(), "w");
+    PEM_write_X509(out, cert);
+    std::fclose(out);
+    out = std::fopen(keyPath.c_str(), "w");
+    PEM_write_PrivateKey(out, key, nullptr, nullptr, 0, nullptr, nullptr);
+    std::fclose(out);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+  }
+
+  uint16_t freePort()
+  {
+    boost::asio::io_context io;
+    udp::socket socket(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    return socket.local_endpoint().port();
+  }
+
+  int connectedSocket(const udp::endpoint& server)
+  {
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval timeout {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, server.data(), server.size()) != 0)
+    {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Blocking DTLS client on a socket of its own
+  class Client {
+    public:
+      Client(SSL_CTX* ctx, const udp::endpoint& server)
+          : _fd(connectedSocket(server))
+          , _ssl(SSL_new(ctx))
+      {
+        BIO* bio = BIO_new_dgram(_fd, BIO_NOCLOSE);
+        timeval timeout {1, 0};
+        BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, const_cast<sockaddr*>(server.data()));
+        BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
+        SSL_set_bio(_ssl, bio, bio);
+      }
+
+      ~Client()
+      {
+        SSL_free(_ssl);
+        ::close(_fd);
+      }
+
+      bool connect(SSL_SESSION* session)
+      {
+        if (session)
+          SSL_set_session(_ssl, session);
+        const bool ok = SSL_connect(_ssl) == 1;
+        ERR_clear_error();
+        return ok;
+      }
+
+      bool resumed() const { return SSL_session_reused(_ssl) == 1; }
+      SSL_SESSION* session() const { return SSL_get1_session(_ssl); }
+      void shutdown() { SSL_shutdown(_ssl); }
+
+      bool write(const uint8_t* data, std::size_t bytes) { return SSL_write(_ssl, data, static_cast<int>(bytes)) > 0; }
+      int read(uint8_t* out, std::size_t size)
+      {
+        const int bytes = SSL_read(_ssl, out, static_cast<int>(size));
+        ERR_clear_error();
+        return bytes;
+      }
+
+    private:
+      int _fd;
+      SSL* _ssl;
+  };
+
+  struct Handshakes
+  {
+    unsigned done    = 0;
+    unsigned resumed = 0;
+    double seconds   = 0;
+    double serverCpu = 0;
+  };
+
+  Handshakes runHandshakes(SSL_CTX* ctx, const udp::endpoint& server, unsigned count, SSL_SESSION* session)
+  {
+    Handshakes result;
+    const ServerCpu serverCpu;
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < count; ++i)
+    {
+      Client client(ctx, server);
+      if (!client.connect(session))
+        continue;
+      ++result.done;
+      result.resumed += client.resumed();
+      client.shutdown();
+    }
+    result.seconds   = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.serverCpu = serverCpu.elapsed();
+    return result;
+  }
+
+  // First flight of a fresh client: a ClientHello without cookie
+  std::vector<uint8_t> clientHello(SSL_CTX* ctx)
+  {
+    SSL* ssl = SSL_new(ctx);
+    BIO* out = BIO_new(BIO_s_mem());
+    SSL_set_bio(ssl, BIO_new(BIO_s_mem()), out);
+    SSL_connect(ssl);
+    ERR_clear_error();
+
+    char* data      = nullptr;
+    const long size = BIO_get_mem_data(out, &data);
+    std::vector<uint8_t> hello(data, data + size);
+    SSL_free(ssl);
+    return hello;
+  }
+
+  struct Flood
+  {
+    uint64_t sent     = 0;
+    uint64_t answered = 0; // HelloVerifyRequests
+    double seconds    = 0;
+    double serverCpu  = 0;
+  };
+
+  // From 64 source ports, in bursts of one datagram per port
+  Flood runFlood(const std::vector<uint8_t>& hello, const udp::endpoint& server, unsigned count)
+  {
+    std::vector<int> sockets;
+    for (int i = 0; i < 64; ++i)
+    {
+      sockets.push_back(connectedSocket(server));
+      timeval timeout {0, 50000};
+      setsockopt(sockets.back(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    Flood result;
+    uint8_t buffer[2048];
+    const ServerCpu serverCpu;
+    const auto start = std::chrono::steady_clock::now();
+    while (result.sent < count)
+    {
+      for (int fd : sockets)
+        result.sent += ::send(fd, hello.data(), hello.size(), 0) > 0;
+      for (int fd : sockets)
+        result.answered += recv(fd, buffer, sizeof(buffer), 0) > 0;
+    }
+    result.seconds   = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.serverCpu = serverCpu.elapsed();
+    for (int fd : sockets)
+      ::close(fd);
+    return result;
+  }
+
+  struct Throughput
+  {
+    uint64_t answered = 0;
+    double seconds    = 0;
+    double serverCpu  = 0;
+  };
+
+  // Windows of Binding requests, each one answered (or timed out) before
+  // the next window leaves
+  template<typename Send, typename Receive>
+  Throughput runBindings(unsigned count, unsigned window, Send send, Receive receive)
+  {
+    std::mt19937_64 rng(1);
+    std::vector<uint8_t> requests(window * STUN_HEADER_SIZE * 2);
+    uint8_t response[2048];
+
+    Throughput result;
+    const ServerCpu serverCpu;
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned done = 0; done < count; done += window)
+    {
+      for (unsigned i = 0; i < window; ++i)
+      {
+        uint8_t transaction[12];
+        for (auto& byte : transaction)
+          byte = static_cast<uint8_t>(rng());
+        ustun::MessageWriter request({requests.data() + i * STUN_HEADER_SIZE * 2, STUN_HEADER_SIZE * 2},
+            BINDING_REQUEST, transaction);
+        send(requests.data() + i * STUN_HEADER_SIZE * 2, request.size());
+      }
+      for (unsigned i = 0; i < window; ++i)
+      {
+        const int bytes = receive(response, sizeof(response));
+        ustun::MessageView msg;
+        if (bytes <= 0)
+          break;
+        result.answered += msg.parse(response, static_cast<std::size_t>(bytes)) && msg.type() == BINDING_SUCCESS_RESP;
+      }
+    }
+    result.seconds   = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.serverCpu = serverCpu.elapsed();
+    return result;
+  }
+
+  void report(const char* name, double count, double seconds, double serverCpu)
+  {
+    std::printf("%-28s %12.0f/s %10.1f us server cpu each\n", name, count / seconds,
+        count ? serverCpu * 1e6 / count : 0.0);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const unsigned handshakes = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 1000;
+  const unsigned spoofed    = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : 50000;
+  const unsigned requests   = argc > 3 ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : 200000;
+  const unsigned window     = argc > 4 ? static_cast<unsigned>(std::strtoul(argv[4], nullptr, 10)) : 32;
+  if (handshakes == 0 || window == 0)
+  {
+    std::fprintf(stderr, "usage: %s [handshakes=1000] [spoofed=50000] [requests=200000] [window=32]\n", argv[0]);
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+
+  TempFile certFile("/tmp/ustun-dtls-cert-XXXXXX"), keyFile("/tmp/ustun-dtls-key-XXXXXX");
+  writeCertificate(certFile.path, keyFile.path);
+
+  const auto loopback = boost::asio::ip::address_v4::loopback();
+  ServerConfig config;
+  config.workers = 1;
+  ListenerConfig dtls;
+  dtls.transport = Transport::Dtls;
+  dtls.address   = loopback;
+  dtls.port      = freePort();
+  dtls.certFile  = certFile.path;
+  dtls.keyFile   = keyFile.path;
+  ListenerConfig plain;
+  plain.address = loopback;
+  plain.port    = freePort();
+  config.listeners.push_back(dtls);
+  config.listeners.push_back(plain);
+
+  StunServer server(config);
+  server.start();
+  const udp::endpoint dtlsServer(loopback, dtls.port), udpServer(loopback, plain.port);
+  const Stats& stats = server.stats();
+
+  SSL_CTX* ctx = SSL_CTX_new(DTLS_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  // Session IDs only, as the server does not issue tickets
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+  SSL_SESSION* session = nullptr;
+  {
+    Client first(ctx, dtlsServer);
+    if (!first.connect(nullptr))
+    {
+      std::fprintf(stderr, "DTLS handshake failed\n");
+      return 1;
+    }
+    session = first.session();
+    first.shutdown();
+  }
+
+  const Handshakes full    = runHandshakes(ctx, dtlsServer, handshakes, nullptr);
+  const Handshakes resumed = runHandshakes(ctx, dtlsServer, handshakes, session);
+
+  const uint64_t challenges = stats.dtlsCookieChallenges.load();
+  const uint64_t buffers    = MemoryAccounting::bytes(MemoryTag::Buffers);
+  const Flood flood         = runFlood(clientHello(ctx), dtlsServer, spoofed);
+  const uint64_t grown      = MemoryAccounting::bytes(MemoryTag::Buffers) - buffers;
+  const uint64_t open       = stats.dtlsConnections.load();
+
+  Client client(ctx, dtlsServer);
+  client.connect(session);
+  const Throughput overDtls = runBindings(requests, window,
+      [&](const uint8_t* data, std::size_t bytes) { client.write(data, bytes); },
+      [&](uint8_t* out, std::size_t size) { return client.read(out, size); });
+
+  const int fd = connectedSocket(udpServer);
+  const Throughput overUdp = runBindings(requests, window,
+      [&](const uint8_t* data, std::size_t bytes) { ::send(fd, data, bytes, 0); },
+      [&](uint8_t* out, std::size_t size) { return static_cast<int>(recv(fd, out, size, 0)); });
+  ::close(fd);
+
+  std::printf("%u handshakes each, %u spoofed ClientHellos, %u Binding requests in windows of %u\n", handshakes,
+      spoofed, requests, window);
+  report("full handshakes", full.done, full.seconds, full.serverCpu);
+  report("resumed handshakes", resumed.resumed, resumed.seconds, resumed.serverCpu);
+  report("spoofed ClientHellos", flood.sent, flood.seconds, flood.serverCpu);
+  report("Binding over DTLS", overDtls.answered, overDtls.seconds, overDtls.serverCpu);
+  report("Binding over UDP", overUdp.answered, overUdp.seconds, overUdp.serverCpu);
+  std::printf("%-28s %12llu of %llu\n", "cookie challenges answered", static_cast<unsigned long long>(flood.answered),
+      static_cast<unsigned long long>(stats.dtlsCookieChallenges.load() - challenges));
+  std::printf("%-28s %12llu\n", "connections after flood", static_cast<unsigned long long>(open));
+  std::printf("%-28s %12llu\n", "bytes grown by flood", static_cast<unsigned long long>(grown));
+  std::printf("%-28s %12llu %llu %llu\n", "handshakes, resumed, errors",
+      static_cast<unsigned long long>(stats.dtlsHandshakes.load()),
+      static_cast<unsigned long long>(stats.dtlsResumed.load()),
+      static_cast<unsigned long long>(stats.dtlsHandshakeErrors.load()));
+
+  client.shutdown();
+  SSL_SESSION_free(session);
+  SSL_CTX_free(ctx);
+  server.stop();
+  return resumed.resumed == resumed.done && open == 0 && grown == 0 ? 0 : 1;
+}
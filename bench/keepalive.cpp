@@ -0,0 +1,238 @@
+// Keepalive engine at scale against a STUN responder on loopback, in a
+// thread of its own. The responder drops one request in 100, rebinds (port
+// + 1) in the middle of the run and ignores about 1% of the transactions
+// during the third quarter, which the engine has to report as lost. The
+// intervals are shortened so that a few seconds cover several rounds.
+//
+//   bench-keepalive [endpoints=100000] [seconds=10] [interval_ms=2000]
+//
+// Reports the keepalive rate, the engine CPU time per keepalive (system calls
+// included), its memory per endpoint and the heap allocations made after the
+// warm up second.
+
+#include "keepaliveEngine.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <ctime>
+#include <sys/socket.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  std::atomic<uint64_t> allocations {0};
+
+  constexpr std::size_t BATCH = 64;
+
+  // Includes the system calls, and loopback delivery which is charged to
+  // the sender
+  double threadCpu()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // Answers Binding requests with their source address, until stopped
+  class Responder {
+    public:
+      Responder()
+          : _io()
+          , _socket(_io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+      {
+        _socket.set_option(udp::socket::receive_buffer_size(8 << 20));
+        _socket.set_option(udp::socket::send_buffer_size(8 << 20));
+        timeval timeout {0, 100000};
+        setsockopt(_socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        _thread = std::thread([this] { run(); });
+      }
+
+      ~Responder()
+      {
+        _stop = true;
+        _thread.join();
+      }
+
+      udp::endpoint endpoint() const { return _socket.local_endpoint(); }
+      void rebind() { _portShift = 1; }
+      void setSilent(bool silent) { _silent = silent; }
+
+    private:
+      void run()
+      {
+        std::vector<uint8_t> in(BATCH * 512), out(BATCH * 128);
+        std::vector<sockaddr_storage> names(BATCH);
+        std::vector<iovec> inIov(BATCH), outIov(BATCH);
+        std::vector<mmsghdr> inHeaders(BATCH), outHeaders(BATCH);
+        for (std::size_t i = 0; i < BATCH; ++i)
+        {
+          inIov[i]                        = {in.data() + i * 512, 512};
+          inHeaders[i].msg_hdr.msg_name   = &names[i];
+          inHeaders[i].msg_hdr.msg_iov    = &inIov[i];
+          inHeaders[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const int fd   = _socket.native_handle();
+        uint64_t count = 0;
+        while (!_stop)
+        {
+          for (auto& header : inHeaders)
+            header.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+          const int received = recvmmsg(fd, inHeaders.data(), BATCH, MSG_WAITFORONE, nullptr);
+          if (received <= 0)
+            continue;
+
+          std::size_t replies = 0;
+          for (int i = 0; i < received; ++i)
+          {
+            ustun::MessageView request;
+            if (!request.parse(in.data() + i * 512, inHeaders[i].msg_len) || request.type() != BINDING_REQUEST
+                || ++count % 100 == 0 || (_silent && request.transactionId()[0] < 3))
+              continue;
+
+            const auto* from = reinterpret_cast<const sockaddr_in*>(&names[i]);
+            ustun::Address mapped;
+            mapped.family = FAMILY_IPV4;
+            mapped.port   = static_cast<uint16_t>(ntohs(from->sin_port) + _portShift);
+            std::memcpy(mapped.bytes, &from->sin_addr, 4);
+
+            uint8_t* buffer = out.data() + replies * 128;
+            ustun::MessageWriter response({buffer, 128}, BINDING_SUCCESS_RESP, request.transactionId());
+            response.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped);
+            response.addFingerprint();
+
+            outIov[replies]                         = {buffer, response.size()};
+            outHeaders[replies].msg_hdr             = {};
+            outHeaders[replies].msg_hdr.msg_name    = &names[i];
+            outHeaders[replies].msg_hdr.msg_namelen = inHeaders[i].msg_hdr.msg_namelen;
+            outHeaders[replies].msg_hdr.msg_iov     = &outIov[replies];
+            outHeaders[replies].msg_hdr.msg_iovlen  = 1;
+            ++replies;
+          }
+          if (replies > 0)
+            sendmmsg(fd, outHeaders.data(), static_cast<unsigned>(replies), 0);
+        }
+      }
+
+    private:
+      boost::asio::io_context _io;
+      udp::socket _socket;
+      std::thread _thread;
+      std::atomic<bool> _stop {false};
+      std::atomic<uint16_t> _portShift {0};
+      std::atomic<bool> _silent {false};
+  };
+}
+
+// Not inlined, or the compiler pairs malloc() and free() with new and delete
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+int main(int argc, char** argv)
+{
+  const uint32_t endpoints = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+  const int seconds        = argc > 2 ? std::atoi(argv[2]) : 10;
+  const int intervalMs     = argc > 3 ? std::atoi(argv[3]) : 2000;
+  if (endpoints == 0 || seconds < 2 || intervalMs < 10)
+  {
+    std::fprintf(stderr, "usage: %s [endpoints=100000] [seconds=10] [interval_ms=2000]\n", argv[0]);
+    return 1;
+  }
+
+  Responder responder;
+
+  KeepaliveConfig config;
+  config.capacity      = endpoints;
+  config.interval      = std::chrono::milliseconds(intervalMs);
+  config.jitterPercent = 10;
+  config.timeout       = std::chrono::milliseconds(std::max(intervalMs / 20, 5));
+  config.retries       = 3;
+  config.tick          = std::chrono::milliseconds(1);
+  config.socketBuffer  = 8 << 20;
+
+  uint64_t mapped = 0, changed = 0, lost = 0;
+  boost::asio::io_context io;
+  KeepaliveEngine engine(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0), config,
+      [&](uint32_t, KeepaliveEngine::Event event, const ustun::Address&) {
+        switch (event)
+        {
+          case KeepaliveEngine::Event::Mapped:
+            ++mapped;
+            break;
+          case KeepaliveEngine::Event::Changed:
+            ++changed;
+            break;
+          case KeepaliveEngine::Event::Lost:
+            ++lost;
+            break;
+        }
+      });
+  for (uint32_t i = 0; i < endpoints; ++i)
+  {
+    if (engine.add(responder.endpoint()) == KeepaliveEngine::NONE)
+      return 1;
+  }
+  engine.start();
+
+  // Warm up, then the phases of the responder, one quarter each
+  io.run_for(std::chrono::seconds(1));
+  const KeepaliveStats before = engine.stats();
+  const uint64_t allocated    = allocations.load();
+  const double cpu            = threadCpu();
+  const auto start            = std::chrono::steady_clock::now();
+
+  const auto quarter = std::chrono::milliseconds((seconds - 1) * 250);
+  io.run_for(quarter);
+  responder.rebind();
+  io.run_for(quarter);
+  responder.setSilent(true);
+  io.run_for(quarter);
+  responder.setSilent(false);
+  io.run_for(quarter);
+
+  const double elapsed  = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const double cpuUsed  = threadCpu() - cpu;
+  const uint64_t extra  = allocations.load() - allocated;
+  const auto& stats     = engine.stats();
+  const uint64_t sent   = stats.sent - before.sent;
+  const uint64_t answer = stats.answered - before.answered;
+  engine.stop();
+
+  std::printf("%u endpoints, %d ms interval, %.1f s measured\n", endpoints, intervalMs, elapsed);
+  std::printf("%-28s %12.0f\n", "keepalives/s", answer / elapsed);
+  std::printf("%-28s %12.0f\n", "engine cpu ns/keepalive", answer ? cpuUsed * 1e9 / answer : 0.0);
+  std::printf("%-28s %12.1f\n", "bytes/endpoint", double(engine.memoryUsage()) / endpoints);
+  std::printf("%-28s %12llu\n", "allocations after warm up", static_cast<unsigned long long>(extra));
+  std::printf("%-28s %12llu\n", "requests sent", static_cast<unsigned long long>(sent));
+  std::printf("%-28s %12llu\n", "retransmissions",
+      static_cast<unsigned long long>(stats.retransmitted - before.retransmitted));
+  std::printf("%-28s %12llu\n", "send errors", static_cast<unsigned long long>(stats.sendErrors));
+  std::printf("%-28s %12llu\n", "unmatched", static_cast<unsigned long long>(stats.unmatched));
+  std::printf("%-28s %12llu %llu %llu\n", "mapped, changed, lost", static_cast<unsigned long long>(mapped),
+      static_cast<unsigned long long>(changed), static_cast<unsigned long long>(lost));
+  return extra == 0 && changed > 0 ? 0 : 1;
+}
@@ -0,0 +1,903 @@
+// Load generator against a running server. The turn mode acts as thousands of
+// TURN clients, each on a UDP socket of its own: Allocate (long-term
+// credentials when user= is given), CreatePermission and ChannelBind towards
+// an echo peer run here, then ChannelData at a fixed rate and size per
+// client, with a Refresh and a new ChannelBind every refresh seconds.
+// Allocations are deleted at the end.
+//
+//   ustun-bench turn [server=127.0.0.1:3478] [peer=127.0.0.1] [clients=1000]
+//                    [rate=50] [size=160] [seconds=10] [refresh=60]
+//                    [lifetime=600] [window=64] [threads=1] [user=] [password=]
+//
+// Reports the allocation setup rate and latency, the failures by request and
+// error, the relay throughput both ways and the one-way latencies through
+// the relay: client to peer and peer to client, on the same host and clock.
+// The server needs a relay address the peer can reach ("turn-relay
+// 127.0.0.1") and a file limit above the number of clients.
+
+#include <ustun/stunCodec.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <boost/asio.hpp>
+#include <openssl/evp.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  // Client send time, peer send time, client, sequence
+  constexpr std::size_t STAMP_SIZE = 24;
+  constexpr std::size_t BATCH      = 64;
+  constexpr uint16_t CHANNEL       = 0x4000;
+  constexpr unsigned MAX_ATTEMPTS  = 5; // 0.5 s, doubled: 15.5 s
+  constexpr auto FIRST_RTO         = std::chrono::milliseconds(500);
+  constexpr auto PUMP_TICK         = std::chrono::milliseconds(1);
+
+  uint64_t nowNs()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+  }
+
+  uint64_t load64(const uint8_t* p)
+  {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  void store64(uint8_t* p, uint64_t value) { std::memcpy(p, &value, sizeof(value)); }
+
+  ustun::Address toAddress(const udp::endpoint& endpoint)
+  {
+    ustun::Address address;
+    address.port = endpoint.port();
+    if (endpoint.address().is_v4())
+    {
+      address.family   = FAMILY_IPV4;
+      const auto bytes = endpoint.address().to_v4().to_bytes();
+      std::copy(bytes.begin(), bytes.end(), address.bytes);
+    }
+    else
+    {
+      address.family   = FAMILY_IPV6;
+      const auto bytes = endpoint.address().to_v6().to_bytes();
+      std::copy(bytes.begin(), bytes.end(), address.bytes);
+    }
+    return address;
+  }
+
+  struct Parameters
+  {
+    udp::endpoint server {boost::asio::ip::address_v4::loopback(), 3478};
+    boost::asio::ip::address peer = boost::asio::ip::address_v4::loopback(); // reachable from the relays
+    uint32_t clients  = 1000;
+    uint32_t rate     = 50; // ChannelData per second and client
+    uint32_t size     = 160; // payload bytes, at least STAMP_SIZE
+    uint32_t seconds  = 10;
+    uint32_t refresh  = 60; // seconds between two refreshes of a client
+    uint32_t lifetime = 600;
+    uint32_t window   = 64; // allocations being set up at once
+    uint32_t threads  = 1;
+    std::string user;
+    std::string password;
+  };
+
+  bool parseArgument(const char* arg, Parameters& p)
+  {
+    const char* eq = std::strchr(arg, '=');
+    if (!eq)
+      return false;
+    const std::string name(arg, eq);
+    const std::string value(eq + 1);
+
+    const std::map<std::string, uint32_t*> integers {{"clients", &p.clients}, {"rate", &p.rate},
+        {"size", &p.size}, {"seconds", &p.seconds}, {"refresh", &p.refresh}, {"lifetime", &p.lifetime},
+        {"window", &p.window}, {"threads", &p.threads}};
+    const auto it = integers.find(name);
+    boost::system::error_code ec;
+    if (it != integers.end())
+      *it->second = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+    else if (name == "server")
+    {
+      const auto colon = value.rfind(':');
+      if (colon == std::string::npos)
+        return false;
+      std::string host = value.substr(0, colon);
+      if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+      p.server = {boost::asio::ip::make_address(host, ec),
+          static_cast<uint16_t>(std::strtoul(value.c_str() + colon + 1, nullptr, 10))};
+    }
+    else if (name == "peer")
+      p.peer = boost::asio::ip::make_address(value, ec);
+    else if (name == "user")
+      p.user = value;
+    else if (name == "password")
+      p.password = value;
+    else
+      return false;
+    return !ec;
+  }
+
+  // Log-linear, 64 buckets per power of two: within 1.6% of the value
+  class Histogram {
+    public:
+      Histogram()
+          : _counts(BUCKETS, 0)
+      {
+      }
+
+      void add(uint64_t value)
+      {
+        ++_counts[bucket(value)];
+        ++_total;
+      }
+
+      void merge(const Histogram& other)
+      {
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+          _counts[i] += other._counts[i];
+        _total += other._total;
+      }
+
+      uint64_t count() const { return _total; }
+
+      // Lower bound of the bucket holding the quantile
+      uint64_t percentile(double quantile) const
+      {
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * _total)));
+        uint64_t seen       = 0;
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+        {
+          seen += _counts[i];
+          if (seen >= rank)
+            return lower(i);
+        }
+        return 0;
+      }
+
+    private:
+      static constexpr std::size_t BUCKETS = 59 * 64;
+
+      static std::size_t bucket(uint64_t value)
+      {
+        if (value < 64)
+          return value;
+        const int bits = 63 - __builtin_clzll(value);
+        return (bits - 5) * 64 + ((value >> (bits - 6)) & 63);
+      }
+
+      static uint64_t lower(std::size_t index)
+      {
+        if (index < 64)
+          return index;
+        const int bits = static_cast<int>(index / 64) + 5;
+        return (64 + index % 64) << (bits - 6);
+      }
+
+    private:
+      std::vector<uint64_t> _counts;
+      uint64_t _total = 0;
+  };
+
+  // Echoes every datagram to its source, the relay it came through, after
+  // timing its way from the client and stamping its departure
+  class EchoPeer {
+    public:
+      explicit EchoPeer(const boost::asio::ip::address& address)
+          : _io()
+          , _socket(_io, udp::endpoint(address, 0))
+      {
+        _socket.set_option(udp::socket::receive_buffer_size(8 << 20));
+        _socket.set_option(udp::socket::send_buffer_size(8 << 20));
+        timeval timeout {0, 100000};
+        setsockopt(_socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        _thread = std::thread([this] { run(); });
+      }
+
+      ~EchoPeer() { stop(); }
+
+      void stop()
+      {
+        _stop = true;
+        if (_thread.joinable())
+          _thread.join();
+      }
+
+      udp::endpoint endpoint() const { return _socket.local_endpoint(); }
+      // Read once stopped
+      const Histogram& toPeer() const { return _toPeer; }
+      uint64_t packets() const { return _packets; }
+      uint64_t bytes() const { return _bytes; }
+
+    private:
+      void run()
+      {
+        constexpr std::size_t SLOT = 2048;
+        std::vector<uint8_t> buffers(BATCH * SLOT);
+        std::vector<sockaddr_storage> names(BATCH);
+        std::vector<iovec> iov(BATCH);
+        std::vector<mmsghdr> in(BATCH), out(BATCH);
+        for (std::size_t i = 0; i < BATCH; ++i)
+        {
+          iov[i]                   = {buffers.data() + i * SLOT, SLOT};
+          in[i].msg_hdr.msg_name   = &names[i];
+          in[i].msg_hdr.msg_iov    = &iov[i];
+          in[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const int fd = _socket.native_handle();
+        while (!_stop)
+        {
+          for (auto& header : in)
+            header.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+          const int received = recvmmsg(fd, in.data(), BATCH, MSG_WAITFORONE, nullptr);
+          if (received <= 0)
+            continue;
+
+          const uint64_t now = nowNs();
+          for (int i = 0; i < received; ++i)
+          {
+            uint8_t* data = buffers.data() + i * SLOT;
+            ++_packets;
+            _bytes += in[i].msg_len;
+            if (in[i].msg_len >= STAMP_SIZE)
+            {
+              _toPeer.add(now - load64(data));
+              store64(data + 8, nowNs());
+            }
+            iov[i].iov_len = in[i].msg_len;
+            out[i].msg_hdr = in[i].msg_hdr;
+          }
+          sendmmsg(fd, out.data(), static_cast<unsigned>(received), 0);
+          for (int i = 0; i < received; ++i)
+            iov[i].iov_len = SLOT;
+        }
+      }
+
+    private:
+      boost::asio::io_context _io;
+      udp::socket _socket;
+      std::thread _thread;
+      std::atomic<bool> _stop {false};
+      Histogram _toPeer;
+      uint64_t _packets = 0;
+      uint64_t _bytes   = 0;
+  };
+
+  struct Counters
+  {
+    uint64_t ready         = 0;
+    uint64_t failed        = 0;
+    uint64_t challenges    = 0; // 401 and 438 answered with credentials
+    uint64_t retransmitted = 0; // requests
+    uint64_t refreshes     = 0;
+    uint64_t deleted       = 0;
+    uint64_t sent          = 0; // ChannelData while pumping
+    uint64_t sentBytes     = 0;
+    uint64_t received      = 0;
+    uint64_t receivedBytes = 0;
+    uint64_t sendErrors    = 0;
+    uint64_t behind        = 0; // packets skipped, the generator could not keep up
+    uint64_t setupStart    = 0; // ns
+    uint64_t setupEnd      = 0;
+    std::map<std::string, uint64_t> failures; // "<request> <error code|timeout>"
+    Histogram setup;
+    Histogram toClient;
+    Histogram roundTrip;
+  };
+
+  // A share of the clients, on an io_context and a thread of its own
+  class LoadThread {
+    public:
+      LoadThread(const Parameters& params, const udp::endpoint& peer, uint32_t clients, uint64_t seed)
+          : _params(params)
+          , _peer(toAddress(peer))
+          , _work(boost::asio::make_work_guard(_io))
+          , _pumpTimer(_io)
+          , _rng(seed)
+          , _window(std::max<uint32_t>(params.window / params.threads, 1))
+          , _data(CHANNEL_DATA_HEADER_SIZE + params.size)
+      {
+        for (uint32_t i = 0; i < clients; ++i)
+        {
+          _clients.emplace_back(new Client(_io));
+          auto& socket = _clients.back()->socket;
+          socket.open(params.server.protocol());
+          socket.connect(params.server);
+        }
+        ustun::detail::write16(_data.data(), CHANNEL);
+        ustun::detail::write16(_data.data() + 2, static_cast<uint16_t>(params.size));
+      }
+
+      void start()
+      {
+        boost::asio::post(_io, [this] {
+          for (uint32_t i = 0; i < _clients.size(); ++i)
+            receive(i);
+          startSetups();
+        });
+        _thread = std::thread([this] { _io.run(); });
+      }
+
+      void startPumping()
+      {
+        boost::asio::post(_io, [this] {
+          for (uint32_t i = 0; i < _clients.size(); ++i)
+          {
+            if (_clients[i]->ready)
+              _pumping.push_back(i);
+          }
+          _pumpStart = Clock::now();
+          pump();
+        });
+      }
+
+      void stopPumping()
+      {
+        boost::asio::post(_io, [this] {
+          _pumping.clear();
+          _pumpTimer.cancel();
+        });
+      }
+
+      // Deletes the allocations, the thread ends once they are answered
+      void teardown()
+      {
+        boost::asio::post(_io, [this] {
+          _closing = true;
+          _next    = 0;
+          startDeletes();
+        });
+      }
+
+      void join() { _thread.join(); }
+
+      uint32_t settled() const { return _settled.load(); }
+      // Read once joined
+      const Counters& counters() const { return _counters; }
+
+    private:
+      enum class Phase : uint8_t
+      {
+        Allocate,
+        Permission,
+        Channel,
+        Refresh,
+        Rebind, // ChannelBind after a Refresh, keeps the channel and the permission
+        Delete
+      };
+
+      struct Client
+      {
+        explicit Client(boost::asio::io_context& io)
+            : socket(io)
+            , timer(io)
+        {
+        }
+
+        udp::socket socket;
+        boost::asio::steady_timer timer; // retransmissions, or the next refresh
+        Phase phase         = Phase::Allocate;
+        bool pending        = false; // request outstanding
+        bool ready          = false; // channel bound, data may flow
+        unsigned attempts   = 0;
+        unsigned challenges = 0; // in a row
+        uint8_t transaction[12];
+        std::array<uint8_t, 512> request;
+        std::size_t requestSize = 0;
+        std::string nonce;
+        uint64_t setupStart = 0;
+        uint32_t sequence   = 0;
+        std::array<uint8_t, 2048> buffer;
+      };
+
+      static const char* phase2str(Phase phase)
+      {
+        switch (phase)
+        {
+          case Phase::Allocate:
+            return "allocate";
+          case Phase::Permission:
+            return "create-permission";
+          case Phase::Channel:
+            return "channel-bind";
+          case Phase::Refresh:
+            return "refresh";
+          case Phase::Rebind:
+            return "channel-bind-refresh";
+          case Phase::Delete:
+            return "delete";
+        }
+        return "?";
+      }
+
+      void startSetups()
+      {
+        while (!_closing && _setups < _window && _next < _clients.size())
+        {
+          if (_counters.setupStart == 0)
+            _counters.setupStart = nowNs();
+          Client& client    = *_clients[_next++];
+          client.setupStart = nowNs();
+          ++_setups;
+          request(client, Phase::Allocate);
+        }
+      }
+
+      void setupDone(Client& client, bool ok)
+      {
+        --_setups;
+        ++_settled;
+        if (ok)
+        {
+          client.ready = true;
+          ++_counters.ready;
+          _counters.setupEnd = nowNs();
+          _counters.setup.add(_counters.setupEnd - client.setupStart);
+          scheduleRefresh(client, std::uniform_int_distribution<uint32_t>(1, _params.refresh * 1000)(_rng));
+        }
+        else
+          ++_counters.failed;
+        startSetups();
+      }
+
+      void request(Client& client, Phase phase)
+      {
+        client.phase    = phase;
+        client.pending  = true;
+        client.attempts = 0;
+        for (auto& byte : client.transaction)
+          byte = static_cast<uint8_t>(_rng());
+
+        uint16_t method = METHOD_REFRESH;
+        if (phase == Phase::Allocate)
+          method = METHOD_ALLOCATE;
+        else if (phase == Phase::Permission)
+          method = METHOD_CREATE_PERMISSION;
+        else if (phase == Phase::Channel || phase == Phase::Rebind)
+          method = METHOD_CHANNEL_BIND;
+
+        ustun::MessageWriter writer(
+            {client.request.data(), client.request.size()}, messageType(method, CLASS_REQUEST), client.transaction);
+        if (phase == Phase::Allocate)
+          writer.addUint32(ATTR_REQUESTED_TRANSPORT, 17u << 24);
+        if (phase == Phase::Allocate || phase == Phase::Refresh)
+          writer.addUint32(ATTR_LIFETIME, _params.lifetime);
+        if (phase == Phase::Delete)
+          writer.addUint32(ATTR_LIFETIME, 0);
+        if (phase == Phase::Channel || phase == Phase::Rebind)
+          writer.addUint32(ATTR_CHANNEL_NUMBER, uint32_t(CHANNEL) << 16);
+        if (phase == Phase::Permission || phase == Phase::Channel || phase == Phase::Rebind)
+          writer.addXorAddress(ATTR_XOR_PEER_ADDRESS, _peer);
+
+        if (!_params.user.empty() && !client.nonce.empty())
+        {
+          writer.addAttribute(ATTR_USERNAME, reinterpret_cast<const uint8_t*>(_params.user.data()),
+              static_cast<uint16_t>(_params.user.size()));
+          writer.addAttribute(ATTR_REALM, reinterpret_cast<const uint8_t*>(_realm.data()),
+              static_cast<uint16_t>(_realm.size()));
+          writer.addAttribute(ATTR_NONCE, reinterpret_cast<const uint8_t*>(client.nonce.data()),
+              static_cast<uint16_t>(client.nonce.size()));
+          writer.addIntegrity(_key, sizeof(_key));
+        }
+        client.requestSize = writer.size();
+        transmit(client);
+      }
+
+      void transmit(Client& client)
+      {
+        boost::system::error_code ec;
+        client.socket.send(boost::asio::buffer(client.request.data(), client.requestSize), 0, ec);
+        if (client.attempts++ > 0)
+          ++_counters.retransmitted;
+
+        client.timer.expires_after(FIRST_RTO * (1 << (client.attempts - 1)));
+        client.timer.async_wait([this, &client](const boost::system::error_code& error) {
+          if (error || !client.pending || !client.socket.is_open())
+            return;
+          if (client.attempts < MAX_ATTEMPTS)
+            transmit(client);
+          else
+            fail(client, "timeout");
+        });
+      }
+
+      void fail(Client& client, const std::string& reason)
+      {
+        client.pending = false;
+        ++_counters.failures[std::string(phase2str(client.phase)) + " " + reason];
+        switch (client.phase)
+        {
+          case Phase::Allocate:
+          case Phase::Permission:
+          case Phase::Channel:
+            setupDone(client, false);
+            break;
+          case Phase::Refresh:
+          case Phase::Rebind:
+            scheduleRefresh(client, _params.refresh * 1000);
+            break;
+          case Phase::Delete:
+            deleted();
+            break;
+        }
+      }
+
+      void scheduleRefresh(Client& client, uint32_t ms)
+      {
+        if (_closing)
+          return;
+        client.timer.expires_after(std::chrono::milliseconds(ms));
+        client.timer.async_wait([this, &client](const boost::system::error_code& error) {
+          if (!error && !_closing && !client.pending)
+            request(client, Phase::Refresh);
+        });
+      }
+
+      // A window at a time, as the setups
+      void startDeletes()
+      {
+        while (_deleting < _window && _next < _clients.size())
+        {
+          Client& client = *_clients[_next++];
+          if (!client.ready)
+            continue;
+          ++_deleting;
+          request(client, Phase::Delete);
+        }
+        if (_deleting == 0)
+          finish();
+      }
+
+      void deleted()
+      {
+        --_deleting;
+        startDeletes();
+      }
+
+      void finish()
+      {
+        _pumpTimer.cancel();
+        for (auto& client : _clients)
+        {
+          boost::system::error_code ec;
+          client->timer.cancel();
+          client->socket.close(ec);
+        }
+        _work.reset();
+      }
+
+      void receive(uint32_t id)
+      {
+        Client& client = *_clients[id];
+        client.socket.async_receive(boost::asio::buffer(client.buffer),
+            [this, id](const boost::system::error_code& ec, std::size_t bytes) {
+              if (ec == boost::asio::error::operation_aborted || !_clients[id]->socket.is_open())
+                return;
+              if (!ec)
+                handleDatagram(*_clients[id], bytes);
+              receive(id);
+            });
+      }
+
+      void handleDatagram(Client& client, std::size_t bytes)
+      {
+        const uint8_t* data = client.buffer.data();
+        if (isChannelData(data, bytes))
+        {
+          const std::size_t length = ustun::detail::read16(data + 2);
+          if (CHANNEL_DATA_HEADER_SIZE + length > bytes)
+            return;
+          ++_counters.received;
+          _counters.receivedBytes += length;
+          if (length >= STAMP_SIZE)
+          {
+            const uint64_t now = nowNs();
+            _counters.roundTrip.add(now - load64(data + CHANNEL_DATA_HEADER_SIZE));
+            _counters.toClient.add(now - load64(data + CHANNEL_DATA_HEADER_SIZE + 8));
+          }
+          return;
+        }
+
+        ustun::MessageView msg;
+        if (!client.pending || !msg.parse(data, bytes) || msg.cls() == CLASS_REQUEST
+            || std::memcmp(msg.transactionId(), client.transaction, sizeof(client.transaction)) != 0)
+          return;
+        client.pending = false;
+        client.timer.cancel();
+
+        const unsigned code = msg.cls() == CLASS_ERROR ? msg.errorCode() : 0;
+        if ((code == 401 || code == 438) && !_params.user.empty() && client.challenges < 3)
+        {
+          ++client.challenges;
+          ++_counters.challenges;
+          challenged(client, msg);
+          request(client, client.phase);
+          return;
+        }
+        client.challenges = 0;
+        if (code != 0)
+        {
+          fail(client, std::to_string(code));
+          return;
+        }
+
+        switch (client.phase)
+        {
+          case Phase::Allocate:
+            request(client, Phase::Permission);
+            break;
+          case Phase::Permission:
+            request(client, Phase::Channel);
+            break;
+          case Phase::Channel:
+            setupDone(client, true);
+            break;
+          case Phase::Refresh:
+            request(client, Phase::Rebind);
+            break;
+          case Phase::Rebind:
+            ++_counters.refreshes;
+            scheduleRefresh(client, _params.refresh * 1000);
+            break;
+          case Phase::Delete:
+            ++_counters.deleted;
+            deleted();
+            break;
+        }
+      }
+
+      // Takes the nonce, and the realm with the key derived from it
+      void challenged(Client& client, const ustun::MessageView& msg)
+      {
+        ustun::Attribute realm {}, nonce {};
+        if (msg.find(ATTR_NONCE, nonce))
+          client.nonce.assign(reinterpret_cast<const char*>(nonce.value), nonce.length);
+        if (!msg.find(ATTR_REALM, realm))
+          return;
+        const std::string name(reinterpret_cast<const char*>(realm.value), realm.length);
+        if (name == _realm)
+          return;
+
+        _realm                  = name;
+        const std::string input = _params.user + ":" + _realm + ":" + _params.password;
+        unsigned length         = 0;
+        EVP_Digest(input.data(), input.size(), _key, &length, EVP_md5(), nullptr);
+      }
+
+      // Sends what the rate asks for since the start, round robin over the
+      // ready clients, at most 100 ms worth at once
+      void pump()
+      {
+        if (_pumping.empty())
+          return;
+
+        const double total   = double(_params.rate) * _pumping.size();
+        const double elapsed = std::chrono::duration<double>(Clock::now() - _pumpStart).count();
+        const auto due       = static_cast<uint64_t>(elapsed * total);
+        const auto burst     = static_cast<uint64_t>(total / 10) + 1;
+        if (due > _pumped + burst)
+        {
+          _counters.behind += due - burst - _pumped;
+          _pumped = due - burst;
+        }
+
+        for (; _pumped < due; ++_pumped)
+        {
+          const uint32_t id = _pumping[_cursor];
+          Client& client    = *_clients[id];
+          _cursor           = (_cursor + 1) % _pumping.size();
+
+          uint8_t* payload = _data.data() + CHANNEL_DATA_HEADER_SIZE;
+          store64(payload, nowNs());
+          store64(payload + 8, 0);
+          std::memcpy(payload + 16, &id, 4);
+          std::memcpy(payload + 20, &client.sequence, 4);
+          ++client.sequence;
+
+          boost::system::error_code ec;
+          client.socket.send(boost::asio::buffer(_data), 0, ec);
+          if (ec)
+            ++_counters.sendErrors;
+          else
+          {
+            ++_counters.sent;
+            _counters.sentBytes += _params.size;
+          }
+        }
+
+        _pumpTimer.expires_after(PUMP_TICK);
+        _pumpTimer.async_wait([this](const boost::system::error_code& ec) {
+          if (!ec)
+            pump();
+        });
+      }
+
+    private:
+      const Parameters& _params;
+      const ustun::Address _peer;
+      boost::asio::io_context _io;
+      boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
+      boost::asio::steady_timer _pumpTimer;
+      std::vector<std::unique_ptr<Client>> _clients;
+      std::thread _thread;
+      std::mt19937_64 _rng;
+
+      std::string _realm;
+      uint8_t _key[16] {};
+
+      uint32_t _window;
+      uint32_t _next   = 0; // next client to set up, or to delete when closing
+      uint32_t _setups = 0; // in progress
+      std::atomic<uint32_t> _settled {0}; // ready or failed
+      bool _closing      = false;
+      uint32_t _deleting = 0;
+
+      std::vector<uint32_t> _pumping; // ready clients when pumping started
+      std::size_t _cursor = 0;
+      Clock::time_point _pumpStart;
+      uint64_t _pumped = 0;
+      std::vector<uint8_t> _data; // ChannelData being sent
+
+      Counters _counters;
+  };
+
+  unsigned long long ull(uint64_t value) { return static_cast<unsigned long long>(value); }
+
+  void printLatency(const char* name, const Histogram& histogram)
+  {
+    std::printf("%-28s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  (%llu samples)\n", name,
+        histogram.percentile(0.5) / 1e3, histogram.percentile(0.99) / 1e3, histogram.percentile(0.999) / 1e3,
+        ull(histogram.count()));
+  }
+
+  int turnLoad(const Parameters& params)
+  {
+    // One socket per client
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < params.clients + 64)
+    {
+      std::fprintf(stderr, "file limit %llu too low for %u clients\n", ull(limit.rlim_cur), params.clients);
+      return 1;
+    }
+
+    EchoPeer peer(params.peer);
+    std::vector<std::unique_ptr<LoadThread>> threads;
+    for (uint32_t i = 0; i < params.threads; ++i)
+    {
+      const uint32_t share = params.clients / params.threads + (i < params.clients % params.threads);
+      threads.emplace_back(new LoadThread(params, peer.endpoint(), share, i + 1));
+    }
+    for (auto& thread : threads)
+      thread->start();
+
+    // Until every client is set up or has failed, or nothing moves for 20 s
+    uint32_t settled = 0;
+    auto progress    = Clock::now();
+    while (settled < params.clients && Clock::now() - progress < std::chrono::seconds(20))
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      uint32_t now = 0;
+      for (const auto& thread : threads)
+        now += thread->settled();
+      if (now != settled)
+        progress = Clock::now();
+      settled = now;
+    }
+
+    for (auto& thread : threads)
+      thread->startPumping();
+    std::this_thread::sleep_for(std::chrono::seconds(params.seconds));
+    for (auto& thread : threads)
+      thread->stopPumping();
+    // The echoes still in flight
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for (auto& thread : threads)
+      thread->teardown();
+    for (auto& thread : threads)
+      thread->join();
+    peer.stop();
+
+    Counters total;
+    total.setupStart = ~uint64_t(0);
+    for (const auto& thread : threads)
+    {
+      const auto& c = thread->counters();
+      total.ready += c.ready;
+      total.failed += c.failed;
+      total.challenges += c.challenges;
+      total.retransmitted += c.retransmitted;
+      total.refreshes += c.refreshes;
+      total.deleted += c.deleted;
+      total.sent += c.sent;
+      total.sentBytes += c.sentBytes;
+      total.received += c.received;
+      total.receivedBytes += c.receivedBytes;
+      total.sendErrors += c.sendErrors;
+      total.behind += c.behind;
+      if (c.setupStart)
+        total.setupStart = std::min(total.setupStart, c.setupStart);
+      total.setupEnd = std::max(total.setupEnd, c.setupEnd);
+      for (const auto& failure : c.failures)
+        total.failures[failure.first] += failure.second;
+      total.setup.merge(c.setup);
+      total.toClient.merge(c.toClient);
+      total.roundTrip.merge(c.roundTrip);
+    }
+
+    const double seconds = params.seconds;
+    const double setup   = total.setupEnd > total.setupStart ? (total.setupEnd - total.setupStart) / 1e9 : 0;
+    std::printf("%u clients on %u thread(s), %u pkt/s of %u bytes each, %u s\n", params.clients, params.threads,
+        params.rate, params.size, params.seconds);
+    std::printf("%-28s %llu ready, %llu failed in %.2f s (%.0f/s), %llu challenges\n", "allocations",
+        ull(total.ready), ull(total.failed), setup, setup > 0 ? total.ready / setup : 0.0, ull(total.challenges));
+    printLatency("setup (4 transactions)", total.setup);
+    std::printf("%-28s %12.0f pkt/s %10.1f Mbit/s\n", "client -> relay", total.sent / seconds,
+        total.sentBytes * 8 / seconds / 1e6);
+    std::printf("%-28s %12.0f pkt/s %10.1f Mbit/s  loss %.3f%%\n", "relay -> peer", peer.packets() / seconds,
+        peer.bytes() * 8 / seconds / 1e6,
+        total.sent ? 100.0 * (1 - double(peer.packets()) / total.sent) : 0.0);
+    std::printf("%-28s %12.0f pkt/s %10.1f Mbit/s  loss %.3f%%\n", "peer -> relay -> client",
+        total.received / seconds, total.receivedBytes * 8 / seconds / 1e6,
+        peer.packets() ? 100.0 * (1 - double(total.received) / peer.packets()) : 0.0);
+    printLatency("one way client -> peer", peer.toPeer());
+    printLatency("one way peer -> client", total.toClient);
+    printLatency("round trip", total.roundTrip);
+    std::printf("%-28s %llu refreshes, %llu deleted, %llu retransmitted requests, %llu send errors, "
+                "%llu behind schedule\n",
+        "other", ull(total.refreshes), ull(total.deleted), ull(total.retransmitted), ull(total.sendErrors),
+        ull(total.behind));
+    for (const auto& failure : total.failures)
+      std::printf("%-28s %s: %llu\n", "failure", failure.first.c_str(), ull(failure.second));
+    return total.ready > 0 && total.received > 0 ? 0 : 1;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Parameters params;
+  const bool turn = argc > 1 && std::strcmp(argv[1], "turn") == 0;
+  for (int i = 2; turn && i < argc; ++i)
+  {
+    if (!parseArgument(argv[i], params))
+    {
+      std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (!turn || params.clients == 0 || params.threads == 0 || params.size < STAMP_SIZE || params.seconds == 0
+      || params.refresh == 0)
+  {
+    std::fprintf(stderr,
+        "usage: %s turn [server=127.0.0.1:3478] [peer=127.0.0.1] [clients=1000] [rate=50] [size=160]\n"
+        "          [seconds=10] [refresh=60] [lifetime=600] [window=64] [threads=1] [user=] [password=]\n",
+        argv[0]);
+    return 1;
+  }
+  params.threads = std::min(params.threads, params.clients);
+  return turnLoad(params);
+}
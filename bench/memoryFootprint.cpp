@@ -0,0 +1,231 @@
+// Memory cost of the server state, to size hosts: bytes per TURN allocation
+// (with one permission and one channel) at growing populations, then per
+// extra permission, per extra channel and per cache entry. Accounted bytes
+// come from MemoryAccounting, the RSS growth is shown alongside. Relay
+// sockets are not opened (TurnConfig::virtualRelays): each real allocation
+// also holds one kernel UDP socket.
+//
+//   bench-memory-footprint [allocations...=10000 100000 1000000]
+
+#include "externalAuth.hpp"
+#include "memoryAccounting.hpp"
+#include "responseCache.hpp"
+#include "stats.hpp"
+#include "stunMessage.hpp"
+#include "tenantTable.hpp"
+#include "tokenCache.hpp"
+#include "turnServer.hpp"
+#include "worker.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  // Extra peers given to the sampled allocations: the first ones fill the
+  // inline PeerSet arrays, the others spill to its hash set
+  constexpr uint32_t EXTRA_PEERS    = 31;
+  constexpr uint32_t INLINE_PEERS   = 8;
+  constexpr uint32_t EXTRA_CHANNELS = 16;
+  constexpr uint32_t SAMPLE         = 10000;
+
+  class NullSender : public ClientSender {
+    public:
+      void sendToClient(const uint8_t*, std::size_t, const udp::endpoint&) override {}
+      std::shared_ptr<ClientSender> retain() override
+      {
+        return std::shared_ptr<ClientSender>(this, [](ClientSender*) {});
+      }
+  };
+
+  uint64_t residentBytes()
+  {
+    long pages = 0, resident = 0;
+    if (FILE* f = std::fopen("/proc/self/statm", "r"))
+    {
+      if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+      std::fclose(f);
+    }
+    return static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE);
+  }
+
+  uint64_t accounted()
+  {
+    uint64_t total = 0;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(MemoryTag::Count); ++i)
+      total += MemoryAccounting::bytes(static_cast<MemoryTag>(i));
+    return total;
+  }
+
+  class Driver {
+    public:
+      Driver(Worker& worker, TurnServer& turn) : _worker(worker), _turn(turn) {}
+
+      void allocate(uint32_t client)
+      {
+        const uint8_t udpTransport[4] = {17, 0, 0, 0};
+        request(client, METHOD_ALLOCATE, [&](StunMessageBuilder& b) {
+          b.addAttribute(ATTR_REQUESTED_TRANSPORT, udpTransport, sizeof(udpTransport));
+        });
+      }
+
+      void permit(uint32_t client, uint32_t peer)
+      {
+        request(client, METHOD_CREATE_PERMISSION,
+            [&](StunMessageBuilder& b) { b.addXorAddress(ATTR_XOR_PEER_ADDRESS, peerAddress(peer)); });
+      }
+
+      void bind(uint32_t client, uint32_t peer, uint16_t channel)
+      {
+        request(client, METHOD_CHANNEL_BIND, [&](StunMessageBuilder& b) {
+          b.addUint32(ATTR_CHANNEL_NUMBER, uint32_t(channel) << 16);
+          b.addXorAddress(ATTR_XOR_PEER_ADDRESS, peerAddress(peer));
+        });
+      }
+
+    private:
+      static udp::endpoint peerAddress(uint32_t peer)
+      {
+        return udp::endpoint(boost::asio::ip::address_v4(0xC6120000u + peer), 3478);
+      }
+
+      template<typename F>
+      void request(uint32_t client, uint16_t method, F attributes)
+      {
+        uint8_t trans_id[12] = {};
+        ++_transactions;
+        std::memcpy(trans_id, &_transactions, sizeof(_transactions));
+
+        _message.clear();
+        StunMessageBuilder builder(_message, messageType(method, CLASS_REQUEST), trans_id);
+        attributes(builder);
+
+        StunMessage msg;
+        msg.parse(_message.data(), _message.size());
+        const udp::endpoint remote(boost::asio::ip::address_v4(0x0A000000u + client), 40000);
+        const RequestContext ctx {_worker, Transport::Udp, remote, remote, &_sender, 0};
+        _turn.handleMessage(ctx, msg, _response);
+      }
+
+      Worker& _worker;
+      TurnServer& _turn;
+      NullSender _sender;
+      uint64_t _transactions = 0;
+      std::vector<uint8_t> _message;
+      std::vector<uint8_t> _response;
+  };
+
+  void measureAllocations(uint32_t count)
+  {
+    std::vector<TenantConfig> tenantConfigs(1);
+    TurnConfig config;
+    config.enabled         = true;
+    config.relayAddress    = boost::asio::ip::address_v4::loopback();
+    config.externalAddress = boost::asio::ip::make_address("192.0.2.1");
+    config.virtualRelays   = true;
+
+    Worker worker(0);
+    TenantTable tenants(tenantConfigs, 1);
+    Stats stats;
+    TurnServer turn(worker, config, tenants, stats, nullptr);
+    Driver driver(worker, turn);
+
+    const uint64_t accountedBefore = accounted();
+    const uint64_t turnBefore      = MemoryAccounting::bytes(MemoryTag::Turn);
+    const uint64_t rssBefore       = residentBytes();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      driver.allocate(i);
+      driver.bind(i, i & 0xFFFF, 0x4000);
+    }
+    const double turnBytes = double(MemoryAccounting::bytes(MemoryTag::Turn) - turnBefore) / count;
+    const double allBytes  = double(accounted() - accountedBefore) / count;
+    const double rssBytes  = double(residentBytes() - rssBefore) / count;
+    std::printf("%11u %14.0f %14.0f %14.0f\n", count, turnBytes, allBytes, rssBytes);
+
+    if (count < SAMPLE)
+      return;
+
+    // Extra permissions then channels on a sample of the allocations
+    uint64_t before = MemoryAccounting::bytes(MemoryTag::Turn);
+    for (uint32_t i = 0; i < SAMPLE; ++i)
+    {
+      for (uint32_t p = 1; p < INLINE_PEERS; ++p)
+        driver.permit(i, 0x10000 + p);
+    }
+    const double inlinePermission = double(MemoryAccounting::bytes(MemoryTag::Turn) - before) / (SAMPLE * (INLINE_PEERS - 1));
+
+    before = MemoryAccounting::bytes(MemoryTag::Turn);
+    for (uint32_t i = 0; i < SAMPLE; ++i)
+    {
+      for (uint32_t p = INLINE_PEERS; p <= EXTRA_PEERS; ++p)
+        driver.permit(i, 0x10000 + p);
+    }
+    const double spilledPermission
+        = double(MemoryAccounting::bytes(MemoryTag::Turn) - before) / (SAMPLE * (EXTRA_PEERS + 1 - INLINE_PEERS));
+
+    before = MemoryAccounting::bytes(MemoryTag::Turn);
+    for (uint32_t i = 0; i < SAMPLE; ++i)
+    {
+      for (uint32_t c = 1; c <= EXTRA_CHANNELS; ++c)
+        driver.bind(i, 0x10000 + c, static_cast<uint16_t>(0x4000 + c));
+    }
+    const double channel = double(MemoryAccounting::bytes(MemoryTag::Turn) - before) / (SAMPLE * EXTRA_CHANNELS);
+
+    std::printf("  permission, inline (up to %u peers) %.0f bytes, past that %.0f bytes; channel %.0f bytes\n",
+        INLINE_PEERS, inlinePermission, spilledPermission, channel);
+  }
+
+  template<typename F>
+  double perEntry(std::size_t entries, F create)
+  {
+    const uint64_t before = MemoryAccounting::bytes(MemoryTag::Caches);
+    auto cache            = create(entries);
+    return double(MemoryAccounting::bytes(MemoryTag::Caches) - before) / entries;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  spdlog::set_level(spdlog::level::warn);
+
+  std::vector<uint32_t> counts;
+  for (int i = 1; i < argc; ++i)
+    counts.push_back(static_cast<uint32_t>(std::strtoul(argv[i], nullptr, 10)));
+  if (counts.empty())
+    counts = {10000, 100000, 1000000};
+
+  std::printf("Per allocation, with one permission and one channel:\n");
+  std::printf("%11s %14s %14s %14s\n", "allocations", "turn bytes", "all accounted", "rss bytes");
+  for (const uint32_t count : counts)
+    measureAllocations(count);
+
+  const std::size_t entries = 65536;
+  std::printf("\nPer cache entry:\n");
+  std::printf("  response cache %.0f bytes\n",
+      perEntry(entries, [](std::size_t n) { return std::unique_ptr<ResponseCache>(new ResponseCache(n)); }));
+  std::printf("  token cache %.0f bytes\n",
+      perEntry(entries, [](std::size_t n) { return std::unique_ptr<TokenCache>(new TokenCache(n)); }));
+
+  Worker worker(0);
+  Stats stats;
+  AuthConfig authConfig;
+  authConfig.externalCacheEntries = entries;
+  const std::vector<TenantConfig> tenantConfigs(1);
+  std::printf("  external credential cache %.0f bytes (usernames past 13 bytes add their length)\n",
+      perEntry(entries, [&](std::size_t) {
+        return std::unique_ptr<ExternalAuth>(new ExternalAuth(worker, tenantConfigs, authConfig, stats));
+      }));
+  return 0;
+}
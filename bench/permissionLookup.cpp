@@ -0,0 +1,109 @@
+// Permission check done for every relayed packet: the packed PeerSet against
+// a list of pooled address objects (the former layout), for permission sets
+// of growing size. A quarter of the packets come from peers without a
+// permission.
+//
+//   bench-permission-lookup [packets=1000000]
+
+#include "peerSet.hpp"
+#include "slabPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace
+{
+  using BenchClock = std::chrono::steady_clock;
+  using boost::asio::ip::address;
+
+  struct Permission
+  {
+    address peer;
+    uint32_t expiry;
+    PoolHandle next;
+  };
+
+  template<typename F>
+  double bestOf(int runs, F f)
+  {
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i)
+    {
+      const auto start = BenchClock::now();
+      f();
+      best = std::min(best, std::chrono::duration<double, std::nano>(BenchClock::now() - start).count());
+    }
+    return best;
+  }
+
+  address randomAddress(std::mt19937& rng, bool v6)
+  {
+    if (!v6)
+      return boost::asio::ip::address_v4(rng());
+
+    boost::asio::ip::address_v6::bytes_type bytes;
+    for (auto& byte : bytes)
+      byte = static_cast<uint8_t>(rng());
+    bytes[0] = 0x20; // global unicast
+    return boost::asio::ip::address_v6(bytes);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const std::size_t packets = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  const int runs            = 10;
+
+  std::atomic<uint64_t> live {0}, capacity {0}, bytes {0};
+  std::mt19937 rng(42);
+  std::size_t sink = 0;
+
+  std::printf("%zu packets, best of %d runs\n", packets, runs);
+  std::printf("%-8s %-6s %14s %14s\n", "peers", "family", "peerset (ns)", "list (ns)");
+  for (const bool v6 : {false, true})
+  {
+    for (const std::size_t peers : {1, 2, 4, 8, 32})
+    {
+      PeerSet set;
+      SlabPool<Permission> pool(live, capacity, bytes);
+      PoolHandle head;
+      std::vector<address> known;
+      for (std::size_t i = 0; i < peers; ++i)
+      {
+        known.push_back(randomAddress(rng, v6));
+        set.insert(known.back(), 300);
+        head = pool.create(Permission {known.back(), 300, head});
+      }
+
+      std::vector<address> stream;
+      stream.reserve(packets);
+      for (std::size_t i = 0; i < packets; ++i)
+        stream.push_back(rng() % 4 ? known[rng() % peers] : randomAddress(rng, v6));
+
+      const double setTime = bestOf(runs, [&] {
+        for (const auto& peer : stream)
+          sink += set.contains(peer);
+      });
+      const double listTime = bestOf(runs, [&] {
+        for (const auto& peer : stream)
+        {
+          for (PoolHandle h = head; const Permission* permission = pool.get(h); h = permission->next)
+          {
+            if (permission->peer == peer)
+            {
+              ++sink;
+              break;
+            }
+          }
+        }
+      });
+
+      std::printf("%-8zu %-6s %14.1f %14.1f\n", peers, v6 ? "ipv6" : "ipv4", setTime / packets, listTime / packets);
+    }
+  }
+  return sink == 0 ? 1 : 0;
+}
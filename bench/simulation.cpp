@@ -0,0 +1,442 @@
+// Deterministic simulation of one TURN worker under a synthetic population of
+// clients, on virtual time: allocations, permissions and channels are
+// created, refreshed, deleted or left to expire, data flows through channels,
+// and one tenant is held to an allocation quota and a request rate. Hours of
+// lifetime run in minutes, and the counters only depend on the parameters and
+// the seed, so two runs with the same arguments end on the same numbers.
+//
+// Relay sockets are not opened (TurnConfig::virtualRelays), data towards
+// peers is only accounted. Each report gives the CPU time spent per
+// simulated second and the memory high-water marks.
+//
+//   ustun-sim [allocations=100000] [duration=3600] [ramp=60] [session=1800]
+//             [gap=60] [lifetime=600] [vanish=0.2] [packets=10000]
+//             [quota=allocations/8] [rps=0] [seed=1] [report=300]
+//
+// A quarter of the clients belong to the limited tenant, vanish is the share
+// of sessions that end without a deleting Refresh.
+
+#include "serverClock.hpp"
+#include "stats.hpp"
+#include "stunMessage.hpp"
+#include "tenantTable.hpp"
+#include "turnServer.hpp"
+#include "worker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  struct Parameters
+  {
+    uint32_t allocations = 100000; // clients, each holding at most one allocation
+    uint32_t duration    = 3600; // simulated seconds
+    uint32_t ramp        = 60; // seconds over which clients first arrive
+    uint32_t session     = 1800; // mean allocation life, exponential
+    uint32_t gap         = 60; // mean pause between two sessions of a client
+    uint32_t lifetime    = 600; // requested LIFETIME
+    double vanish        = 0.2;
+    uint32_t packets     = 10000; // ChannelData per simulated second
+    uint32_t quota       = 0; // of the limited tenant, 0 is allocations/8
+    double rps           = 0; // of the limited tenant, 0 is unlimited
+    uint64_t seed        = 1;
+    uint32_t report      = 300;
+  };
+
+  enum class EventKind : uint8_t
+  {
+    Start,
+    Refresh,
+    End
+  };
+
+  struct Event
+  {
+    uint32_t client;
+    uint32_t session; // stale once the client moved on
+    EventKind kind;
+  };
+
+  struct Client
+  {
+    udp::endpoint remote;
+    udp::endpoint peer;
+    TenantId tenant;
+    uint32_t session = 0;
+    uint32_t ends    = 0;
+    bool active      = false;
+  };
+
+  struct Counters
+  {
+    uint64_t created       = 0;
+    uint64_t deleted       = 0;
+    uint64_t quotaRejected = 0;
+    uint64_t rateLimited   = 0;
+    uint64_t otherErrors   = 0;
+    uint64_t refreshes     = 0;
+    uint64_t refreshLost   = 0; // 437, the allocation expired before
+    uint64_t packets       = 0;
+  };
+
+  // Replies of the server, only counted
+  class SimSender : public ClientSender {
+    public:
+      void sendToClient(const uint8_t*, std::size_t bytes, const udp::endpoint&) override { sent += bytes; }
+      std::shared_ptr<ClientSender> retain() override
+      {
+        return std::shared_ptr<ClientSender>(this, [](ClientSender*) {});
+      }
+
+      uint64_t sent = 0;
+  };
+
+  double threadCpuMicros()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+  }
+
+  long maxRssKib()
+  {
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  bool parseArgument(const char* arg, Parameters& p)
+  {
+    const char* eq = std::strchr(arg, '=');
+    if (!eq)
+      return false;
+    const std::string name(arg, eq);
+    const char* value = eq + 1;
+
+    const std::map<std::string, uint32_t*> integers {{"allocations", &p.allocations},
+        {"duration", &p.duration}, {"ramp", &p.ramp}, {"session", &p.session}, {"gap", &p.gap},
+        {"lifetime", &p.lifetime}, {"packets", &p.packets}, {"quota", &p.quota}, {"report", &p.report}};
+    const auto it = integers.find(name);
+    if (it != integers.end())
+      *it->second = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+    else if (name == "vanish")
+      p.vanish = std::strtod(value, nullptr);
+    else if (name == "rps")
+      p.rps = std::strtod(value, nullptr);
+    else if (name == "seed")
+      p.seed = std::strtoull(value, nullptr, 10);
+    else
+      return false;
+    return true;
+  }
+
+  class Simulation {
+    public:
+      Simulation(const Parameters& params, TenantTable& tenants, TurnServer& turn, Worker& worker, Stats& stats)
+          : _params(params)
+          , _tenants(tenants)
+          , _turn(turn)
+          , _worker(worker)
+          , _stats(stats)
+          , _rng(params.seed)
+          , _clients(params.allocations)
+      {
+        // Long enough for the longest delay ever scheduled
+        std::size_t size = 1;
+        while (size <= std::max({params.ramp, params.session * 8, params.gap * 8, params.lifetime}) + 1)
+          size <<= 1;
+        _wheel.resize(size);
+
+        for (uint32_t i = 0; i < params.allocations; ++i)
+        {
+          auto& client  = _clients[i];
+          client.tenant = i % 4 == 0 ? 1 : 0;
+          client.remote = udp::endpoint(boost::asio::ip::address_v4(0x0A000000u + i), 1024);
+          client.peer   = udp::endpoint(boost::asio::ip::address_v4(0xC6120000u + (i & 0xFFFF)), 3478);
+          schedule(params.ramp ? _rng() % params.ramp : 0, i, EventKind::Start);
+        }
+      }
+
+      void run()
+      {
+        std::vector<double> cpu;
+        double windowStart = 0;
+        for (uint32_t second = 0; second < _params.duration; ++second)
+        {
+          const double before = threadCpuMicros();
+
+          auto& slot  = _wheel[second & (_wheel.size() - 1)];
+          auto events = std::move(slot);
+          slot.clear();
+          for (const auto& event : events)
+            handle(event);
+          sendData();
+
+          ServerClock::advance(std::chrono::seconds(1));
+          ++_now;
+          _turn.sweep();
+
+          cpu.push_back(threadCpuMicros() - before);
+          _poolHighWater = std::max(_poolHighWater, _stats.poolBytes.load());
+
+          if ((second + 1) % _params.report == 0 || second + 1 == _params.duration)
+          {
+            report(second + 1, cpu, windowStart);
+            windowStart = second + 1;
+            cpu.clear();
+          }
+        }
+      }
+
+      const Counters& counters() const { return _counters; }
+
+    private:
+      void schedule(uint32_t delay, uint32_t client, EventKind kind)
+      {
+        delay = std::max<uint32_t>(delay, 1);
+        _wheel[(_now + delay) & (_wheel.size() - 1)].push_back(Event {client, _clients[client].session, kind});
+      }
+
+      uint32_t exponential(uint32_t mean)
+      {
+        const double u = (_rng() >> 11) * (1.0 / 9007199254740992.0);
+        return static_cast<uint32_t>(std::min(-std::log(1 - u) * mean, mean * 8.0));
+      }
+
+      RequestContext context(uint32_t index)
+      {
+        const auto& client = _clients[index];
+        return RequestContext {_worker, Transport::Udp, client.remote, client.remote, &_sender, client.tenant};
+      }
+
+      // Runs one request through the rate limit and the TURN server, returns
+      // the response class and code
+      uint16_t request(uint32_t index, uint16_t method, uint32_t lifetime, unsigned& code)
+      {
+        const auto& client = _clients[index];
+        code               = 0;
+        if (!_tenants.admitRequest(_worker.index(), client.tenant))
+        {
+          ++_counters.rateLimited;
+          return CLASS_ERROR;
+        }
+
+        uint8_t trans_id[12] = {};
+        ++_transactions;
+        std::memcpy(trans_id, &_transactions, sizeof(_transactions));
+
+        _message.clear();
+        StunMessageBuilder builder(_message, messageType(method, CLASS_REQUEST), trans_id);
+        if (method == METHOD_ALLOCATE)
+        {
+          const uint8_t udpTransport[4] = {17, 0, 0, 0};
+          builder.addAttribute(ATTR_REQUESTED_TRANSPORT, udpTransport, sizeof(udpTransport));
+        }
+        if (method == METHOD_ALLOCATE || method == METHOD_REFRESH)
+          builder.addUint32(ATTR_LIFETIME, lifetime);
+        if (method == METHOD_CHANNEL_BIND)
+          builder.addUint32(ATTR_CHANNEL_NUMBER, 0x40000000u);
+        if (method == METHOD_CHANNEL_BIND || method == METHOD_CREATE_PERMISSION)
+          builder.addXorAddress(ATTR_XOR_PEER_ADDRESS, client.peer);
+
+        StunMessage msg;
+        msg.parse(_message.data(), _message.size());
+        _turn.handleMessage(context(index), msg, _response);
+
+        StunMessage resp;
+        if (!resp.parse(_response.data(), _response.size()))
+          return CLASS_ERROR;
+        StunAttribute error;
+        if (resp.cls() == CLASS_ERROR && resp.find(ATTR_ERROR_CODE, error) && error.length >= 4)
+          code = error.value[2] * 100u + error.value[3];
+        return resp.cls();
+      }
+
+      void handle(const Event& event)
+      {
+        auto& client = _clients[event.client];
+        if (event.session != client.session)
+          return;
+
+        unsigned code = 0;
+        switch (event.kind)
+        {
+          case EventKind::Start:
+          {
+            if (request(event.client, METHOD_ALLOCATE, _params.lifetime, code) != CLASS_SUCCESS)
+            {
+              if (code == 486)
+                ++_counters.quotaRejected;
+              else if (code != 0)
+                ++_counters.otherErrors;
+              schedule(code == 486 ? 30 : 5, event.client, EventKind::Start);
+              return;
+            }
+            ++_counters.created;
+            request(event.client, METHOD_CREATE_PERMISSION, 0, code);
+            request(event.client, METHOD_CHANNEL_BIND, 0, code);
+            client.active = true;
+            client.ends   = _now + std::max<uint32_t>(exponential(_params.session), 1);
+            schedule(client.ends - _now, event.client, EventKind::End);
+            scheduleRefresh(event.client);
+            break;
+          }
+          case EventKind::Refresh:
+            ++_counters.refreshes;
+            if (request(event.client, METHOD_REFRESH, _params.lifetime, code) == CLASS_SUCCESS)
+              request(event.client, METHOD_CHANNEL_BIND, 0, code);
+            else if (code == 437)
+              ++_counters.refreshLost;
+            scheduleRefresh(event.client);
+            break;
+          case EventKind::End:
+          {
+            const bool vanish = (_rng() >> 11) * (1.0 / 9007199254740992.0) < _params.vanish;
+            if (!vanish && request(event.client, METHOD_REFRESH, 0, code) == CLASS_SUCCESS)
+              ++_counters.deleted;
+
+            // Next session from another port, a new allocation
+            client.active = false;
+            ++client.session;
+            client.remote.port(static_cast<uint16_t>(1024 + client.session % 64512));
+            schedule(exponential(_params.gap), event.client, EventKind::Start);
+            break;
+          }
+        }
+      }
+
+      // Before the allocation expires, and often enough for the channel and
+      // its permission (300 s)
+      void scheduleRefresh(uint32_t index)
+      {
+        const uint32_t interval = std::min<uint32_t>(std::max<uint32_t>(_params.lifetime / 2, 1), 240);
+        if (_now + interval < _clients[index].ends)
+          schedule(interval, index, EventKind::Refresh);
+      }
+
+      void sendData()
+      {
+        uint8_t data[4 + 160] = {0x40, 0x00, 0x00, 160};
+        for (uint32_t i = 0; i < _params.packets; ++i)
+        {
+          const uint32_t index = static_cast<uint32_t>(_rng() % _clients.size());
+          if (!_clients[index].active)
+            continue;
+          _turn.handleChannelData(context(index), data, sizeof(data));
+          ++_counters.packets;
+        }
+      }
+
+      void report(uint32_t second, std::vector<double>& cpu, double windowStart)
+      {
+        std::sort(cpu.begin(), cpu.end());
+        double total = 0;
+        for (const double c : cpu)
+          total += c;
+        const uint64_t live    = _stats.turnAllocations.load();
+        const uint64_t expired = _counters.created - _counters.deleted - live;
+
+        std::printf("t=%us allocations=%llu created=%llu deleted=%llu expired=%llu quota_rejected=%llu "
+                    "rate_limited=%llu relayed=%llu | cpu per simulated s: mean %.0f us p99 %.0f us max %.0f us "
+                    "| rss_hwm %.1f MiB pool_hwm %.1f MiB\n",
+            second, static_cast<unsigned long long>(live), static_cast<unsigned long long>(_counters.created),
+            static_cast<unsigned long long>(_counters.deleted), static_cast<unsigned long long>(expired),
+            static_cast<unsigned long long>(_counters.quotaRejected),
+            static_cast<unsigned long long>(_counters.rateLimited),
+            static_cast<unsigned long long>(_stats.relayedToPeer.load()), total / (second - windowStart),
+            cpu[std::min(cpu.size() - 1, cpu.size() * 99 / 100)], cpu.back(), maxRssKib() / 1024.0,
+            _poolHighWater / 1048576.0);
+        std::fflush(stdout);
+      }
+
+    private:
+      const Parameters& _params;
+      TenantTable& _tenants;
+      TurnServer& _turn;
+      Worker& _worker;
+      Stats& _stats;
+      std::mt19937_64 _rng;
+      std::vector<Client> _clients;
+      std::vector<std::vector<Event>> _wheel; // by due second
+      uint32_t _now           = 0;
+      uint64_t _transactions  = 0;
+      uint64_t _poolHighWater = 0;
+      SimSender _sender;
+      Counters _counters;
+      std::vector<uint8_t> _message;
+      std::vector<uint8_t> _response;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  Parameters params;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!parseArgument(argv[i], params))
+    {
+      std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (params.quota == 0)
+    params.quota = std::max<uint32_t>(params.allocations / 8, 1);
+  params.report = std::max<uint32_t>(params.report, 1);
+
+  spdlog::set_level(spdlog::level::warn);
+  ServerClock::useVirtualTime(1700000000);
+
+  std::vector<TenantConfig> tenantConfigs(2);
+  tenantConfigs[0].realm          = "open.example";
+  tenantConfigs[1].realm          = "limited.example";
+  tenantConfigs[1].maxAllocations = params.quota;
+  tenantConfigs[1].requestRate    = params.rps;
+
+  TurnConfig turnConfig;
+  turnConfig.enabled         = true;
+  turnConfig.relayAddress    = boost::asio::ip::address_v4::loopback();
+  turnConfig.externalAddress = boost::asio::ip::make_address("192.0.2.1");
+  turnConfig.maxLifetime     = std::max<uint32_t>(turnConfig.maxLifetime, params.lifetime);
+  turnConfig.virtualRelays   = true;
+
+  const long rssBefore = maxRssKib();
+  const auto wallStart = std::chrono::steady_clock::now();
+  {
+    Worker worker(0);
+    TenantTable tenants(tenantConfigs, 1);
+    Stats stats;
+    TurnServer turn(worker, turnConfig, tenants, stats, nullptr);
+    Simulation simulation(params, tenants, turn, worker, stats);
+    simulation.run();
+
+    const auto& c     = simulation.counters();
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    std::printf("result: created=%llu deleted=%llu quota_rejected=%llu rate_limited=%llu errors=%llu "
+                "refreshes=%llu refresh_lost=%llu packets=%llu\n",
+        static_cast<unsigned long long>(c.created), static_cast<unsigned long long>(c.deleted),
+        static_cast<unsigned long long>(c.quotaRejected), static_cast<unsigned long long>(c.rateLimited),
+        static_cast<unsigned long long>(c.otherErrors), static_cast<unsigned long long>(c.refreshes),
+        static_cast<unsigned long long>(c.refreshLost), static_cast<unsigned long long>(c.packets));
+    std::printf("%u simulated seconds in %.1f s (x%.0f), baseline rss %.1f MiB\n", params.duration, wall,
+        params.duration / wall, rssBefore / 1024.0);
+  }
+  return 0;
+}
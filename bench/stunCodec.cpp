@@ -0,0 +1,262 @@
+// The header-only codec on its own: building and parsing one message, the
+// batch helpers, FINGERPRINT and MESSAGE-INTEGRITY, the latter against
+// OpenSSL's HMAC as the server used it (copy of the message, length patched).
+// The known answer tests and a round trip run at compile time.
+//
+//   bench-stun-codec [messages=100000]
+
+#include <ustun/stunCodec.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+using namespace ustun::protocol;
+
+namespace
+{
+  using BenchClock = std::chrono::steady_clock;
+
+  constexpr std::size_t BATCH = 64;
+
+  template<std::size_t N>
+  constexpr bool equal(const uint8_t* a, const uint8_t (&b)[N])
+  {
+    for (std::size_t i = 0; i < N; ++i)
+    {
+      if (a[i] != b[i])
+        return false;
+    }
+    return true;
+  }
+
+  constexpr bool sha1Abc()
+  {
+    const uint8_t abc[] = {'a', 'b', 'c'};
+    const uint8_t expected[] = {0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e, 0x25, 0x71, 0x78, 0x50,
+        0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d};
+    ustun::detail::Sha1 sha;
+    sha.update(abc, sizeof(abc));
+    uint8_t digest[20] {};
+    sha.finish(digest);
+    return equal(digest, expected);
+  }
+
+  // RFC 2202 test case 2
+  constexpr bool hmacJefe()
+  {
+    const uint8_t key[]  = {'J', 'e', 'f', 'e'};
+    const char text[]    = "what do ya want for nothing?";
+    const uint8_t expected[] = {0xef, 0xfc, 0xdf, 0x6a, 0xe5, 0xeb, 0x2f, 0xa2, 0xd2, 0x74, 0x16, 0xd5, 0xf1, 0x84,
+        0xdf, 0x9c, 0x25, 0x9a, 0x7c, 0x79};
+    uint8_t data[sizeof(text) - 1] {};
+    for (std::size_t i = 0; i < sizeof(data); ++i)
+      data[i] = static_cast<uint8_t>(text[i]);
+    ustun::detail::HmacSha1 hmac(key, sizeof(key));
+    hmac.update(data, sizeof(data));
+    uint8_t mac[20] {};
+    hmac.finish(mac);
+    return equal(mac, expected);
+  }
+
+  constexpr bool crcCheck()
+  {
+    const uint8_t digits[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    return (ustun::detail::crc32Update(0xFFFFFFFF, digits, sizeof(digits)) ^ 0xFFFFFFFF) == 0xCBF43926;
+  }
+
+  constexpr bool roundTrip()
+  {
+    const uint8_t id[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    const uint8_t key[]  = {'k', 'e', 'y'};
+    uint8_t buffer[128] {};
+
+    ustun::Address mapped;
+    mapped.family   = FAMILY_IPV4;
+    mapped.port     = 3478;
+    mapped.bytes[0] = 192;
+    mapped.bytes[3] = 7;
+
+    ustun::MessageWriter writer(buffer, BINDING_SUCCESS_RESP, id);
+    writer.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped);
+    writer.addIntegrity(key, sizeof(key));
+    writer.addFingerprint();
+
+    ustun::MessageView view;
+    ustun::Address decoded;
+    return writer.ok() && view.parse(buffer, writer.size()) && view.type() == BINDING_SUCCESS_RESP
+        && view.xorAddress(ATTR_XOR_MAPPED_ADDRESS, decoded) && decoded.port == 3478 && decoded.bytes[0] == 192
+        && decoded.bytes[3] == 7 && view.checkIntegrity(key, sizeof(key)) && view.checkFingerprint()
+        && !view.checkIntegrity(id, sizeof(id));
+  }
+
+  static_assert(sha1Abc(), "SHA-1 known answer");
+  static_assert(hmacJefe(), "HMAC-SHA1 known answer");
+  static_assert(crcCheck(), "CRC-32 check value");
+  static_assert(roundTrip(), "constexpr round trip");
+
+  template<typename F>
+  double bestOf(int runs, F f)
+  {
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i)
+    {
+      const auto start = BenchClock::now();
+      f();
+      best = std::min(best, std::chrono::duration<double, std::nano>(BenchClock::now() - start).count());
+    }
+    return best;
+  }
+
+  // Authenticated Allocate-like request: USERNAME, REALM, NONCE, then
+  // MESSAGE-INTEGRITY and FINGERPRINT
+  std::size_t buildRequest(std::mt19937& rng, const uint8_t* key, std::size_t keyLength, ustun::Span<uint8_t> out)
+  {
+    uint8_t id[12];
+    for (auto& byte : id)
+      byte = static_cast<uint8_t>(rng());
+    const char username[] = "alice";
+    const char realm[]    = "example.org";
+    uint8_t nonce[32];
+    for (auto& byte : nonce)
+      byte = static_cast<uint8_t>('a' + rng() % 26);
+
+    ustun::MessageWriter writer(out, messageType(METHOD_ALLOCATE, CLASS_REQUEST), id);
+    writer.addUint32(ATTR_REQUESTED_TRANSPORT, 17 << 24);
+    writer.addAttribute(ATTR_USERNAME, reinterpret_cast<const uint8_t*>(username), sizeof(username) - 1);
+    writer.addAttribute(ATTR_REALM, reinterpret_cast<const uint8_t*>(realm), sizeof(realm) - 1);
+    writer.addAttribute(ATTR_NONCE, nonce, sizeof(nonce));
+    writer.addIntegrity(key, keyLength);
+    writer.addFingerprint();
+    return writer.size();
+  }
+
+  bool opensslIntegrity(const ustun::MessageView& view, const uint8_t* key, std::size_t keyLength,
+      std::vector<uint8_t>& scratch)
+  {
+    ustun::Attribute integrity {};
+    if (!view.find(ATTR_MESSAGE_INTEGRITY, integrity) || integrity.length != HMAC_SHA1_SIZE)
+      return false;
+    const std::size_t offset = integrity.value - 4 - view.data();
+    const std::size_t length = offset + 4 + HMAC_SHA1_SIZE - STUN_HEADER_SIZE;
+    scratch.assign(view.data(), view.data() + offset);
+    scratch[2] = static_cast<uint8_t>(length >> 8);
+    scratch[3] = static_cast<uint8_t>(length);
+
+    uint8_t mac[HMAC_SHA1_SIZE];
+    unsigned macLength = 0;
+    HMAC(EVP_sha1(), key, static_cast<int>(keyLength), scratch.data(), offset, mac, &macLength);
+    return std::memcmp(mac, integrity.value, HMAC_SHA1_SIZE) == 0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const std::size_t messages = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+  const int runs             = 10;
+  if (messages == 0)
+    return 1;
+
+  std::mt19937 rng(42);
+  const uint8_t key[16] = {0x84, 0x93, 0xfb, 0xc5, 0x3b, 0xa5, 0x82, 0xfb, 0x4c, 0x04, 0x4c, 0x45, 0x6b, 0xdc,
+      0x40, 0xeb}; // MD5("user:realm:pass") sized
+
+  // Stored back to back, as a batch receive would leave them
+  std::vector<uint8_t> storage(messages * 256);
+  std::vector<ustun::Span<const uint8_t>> datagrams;
+  std::size_t used = 0;
+  for (std::size_t i = 0; i < messages; ++i)
+  {
+    const std::size_t size = buildRequest(rng, key, sizeof(key), {storage.data() + used, storage.size() - used});
+    datagrams.emplace_back(storage.data() + used, size);
+    used += size;
+  }
+
+  // Cross check against OpenSSL before timing anything
+  std::vector<uint8_t> scratch;
+  for (const auto& datagram : datagrams)
+  {
+    ustun::MessageView view;
+    if (!view.parse(datagram) || !view.checkIntegrity(key, sizeof(key)) || !view.checkFingerprint()
+        || !opensslIntegrity(view, key, sizeof(key), scratch))
+    {
+      std::fprintf(stderr, "codec and OpenSSL disagree\n");
+      return 1;
+    }
+  }
+
+  std::size_t sink = 0;
+  std::vector<uint8_t> out(BATCH * 128);
+  std::vector<ustun::MessageView> views(messages);
+  std::vector<std::size_t> sizes(BATCH);
+
+  ustun::Address mapped;
+  mapped.family = FAMILY_IPV6;
+  mapped.port   = 50000;
+  for (auto& byte : mapped.bytes)
+    byte = static_cast<uint8_t>(rng());
+
+  const double encode = bestOf(runs, [&] {
+    for (std::size_t i = 0; i < messages; ++i)
+    {
+      ustun::MessageWriter writer({out.data(), out.size()}, BINDING_SUCCESS_RESP, datagrams[i].data() + 8);
+      writer.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped);
+      writer.addFingerprint();
+      sink += writer.size();
+    }
+  });
+  const double encodeBatch = bestOf(runs, [&] {
+    for (std::size_t i = 0; i + BATCH <= messages; i += BATCH)
+    {
+      sink += ustun::encodeBatch({out.data(), out.size()}, {sizes.data(), sizes.size()},
+          [&](std::size_t j, ustun::Span<uint8_t> room) {
+            ustun::MessageWriter writer(room, BINDING_SUCCESS_RESP, datagrams[i + j].data() + 8);
+            writer.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped);
+            writer.addFingerprint();
+            return writer.size();
+          });
+    }
+  });
+  const double parse = bestOf(runs, [&] {
+    for (const auto& datagram : datagrams)
+    {
+      ustun::MessageView view;
+      ustun::Attribute nonce {};
+      sink += view.parse(datagram) && view.find(ATTR_NONCE, nonce);
+    }
+  });
+  const double parseBatch = bestOf(runs, [&] {
+    sink += ustun::parseBatch({datagrams.data(), datagrams.size()}, {views.data(), views.size()});
+  });
+  const double fingerprint = bestOf(runs, [&] {
+    for (const auto& view : views)
+      sink += view.checkFingerprint();
+  });
+  const double integrity = bestOf(runs, [&] {
+    for (const auto& view : views)
+      sink += view.checkIntegrity(key, sizeof(key));
+  });
+  const double openssl = bestOf(runs, [&] {
+    for (const auto& view : views)
+      sink += opensslIntegrity(view, key, sizeof(key), scratch);
+  });
+
+  const std::size_t batched = messages / BATCH * BATCH;
+  std::printf("%zu messages of %zu bytes, best of %d runs\n", messages, datagrams[0].size(), runs);
+  std::printf("%-36s %10s\n", "", "ns/msg");
+  std::printf("%-36s %10.1f\n", "encode (xor-mapped, fingerprint)", encode / messages);
+  std::printf("%-36s %10.1f\n", "encodeBatch", batched ? encodeBatch / batched : 0.0);
+  std::printf("%-36s %10.1f\n", "parse + find", parse / messages);
+  std::printf("%-36s %10.1f\n", "parseBatch", parseBatch / messages);
+  std::printf("%-36s %10.1f\n", "check fingerprint", fingerprint / messages);
+  std::printf("%-36s %10.1f\n", "check integrity (codec)", integrity / messages);
+  std::printf("%-36s %10.1f\n", "check integrity (OpenSSL HMAC)", openssl / messages);
+  return sink == 0 ? 1 : 0;
+}
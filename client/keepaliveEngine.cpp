@@ -0,0 +1,450 @@
+#include "keepaliveEngine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+
+using boost::asio::ip::udp;
+
+constexpr uint32_t KeepaliveEngine::NONE;
+constexpr std::size_t KeepaliveEngine::BATCH;
+constexpr std::size_t KeepaliveEngine::REQUEST_SIZE;
+constexpr std::size_t KeepaliveEngine::RECEIVE_SIZE;
+
+namespace
+{
+  constexpr std::size_t MIN_WHEEL = 256;
+  constexpr std::size_t MAX_WHEEL = std::size_t(1) << 20;
+  // Receive batches per wake up, so that a flood cannot starve the sends
+  constexpr int RECEIVE_ROUNDS = 16;
+
+  std::size_t powerOfTwo(std::size_t n)
+  {
+    std::size_t size = 1;
+    while (size < n)
+      size *= 2;
+    return size;
+  }
+
+  bool sameAddress(const ustun::Address& a, const ustun::Address& b)
+  {
+    return a.family == b.family && a.port == b.port && std::equal(a.bytes, a.bytes + sizeof(a.bytes), b.bytes);
+  }
+}
+
+KeepaliveEngine::KeepaliveEngine(boost::asio::io_context& io, const udp::endpoint& local,
+    const KeepaliveConfig& config, Callback callback)
+    : _config(config)
+    , _callback(std::move(callback))
+    , _socket(io)
+    , _timer(io)
+    , _endpoints(config.capacity)
+    , _index(powerOfTwo(std::max<std::size_t>(2 * std::size_t(config.capacity), 2)), NONE)
+    , _indexMask(_index.size() - 1)
+    , _origin(Clock::now())
+    , _sendHeaders(BATCH)
+    , _sendIov(BATCH)
+    , _sendNames(BATCH)
+    , _sendBuffers(BATCH * REQUEST_SIZE)
+    , _receiveHeaders(BATCH)
+    , _receiveIov(BATCH)
+    , _receiveNames(BATCH)
+    , _receiveBuffers(BATCH * RECEIVE_SIZE)
+{
+  const auto tick = std::max<int64_t>(config.tick.count(), 1);
+  _intervalTicks  = static_cast<uint32_t>(std::max<int64_t>(config.interval.count() / tick, 1));
+  _timeoutTicks   = static_cast<uint32_t>(std::max<int64_t>(config.timeout.count() / tick, 1));
+
+  // One turn covers an interval and its jitter, later due times wait for
+  // their turn
+  const std::size_t span = std::size_t(_intervalTicks) * (100 + config.jitterPercent) / 100 + 1;
+  _wheel.assign(std::min(powerOfTwo(std::max(span, MIN_WHEEL)), MAX_WHEEL), NONE);
+  _wheelMask = _wheel.size() - 1;
+
+  for (uint32_t id = 0; id < config.capacity; ++id)
+  {
+    _endpoints[id].state = State::Free;
+    _endpoints[id].next  = id + 1 < config.capacity ? id + 1 : NONE;
+  }
+  _free = config.capacity > 0 ? 0 : NONE;
+
+  std::random_device seed;
+  _rng[0] = (uint64_t(seed()) << 32) | seed();
+  _rng[1] = (uint64_t(seed()) << 32) | seed() | 1;
+
+  for (std::size_t i = 0; i < BATCH; ++i)
+  {
+    _receiveIov[i]                        = {_receiveBuffers.data() + i * RECEIVE_SIZE, RECEIVE_SIZE};
+    _receiveHeaders[i].msg_hdr            = {};
+    _receiveHeaders[i].msg_hdr.msg_name   = &_receiveNames[i];
+    _receiveHeaders[i].msg_hdr.msg_iov    = &_receiveIov[i];
+    _receiveHeaders[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  _socket.open(local.protocol());
+  _socket.non_blocking(true);
+  _socket.set_option(udp::socket::send_buffer_size(config.socketBuffer));
+  _socket.set_option(udp::socket::receive_buffer_size(config.socketBuffer));
+  _socket.bind(local);
+}
+
+uint32_t KeepaliveEngine::add(const udp::endpoint& server)
+{
+  const bool v6 = _socket.local_endpoint().protocol() == udp::v6();
+  if (_free == NONE || (!v6 && server.address().is_v6()))
+    return NONE;
+
+  const uint32_t id = _free;
+  Endpoint& e       = _endpoints[id];
+  _free             = e.next;
+
+  e.server = server;
+  if (v6 && server.address().is_v4())
+    e.server = {boost::asio::ip::address_v6::v4_mapped(server.address().to_v4()), server.port()};
+  e.mapped   = ustun::Address();
+  e.attempts = 0;
+  e.state    = State::Idle;
+  schedule(id, now() + 1 + random() % _intervalTicks);
+  return id;
+}
+
+void KeepaliveEngine::remove(uint32_t id)
+{
+  if (id >= _endpoints.size() || _endpoints[id].state == State::Free)
+    return;
+
+  Endpoint& e = _endpoints[id];
+  if (e.state == State::Pending)
+    unindex(id);
+  unschedule(id);
+  e.state = State::Free;
+  e.next  = _free;
+  _free   = id;
+}
+
+bool KeepaliveEngine::mapping(uint32_t id, ustun::Address& out) const
+{
+  if (id >= _endpoints.size() || _endpoints[id].state == State::Free || _endpoints[id].mapped.family == 0)
+    return false;
+  out = _endpoints[id].mapped;
+  return true;
+}
+
+void KeepaliveEngine::start()
+{
+  _running = true;
+  scheduleTick();
+  startReceive();
+}
+
+void KeepaliveEngine::stop()
+{
+  _running = false;
+  _timer.cancel();
+  _socket.cancel();
+}
+
+std::size_t KeepaliveEngine::memoryUsage() const
+{
+  return _endpoints.capacity() * sizeof(Endpoint) + _index.capacity() * sizeof(uint32_t)
+      + _wheel.capacity() * sizeof(uint32_t) + BATCH * (2 * sizeof(mmsghdr) + 2 * sizeof(iovec)
+      + 2 * sizeof(sockaddr_storage) + REQUEST_SIZE + RECEIVE_SIZE);
+}
+
+uint64_t KeepaliveEngine::now() const
+{
+  const auto elapsed = Clock::now() - _origin;
+  const auto tick    = std::max<int64_t>(_config.tick.count(), 1);
+  return std::max(_tick, uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / tick));
+}
+
+uint32_t KeepaliveEngine::jittered()
+{
+  const uint32_t spread = static_cast<uint32_t>(uint64_t(_intervalTicks) * _config.jitterPercent / 100);
+  return std::max<uint32_t>(_intervalTicks - spread + static_cast<uint32_t>(random() % (2 * spread + 1)), 1);
+}
+
+// xorshift128+, the transaction IDs only need to be hard to guess off path
+uint64_t KeepaliveEngine::random()
+{
+  uint64_t s1       = _rng[0];
+  const uint64_t s0 = _rng[1];
+  _rng[0]           = s0;
+  s1 ^= s1 << 23;
+  _rng[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+  return _rng[1] + s0;
+}
+
+void KeepaliveEngine::advance(Clock::time_point time)
+{
+  const auto tick       = std::max<int64_t>(_config.tick.count(), 1);
+  const uint64_t target = uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(time - _origin).count())
+      / uint64_t(tick);
+  if (target <= _tick)
+    return;
+
+  // After a stall every slot is visited once, due times say what is late
+  const uint64_t from  = _tick;
+  const uint64_t steps = std::min<uint64_t>(target - from, _wheel.size());
+  _tick                = target;
+  for (uint64_t k = 1; k <= steps; ++k)
+  {
+    for (uint32_t id = _wheel[(from + k) & _wheelMask]; id != NONE; id = _walkNext)
+    {
+      _walkNext = _endpoints[id].next;
+      if (static_cast<int32_t>(_endpoints[id].due - static_cast<uint32_t>(target)) <= 0)
+      {
+        unschedule(id);
+        fire(id);
+      }
+    }
+  }
+  _walkNext = NONE;
+  flush();
+}
+
+void KeepaliveEngine::fire(uint32_t id)
+{
+  Endpoint& e = _endpoints[id];
+  if (e.state == State::Idle)
+  {
+    const uint64_t a = random(), b = random();
+    std::memcpy(e.transaction, &a, 8);
+    std::memcpy(e.transaction + 8, &b, 4);
+    e.attempts = 0;
+    e.state    = State::Pending;
+    index(id);
+    send(id);
+    schedule(id, _tick + _timeoutTicks);
+    return;
+  }
+
+  // Retransmissions keep the transaction ID (RFC 5389 §7.2.1)
+  if (e.attempts < _config.retries)
+  {
+    ++e.attempts;
+    ++_stats.retransmitted;
+    send(id);
+    schedule(id, _tick + (uint64_t(_timeoutTicks) << e.attempts));
+    return;
+  }
+
+  unindex(id);
+  e.state = State::Idle;
+  ++_stats.lost;
+  schedule(id, _tick + jittered());
+  if (e.mapped.family != 0)
+  {
+    const ustun::Address last = e.mapped;
+    e.mapped                  = ustun::Address();
+    _callback(id, Event::Lost, last);
+  }
+}
+
+void KeepaliveEngine::send(uint32_t id)
+{
+  const Endpoint& e = _endpoints[id];
+  uint8_t* buffer   = _sendBuffers.data() + _batched * REQUEST_SIZE;
+  ustun::MessageWriter writer({buffer, REQUEST_SIZE}, ustun::BINDING_REQUEST, e.transaction);
+  writer.addFingerprint();
+
+  // The address is copied, the endpoint may be removed before the flush
+  std::memcpy(&_sendNames[_batched], e.server.data(), e.server.size());
+  _sendIov[_batched]     = {buffer, writer.size()};
+  msghdr& hdr            = _sendHeaders[_batched].msg_hdr;
+  hdr                    = {};
+  hdr.msg_name           = &_sendNames[_batched];
+  hdr.msg_namelen        = static_cast<socklen_t>(e.server.size());
+  hdr.msg_iov            = &_sendIov[_batched];
+  hdr.msg_iovlen         = 1;
+  ++_stats.sent;
+
+  if (++_batched == BATCH)
+    flush();
+}
+
+void KeepaliveEngine::flush()
+{
+  const int fd     = _socket.native_handle();
+  std::size_t done = 0;
+  while (done < _batched)
+  {
+    const int sent = sendmmsg(fd, _sendHeaders.data() + done, static_cast<unsigned>(_batched - done), 0);
+    if (sent > 0)
+    {
+      done += static_cast<std::size_t>(sent);
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    // A full socket buffer drops the rest, the retransmissions make up for
+    // it; any other error is the first datagram's own
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      _stats.sendErrors += _batched - done;
+      break;
+    }
+    ++_stats.sendErrors;
+    ++done;
+  }
+  _batched = 0;
+}
+
+void KeepaliveEngine::receive()
+{
+  const int fd = _socket.native_handle();
+  for (int round = 0; round < RECEIVE_ROUNDS; ++round)
+  {
+    for (auto& header : _receiveHeaders)
+      header.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+
+    const int received = recvmmsg(fd, _receiveHeaders.data(), BATCH, MSG_DONTWAIT, nullptr);
+    if (received <= 0)
+      break;
+    for (int i = 0; i < received; ++i)
+    {
+      handleResponse(_receiveBuffers.data() + i * RECEIVE_SIZE, _receiveHeaders[i].msg_len, _receiveNames[i],
+          _receiveHeaders[i].msg_hdr.msg_namelen);
+    }
+    if (static_cast<std::size_t>(received) < BATCH)
+      break;
+  }
+}
+
+void KeepaliveEngine::handleResponse(const uint8_t* data, std::size_t bytes, const sockaddr_storage& from,
+    socklen_t fromLength)
+{
+  ustun::MessageView msg;
+  ustun::Attribute fingerprint {};
+  if (!msg.parse(data, bytes) || msg.type() != ustun::BINDING_SUCCESS_RESP
+      || (msg.find(ustun::ATTR_FINGERPRINT, fingerprint) && !msg.checkFingerprint()))
+  {
+    ++_stats.unmatched;
+    return;
+  }
+
+  const uint32_t id = lookup(msg.transactionId());
+  ustun::Address mapped;
+  if (id == NONE || fromLength != _endpoints[id].server.size()
+      || std::memcmp(&from, _endpoints[id].server.data(), fromLength) != 0
+      || !msg.xorAddress(ustun::ATTR_XOR_MAPPED_ADDRESS, mapped))
+  {
+    ++_stats.unmatched;
+    return;
+  }
+
+  Endpoint& e = _endpoints[id];
+  unindex(id);
+  unschedule(id);
+  e.state = State::Idle;
+  ++_stats.answered;
+  schedule(id, now() + jittered());
+
+  if (e.mapped.family == 0)
+  {
+    e.mapped = mapped;
+    _callback(id, Event::Mapped, mapped);
+  }
+  else if (!sameAddress(e.mapped, mapped))
+  {
+    e.mapped = mapped;
+    ++_stats.changed;
+    _callback(id, Event::Changed, mapped);
+  }
+}
+
+void KeepaliveEngine::schedule(uint32_t id, uint64_t due)
+{
+  Endpoint& e = _endpoints[id];
+  e.due       = static_cast<uint32_t>(due);
+
+  uint32_t& head = _wheel[due & _wheelMask];
+  e.prev         = NONE;
+  e.next         = head;
+  if (head != NONE)
+    _endpoints[head].prev = id;
+  head = id;
+}
+
+void KeepaliveEngine::unschedule(uint32_t id)
+{
+  const Endpoint& e = _endpoints[id];
+  // The wheel walk of advance() continues after the removed endpoint
+  if (id == _walkNext)
+    _walkNext = e.next;
+
+  if (e.prev == NONE)
+    _wheel[e.due & _wheelMask] = e.next;
+  else
+    _endpoints[e.prev].next = e.next;
+  if (e.next != NONE)
+    _endpoints[e.next].prev = e.prev;
+}
+
+// Transaction IDs are random, their first bytes hash well enough
+uint64_t KeepaliveEngine::keyOf(const uint8_t* transaction)
+{
+  uint64_t key;
+  std::memcpy(&key, transaction, sizeof(key));
+  return key;
+}
+
+void KeepaliveEngine::index(uint32_t id)
+{
+  std::size_t i = keyOf(_endpoints[id].transaction) & _indexMask;
+  while (_index[i] != NONE)
+    i = (i + 1) & _indexMask;
+  _index[i] = id;
+}
+
+uint32_t KeepaliveEngine::lookup(const uint8_t* transaction) const
+{
+  for (std::size_t i = keyOf(transaction) & _indexMask;; i = (i + 1) & _indexMask)
+  {
+    const uint32_t id = _index[i];
+    if (id == NONE || std::memcmp(_endpoints[id].transaction, transaction, 12) == 0)
+      return id;
+  }
+}
+
+// Backward shift deletion, keeps the probe sequences free of holes
+void KeepaliveEngine::unindex(uint32_t id)
+{
+  std::size_t i = keyOf(_endpoints[id].transaction) & _indexMask;
+  while (_index[i] != id)
+    i = (i + 1) & _indexMask;
+
+  for (std::size_t j = (i + 1) & _indexMask; _index[j] != NONE; j = (j + 1) & _indexMask)
+  {
+    const std::size_t home = keyOf(_endpoints[_index[j]].transaction) & _indexMask;
+    // Move j into the hole at i unless its home lies cyclically in (i, j]
+    if (((j - home) & _indexMask) >= ((j - i) & _indexMask))
+    {
+      _index[i] = _index[j];
+      i         = j;
+    }
+  }
+  _index[i] = NONE;
+}
+
+void KeepaliveEngine::scheduleTick()
+{
+  _timer.expires_after(_config.tick);
+  _timer.async_wait([this](boost::system::error_code ec) {
+    if (ec || !_running)
+      return;
+    advance(Clock::now());
+    scheduleTick();
+  });
+}
+
+void KeepaliveEngine::startReceive()
+{
+  _socket.async_wait(udp::socket::wait_read, [this](boost::system::error_code ec) {
+    if (ec || !_running)
+      return;
+    receive();
+    startReceive();
+  });
+}
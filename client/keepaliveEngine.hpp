@@ -0,0 +1,172 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <ustun/stunCodec.hpp>
+
+struct KeepaliveConfig
+{
+  uint32_t capacity = 100000; // endpoints, the memory is allocated up front
+  std::chrono::milliseconds interval {15000}; // between two keepalives of an endpoint
+  unsigned jitterPercent = 10; // +/- on every interval, spreads the sends
+  std::chrono::milliseconds timeout {500}; // first retransmission, doubled after each
+  unsigned retries = 3; // unanswered retransmissions before the mapping counts as lost
+  std::chrono::milliseconds tick {10}; // timing wheel resolution
+  int socketBuffer = 4 << 20; // SO_SNDBUF and SO_RCVBUF
+};
+
+struct KeepaliveStats
+{
+  uint64_t sent          = 0; // Binding requests, retransmissions included
+  uint64_t retransmitted = 0;
+  uint64_t answered      = 0;
+  uint64_t unmatched     = 0; // not a response to an outstanding request
+  uint64_t changed       = 0; // mapping changes, first mappings excluded
+  uint64_t lost          = 0;
+  uint64_t sendErrors    = 0;
+};
+
+// Keeps the NAT bindings of many endpoints alive with periodic Binding
+// requests from one UDP socket, one endpoint per STUN server (or peer
+// answering STUN) the binding goes to. Run one engine per local socket.
+//
+// The state of an endpoint is a fixed size row, the rows, the transaction
+// index and the timing wheel are allocated by the constructor: adding,
+// sending, receiving and expiring allocate nothing. Due requests go out in
+// sendmmsg batches, responses are read in recvmmsg batches and matched by
+// transaction ID (and source address) in an open addressing index.
+//
+// Single threaded: everything runs on the io_context given.
+class KeepaliveEngine {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+    enum class Event
+    {
+      Mapped, // first mapping, or first after a loss
+      Changed, // different from the previous response: the NAT rebound
+      Lost // no response after the retransmissions, address is the last mapping
+    };
+
+    using Callback = std::function<void(uint32_t endpoint, Event event, const ustun::Address& address)>;
+
+    KeepaliveEngine(boost::asio::io_context& io, const boost::asio::ip::udp::endpoint& local,
+        const KeepaliveConfig& config, Callback callback);
+
+    KeepaliveEngine(const KeepaliveEngine&) = delete;
+    KeepaliveEngine& operator=(const KeepaliveEngine&) = delete;
+
+    // NONE when at capacity. The first keepalive goes at a random point of
+    // the first interval, so that endpoints added together do not stay in step.
+    uint32_t add(const boost::asio::ip::udp::endpoint& server);
+    void remove(uint32_t endpoint);
+
+    // Last mapping reported by the server of the endpoint, false if none
+    bool mapping(uint32_t endpoint, ustun::Address& out) const;
+
+    // Drives the engine from the io_context: wheel ticks and receives
+    void start();
+    void stop();
+
+    // What start() schedules, for callers with their own loop: sends what is
+    // due at now, reads what the socket holds
+    void advance(Clock::time_point now);
+    void receive();
+
+    boost::asio::ip::udp::endpoint localEndpoint() const { return _socket.local_endpoint(); }
+    const KeepaliveStats& stats() const { return _stats; }
+    // Bytes allocated, independent of the number of endpoints in use
+    std::size_t memoryUsage() const;
+
+  private:
+    static constexpr std::size_t BATCH        = 64;
+    static constexpr std::size_t REQUEST_SIZE = ustun::STUN_HEADER_SIZE + 8; // FINGERPRINT
+    static constexpr std::size_t RECEIVE_SIZE = 512;
+
+    enum class State : uint8_t
+    {
+      Free,
+      Idle, // waiting for the next keepalive
+      Pending // request outstanding, indexed by transaction ID
+    };
+
+    // 76 bytes per endpoint, plus 8 to 16 in the index
+    struct Endpoint
+    {
+      boost::asio::ip::udp::endpoint server;
+      ustun::Address mapped;
+      uint8_t transaction[12];
+      uint32_t prev; // wheel slot list, or free list
+      uint32_t next;
+      uint32_t due; // tick
+      uint8_t attempts;
+      State state;
+    };
+
+    // Current tick, never behind the last processed one
+    uint64_t now() const;
+    uint32_t jittered();
+    uint64_t random();
+
+    void schedule(uint32_t id, uint64_t due);
+    void unschedule(uint32_t id);
+    void fire(uint32_t id);
+    void send(uint32_t id);
+    void flush();
+    void handleResponse(const uint8_t* data, std::size_t bytes, const sockaddr_storage& from, socklen_t fromLength);
+
+    static uint64_t keyOf(const uint8_t* transaction);
+    void index(uint32_t id);
+    void unindex(uint32_t id);
+    uint32_t lookup(const uint8_t* transaction) const;
+
+    void scheduleTick();
+    void startReceive();
+
+  private:
+    KeepaliveConfig _config;
+    Callback _callback;
+    boost::asio::ip::udp::socket _socket;
+    boost::asio::steady_timer _timer;
+    bool _running = false;
+
+    std::vector<Endpoint> _endpoints;
+    uint32_t _free = NONE; // free list through Endpoint::next
+
+    std::vector<uint32_t> _index; // open addressing on the transaction ID, endpoints or NONE
+    std::size_t _indexMask;
+
+    std::vector<uint32_t> _wheel; // list heads, per tick modulo its size
+    std::size_t _wheelMask;
+    Clock::time_point _origin;
+    uint64_t _tick = 0; // last processed
+    uint32_t _intervalTicks;
+    uint32_t _timeoutTicks;
+    uint32_t _walkNext = NONE; // next endpoint of the slot advance() walks
+
+    uint64_t _rng[2];
+
+    std::vector<mmsghdr> _sendHeaders;
+    std::vector<iovec> _sendIov;
+    std::vector<sockaddr_storage> _sendNames;
+    std::vector<uint8_t> _sendBuffers;
+    std::size_t _batched = 0;
+
+    std::vector<mmsghdr> _receiveHeaders;
+    std::vector<iovec> _receiveIov;
+    std::vector<sockaddr_storage> _receiveNames;
+    std::vector<uint8_t> _receiveBuffers;
+
+    KeepaliveStats _stats;
+};
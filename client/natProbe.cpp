@@ -0,0 +1,349 @@
+#include "natProbe.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  bool sameAddress(const ustun::Address& a, const ustun::Address& b)
+  {
+    return a.family == b.family && a.port == b.port && std::equal(a.bytes, a.bytes + sizeof(a.bytes), b.bytes);
+  }
+
+  udp::endpoint toEndpoint(const ustun::Address& address)
+  {
+    if (address.family == FAMILY_IPV4)
+    {
+      boost::asio::ip::address_v4::bytes_type bytes;
+      std::copy(address.bytes, address.bytes + bytes.size(), bytes.begin());
+      return {boost::asio::ip::address_v4(bytes), address.port};
+    }
+    boost::asio::ip::address_v6::bytes_type bytes;
+    std::copy(address.bytes, address.bytes + bytes.size(), bytes.begin());
+    return {boost::asio::ip::address_v6(bytes), address.port};
+  }
+
+  // RFC 6298 section 2, in microseconds
+  void updateRtt(double rtt, double& srtt, double& rttvar)
+  {
+    if (srtt == 0)
+    {
+      srtt   = rtt;
+      rttvar = rtt / 2;
+      return;
+    }
+    rttvar = 0.75 * rttvar + 0.25 * std::fabs(srtt - rtt);
+    srtt   = 0.875 * srtt + 0.125 * rtt;
+  }
+}
+
+const char* natBehaviour2str(NatBehaviour behaviour)
+{
+  switch (behaviour)
+  {
+    case NatBehaviour::Unknown:
+      return "unknown";
+    case NatBehaviour::None:
+      return "none";
+    case NatBehaviour::EndpointIndependent:
+      return "endpoint-independent";
+    case NatBehaviour::AddressDependent:
+      return "address-dependent";
+    case NatBehaviour::AddressPortDependent:
+      return "address-and-port-dependent";
+  }
+  return "unknown";
+}
+
+NatProbe::NatProbe(boost::asio::io_context& io, const NatProbeConfig& config, Callback callback)
+    : _io(io)
+    , _config(config)
+    , _callback(std::move(callback))
+    , _rng(std::random_device()())
+{
+  _config.parallel = std::max(_config.parallel, 1u);
+}
+
+void NatProbe::add(const udp::endpoint& server)
+{
+  _queue.push_back(server);
+  pump();
+}
+
+void NatProbe::pump()
+{
+  while (_active < _config.parallel && !_queue.empty())
+  {
+    const udp::endpoint server = _queue.front();
+    _queue.pop_front();
+    start(server);
+  }
+}
+
+NatProbe::Clock::duration NatProbe::rto() const
+{
+  if (_srtt == 0)
+    return _config.initialRto;
+  const auto rto = std::chrono::microseconds(static_cast<int64_t>(_srtt + 4 * _rttvar));
+  return std::min<Clock::duration>(std::max<Clock::duration>(rto, _config.minRto), _config.maxRto);
+}
+
+NatProbe::Clock::duration NatProbe::rto(const Site& site) const
+{
+  if (site.srtt == 0)
+    return rto();
+  const auto rto = std::chrono::microseconds(static_cast<int64_t>(site.srtt + 4 * site.rttvar));
+  return std::min<Clock::duration>(std::max<Clock::duration>(rto, _config.minRto), _config.maxRto);
+}
+
+void NatProbe::start(const udp::endpoint& server)
+{
+  auto site           = std::make_shared<Site>(_io);
+  site->result.server = server;
+  site->start         = Clock::now();
+  ++_active;
+
+  boost::system::error_code ec;
+  for (auto* socket : {&site->mapping.socket, &site->filtering.socket})
+  {
+    if (!ec)
+      socket->open(server.protocol(), ec);
+    if (!ec)
+      socket->bind(udp::endpoint(server.protocol(), 0), ec);
+  }
+  if (ec)
+  {
+    // Reported without pump(), the caller's loop starts the next server;
+    // finish() would recurse once per queued server that fails the same way
+    report(*site);
+    return;
+  }
+
+  // The source address the kernel picks towards the server, to tell a
+  // mapping from no NAT at all; connect() sends nothing
+  udp::socket route(_io);
+  route.connect(server, ec);
+  if (!ec)
+    site->local = {route.local_endpoint(ec).address(), site->mapping.socket.local_endpoint(ec).port()};
+
+  for (auto& test : site->tests)
+  {
+    for (auto& byte : test.transaction)
+      byte = static_cast<uint8_t>(_rng());
+  }
+  site->tests[MAP_I].to          = server;
+  site->tests[FILTER_II].to      = server;
+  site->tests[FILTER_II].change  = CHANGE_IP | CHANGE_PORT;
+  site->tests[FILTER_III].to     = server;
+  site->tests[FILTER_III].change = CHANGE_PORT;
+
+  send(*site, MAP_I);
+  send(*site, FILTER_II);
+  send(*site, FILTER_III);
+  receive(site, false);
+  receive(site, true);
+  arm(site);
+}
+
+void NatProbe::send(Site& site, TestKind kind)
+{
+  Test& test = site.tests[kind];
+
+  uint8_t buffer[STUN_HEADER_SIZE + 16];
+  ustun::MessageWriter request({buffer, sizeof(buffer)}, BINDING_REQUEST, test.transaction);
+  if (test.change)
+    request.addUint32(ATTR_CHANGE_REQUEST, test.change);
+  request.addFingerprint();
+
+  // A failed send is an unanswered attempt
+  boost::system::error_code ec;
+  auto& socket = kind >= FILTER_II ? site.filtering.socket : site.mapping.socket;
+  socket.send_to(boost::asio::buffer(buffer, request.size()), test.to, 0, ec);
+  ++test.attempts;
+  ++site.result.sent;
+  test.sent = Clock::now();
+}
+
+void NatProbe::receive(const std::shared_ptr<Site>& site, bool filtering)
+{
+  Socket& socket = filtering ? site->filtering : site->mapping;
+  socket.socket.async_receive_from(boost::asio::buffer(socket.buffer), socket.from,
+      [this, site, filtering](const boost::system::error_code& ec, std::size_t bytes) {
+        if (site->finished || ec == boost::asio::error::operation_aborted)
+          return;
+        if (!ec)
+          handleResponse(site, filtering, bytes);
+        if (!site->finished)
+          receive(site, filtering);
+      });
+}
+
+void NatProbe::handleResponse(const std::shared_ptr<Site>& site, bool filtering, std::size_t bytes)
+{
+  Socket& socket = filtering ? site->filtering : site->mapping;
+  ustun::MessageView msg;
+  if (!msg.parse(socket.buffer.data(), bytes) || msg.method() != METHOD_BINDING
+      || (msg.cls() != CLASS_SUCCESS && msg.cls() != CLASS_ERROR))
+    return;
+
+  const int first = filtering ? FILTER_II : MAP_I;
+  const int last  = filtering ? FILTER_III : MAP_III;
+  int kind        = first;
+  while (kind <= last
+      && (site->tests[kind].attempts == 0 || site->tests[kind].done
+          || std::memcmp(site->tests[kind].transaction, msg.transactionId(), 12) != 0))
+    ++kind;
+  if (kind > last)
+    return;
+
+  Test& test = site->tests[kind];
+  test.done  = true;
+  test.from  = socket.from;
+  if (msg.cls() == CLASS_ERROR)
+    test.error = true;
+  else
+  {
+    test.answered = msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, test.mapped)
+        || msg.address(ATTR_MAPPED_ADDRESS, test.mapped);
+  }
+  if (test.attempts == 1)
+    sample(*site, Clock::now() - test.sent);
+
+  // The alternate address is known: the rest of the mapping tests can go
+  ustun::Address other;
+  if (kind == MAP_I && test.answered && msg.address(ATTR_OTHER_ADDRESS, other)
+      && other.family == test.mapped.family)
+  {
+    const udp::endpoint alternate = toEndpoint(other);
+    site->result.discovery        = true;
+    site->tests[MAP_II].to        = {alternate.address(), site->result.server.port()};
+    site->tests[MAP_III].to       = alternate;
+    send(*site, MAP_II);
+    send(*site, MAP_III);
+  }
+  else if (kind == MAP_I)
+  {
+    // Not an RFC 5780 server, nothing more to learn
+    for (auto& pending : site->tests)
+      pending.done = true;
+  }
+
+  if (complete(*site))
+    finish(*site);
+  else
+    arm(site);
+}
+
+void NatProbe::sample(Site& site, Clock::duration rtt)
+{
+  const double us = std::chrono::duration<double, std::micro>(rtt).count();
+  updateRtt(us, site.srtt, site.rttvar);
+  updateRtt(us, _srtt, _rttvar);
+  if (site.result.rtt.count() == 0)
+    site.result.rtt = std::chrono::duration_cast<std::chrono::microseconds>(rtt);
+}
+
+bool NatProbe::complete(Site& site)
+{
+  // Mapping tests never sent once the first one gave up
+  if (site.tests[MAP_I].done && site.tests[MAP_II].attempts == 0)
+    site.tests[MAP_II].done = site.tests[MAP_III].done = true;
+  return std::all_of(site.tests.begin(), site.tests.end(), [](const Test& test) { return test.done; });
+}
+
+// Wakes up for the earliest retransmission, with the RTO as it is now
+void NatProbe::arm(const std::shared_ptr<Site>& site)
+{
+  const auto rto = this->rto(*site);
+  auto due       = Clock::time_point::max();
+  for (const auto& test : site->tests)
+  {
+    if (test.attempts > 0 && !test.done)
+      due = std::min(due, test.sent + rto);
+  }
+
+  site->timer.expires_at(due);
+  site->timer.async_wait([this, site](const boost::system::error_code& ec) {
+    if (!ec && !site->finished)
+      expire(site);
+  });
+}
+
+void NatProbe::expire(const std::shared_ptr<Site>& site)
+{
+  const auto now = Clock::now();
+  const auto rto = this->rto(*site);
+  for (int kind = 0; kind < TESTS; ++kind)
+  {
+    Test& test = site->tests[kind];
+    if (test.attempts == 0 || test.done || now < test.sent + rto)
+      continue;
+    if (test.attempts > _config.retries)
+      test.done = true;
+    else
+      send(*site, static_cast<TestKind>(kind));
+  }
+
+  if (complete(*site))
+    finish(*site);
+  else
+    arm(site);
+}
+
+void NatProbe::finish(Site& site)
+{
+  report(site);
+  pump();
+}
+
+void NatProbe::report(Site& site)
+{
+  site.finished = true;
+  boost::system::error_code ec;
+  site.timer.cancel();
+  site.mapping.socket.close(ec);
+  site.filtering.socket.close(ec);
+
+  classify(site);
+  site.result.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - site.start);
+  --_active;
+  _callback(site.result);
+}
+
+// RFC 5780 sections 4.3 and 4.4, on the pipelined results
+void NatProbe::classify(Site& site)
+{
+  auto& result      = site.result;
+  const auto& tests = site.tests;
+
+  result.reachable = tests[MAP_I].answered;
+  if (!result.reachable)
+    return;
+  result.mapped = toEndpoint(tests[MAP_I].mapped);
+
+  if (result.mapped == site.local)
+    result.mapping = NatBehaviour::None;
+  else if (tests[MAP_II].answered && sameAddress(tests[MAP_II].mapped, tests[MAP_I].mapped))
+    result.mapping = NatBehaviour::EndpointIndependent;
+  else if (tests[MAP_II].answered && tests[MAP_III].answered)
+  {
+    result.mapping = sameAddress(tests[MAP_III].mapped, tests[MAP_II].mapped) ? NatBehaviour::AddressDependent
+                                                                              : NatBehaviour::AddressPortDependent;
+  }
+
+  if (!result.discovery || tests[FILTER_II].error || tests[FILTER_III].error)
+    return;
+
+  // Only responses from where CHANGE-REQUEST sends them count
+  const udp::endpoint alternate = tests[MAP_III].to;
+  if (tests[FILTER_II].answered && tests[FILTER_II].from == alternate)
+    result.filtering = NatBehaviour::EndpointIndependent;
+  else if (tests[FILTER_III].answered && tests[FILTER_III].from == udp::endpoint(result.server.address(), alternate.port()))
+    result.filtering = NatBehaviour::AddressDependent;
+  else
+    result.filtering = NatBehaviour::AddressPortDependent;
+}
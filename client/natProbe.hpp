@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <ustun/stunCodec.hpp>
+
+// RFC 4787 behaviours, as RFC 5780 tells them apart
+enum class NatBehaviour : uint8_t
+{
+  Unknown, // unreachable server, no RFC 5780 support or unanswered mapping test
+  None, // mapped address is the local one: no NAT
+  EndpointIndependent,
+  AddressDependent,
+  AddressPortDependent
+};
+
+const char* natBehaviour2str(NatBehaviour behaviour);
+
+struct NatProbeConfig
+{
+  unsigned parallel = 256; // servers probed at once, two sockets each
+  std::chrono::milliseconds initialRto {300}; // until the first RTT sample
+  std::chrono::milliseconds minRto {20};
+  std::chrono::milliseconds maxRto {3000};
+  unsigned retries = 2; // retransmissions before a test counts as unanswered
+};
+
+struct NatResult
+{
+  boost::asio::ip::udp::endpoint server;
+  bool reachable = false; // Binding answered
+  bool discovery = false; // OTHER-ADDRESS in the response: RFC 5780 server
+  NatBehaviour mapping   = NatBehaviour::Unknown;
+  NatBehaviour filtering = NatBehaviour::Unknown;
+  boost::asio::ip::udp::endpoint mapped;
+  std::chrono::microseconds rtt {0}; // first sample
+  std::chrono::microseconds elapsed {0}; // first request to classification
+  unsigned sent = 0; // requests, retransmissions included
+};
+
+// Classifies the mapping and filtering behaviour of the NAT in front of this
+// host towards many RFC 5780 servers at once, from one io_context.
+//
+// The tests of a server are pipelined rather than run one after the other
+// as in RFC 5780 section 4: the filtering tests (CHANGE-REQUEST for address
+// and port, then port only) go out with the first Binding request, from a
+// socket of their own so that the mapping tests cannot open the filter they
+// test. The two mapping tests towards the alternate address leave as soon
+// as the first response names it. An open NAT is classified in two round
+// trips, a filtering one once its unanswered tests run out of retries.
+//
+// Unanswered tests are retransmitted every RTO, without backoff: a probe is
+// a handful of datagrams. The RTO comes from the RTT samples of the server
+// (RFC 6298, Karn's rule), and before the first of them from the samples of
+// the servers probed so far.
+//
+// Single threaded: everything runs on the io_context given, which must not
+// run the handlers of a probe after its destruction.
+class NatProbe {
+  public:
+    using Clock    = std::chrono::steady_clock;
+    using Callback = std::function<void(const NatResult& result)>;
+
+    NatProbe(boost::asio::io_context& io, const NatProbeConfig& config, Callback callback);
+
+    NatProbe(const NatProbe&) = delete;
+    NatProbe& operator=(const NatProbe&) = delete;
+
+    // Probed as soon as fewer than parallel servers are in flight, the
+    // callback runs once per call
+    void add(const boost::asio::ip::udp::endpoint& server);
+
+    // Queued or in flight
+    std::size_t pending() const { return _queue.size() + _active; }
+    // What a server without RTT sample starts with
+    Clock::duration rto() const;
+
+  private:
+    enum TestKind
+    {
+      MAP_I, // to the primary address, learns the mapping and OTHER-ADDRESS
+      MAP_II, // alternate address, primary port
+      MAP_III, // alternate address and port
+      FILTER_II, // CHANGE-REQUEST address and port
+      FILTER_III, // CHANGE-REQUEST port
+      TESTS
+    };
+
+    struct Test
+    {
+      boost::asio::ip::udp::endpoint to;
+      uint32_t change = 0; // CHANGE-REQUEST flags
+      uint8_t transaction[12];
+      unsigned attempts = 0; // 0 until sent
+      bool done         = false;
+      bool answered     = false;
+      bool error        = false; // error response, 420 from servers without RFC 5780
+      Clock::time_point sent;
+      boost::asio::ip::udp::endpoint from;
+      ustun::Address mapped;
+    };
+
+    struct Socket
+    {
+      explicit Socket(boost::asio::io_context& io)
+          : socket(io)
+      {
+      }
+
+      boost::asio::ip::udp::socket socket;
+      boost::asio::ip::udp::endpoint from;
+      std::array<uint8_t, 512> buffer;
+    };
+
+    struct Site
+    {
+      explicit Site(boost::asio::io_context& io)
+          : mapping(io)
+          , filtering(io)
+          , timer(io)
+      {
+      }
+
+      NatResult result;
+      Socket mapping; // MAP_* tests
+      Socket filtering; // FILTER_* tests
+      boost::asio::steady_timer timer;
+      boost::asio::ip::udp::endpoint local; // of the mapping socket, towards the server
+      std::array<Test, TESTS> tests;
+      Clock::time_point start;
+      double srtt   = 0; // us, 0 without sample
+      double rttvar = 0;
+      bool finished = false;
+    };
+
+    // Starts queued servers while fewer than parallel are in flight
+    void pump();
+    void start(const boost::asio::ip::udp::endpoint& server);
+    void send(Site& site, TestKind kind);
+    void receive(const std::shared_ptr<Site>& site, bool filtering);
+    void handleResponse(const std::shared_ptr<Site>& site, bool filtering, std::size_t bytes);
+    void sample(Site& site, Clock::duration rtt);
+    static bool complete(Site& site);
+    Clock::duration rto(const Site& site) const;
+    void arm(const std::shared_ptr<Site>& site);
+    void expire(const std::shared_ptr<Site>& site);
+    // Completes a site and starts queued servers into the freed slot
+    void finish(Site& site);
+    void report(Site& site);
+    static void classify(Site& site);
+
+  private:
+    boost::asio::io_context& _io;
+    NatProbeConfig _config;
+    Callback _callback;
+    std::deque<boost::asio::ip::udp::endpoint> _queue;
+    std::size_t _active = 0;
+    std::mt19937_64 _rng;
+    double _srtt   = 0; // us, over every server, 0 without sample
+    double _rttvar = 0;
+};
@@ -0,0 +1,134 @@
+// NAT behaviour survey: classifies the mapping and filtering of the NAT in
+// front of this host towards RFC 5780 servers (ustun with nat-discovery),
+// many of them at once, one line per server as they complete.
+//
+//   ustun-probe [parallel=256] [rto_ms=300] [retries=2] <address>:<port>... | -
+//
+// '-' reads the servers from the standard input, one per line.
+
+#include "natProbe.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+using boost::asio::ip::udp;
+
+namespace
+{
+  bool parseServer(std::string str, udp::endpoint& out)
+  {
+    const auto colon = str.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+      return false;
+
+    std::string host = str.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+
+    boost::system::error_code ec;
+    const auto address = boost::asio::ip::make_address(host, ec);
+    const auto port    = std::strtoul(str.c_str() + colon + 1, nullptr, 10);
+    if (ec || port == 0 || port > 65535)
+      return false;
+    out = {address, static_cast<uint16_t>(port)};
+    return true;
+  }
+
+  // Two sockets per server in flight
+  unsigned raiseFileLimit(unsigned parallel)
+  {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+      return parallel;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return static_cast<unsigned>(std::min<rlim_t>(parallel, (limit.rlim_cur - 16) / 2));
+  }
+
+  double ms(std::chrono::microseconds us) { return us.count() / 1000.0; }
+}
+
+int main(int argc, char** argv)
+{
+  NatProbeConfig config;
+  std::vector<udp::endpoint> servers;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    udp::endpoint server;
+    if (arg.compare(0, 9, "parallel=") == 0)
+      config.parallel = static_cast<unsigned>(std::strtoul(arg.c_str() + 9, nullptr, 10));
+    else if (arg.compare(0, 7, "rto_ms=") == 0)
+      config.initialRto = std::chrono::milliseconds(std::strtoul(arg.c_str() + 7, nullptr, 10));
+    else if (arg.compare(0, 8, "retries=") == 0)
+      config.retries = static_cast<unsigned>(std::strtoul(arg.c_str() + 8, nullptr, 10));
+    else if (arg == "-")
+    {
+      std::string line;
+      while (std::getline(std::cin, line))
+      {
+        if (!line.empty() && parseServer(line, server))
+          servers.push_back(server);
+        else if (!line.empty())
+          std::fprintf(stderr, "ignoring '%s'\n", line.c_str());
+      }
+    }
+    else if (parseServer(arg, server))
+      servers.push_back(server);
+    else
+    {
+      std::fprintf(stderr, "usage: %s [parallel=256] [rto_ms=300] [retries=2] <address>:<port>... | -\n",
+          argv[0]);
+      return 1;
+    }
+  }
+  if (servers.empty())
+  {
+    std::fprintf(stderr, "no server to probe\n");
+    return 1;
+  }
+  config.parallel = raiseFileLimit(std::max(config.parallel, 1u));
+
+  std::vector<double> elapsed;
+  std::size_t unreachable = 0, unsupported = 0;
+  unsigned long long sent = 0;
+
+  boost::asio::io_context io;
+  NatProbe probe(io, config, [&](const NatResult& result) {
+    const std::string server = result.server.address().to_string() + ":" + std::to_string(result.server.port());
+    elapsed.push_back(ms(result.elapsed));
+    sent += result.sent;
+    if (!result.reachable)
+    {
+      ++unreachable;
+      std::printf("%s unreachable time=%.1fms\n", server.c_str(), ms(result.elapsed));
+      return;
+    }
+    unsupported += !result.discovery;
+    std::printf("%s mapping=%s filtering=%s mapped=%s:%u rtt=%.1fms time=%.1fms\n", server.c_str(),
+        natBehaviour2str(result.mapping), natBehaviour2str(result.filtering),
+        result.mapped.address().to_string().c_str(), result.mapped.port(), ms(result.rtt), ms(result.elapsed));
+  });
+
+  const auto start = NatProbe::Clock::now();
+  for (const auto& server : servers)
+    probe.add(server);
+  io.run();
+  const double wall = std::chrono::duration<double>(NatProbe::Clock::now() - start).count();
+
+  std::sort(elapsed.begin(), elapsed.end());
+  std::fflush(stdout);
+  std::fprintf(stderr,
+      "%zu servers in %.2f s (%.0f/s), %zu unreachable, %zu without RFC 5780, %llu requests, "
+      "time median %.1f ms p99 %.1f ms\n",
+      servers.size(), wall, servers.size() / wall, unreachable, unsupported, sent, elapsed[elapsed.size() / 2],
+      elapsed[elapsed.size() * 99 / 100]);
+  return 0;
+}
@@ -0,0 +1,755 @@
+#pragma once
+
+// Header-only STUN codec (RFC 5389, RFC 5766 attributes) shared by the ustun
+// server and client code. It only depends on the standard library, never
+// allocates, and is constexpr in C++14, so messages can also be built and
+// checked at compile time. Messages are read in place from caller buffers and
+// written to caller buffers; batch helpers work on spans of datagrams.
+//
+// Everything in namespace ustun is the stable API, ustun::detail may change.
+// The protocol constants live in the inline namespace ustun::protocol, for a
+// single using-directive.
+
+#include <cstddef>
+#include <cstdint>
+
+#define USTUN_CODEC_VERSION 1
+
+namespace ustun
+{
+  inline namespace protocol
+  {
+    constexpr uint32_t MAGIC_COOKIE = 0x2112A442;
+    // XORed into FINGERPRINT
+    constexpr uint32_t FINGERPRINT_XOR = 0x5354554E;
+
+    // Methods (RFC 5389, RFC 5766)
+    constexpr uint16_t METHOD_BINDING           = 0x001;
+    constexpr uint16_t METHOD_ALLOCATE          = 0x003;
+    constexpr uint16_t METHOD_REFRESH           = 0x004;
+    constexpr uint16_t METHOD_SEND              = 0x006;
+    constexpr uint16_t METHOD_DATA              = 0x007;
+    constexpr uint16_t METHOD_CREATE_PERMISSION = 0x008;
+    constexpr uint16_t METHOD_CHANNEL_BIND      = 0x009;
+
+    // Classes
+    constexpr uint16_t CLASS_REQUEST    = 0x000;
+    constexpr uint16_t CLASS_INDICATION = 0x010;
+    constexpr uint16_t CLASS_SUCCESS    = 0x100;
+    constexpr uint16_t CLASS_ERROR      = 0x110;
+
+    constexpr uint16_t BINDING_REQUEST      = METHOD_BINDING | CLASS_REQUEST;
+    constexpr uint16_t BINDING_SUCCESS_RESP = METHOD_BINDING | CLASS_SUCCESS;
+
+    // Attributes
+    constexpr uint16_t ATTR_MAPPED_ADDRESS      = 0x0001;
+    constexpr uint16_t ATTR_CHANGE_REQUEST      = 0x0003;
+    constexpr uint16_t ATTR_USERNAME            = 0x0006;
+    constexpr uint16_t ATTR_MESSAGE_INTEGRITY   = 0x0008;
+    constexpr uint16_t ATTR_ERROR_CODE          = 0x0009;
+    constexpr uint16_t ATTR_UNKNOWN_ATTRIBUTES  = 0x000A;
+    constexpr uint16_t ATTR_CHANNEL_NUMBER      = 0x000C;
+    constexpr uint16_t ATTR_LIFETIME            = 0x000D;
+    constexpr uint16_t ATTR_XOR_PEER_ADDRESS    = 0x0012;
+    constexpr uint16_t ATTR_DATA                = 0x0013;
+    constexpr uint16_t ATTR_REALM               = 0x0014;
+    constexpr uint16_t ATTR_NONCE               = 0x0015;
+    constexpr uint16_t ATTR_XOR_RELAYED_ADDRESS = 0x0016;
+    constexpr uint16_t ATTR_REQUESTED_TRANSPORT = 0x0019;
+    constexpr uint16_t ATTR_ACCESS_TOKEN        = 0x001B;
+    constexpr uint16_t ATTR_XOR_MAPPED_ADDRESS  = 0x0020;
+    constexpr uint16_t ATTR_SOFTWARE            = 0x8022;
+    constexpr uint16_t ATTR_ALTERNATE_SERVER    = 0x8023;
+    constexpr uint16_t ATTR_FINGERPRINT         = 0x8028;
+    constexpr uint16_t ATTR_RESPONSE_ORIGIN     = 0x802B;
+    constexpr uint16_t ATTR_OTHER_ADDRESS       = 0x802C;
+    constexpr uint16_t ATTR_THIRD_PARTY_AUTH    = 0x802E;
+
+    // CHANGE-REQUEST flags (RFC 5780)
+    constexpr uint32_t CHANGE_IP   = 0x04;
+    constexpr uint32_t CHANGE_PORT = 0x02;
+
+    constexpr uint8_t FAMILY_IPV4 = 0x01;
+    constexpr uint8_t FAMILY_IPV6 = 0x02;
+
+    constexpr std::size_t STUN_HEADER_SIZE         = 20;
+    constexpr std::size_t CHANNEL_DATA_HEADER_SIZE = 4;
+    constexpr std::size_t HMAC_SHA1_SIZE           = 20;
+
+    constexpr uint16_t messageMethod(uint16_t type)
+    {
+      return (type & 0x000F) | ((type & 0x00E0) >> 1) | ((type & 0x3E00) >> 2);
+    }
+
+    constexpr uint16_t messageClass(uint16_t type) { return type & 0x0110; }
+
+    constexpr uint16_t messageType(uint16_t method, uint16_t cls)
+    {
+      return (method & 0x000F) | ((method & 0x0070) << 1) | ((method & 0x0F80) << 2) | cls;
+    }
+
+    // ChannelData messages start with 0b01, STUN messages with 0b00
+    constexpr bool isChannelData(const uint8_t* data, std::size_t bytes)
+    {
+      return bytes >= CHANNEL_DATA_HEADER_SIZE && (data[0] & 0xC0) == 0x40;
+    }
+  }
+
+  // Contiguous sequence, std::span until C++20
+  template<typename T>
+  class Span {
+    public:
+      constexpr Span() = default;
+      constexpr Span(T* data, std::size_t size) : _data(data), _size(size) {}
+      template<std::size_t N>
+      constexpr Span(T (&array)[N]) : _data(array), _size(N) {}
+
+      constexpr T* data() const { return _data; }
+      constexpr std::size_t size() const { return _size; }
+      constexpr bool empty() const { return _size == 0; }
+      constexpr T* begin() const { return _data; }
+      constexpr T* end() const { return _data + _size; }
+      constexpr T& operator[](std::size_t i) const { return _data[i]; }
+
+    private:
+      T* _data          = nullptr;
+      std::size_t _size = 0;
+  };
+
+  // Transport address of the *-ADDRESS attributes, in network order
+  struct Address
+  {
+    uint8_t family = 0; // FAMILY_IPV4 (first 4 bytes used) or FAMILY_IPV6
+    uint16_t port  = 0;
+    uint8_t bytes[16] {};
+  };
+
+  struct Attribute
+  {
+    uint16_t type;
+    uint16_t length;
+    const uint8_t* value; // inside the message
+  };
+
+  // Parser limits, they bound the cost of a message: every attribute lookup
+  // walks the attribute chain
+  struct Limits
+  {
+    std::size_t maxSize       = 2048;
+    std::size_t maxAttributes = 32;
+  };
+
+  namespace detail
+  {
+    constexpr uint16_t read16(const uint8_t* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+    constexpr uint32_t read32(const uint8_t* p)
+    {
+      return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+
+    constexpr void write16(uint8_t* p, uint16_t value)
+    {
+      p[0] = static_cast<uint8_t>(value >> 8);
+      p[1] = static_cast<uint8_t>(value);
+    }
+
+    constexpr void write32(uint8_t* p, uint32_t value)
+    {
+      write16(p, static_cast<uint16_t>(value >> 16));
+      write16(p + 2, static_cast<uint16_t>(value));
+    }
+
+    constexpr std::size_t pad4(std::size_t length) { return (length + 3) & ~std::size_t(3); }
+
+    constexpr uint32_t rotl(uint32_t x, unsigned n) { return (x << n) | (x >> (32 - n)); }
+
+    // FIPS 180-4, streaming
+    class Sha1 {
+      public:
+        constexpr Sha1() = default;
+
+        constexpr void update(const uint8_t* data, std::size_t bytes)
+        {
+          _total += bytes;
+          while (bytes > 0)
+          {
+            // Whole blocks straight from the input
+            if (_used == 0 && bytes >= 64)
+            {
+              compress(data);
+              data += 64;
+              bytes -= 64;
+              continue;
+            }
+            const std::size_t n = bytes < 64 - _used ? bytes : 64 - _used;
+            for (std::size_t i = 0; i < n; ++i)
+              _block[_used + i] = data[i];
+            _used += n;
+            data += n;
+            bytes -= n;
+            if (_used == 64)
+            {
+              compress(_block);
+              _used = 0;
+            }
+          }
+        }
+
+        constexpr void finish(uint8_t out[20])
+        {
+          const uint64_t bits = _total * 8;
+          _block[_used++]     = 0x80;
+          if (_used > 56)
+          {
+            while (_used < 64)
+              _block[_used++] = 0;
+            compress(_block);
+            _used = 0;
+          }
+          while (_used < 56)
+            _block[_used++] = 0;
+          for (int i = 0; i < 8; ++i)
+            _block[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+          compress(_block);
+          for (int i = 0; i < 5; ++i)
+            write32(out + 4 * i, _h[i]);
+        }
+
+      private:
+        // Message schedule on a ring of 16 words
+        static constexpr uint32_t schedule(uint32_t* w, int i)
+        {
+          if (i >= 16)
+            w[i & 15] = rotl(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+          return w[i & 15];
+        }
+
+        static constexpr void round(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d, uint32_t& e, uint32_t f,
+            uint32_t k, uint32_t w)
+        {
+          const uint32_t t = rotl(a, 5) + f + e + k + w;
+          e                = d;
+          d                = c;
+          c                = rotl(b, 30);
+          b                = a;
+          a                = t;
+        }
+
+        constexpr void compress(const uint8_t* block)
+        {
+          uint32_t w[16] {};
+          for (int i = 0; i < 16; ++i)
+            w[i] = read32(block + 4 * i);
+
+          uint32_t a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4];
+          for (int i = 0; i < 20; ++i)
+            round(a, b, c, d, e, (b & c) | (~b & d), 0x5A827999, schedule(w, i));
+          for (int i = 20; i < 40; ++i)
+            round(a, b, c, d, e, b ^ c ^ d, 0x6ED9EBA1, schedule(w, i));
+          for (int i = 40; i < 60; ++i)
+            round(a, b, c, d, e, (b & c) | (b & d) | (c & d), 0x8F1BBCDC, schedule(w, i));
+          for (int i = 60; i < 80; ++i)
+            round(a, b, c, d, e, b ^ c ^ d, 0xCA62C1D6, schedule(w, i));
+          _h[0] += a;
+          _h[1] += b;
+          _h[2] += c;
+          _h[3] += d;
+          _h[4] += e;
+        }
+
+      private:
+        uint32_t _h[5] {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+        uint8_t _block[64] {};
+        std::size_t _used = 0;
+        uint64_t _total   = 0;
+    };
+
+    // RFC 2104, streaming
+    class HmacSha1 {
+      public:
+        constexpr HmacSha1(const uint8_t* key, std::size_t keyLength)
+        {
+          uint8_t hashed[20] {};
+          if (keyLength > 64)
+          {
+            Sha1 sha;
+            sha.update(key, keyLength);
+            sha.finish(hashed);
+            key       = hashed;
+            keyLength = sizeof(hashed);
+          }
+          for (std::size_t i = 0; i < 64; ++i)
+            _key[i] = i < keyLength ? key[i] : 0;
+
+          uint8_t pad[64] {};
+          for (std::size_t i = 0; i < 64; ++i)
+            pad[i] = _key[i] ^ 0x36;
+          _inner.update(pad, sizeof(pad));
+        }
+
+        constexpr void update(const uint8_t* data, std::size_t bytes) { _inner.update(data, bytes); }
+
+        constexpr void finish(uint8_t out[HMAC_SHA1_SIZE])
+        {
+          uint8_t inner[20] {};
+          _inner.finish(inner);
+
+          uint8_t pad[64] {};
+          for (std::size_t i = 0; i < 64; ++i)
+            pad[i] = _key[i] ^ 0x5C;
+          Sha1 outer;
+          outer.update(pad, sizeof(pad));
+          outer.update(inner, sizeof(inner));
+          outer.finish(out);
+        }
+
+      private:
+        uint8_t _key[64] {};
+        Sha1 _inner;
+    };
+
+    // Slicing by 4: entries[k][b] is the CRC of byte b followed by k zeros
+    struct Crc32Table
+    {
+      constexpr Crc32Table()
+      {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+          uint32_t c = i;
+          for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+          entries[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+          for (int k = 1; k < 4; ++k)
+            entries[k][i] = entries[0][entries[k - 1][i] & 0xFF] ^ (entries[k - 1][i] >> 8);
+        }
+      }
+
+      uint32_t entries[4][256] {};
+    };
+
+    constexpr Crc32Table CRC32_TABLE;
+
+    // ISO-HDLC CRC-32 (zlib), over data split in pieces
+    constexpr uint32_t crc32Update(uint32_t crc, const uint8_t* data, std::size_t bytes)
+    {
+      const auto& t = CRC32_TABLE.entries;
+      for (; bytes >= 4; data += 4, bytes -= 4)
+      {
+        crc ^= uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+        crc = t[3][crc & 0xFF] ^ t[2][(crc >> 8) & 0xFF] ^ t[1][(crc >> 16) & 0xFF] ^ t[0][crc >> 24];
+      }
+      for (; bytes > 0; ++data, --bytes)
+        crc = t[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+      return crc;
+    }
+
+    // XOR mask of the addresses: magic cookie then transaction ID (RFC 5389 §15.2)
+    constexpr uint8_t xorMask(std::size_t i, const uint8_t* transactionId)
+    {
+      return i < 4 ? static_cast<uint8_t>(MAGIC_COOKIE >> (24 - 8 * i)) : transactionId[i - 4];
+    }
+
+    // Integrity and fingerprint cover the message up to their attribute,
+    // with a header length ending right after it
+    template<typename Hash>
+    constexpr void hashPrefix(Hash& hash, const uint8_t* message, std::size_t offset, std::size_t attributeSize)
+    {
+      uint8_t length[2] {};
+      write16(length, static_cast<uint16_t>(offset + attributeSize - STUN_HEADER_SIZE));
+      hash.update(message, 2);
+      hash.update(length, 2);
+      hash.update(message + 4, offset - 4);
+    }
+
+    struct Crc32Hash
+    {
+      constexpr void update(const uint8_t* data, std::size_t bytes) { crc = crc32Update(crc, data, bytes); }
+      uint32_t crc = 0xFFFFFFFF;
+    };
+  }
+
+  // Size of an attribute on the wire, padding included
+  constexpr std::size_t attributeSize(std::size_t length) { return 4 + detail::pad4(length); }
+
+  // Low level encoders, the caller makes room; they return the bytes written
+
+  constexpr std::size_t encodeHeader(uint8_t* out, uint16_t type, uint16_t length, const uint8_t* transactionId)
+  {
+    detail::write16(out, type);
+    detail::write16(out + 2, length);
+    detail::write32(out + 4, MAGIC_COOKIE);
+    for (std::size_t i = 0; i < 12; ++i)
+      out[8 + i] = transactionId[i];
+    return STUN_HEADER_SIZE;
+  }
+
+  constexpr std::size_t encodeAttribute(uint8_t* out, uint16_t type, const uint8_t* value, uint16_t length)
+  {
+    detail::write16(out, type);
+    detail::write16(out + 2, length);
+    for (std::size_t i = 0; i < detail::pad4(length); ++i)
+      out[4 + i] = i < length ? value[i] : 0;
+    return attributeSize(length);
+  }
+
+  // MAPPED-ADDRESS style, or XOR-*-ADDRESS when transactionId is set
+  constexpr std::size_t encodeAddress(uint8_t* out, uint16_t type, const Address& address,
+      const uint8_t* transactionId = nullptr)
+  {
+    const uint16_t length = address.family == FAMILY_IPV4 ? 8 : 20;
+    detail::write16(out, type);
+    detail::write16(out + 2, length);
+    out[4] = 0;
+    out[5] = address.family;
+    detail::write16(out + 6, transactionId ? address.port ^ (MAGIC_COOKIE >> 16) : address.port);
+    for (std::size_t i = 0; i < std::size_t(length - 4); ++i)
+      out[8 + i] = transactionId ? address.bytes[i] ^ detail::xorMask(i, transactionId) : address.bytes[i];
+    return attributeSize(length);
+  }
+
+  constexpr std::size_t encodeErrorCode(uint8_t* out, unsigned code, const char* reason, uint16_t reasonLength)
+  {
+    detail::write16(out, ATTR_ERROR_CODE);
+    detail::write16(out + 2, static_cast<uint16_t>(4 + reasonLength));
+    out[4] = 0;
+    out[5] = 0;
+    out[6] = static_cast<uint8_t>(code / 100);
+    out[7] = static_cast<uint8_t>(code % 100);
+    for (std::size_t i = 0; i < detail::pad4(reasonLength); ++i)
+      out[8 + i] = i < reasonLength ? static_cast<uint8_t>(reason[i]) : 0;
+    return attributeSize(4 + reasonLength);
+  }
+
+  // Appends MESSAGE-INTEGRITY to the message of the given size, the caller
+  // makes attributeSize(HMAC_SHA1_SIZE) bytes of room after it; the header
+  // length is updated
+  constexpr std::size_t encodeIntegrity(uint8_t* message, std::size_t bytes, const uint8_t* key,
+      std::size_t keyLength)
+  {
+    detail::HmacSha1 hmac(key, keyLength);
+    detail::hashPrefix(hmac, message, bytes, attributeSize(HMAC_SHA1_SIZE));
+    uint8_t mac[HMAC_SHA1_SIZE] {};
+    hmac.finish(mac);
+    detail::write16(message + 2, static_cast<uint16_t>(bytes + attributeSize(HMAC_SHA1_SIZE) - STUN_HEADER_SIZE));
+    return encodeAttribute(message + bytes, ATTR_MESSAGE_INTEGRITY, mac, HMAC_SHA1_SIZE);
+  }
+
+  // Same for FINGERPRINT, attributeSize(4) bytes of room
+  constexpr std::size_t encodeFingerprint(uint8_t* message, std::size_t bytes)
+  {
+    detail::Crc32Hash crc;
+    detail::hashPrefix(crc, message, bytes, attributeSize(4));
+    uint8_t value[4] {};
+    detail::write32(value, (crc.crc ^ 0xFFFFFFFF) ^ FINGERPRINT_XOR);
+    detail::write16(message + 2, static_cast<uint16_t>(bytes + attributeSize(4) - STUN_HEADER_SIZE));
+    return encodeAttribute(message + bytes, ATTR_FINGERPRINT, value, 4);
+  }
+
+  // Read-only view over a received message, attributes are not copied
+  class MessageView {
+    public:
+      constexpr MessageView() = default;
+
+      // Validates the header and the attribute chain within the limits
+      constexpr bool parse(const uint8_t* data, std::size_t bytes, const Limits& limits = Limits())
+      {
+        _data = nullptr;
+        if (bytes < STUN_HEADER_SIZE || (data[0] & 0xC0) != 0)
+          return false;
+
+        const std::size_t length = detail::read16(data + 2);
+        const std::size_t end    = STUN_HEADER_SIZE + length;
+        if (detail::read32(data + 4) != MAGIC_COOKIE || (length & 3) != 0 || end > bytes || end > limits.maxSize)
+          return false;
+
+        // Every attribute has to fit in the message
+        std::size_t offset = STUN_HEADER_SIZE;
+        std::size_t count  = 0;
+        while (offset < end)
+        {
+          if (end - offset < 4 || ++count > limits.maxAttributes)
+            return false;
+          const std::size_t attributeLength = detail::read16(data + offset + 2);
+          if (detail::pad4(attributeLength) > end - offset - 4)
+            return false;
+          offset += attributeSize(attributeLength);
+        }
+
+        _data = data;
+        _size = end;
+        _type = detail::read16(data);
+        return true;
+      }
+
+      constexpr bool parse(Span<const uint8_t> datagram, const Limits& limits = Limits())
+      {
+        return parse(datagram.data(), datagram.size(), limits);
+      }
+
+      constexpr bool valid() const { return _data != nullptr; }
+      constexpr uint16_t type() const { return _type; }
+      constexpr uint16_t method() const { return messageMethod(_type); }
+      constexpr uint16_t cls() const { return messageClass(_type); }
+      constexpr const uint8_t* transactionId() const { return _data + 8; }
+      constexpr const uint8_t* data() const { return _data; }
+      constexpr std::size_t size() const { return _size; }
+
+      // Every attribute, in order: for (std::size_t offset = STUN_HEADER_SIZE;
+      // offset < view.size(); offset = view.next(offset)) view.attributeAt(offset)
+      constexpr Attribute attributeAt(std::size_t offset) const
+      {
+        return Attribute {detail::read16(_data + offset), detail::read16(_data + offset + 2), _data + offset + 4};
+      }
+
+      // Offset of the attribute after the one at offset, _size at the end
+      constexpr std::size_t next(std::size_t offset) const
+      {
+        return offset + attributeSize(detail::read16(_data + offset + 2));
+      }
+
+      // First attribute of the given type, false when absent. Attributes
+      // after MESSAGE-INTEGRITY are not authenticated and are ignored, except
+      // FINGERPRINT (RFC 5389 §15.4)
+      constexpr bool find(uint16_t type, Attribute& out) const
+      {
+        for (std::size_t offset = STUN_HEADER_SIZE; offset < _size; offset = next(offset))
+        {
+          const uint16_t current = detail::read16(_data + offset);
+          if (current == type)
+          {
+            out = attributeAt(offset);
+            return true;
+          }
+          if (current == ATTR_MESSAGE_INTEGRITY && type != ATTR_FINGERPRINT)
+            break;
+        }
+        return false;
+      }
+
+      // Calls f(const Attribute&) for every attribute of the given type, up
+      // to MESSAGE-INTEGRITY as find()
+      template<typename F>
+      constexpr void forEach(uint16_t type, F f) const
+      {
+        for (std::size_t offset = STUN_HEADER_SIZE; offset < _size; offset = next(offset))
+        {
+          const uint16_t current = detail::read16(_data + offset);
+          if (current == type)
+            f(attributeAt(offset));
+          if (current == ATTR_MESSAGE_INTEGRITY && type != ATTR_FINGERPRINT)
+            break;
+        }
+      }
+
+      // Decodes a MAPPED-ADDRESS style attribute
+      constexpr bool address(const Attribute& attr, Address& out) const { return decodeAddress(attr, out, false); }
+      constexpr bool address(uint16_t type, Address& out) const
+      {
+        Attribute attr {};
+        return find(type, attr) && address(attr, out);
+      }
+      // Decodes an XOR-*-ADDRESS attribute
+      constexpr bool xorAddress(const Attribute& attr, Address& out) const { return decodeAddress(attr, out, true); }
+      constexpr bool xorAddress(uint16_t type, Address& out) const
+      {
+        Attribute attr {};
+        return find(type, attr) && xorAddress(attr, out);
+      }
+
+      // ERROR-CODE as a number, 0 when absent or malformed
+      constexpr unsigned errorCode() const
+      {
+        Attribute attr {};
+        if (!find(ATTR_ERROR_CODE, attr) || attr.length < 4)
+          return 0;
+        return (attr.value[2] & 0x07) * 100 + attr.value[3];
+      }
+
+      // HMAC-SHA1 of the first MESSAGE-INTEGRITY, compared in constant time
+      constexpr bool checkIntegrity(const uint8_t* key, std::size_t keyLength) const
+      {
+        Attribute integrity {};
+        if (!find(ATTR_MESSAGE_INTEGRITY, integrity) || integrity.length != HMAC_SHA1_SIZE)
+          return false;
+
+        detail::HmacSha1 hmac(key, keyLength);
+        detail::hashPrefix(hmac, _data, integrity.value - 4 - _data, attributeSize(HMAC_SHA1_SIZE));
+        uint8_t mac[HMAC_SHA1_SIZE] {};
+        hmac.finish(mac);
+
+        uint8_t diff = 0;
+        for (std::size_t i = 0; i < HMAC_SHA1_SIZE; ++i)
+          diff |= mac[i] ^ integrity.value[i];
+        return diff == 0;
+      }
+
+      // FINGERPRINT, which has to be the last attribute
+      constexpr bool checkFingerprint() const
+      {
+        const std::size_t offset = _size - attributeSize(4);
+        if (_size < STUN_HEADER_SIZE + attributeSize(4) || detail::read16(_data + offset) != ATTR_FINGERPRINT
+            || detail::read16(_data + offset + 2) != 4)
+          return false;
+
+        detail::Crc32Hash crc;
+        detail::hashPrefix(crc, _data, offset, attributeSize(4));
+        return detail::read32(_data + offset + 4) == ((crc.crc ^ 0xFFFFFFFF) ^ FINGERPRINT_XOR);
+      }
+
+    private:
+      constexpr bool decodeAddress(const Attribute& attr, Address& out, bool xored) const
+      {
+        if (attr.length < 8)
+          return false;
+        const uint8_t family = attr.value[1];
+        if (!(family == FAMILY_IPV4 && attr.length == 8) && !(family == FAMILY_IPV6 && attr.length == 20))
+          return false;
+
+        out.family          = family;
+        const uint16_t port = detail::read16(attr.value + 2);
+        out.port            = xored ? static_cast<uint16_t>(port ^ (MAGIC_COOKIE >> 16)) : port;
+
+        const std::size_t size = family == FAMILY_IPV4 ? 4 : 16;
+        for (std::size_t i = 0; i < size; ++i)
+          out.bytes[i] = xored ? attr.value[4 + i] ^ detail::xorMask(i, transactionId()) : attr.value[4 + i];
+        return true;
+      }
+
+    private:
+      const uint8_t* _data = nullptr;
+      std::size_t _size    = 0;
+      uint16_t _type       = 0;
+  };
+
+  // Builds a message in a caller buffer, the header length is kept up to
+  // date after every attribute. Adding past the end of the buffer fails and
+  // leaves the writer failed; size() is then 0.
+  class MessageWriter {
+    public:
+      constexpr MessageWriter(Span<uint8_t> buffer, uint16_t type, const uint8_t* transactionId)
+          : _out(buffer.data())
+          , _capacity(buffer.size())
+      {
+        if (reserve(STUN_HEADER_SIZE))
+          _size = encodeHeader(_out, type, 0, transactionId);
+      }
+
+      constexpr bool addAttribute(uint16_t type, const uint8_t* value, uint16_t length)
+      {
+        if (!reserve(attributeSize(length)))
+          return false;
+        _size += encodeAttribute(_out + _size, type, value, length);
+        return updateLength();
+      }
+
+      constexpr bool addAttribute(uint16_t type, Span<const uint8_t> value)
+      {
+        return addAttribute(type, value.data(), static_cast<uint16_t>(value.size()));
+      }
+
+      constexpr bool addUint32(uint16_t type, uint32_t value)
+      {
+        uint8_t bytes[4] {};
+        detail::write32(bytes, value);
+        return addAttribute(type, bytes, sizeof(bytes));
+      }
+
+      constexpr bool addAddress(uint16_t type, const Address& address)
+      {
+        if (!reserve(attributeSize(address.family == FAMILY_IPV4 ? 8 : 20)))
+          return false;
+        _size += encodeAddress(_out + _size, type, address);
+        return updateLength();
+      }
+
+      constexpr bool addXorAddress(uint16_t type, const Address& address)
+      {
+        if (!reserve(attributeSize(address.family == FAMILY_IPV4 ? 8 : 20)))
+          return false;
+        _size += encodeAddress(_out + _size, type, address, _out + 8);
+        return updateLength();
+      }
+
+      constexpr bool addErrorCode(unsigned code, const char* reason)
+      {
+        uint16_t length = 0;
+        while (reason[length])
+          ++length;
+        if (!reserve(attributeSize(4 + length)))
+          return false;
+        _size += encodeErrorCode(_out + _size, code, reason, length);
+        return updateLength();
+      }
+
+      // MESSAGE-INTEGRITY over everything added so far
+      constexpr bool addIntegrity(const uint8_t* key, std::size_t keyLength)
+      {
+        if (!reserve(attributeSize(HMAC_SHA1_SIZE)))
+          return false;
+        _size += encodeIntegrity(_out, _size, key, keyLength);
+        return true;
+      }
+
+      // FINGERPRINT, to be added last
+      constexpr bool addFingerprint()
+      {
+        if (!reserve(attributeSize(4)))
+          return false;
+        _size += encodeFingerprint(_out, _size);
+        return true;
+      }
+
+      constexpr bool ok() const { return _ok; }
+      constexpr std::size_t size() const { return _ok ? _size : 0; }
+      constexpr Span<const uint8_t> message() const { return Span<const uint8_t>(_out, size()); }
+
+    private:
+      constexpr bool reserve(std::size_t bytes)
+      {
+        _ok = _ok && _capacity - _size >= bytes;
+        return _ok;
+      }
+
+      constexpr bool updateLength()
+      {
+        detail::write16(_out + 2, static_cast<uint16_t>(_size - STUN_HEADER_SIZE));
+        return true;
+      }
+
+    private:
+      uint8_t* _out;
+      std::size_t _capacity;
+      std::size_t _size = 0;
+      bool _ok          = true;
+  };
+
+  // Parses datagrams[i] into views[i], views of invalid datagrams are left
+  // !valid(). Returns the number of valid messages.
+  constexpr std::size_t parseBatch(Span<const Span<const uint8_t>> datagrams, Span<MessageView> views,
+      const Limits& limits = Limits())
+  {
+    std::size_t parsed = 0;
+    for (std::size_t i = 0; i < datagrams.size() && i < views.size(); ++i)
+      parsed += views[i].parse(datagrams[i], limits);
+    return parsed;
+  }
+
+  // Encodes sizes.size() messages back to back in out: build(i, room)
+  // writes message i into room and returns its size, MessageWriter::size()
+  // typically. sizes[i] receives it, 0 when it did not fit. Returns the
+  // bytes used.
+  template<typename F>
+  constexpr std::size_t encodeBatch(Span<uint8_t> out, Span<std::size_t> sizes, F build)
+  {
+    std::size_t used = 0;
+    for (std::size_t i = 0; i < sizes.size(); ++i)
+    {
+      sizes[i] = build(i, Span<uint8_t>(out.data() + used, out.size() - used));
+      used += sizes[i];
+    }
+    return used;
+  }
+}
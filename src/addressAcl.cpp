@@ -0,0 +1,67 @@
+#include "addressAcl.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+  std::array<uint8_t, 16> toV6Bytes(const boost::asio::ip::address& address)
+  {
+    if (address.is_v4())
+      return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+    return address.to_v6().to_bytes();
+  }
+}
+
+AddressAcl AddressAcl::parse(const std::string& list)
+{
+  AddressAcl acl;
+  std::istringstream stream(list);
+  std::string item;
+
+  while (std::getline(stream, item, ','))
+  {
+    if (item.empty())
+      continue;
+
+    const auto slash   = item.find('/');
+    const auto address = boost::asio::ip::make_address(item.substr(0, slash));
+    const unsigned max = address.is_v4() ? 32 : 128;
+    const unsigned len = slash == std::string::npos ? max : std::stoul(item.substr(slash + 1));
+    if (len > max)
+      throw std::invalid_argument("invalid prefix length in '" + item + "'");
+
+    acl.add(address, len);
+  }
+
+  return acl;
+}
+
+void AddressAcl::add(const boost::asio::ip::address& address, unsigned prefixLength)
+{
+  _entries.push_back({toV6Bytes(address), address.is_v4() ? prefixLength + 96 : prefixLength});
+}
+
+bool AddressAcl::contains(const boost::asio::ip::address& address) const
+{
+  const auto bytes = toV6Bytes(address);
+
+  for (const auto& entry : _entries)
+  {
+    const unsigned full = entry.prefixLength / 8;
+    const unsigned rest = entry.prefixLength % 8;
+
+    if (std::memcmp(bytes.data(), entry.bytes.data(), full) != 0)
+      continue;
+    if (rest != 0)
+    {
+      const uint8_t mask = static_cast<uint8_t>(0xFF << (8 - rest));
+      if ((bytes[full] & mask) != (entry.bytes[full] & mask))
+        continue;
+    }
+    return true;
+  }
+
+  return false;
+}
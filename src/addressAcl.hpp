@@ -0,0 +1,27 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+
+// Set of CIDR prefixes, IPv4 entries are stored as IPv4-mapped IPv6
+class AddressAcl {
+  public:
+    // Comma separated list of "addr" or "addr/prefix", throws on malformed input
+    static AddressAcl parse(const std::string& list);
+
+    void add(const boost::asio::ip::address& address, unsigned prefixLength);
+    bool contains(const boost::asio::ip::address& address) const;
+    bool empty() const { return _entries.empty(); }
+
+  private:
+    struct Entry
+    {
+      std::array<uint8_t, 16> bytes;
+      unsigned prefixLength;
+    };
+
+    std::vector<Entry> _entries;
+};
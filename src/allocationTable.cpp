@@ -0,0 +1,158 @@
+#include "allocationTable.hpp"
+
+constexpr uint32_t AllocationTable::NONE;
+
+namespace
+{
+  constexpr std::size_t INITIAL_INDEX_SIZE = 64;
+}
+
+AllocationTable::AllocationTable()
+    : _index(INITIAL_INDEX_SIZE, NONE)
+    , _indexMask(INITIAL_INDEX_SIZE - 1)
+{
+}
+
+uint32_t AllocationTable::insert(uint64_t hash, PoolHandle object, TenantId tenant, uint32_t expiry)
+{
+  // Index at most half full
+  if ((_object.size() + 1) * 2 > _index.size())
+    grow();
+
+  const auto row = static_cast<uint32_t>(_object.size());
+  _expiry.push_back(expiry);
+  _listExpiry.push_back(NONE);
+  _bytesToPeer.push_back(0);
+  _bytesToClient.push_back(0);
+  _bytesCollected.push_back(0);
+  _packetsToPeer.push_back(0);
+  _packetsToClient.push_back(0);
+  _tenant.push_back(tenant);
+  _tupleHash.push_back(hash);
+  _object.push_back(object);
+
+  std::size_t i = hash & _indexMask;
+  while (_index[i] != NONE)
+    i = (i + 1) & _indexMask;
+  _index[i] = row;
+  return row;
+}
+
+PoolHandle AllocationTable::remove(uint32_t row)
+{
+  unindex(row);
+
+  const uint32_t last = size() - 1;
+  PoolHandle moved;
+  if (row != last)
+  {
+    _index[slotOf(last)]  = row;
+    _expiry[row]          = _expiry[last];
+    _listExpiry[row]      = _listExpiry[last];
+    _bytesToPeer[row]     = _bytesToPeer[last];
+    _bytesToClient[row]   = _bytesToClient[last];
+    _bytesCollected[row]  = _bytesCollected[last];
+    _packetsToPeer[row]   = _packetsToPeer[last];
+    _packetsToClient[row] = _packetsToClient[last];
+    _tenant[row]          = _tenant[last];
+    _tupleHash[row]       = _tupleHash[last];
+    _object[row]          = _object[last];
+    moved                 = _object[last];
+  }
+
+  _expiry.pop_back();
+  _listExpiry.pop_back();
+  _bytesToPeer.pop_back();
+  _bytesToClient.pop_back();
+  _bytesCollected.pop_back();
+  _packetsToPeer.pop_back();
+  _packetsToClient.pop_back();
+  _tenant.pop_back();
+  _tupleHash.pop_back();
+  _object.pop_back();
+  return moved;
+}
+
+// Counting first is branch free and vectorises, most sweeps stop there
+void AllocationTable::collect(const Column<uint32_t>& column, uint32_t now, std::vector<uint32_t>& rows)
+{
+  rows.clear();
+
+  const uint32_t* values = column.data();
+  const std::size_t n    = column.size();
+  std::size_t count      = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    count += values[i] <= now;
+  if (count == 0)
+    return;
+
+  rows.reserve(count);
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    if (values[i] <= now)
+      rows.push_back(static_cast<uint32_t>(i));
+  }
+}
+
+void AllocationTable::collectExpired(uint32_t now, std::vector<uint32_t>& rows) const
+{
+  collect(_expiry, now, rows);
+}
+
+void AllocationTable::collectListExpired(uint32_t now, std::vector<uint32_t>& rows) const
+{
+  collect(_listExpiry, now, rows);
+}
+
+void AllocationTable::collectBytes(std::vector<uint64_t>& perTenant)
+{
+  for (std::size_t row = 0; row < _object.size(); ++row)
+  {
+    const uint64_t total = _bytesToPeer[row] + _bytesToClient[row];
+    perTenant[_tenant[row]] += total - _bytesCollected[row];
+    _bytesCollected[row] = total;
+  }
+}
+
+uint64_t AllocationTable::uncollectedBytes(uint32_t row) const
+{
+  return _bytesToPeer[row] + _bytesToClient[row] - _bytesCollected[row];
+}
+
+void AllocationTable::grow()
+{
+  _index.assign(_index.size() * 2, NONE);
+  _indexMask = _index.size() - 1;
+  for (uint32_t row = 0; row < size(); ++row)
+  {
+    std::size_t i = _tupleHash[row] & _indexMask;
+    while (_index[i] != NONE)
+      i = (i + 1) & _indexMask;
+    _index[i] = row;
+  }
+}
+
+std::size_t AllocationTable::slotOf(uint32_t row) const
+{
+  std::size_t i = _tupleHash[row] & _indexMask;
+  while (_index[i] != row)
+    i = (i + 1) & _indexMask;
+  return i;
+}
+
+// Backward shift deletion, keeps the probe sequences free of holes
+void AllocationTable::unindex(uint32_t row)
+{
+  std::size_t i = slotOf(row);
+  for (std::size_t j = (i + 1) & _indexMask; _index[j] != NONE; j = (j + 1) & _indexMask)
+  {
+    const std::size_t home = _tupleHash[_index[j]] & _indexMask;
+    // Move j into the hole at i unless its home lies cyclically in (i, j]
+    if (((j - home) & _indexMask) >= ((j - i) & _indexMask))
+    {
+      _index[i] = _index[j];
+      i         = j;
+    }
+  }
+  _index[i] = NONE;
+}
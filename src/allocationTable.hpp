@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "config.hpp"
+#include "memoryAccounting.hpp"
+#include "slabPool.hpp"
+
+// Hot fields of the TURN allocations of one worker, stored column by column
+// (struct of arrays) so that the periodic sweeps stream through the few
+// fields they need instead of whole objects. Rows are dense: removing a row
+// moves the last one into its place. The cold part of an allocation (socket,
+// key, permission lists) stays in its pooled object, referenced by the
+// object column.
+//
+// Times are seconds on the clock of the owning TurnServer.
+class AllocationTable {
+  public:
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+    AllocationTable();
+
+    uint32_t size() const { return static_cast<uint32_t>(_object.size()); }
+
+    // Row of the allocation with this 5-tuple hash for which match(object)
+    // holds, NONE otherwise
+    template<typename Match>
+    uint32_t find(uint64_t hash, Match match) const
+    {
+      for (std::size_t i = hash & _indexMask;; i = (i + 1) & _indexMask)
+      {
+        const uint32_t row = _index[i];
+        if (row == NONE)
+          return NONE;
+        if (_tupleHash[row] == hash && match(_object[row]))
+          return row;
+      }
+    }
+
+    uint32_t insert(uint64_t hash, PoolHandle object, TenantId tenant, uint32_t expiry);
+
+    // Removes a row; returns the object moved into its place, if any, so
+    // that the caller can update the row it keeps
+    PoolHandle remove(uint32_t row);
+
+    PoolHandle object(uint32_t row) const { return _object[row]; }
+    TenantId tenant(uint32_t row) const { return _tenant[row]; }
+
+    uint32_t expiry(uint32_t row) const { return _expiry[row]; }
+    void setExpiry(uint32_t row, uint32_t expiry) { _expiry[row] = expiry; }
+
+    // Earliest expiry of the permissions and channels of the allocation
+    uint32_t listExpiry(uint32_t row) const { return _listExpiry[row]; }
+    void setListExpiry(uint32_t row, uint32_t expiry) { _listExpiry[row] = expiry; }
+
+    // One relayed packet of that many bytes
+    void addBytesToPeer(uint32_t row, uint64_t bytes)
+    {
+      _bytesToPeer[row] += bytes;
+      ++_packetsToPeer[row];
+    }
+    void addBytesToClient(uint32_t row, uint64_t bytes)
+    {
+      _bytesToClient[row] += bytes;
+      ++_packetsToClient[row];
+    }
+    uint64_t bytesToPeer(uint32_t row) const { return _bytesToPeer[row]; }
+    uint64_t bytesToClient(uint32_t row) const { return _bytesToClient[row]; }
+    uint64_t packetsToPeer(uint32_t row) const { return _packetsToPeer[row]; }
+    uint64_t packetsToClient(uint32_t row) const { return _packetsToClient[row]; }
+
+    // Rows with expiry (or listExpiry) <= now, in increasing order
+    void collectExpired(uint32_t now, std::vector<uint32_t>& rows) const;
+    void collectListExpired(uint32_t now, std::vector<uint32_t>& rows) const;
+
+    // Adds the bytes relayed since the previous call to perTenant[tenant]
+    void collectBytes(std::vector<uint64_t>& perTenant);
+    // Bytes of one row not collected yet
+    uint64_t uncollectedBytes(uint32_t row) const;
+
+  private:
+    template<typename T>
+    using Column = TaggedVector<T, MemoryTag::Turn>;
+
+    static void collect(const Column<uint32_t>& column, uint32_t now, std::vector<uint32_t>& rows);
+
+    void grow();
+    void unindex(uint32_t row);
+    std::size_t slotOf(uint32_t row) const;
+
+  private:
+    Column<uint32_t> _expiry;
+    Column<uint32_t> _listExpiry;
+    Column<uint64_t> _bytesToPeer;
+    Column<uint64_t> _bytesToClient;
+    Column<uint64_t> _bytesCollected;
+    Column<uint64_t> _packetsToPeer;
+    Column<uint64_t> _packetsToClient;
+    Column<TenantId> _tenant;
+    Column<uint64_t> _tupleHash;
+    Column<PoolHandle> _object;
+
+    Column<uint32_t> _index; // open addressing on the tuple hash, rows or NONE
+    std::size_t _indexMask;
+};
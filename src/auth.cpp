@@ -0,0 +1,280 @@
+#include "auth.hpp"
+#include "serverClock.hpp"
+#include "stunMessage.hpp"
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+using namespace ustun::protocol;
+
+constexpr std::size_t AuthKey::MAX_SIZE;
+constexpr std::chrono::seconds LongTermAuth::NONCE_LIFETIME;
+
+namespace
+{
+  constexpr std::size_t NONCE_SIZE     = 32; // hex(expiry, 8 bytes) + hex(tag, 8 bytes)
+  constexpr std::size_t GCM_TAG_SIZE   = 16;
+  constexpr uint64_t TOKEN_CLOCK_SKEW  = 60; // seconds a token timestamp may be ahead
+
+  const char HEX[] = "0123456789abcdef";
+
+  void toHex(const uint8_t* data, std::size_t n, char* out)
+  {
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      out[2 * i]     = HEX[data[i] >> 4];
+      out[2 * i + 1] = HEX[data[i] & 0xF];
+    }
+  }
+
+  uint64_t nowSeconds() { return static_cast<uint64_t>(ServerClock::unixTime()); }
+
+  uint64_t readBigEndian(const uint8_t* data, std::size_t n)
+  {
+    uint64_t value = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      value = (value << 8) | data[i];
+    return value;
+  }
+
+  struct CipherContextFree
+  {
+    void operator()(EVP_CIPHER_CTX* ctx) const { EVP_CIPHER_CTX_free(ctx); }
+  };
+}
+
+LongTermAuth::LongTermAuth()
+{
+  if (RAND_bytes(_nonceSecret.data(), _nonceSecret.size()) != 1)
+    throw std::runtime_error("cannot generate nonce secret");
+}
+
+void LongTermAuth::addTenant(const std::string& realm)
+{
+  _tenants.push_back({realm, {}});
+}
+
+void LongTermAuth::addUser(TenantId tenant, const std::string& username, const std::string& password)
+{
+  auto& store             = _tenants.at(tenant);
+  const std::string input = username + ":" + store.realm + ":" + password;
+  AuthKey key;
+  unsigned len = 0;
+  EVP_Digest(input.data(), input.size(), key.bytes.data(), &len, EVP_md5(), nullptr);
+  key.length = len;
+  store.users[username] = key;
+}
+
+void LongTermAuth::addTokenKey(const std::string& kid, const std::string& key)
+{
+  if (key.size() != 16 && key.size() != 32)
+    throw std::invalid_argument("access token key must be 16 or 32 bytes");
+  _tokenKeys[kid] = key;
+}
+
+std::string LongTermAuth::makeNonce() const
+{
+  uint8_t expiry[8];
+  const uint64_t value = nowSeconds() + NONCE_LIFETIME.count();
+  for (int i = 0; i < 8; ++i)
+    expiry[i] = static_cast<uint8_t>(value >> (56 - 8 * i));
+
+  uint8_t tag[HMAC_SHA1_SIZE];
+  unsigned len = 0;
+  HMAC(EVP_sha1(), _nonceSecret.data(), _nonceSecret.size(), expiry, sizeof(expiry), tag, &len);
+
+  std::string nonce(NONCE_SIZE, '0');
+  toHex(expiry, 8, &nonce[0]);
+  toHex(tag, 8, &nonce[16]);
+  return nonce;
+}
+
+bool LongTermAuth::checkNonce(const uint8_t* nonce, std::size_t length) const
+{
+  if (length != NONCE_SIZE)
+    return false;
+
+  uint8_t expiry[8];
+  for (int i = 0; i < 8; ++i)
+  {
+    const char* hi = std::strchr(HEX, nonce[2 * i]);
+    const char* lo = std::strchr(HEX, nonce[2 * i + 1]);
+    if (!hi || !lo || !*hi || !*lo)
+      return false;
+    expiry[i] = static_cast<uint8_t>(((hi - HEX) << 4) | (lo - HEX));
+  }
+
+  uint8_t tag[HMAC_SHA1_SIZE];
+  unsigned len = 0;
+  HMAC(EVP_sha1(), _nonceSecret.data(), _nonceSecret.size(), expiry, sizeof(expiry), tag, &len);
+
+  char expected[16];
+  toHex(tag, 8, expected);
+  if (CRYPTO_memcmp(expected, nonce + 16, sizeof(expected)) != 0)
+    return false;
+
+  return readBigEndian(expiry, 8) > nowSeconds();
+}
+
+// RFC 7635 §6.2:
+//   nonce_length (2) | nonce | AEAD(key_length (2) | mac_key | timestamp (8) | lifetime (4)) | tag
+// The timestamp holds the seconds since the epoch in its upper 48 bits.
+bool LongTermAuth::decryptToken(const std::string& kid, const uint8_t* data, std::size_t length,
+    AccessToken& token) const
+{
+  const auto it = _tokenKeys.find(kid);
+  if (it == _tokenKeys.end() || length < 2)
+    return false;
+
+  const std::size_t nonceLength = readBigEndian(data, 2);
+  if (nonceLength == 0 || length < 2 + nonceLength + GCM_TAG_SIZE)
+    return false;
+
+  const uint8_t* nonce         = data + 2;
+  const uint8_t* encrypted     = nonce + nonceLength;
+  const std::size_t cipherSize = length - 2 - nonceLength - GCM_TAG_SIZE;
+  const uint8_t* tag           = encrypted + cipherSize;
+
+  uint8_t plain[2 + AuthKey::MAX_SIZE + 8 + 4];
+  if (cipherSize < 2 + 8 + 4 || cipherSize > sizeof(plain))
+    return false;
+
+  // EVP picks the AES-NI implementation when the CPU has it
+  const auto& key = it->second;
+  std::unique_ptr<EVP_CIPHER_CTX, CipherContextFree> ctx(EVP_CIPHER_CTX_new());
+  const EVP_CIPHER* cipher = key.size() == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+  int len = 0, finalLen = 0;
+  if (!ctx || EVP_DecryptInit_ex(ctx.get(), cipher, nullptr, nullptr, nullptr) != 1
+      || EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, static_cast<int>(nonceLength), nullptr) != 1
+      || EVP_DecryptInit_ex(ctx.get(), nullptr, nullptr,
+             reinterpret_cast<const uint8_t*>(key.data()), nonce) != 1)
+    return false;
+  if (!_tokenServer.empty()
+      && EVP_DecryptUpdate(ctx.get(), nullptr, &len,
+             reinterpret_cast<const uint8_t*>(_tokenServer.data()), static_cast<int>(_tokenServer.size())) != 1)
+    return false;
+  if (EVP_DecryptUpdate(ctx.get(), plain, &len, encrypted, static_cast<int>(cipherSize)) != 1
+      || EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, const_cast<uint8_t*>(tag)) != 1
+      || EVP_DecryptFinal_ex(ctx.get(), plain + len, &finalLen) != 1)
+    return false;
+
+  const std::size_t keyLength = readBigEndian(plain, 2);
+  if (keyLength == 0 || keyLength > AuthKey::MAX_SIZE || cipherSize != 2 + keyLength + 8 + 4)
+    return false;
+
+  std::memcpy(token.macKey.bytes.data(), plain + 2, keyLength);
+  token.macKey.length = keyLength;
+
+  const uint64_t timestamp = readBigEndian(plain + 2 + keyLength, 8) >> 16;
+  const uint64_t lifetime  = readBigEndian(plain + 2 + keyLength + 8, 4);
+  if (timestamp > nowSeconds() + TOKEN_CLOCK_SKEW)
+    return false;
+
+  token.expiry    = timestamp + lifetime;
+  token.decrypted = true;
+  return true;
+}
+
+AuthResult LongTermAuth::checkRequest(const StunMessage& msg, TenantId tenant, std::string& username) const
+{
+  StunAttribute user, realm, nonce;
+  if (!msg.find(ATTR_USERNAME, user) || !msg.find(ATTR_REALM, realm) || !msg.find(ATTR_NONCE, nonce))
+    return AuthResult::BadRequest;
+
+  if (!checkNonce(nonce.value, nonce.length))
+    return AuthResult::StaleNonce;
+
+  const auto& store = _tenants[tenant];
+  if (realm.length != store.realm.size() || std::memcmp(realm.value, store.realm.data(), realm.length) != 0)
+    return AuthResult::Unauthorized;
+
+  username.assign(reinterpret_cast<const char*>(user.value), user.length);
+  return AuthResult::Ok;
+}
+
+AuthResult LongTermAuth::verify(const StunMessage& msg, TenantId tenant, AuthKey& key,
+    AccessToken& token) const
+{
+  std::string name;
+  const AuthResult result = checkRequest(msg, tenant, name);
+  if (result != AuthResult::Ok)
+    return result;
+
+  StunAttribute accessToken;
+  if (!_tokenKeys.empty() && msg.find(ATTR_ACCESS_TOKEN, accessToken))
+  {
+    token.decrypted = false;
+    if (token.expiry == 0 && !decryptToken(name, accessToken.value, accessToken.length, token))
+      return AuthResult::Unauthorized;
+    if (token.expiry <= nowSeconds())
+      return AuthResult::Unauthorized;
+    key = token.macKey;
+  }
+  else
+  {
+    const auto& users = _tenants[tenant].users;
+    const auto it     = users.find(name);
+    if (it == users.end())
+      return AuthResult::Unauthorized;
+    key = it->second;
+  }
+
+  if (!checkIntegrity(msg, key.data(), key.size()))
+    return AuthResult::Unauthorized;
+  return AuthResult::Ok;
+}
+
+AuthResult LongTermAuth::verifyKey(const StunMessage& msg, TenantId tenant, const AuthKey* key) const
+{
+  std::string name;
+  const AuthResult result = checkRequest(msg, tenant, name);
+  if (result != AuthResult::Ok)
+    return result;
+
+  if (!key || !checkIntegrity(msg, key->data(), key->size()))
+    return AuthResult::Unauthorized;
+  return AuthResult::Ok;
+}
+
+bool LongTermAuth::hasUser(TenantId tenant, const std::string& username) const
+{
+  return _tenants[tenant].users.count(username) != 0;
+}
+
+bool LongTermAuth::checkIntegrity(const StunMessage& msg, const uint8_t* key, std::size_t keyLength)
+{
+  // The codec's HMAC hashes the message in place, the length patched on the
+  // fly, and beats a one-shot OpenSSL HMAC on messages this small
+  return msg.view().checkIntegrity(key, keyLength);
+}
+
+void LongTermAuth::challenge(std::vector<uint8_t>& resp, const StunMessage& req, AuthResult reason,
+    TenantId tenant) const
+{
+  const auto& realm = _tenants[tenant].realm;
+  const std::string nonce = makeNonce();
+
+  resp.clear();
+  StunMessageBuilder builder(resp, messageType(req.method(), CLASS_ERROR), req.transactionId());
+  if (reason == AuthResult::StaleNonce)
+    builder.addErrorCode(438, "Stale Nonce");
+  else
+    builder.addErrorCode(401, "Unauthorized");
+  builder.addAttribute(ATTR_REALM, realm.data(), static_cast<uint16_t>(realm.size()));
+  builder.addAttribute(ATTR_NONCE, nonce.data(), static_cast<uint16_t>(nonce.size()));
+  if (!_tokenKeys.empty() && !_tokenServer.empty())
+    builder.addAttribute(ATTR_THIRD_PARTY_AUTH, _tokenServer.data(), static_cast<uint16_t>(_tokenServer.size()));
+}
+
+void LongTermAuth::sign(std::vector<uint8_t>& msg, const AuthKey& key)
+{
+  const std::size_t offset = msg.size();
+  msg.resize(offset + ustun::attributeSize(HMAC_SHA1_SIZE));
+  ustun::encodeIntegrity(msg.data(), offset, key.data(), key.size());
+}
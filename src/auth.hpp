@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config.hpp"
+
+class StunMessage;
+
+// HMAC key: MD5(username:realm:password), or the mac_key of an access token
+struct AuthKey
+{
+  static constexpr std::size_t MAX_SIZE = 64;
+
+  std::array<uint8_t, MAX_SIZE> bytes;
+  std::size_t length = 0;
+
+  const uint8_t* data() const { return bytes.data(); }
+  std::size_t size() const { return length; }
+};
+
+// Decrypted OAuth access token (RFC 7635)
+struct AccessToken
+{
+  AuthKey macKey;
+  uint64_t expiry = 0; // unix time, 0 when not decrypted yet
+  bool decrypted  = false; // decrypted by the last verify(), worth caching
+};
+
+enum class AuthResult
+{
+  Ok,
+  BadRequest, // 400, missing USERNAME, REALM or NONCE
+  Unauthorized, // 401, unknown user or wrong MESSAGE-INTEGRITY
+  StaleNonce, // 438
+  Unavailable // 500, the external credential service did not answer
+};
+
+// Long-term credential mechanism (RFC 5389 §10.2), with one credential store
+// per tenant (realm). Nonces are stateless: the expiry time authenticated with
+// a per-process secret. Every const method may be called from any thread.
+//
+// Third-party authorization (RFC 7635) is supported as well: the USERNAME is
+// then the id of the key the access token was encrypted with (AES-GCM), and
+// MESSAGE-INTEGRITY is keyed by the mac_key found in the token.
+class LongTermAuth {
+  public:
+    static constexpr auto NONCE_LIFETIME = std::chrono::seconds(600);
+
+    LongTermAuth();
+
+    // Tenants must be added in TenantId order
+    void addTenant(const std::string& realm);
+    void addUser(TenantId tenant, const std::string& username, const std::string& password);
+    // AES-128-GCM or AES-256-GCM key shared with the authorization server
+    void addTokenKey(const std::string& kid, const std::string& key);
+    // Server name used as AEAD associated data and sent in THIRD-PARTY-AUTHORIZATION
+    void setTokenServer(const std::string& name) { _tokenServer = name; }
+
+    const std::string& realm(TenantId tenant) const { return _tenants[tenant].realm; }
+
+    // Checks USERNAME, REALM, NONCE and MESSAGE-INTEGRITY, key receives the
+    // user key on success. This is the expensive part: two HMACs, plus the
+    // decryption of the ACCESS-TOKEN unless token holds a cached one.
+    AuthResult verify(const StunMessage& msg, TenantId tenant, AuthKey& key, AccessToken& token) const;
+    // Same checks with a user key found elsewhere (ExternalAuth), null when
+    // the user is unknown
+    AuthResult verifyKey(const StunMessage& msg, TenantId tenant, const AuthKey* key) const;
+
+    bool hasUser(TenantId tenant, const std::string& username) const;
+
+    // 401 or 438 error response with the tenant REALM and a fresh NONCE
+    void challenge(std::vector<uint8_t>& resp, const StunMessage& req, AuthResult reason,
+        TenantId tenant) const;
+
+    // Appends MESSAGE-INTEGRITY to a finished message
+    static void sign(std::vector<uint8_t>& msg, const AuthKey& key);
+
+    // HMAC-SHA1 over the message up to the MESSAGE-INTEGRITY attribute
+    static bool checkIntegrity(const StunMessage& msg, const uint8_t* key, std::size_t keyLength);
+
+  private:
+    // USERNAME, REALM and NONCE checks shared by both verify flavours
+    AuthResult checkRequest(const StunMessage& msg, TenantId tenant, std::string& username) const;
+    std::string makeNonce() const;
+    bool checkNonce(const uint8_t* nonce, std::size_t length) const;
+    bool decryptToken(const std::string& kid, const uint8_t* data, std::size_t length,
+        AccessToken& token) const;
+
+  private:
+    struct Tenant
+    {
+      std::string realm;
+      std::unordered_map<std::string, AuthKey> users;
+    };
+
+    std::array<uint8_t, 32> _nonceSecret;
+    std::vector<Tenant> _tenants;
+    std::unordered_map<std::string, std::string> _tokenKeys; // kid, AES key
+    std::string _tokenServer;
+};
@@ -0,0 +1,253 @@
+#include "cluster.hpp"
+#include "stunServer.hpp"
+
+#include <cmath>
+#include <cstddef>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+
+namespace
+{
+  constexpr uint32_t HEARTBEAT_MAGIC   = 0x5553544E; // "USTN"
+  constexpr uint16_t HEARTBEAT_VERSION = 2;
+
+  constexpr auto HEARTBEAT_INTERVAL = std::chrono::seconds(1);
+  constexpr auto PEER_TIMEOUT       = std::chrono::seconds(3);
+  constexpr uint64_t MAX_CLOCK_SKEW_MS = 10000;
+
+#pragma pack(push, 1)
+  struct Heartbeat
+  {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t loadPermille;
+    uint8_t timestamp[8]; // sender wall clock in ms since the epoch, big-endian
+    uint8_t tag[32]; // HMAC-SHA256 of the fields above under cluster-key
+  };
+#pragma pack(pop)
+
+  uint64_t nowMs()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void computeTag(const std::string& key, const Heartbeat& hb, uint8_t* out)
+  {
+    unsigned length = 32;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()), reinterpret_cast<const uint8_t*>(&hb),
+        offsetof(Heartbeat, tag), out, &length);
+  }
+
+  // The source address is trivially spoofed over UDP: only a valid tag and a
+  // timestamp close to the local clock let a heartbeat through
+  bool verify(const std::string& key, const Heartbeat& hb, uint64_t& timestamp)
+  {
+    uint8_t expected[sizeof(hb.tag)];
+    computeTag(key, hb, expected);
+    if (CRYPTO_memcmp(expected, hb.tag, sizeof(expected)) != 0)
+      return false;
+
+    timestamp = 0;
+    for (const uint8_t byte : hb.timestamp)
+      timestamp = (timestamp << 8) | byte;
+    const uint64_t now = nowMs();
+    return timestamp + MAX_CLOCK_SKEW_MS >= now && timestamp <= now + MAX_CLOCK_SKEW_MS;
+  }
+
+  uint64_t hashEndpoint(uint64_t h, const udp::endpoint& endpoint, bool withPort)
+  {
+    auto mix = [&h](const uint8_t* p, std::size_t n) {
+      for (std::size_t i = 0; i < n; ++i)
+        h = (h ^ p[i]) * 1099511628211ull;
+    };
+
+    if (endpoint.address().is_v4())
+    {
+      const auto bytes = endpoint.address().to_v4().to_bytes();
+      mix(bytes.data(), bytes.size());
+    }
+    else
+    {
+      const auto bytes = endpoint.address().to_v6().to_bytes();
+      mix(bytes.data(), bytes.size());
+    }
+    if (withPort)
+    {
+      const uint16_t port = endpoint.port();
+      mix(reinterpret_cast<const uint8_t*>(&port), sizeof(port));
+    }
+    return h;
+  }
+
+  // Final avalanche so that close inputs give unrelated outputs (splitmix64)
+  uint64_t finalize(uint64_t h)
+  {
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+  }
+}
+
+Cluster::Cluster(boost::asio::io_context& io, const ClusterConfig& config, Stats& stats)
+    : _config(config)
+    , _stats(stats)
+    , _socket(io, config.listen)
+    , _timer(io)
+    , _lastTick(Clock::now())
+{
+  for (const auto& peerConfig : _config.peers)
+  {
+    _peers.emplace_back(new Peer);
+    _peers.back()->config = peerConfig;
+  }
+
+  spdlog::info("Cluster gossip on {} with {} peer(s), shedding above {:.0f}% load",
+      StunServer::endpoint2str(_config.listen), _peers.size(), _config.shedAbove * 100);
+
+  startReceive();
+  scheduleTick();
+}
+
+void Cluster::stop()
+{
+  boost::system::error_code ec;
+  _timer.cancel(ec);
+  _socket.close(ec);
+}
+
+bool Cluster::pickAlternate(const udp::endpoint& client, udp::endpoint& out) const
+{
+  const auto now       = Clock::now().time_since_epoch().count();
+  const auto timeout   = std::chrono::duration_cast<Clock::duration>(PEER_TIMEOUT).count();
+  const auto threshold = static_cast<uint32_t>(_config.shedAbove * 1000);
+  const uint64_t clientHash = hashEndpoint(1469598103934665603ull, client, false);
+
+  double bestScore = 0;
+  const Peer* best = nullptr;
+
+  for (const auto& peer : _peers)
+  {
+    const auto lastSeen = peer->lastSeen.load(std::memory_order_relaxed);
+    const auto load     = peer->loadPermille.load(std::memory_order_relaxed);
+    if (lastSeen == 0 || now - lastSeen > timeout || load >= threshold)
+      continue;
+    // ALTERNATE-SERVER has to be reachable with the client address family
+    if (peer->config.alternate.address().is_v4() != client.address().is_v4())
+      continue;
+
+    // Weighted rendezvous hashing: score = weight / -ln(u), u uniform in (0, 1)
+    const uint64_t h    = finalize(hashEndpoint(clientHash, peer->config.gossip, true));
+    const double u      = (static_cast<double>(h >> 11) + 0.5) / 9007199254740992.0;
+    const double weight = (1000.0 - load) / 1000.0;
+    const double score  = weight / -std::log(u);
+
+    if (score > bestScore)
+    {
+      bestScore = score;
+      best      = peer.get();
+    }
+  }
+
+  if (!best)
+    return false;
+  out = best->config.alternate;
+  return true;
+}
+
+void Cluster::startReceive()
+{
+  _socket.async_receive_from(boost::asio::buffer(_buffer), _remote,
+      [this](boost::system::error_code ec, std::size_t bytes) {
+        if (ec == boost::asio::error::operation_aborted)
+          return;
+
+        Heartbeat hb;
+        if (!ec && bytes == sizeof(hb))
+        {
+          std::memcpy(&hb, _buffer.data(), sizeof(hb));
+          if (ntohl(hb.magic) == HEARTBEAT_MAGIC && ntohs(hb.version) == HEARTBEAT_VERSION)
+          {
+            uint64_t timestamp = 0;
+            const bool valid   = verify(_config.key, hb, timestamp);
+            for (auto& peer : _peers)
+            {
+              if (peer->config.gossip != _remote)
+                continue;
+              // Replays of an older heartbeat are as stale as a skewed clock
+              if (!valid || timestamp <= peer->lastTimestamp)
+              {
+                statsInc(_stats.clusterRejected);
+                continue;
+              }
+              peer->lastTimestamp = timestamp;
+              peer->loadPermille.store(ntohs(hb.loadPermille), std::memory_order_relaxed);
+              peer->lastSeen.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+            }
+          }
+        }
+
+        startReceive();
+      });
+}
+
+void Cluster::scheduleTick()
+{
+  _timer.expires_after(HEARTBEAT_INTERVAL);
+  _timer.async_wait([this](boost::system::error_code ec) {
+    if (ec)
+      return;
+    tick();
+    scheduleTick();
+  });
+}
+
+void Cluster::tick()
+{
+  const auto now       = Clock::now();
+  const double elapsed = std::chrono::duration<double>(now - _lastTick).count();
+  _lastTick            = now;
+
+  const uint32_t load   = computeLoad(elapsed);
+  const bool overloaded = load >= static_cast<uint32_t>(_config.shedAbove * 1000);
+  if (overloaded != _overloaded.load(std::memory_order_relaxed))
+    spdlog::info("Cluster: load {:.1f}%, {} shedding new clients", load / 10.0,
+        overloaded ? "start" : "stop");
+  _overloaded.store(overloaded, std::memory_order_relaxed);
+
+  Heartbeat hb {htonl(HEARTBEAT_MAGIC), htons(HEARTBEAT_VERSION), htons(static_cast<uint16_t>(load)), {}, {}};
+  const uint64_t timestamp = nowMs();
+  for (unsigned i = 0; i < sizeof(hb.timestamp); ++i)
+    hb.timestamp[i] = static_cast<uint8_t>(timestamp >> (56 - 8 * i));
+  computeTag(_config.key, hb, hb.tag);
+  for (const auto& peer : _peers)
+  {
+    boost::system::error_code ec;
+    _socket.send_to(boost::asio::buffer(&hb, sizeof(hb)), peer->config.gossip, 0, ec);
+  }
+}
+
+uint32_t Cluster::computeLoad(double elapsed)
+{
+  const uint64_t packets = _stats.packetsReceived.load(std::memory_order_relaxed);
+  const double rps       = elapsed > 0 ? (packets - _lastPackets) / elapsed : 0;
+  _lastPackets           = packets;
+
+  // The most saturated resource defines the load
+  double load = 0;
+  if (_config.capacityRps)
+    load = std::max(load, rps / _config.capacityRps);
+  if (_config.capacityAllocations)
+    load = std::max(load,
+        double(_stats.turnAllocations.load(std::memory_order_relaxed)) / _config.capacityAllocations);
+
+  return static_cast<uint32_t>(std::min(load, 1.0) * 1000);
+}
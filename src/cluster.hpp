@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "config.hpp"
+#include "stats.hpp"
+
+// Load sharing between ustun nodes. Every node broadcasts its load to the
+// configured peers once per second over UDP; when the local load crosses the
+// shedding threshold, new clients are sent to a peer chosen by weighted
+// rendezvous hashing, so a given client keeps landing on the same peer while
+// the peer set and loads are stable. Heartbeats are signed with the shared
+// cluster key.
+class Cluster {
+  public:
+    Cluster(boost::asio::io_context& io, const ClusterConfig& config, Stats& stats);
+
+    void stop();
+
+    bool overloaded() const { return _overloaded.load(std::memory_order_relaxed); }
+    bool shedBinding() const { return _config.shedBinding; }
+
+    // Peer for this client, false when no live peer has headroom
+    bool pickAlternate(const boost::asio::ip::udp::endpoint& client,
+        boost::asio::ip::udp::endpoint& out) const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Peer
+    {
+      ClusterPeerConfig config;
+      std::atomic<uint32_t> loadPermille {1000};
+      std::atomic<int64_t> lastSeen {0}; // Clock ticks, 0 before the first heartbeat
+      uint64_t lastTimestamp = 0; // sender clock of the last accepted heartbeat, rejects replays
+    };
+
+    void startReceive();
+    void scheduleTick();
+    void tick();
+    uint32_t computeLoad(double elapsed);
+
+  private:
+    const ClusterConfig& _config;
+    Stats& _stats;
+    boost::asio::ip::udp::socket _socket;
+    boost::asio::steady_timer _timer;
+    std::vector<std::unique_ptr<Peer>> _peers;
+    std::atomic<bool> _overloaded {false};
+    uint64_t _lastPackets = 0;
+    Clock::time_point _lastTick;
+    std::array<uint8_t, 64> _buffer {};
+    boost::asio::ip::udp::endpoint _remote;
+};
@@ -0,0 +1,634 @@
+#include "config.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <spdlog/common.h>
+#include <spdlog/fmt/fmt.h>
+
+namespace
+{
+  [[noreturn]] void fail(const std::string& path, unsigned line, const std::string& what)
+  {
+    throw std::runtime_error(fmt::format("{}:{}: {}", path, line, what));
+  }
+
+  Transport parseTransport(const std::string& str)
+  {
+    if (str == "udp")
+      return Transport::Udp;
+    if (str == "tcp")
+      return Transport::Tcp;
+    if (str == "tls")
+      return Transport::Tls;
+    if (str == "dtls")
+      return Transport::Dtls;
+    throw std::invalid_argument("unknown transport '" + str + "'");
+  }
+
+  // "1.2.3.4:3478", "[::1]:3478"
+  template<typename Out>
+  void parseHostPort(const std::string& str, Out& out)
+  {
+    const auto colon = str.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+      throw std::invalid_argument("expected <address>:<port>, got '" + str + "'");
+
+    std::string host = str.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+
+    out.address = boost::asio::ip::make_address(host);
+    out.port    = static_cast<uint16_t>(std::stoul(str.substr(colon + 1)));
+  }
+
+  boost::asio::ip::udp::endpoint parseEndpoint(const std::string& str)
+  {
+    struct
+    {
+      boost::asio::ip::address address;
+      uint16_t port;
+    } parsed;
+    parseHostPort(str, parsed);
+    return {parsed.address, parsed.port};
+  }
+
+  // Splits "key=value", throws when there is no '='
+  std::pair<std::string, std::string> parseOption(const std::string& option)
+  {
+    const auto eq = option.find('=');
+    if (eq == std::string::npos)
+      throw std::invalid_argument("expected <key>=<value>, got '" + option + "'");
+    return {option.substr(0, eq), option.substr(eq + 1)};
+  }
+
+  std::string decodeBase64(const std::string& str)
+  {
+    static const std::string ALPHABET
+        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string out;
+    uint32_t bits  = 0;
+    unsigned count = 0;
+    for (const char c : str)
+    {
+      if (c == '=')
+        break;
+      const auto value = ALPHABET.find(c);
+      if (value == std::string::npos)
+        throw std::invalid_argument("invalid base64 '" + str + "'");
+      bits = (bits << 6) | static_cast<uint32_t>(value);
+      if ((count += 6) >= 8)
+      {
+        count -= 8;
+        out.push_back(static_cast<char>((bits >> count) & 0xFF));
+      }
+    }
+    return out;
+  }
+
+  TenantId findTenant(const std::vector<TenantConfig>& tenants, const std::string& realm)
+  {
+    for (std::size_t i = 0; i < tenants.size(); ++i)
+    {
+      if (tenants[i].realm == realm)
+        return static_cast<TenantId>(i);
+    }
+    throw std::invalid_argument("unknown tenant '" + realm + "'");
+  }
+
+  void parseTenant(std::istringstream& args, std::vector<TenantConfig>& tenants)
+  {
+    std::string realm;
+    if (!(args >> realm))
+      throw std::invalid_argument("expected 'tenant <realm> [options]'");
+
+    // The default tenant may get limits too
+    auto it = std::find_if(tenants.begin(), tenants.end(),
+        [&realm](const TenantConfig& tenant) { return tenant.realm == realm; });
+    if (it == tenants.end())
+    {
+      if (tenants.size() >= INVALID_TENANT)
+        throw std::invalid_argument("too many tenants");
+      tenants.emplace_back();
+      it        = tenants.end() - 1;
+      it->realm = realm;
+    }
+
+    std::string option;
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "ports")
+      {
+        const auto dash = kv.second.find('-');
+        if (dash == std::string::npos)
+          throw std::invalid_argument("expected ports=<min>-<max>");
+        const auto min = std::stoul(kv.second.substr(0, dash));
+        const auto max = std::stoul(kv.second.substr(dash + 1));
+        if (min == 0 || min > max || max > 65535)
+          throw std::invalid_argument("invalid port range '" + kv.second + "'");
+        it->relayPortMin = static_cast<uint16_t>(min);
+        it->relayPortMax = static_cast<uint16_t>(max);
+      }
+      else if (kv.first == "allocations")
+        it->maxAllocations = std::stoull(kv.second);
+      else if (kv.first == "rps")
+        it->requestRate = std::stod(kv.second);
+      else if (kv.first == "burst")
+        it->requestBurst = std::stod(kv.second);
+      else if (kv.first == "auth")
+        it->authSocket = kv.second;
+      else
+        throw std::invalid_argument("unknown tenant option '" + kv.first + "'");
+    }
+  }
+
+  void parseExternalAuthCache(std::istringstream& args, AuthConfig& auth)
+  {
+    std::string entries, option;
+    if (!(args >> entries))
+      throw std::invalid_argument(
+          "expected 'external-auth-cache <entries> [ttl=<s>] [negative-ttl=<s>] [pending=<requests>]'");
+
+    auth.externalCacheEntries = std::stoul(entries);
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "ttl")
+        auth.externalTtl = static_cast<uint32_t>(std::stoul(kv.second));
+      else if (kv.first == "negative-ttl")
+        auth.externalNegativeTtl = static_cast<uint32_t>(std::stoul(kv.second));
+      else if (kv.first == "pending")
+        auth.externalMaxPending = std::stoul(kv.second);
+      else
+        throw std::invalid_argument("unknown external-auth-cache option '" + kv.first + "'");
+    }
+  }
+
+  void parseTrace(std::istringstream& args, TraceConfig& trace)
+  {
+    std::string sampleEvery, option;
+    if (!(args >> sampleEvery))
+      throw std::invalid_argument("expected 'trace <1 in N requests> [spans=<per worker>]'");
+
+    trace.sampleEvery = static_cast<unsigned>(std::stoul(sampleEvery));
+    if (trace.sampleEvery == 0)
+      throw std::invalid_argument("trace must sample at least 1 request in N");
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "spans")
+        trace.spans = std::stoul(kv.second);
+      else
+        throw std::invalid_argument("unknown trace option '" + kv.first + "'");
+    }
+    if (trace.spans == 0)
+      throw std::invalid_argument("trace needs room for at least 1 span");
+  }
+
+  void parseCapture(std::istringstream& args, CaptureConfig& capture)
+  {
+    std::string option;
+    if (!(args >> capture.path))
+      throw std::invalid_argument("expected 'capture <path> [size=<MB>] [sample=<1 in N>] [prefix=<cidr,...>] "
+                                  "[transaction=<hex,...>] [errors]'");
+
+    while (args >> option)
+    {
+      if (option == "errors")
+      {
+        capture.errors = true;
+        continue;
+      }
+
+      const auto kv = parseOption(option);
+      if (kv.first == "size")
+        capture.bytes = std::stoull(kv.second) << 20;
+      else if (kv.first == "sample")
+        capture.sampleEvery = static_cast<unsigned>(std::stoul(kv.second));
+      else if (kv.first == "prefix")
+        capture.prefixes = AddressAcl::parse(kv.second);
+      else if (kv.first == "transaction")
+      {
+        std::istringstream list(kv.second);
+        std::string hex;
+        while (std::getline(list, hex, ','))
+        {
+          std::array<uint8_t, 12> id;
+          if (hex.size() != 2 * id.size() || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+            throw std::invalid_argument("transaction IDs are 24 hex digits, got '" + hex + "'");
+          for (std::size_t i = 0; i < id.size(); ++i)
+            id[i] = static_cast<uint8_t>(std::stoul(hex.substr(2 * i, 2), nullptr, 16));
+          capture.transactions.push_back(id);
+        }
+      }
+      else
+        throw std::invalid_argument("unknown capture option '" + kv.first + "'");
+    }
+
+    if (capture.bytes < (1u << 20) || capture.bytes > (1ull << 30))
+      throw std::invalid_argument("capture size must be between 1 and 1024 MB");
+    if (capture.sampleEvery == 0 && capture.prefixes.empty() && capture.transactions.empty() && !capture.errors)
+      throw std::invalid_argument("capture needs sample=, prefix=, transaction= or errors");
+  }
+
+  void parseTurnRelay(std::istringstream& args, TurnConfig& turn)
+  {
+    std::string relay, external;
+    if (!(args >> relay))
+      throw std::invalid_argument("expected 'turn-relay <address> [external-address]'");
+
+    turn.enabled         = true;
+    turn.relayAddress    = boost::asio::ip::make_address(relay);
+    turn.externalAddress = (args >> external) ? boost::asio::ip::make_address(external)
+                                              : turn.relayAddress;
+  }
+
+  void parseTurnPacing(std::istringstream& args, TurnConfig& turn)
+  {
+    std::string rate, option;
+    if (!(args >> rate))
+      throw std::invalid_argument("expected 'turn-pacing <kbit/s> [horizon=<ms>]'");
+
+    turn.pacingRate = std::stoull(rate) * 1000 / 8;
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "horizon")
+        turn.pacingHorizon = static_cast<uint32_t>(std::stoul(kv.second));
+      else
+        throw std::invalid_argument("unknown turn-pacing option '" + kv.first + "'");
+    }
+  }
+
+  void parseUsageLog(std::istringstream& args, UsageConfig& usage)
+  {
+    std::string option;
+    if (!(args >> usage.path))
+      throw std::invalid_argument("expected 'usage-log <path> [rotate=<MB>]'");
+
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "rotate")
+        usage.rotateBytes = std::stoull(kv.second) << 20;
+      else
+        throw std::invalid_argument("unknown usage-log option '" + kv.first + "'");
+    }
+  }
+
+  void parseClusterPeer(std::istringstream& args, ClusterConfig& cluster)
+  {
+    std::string gossip, option;
+    if (!(args >> gossip))
+      throw std::invalid_argument("expected 'cluster-peer <address>:<port> alternate=<address>:<port>'");
+
+    ClusterPeerConfig peer;
+    peer.gossip = parseEndpoint(gossip);
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "alternate")
+        peer.alternate = parseEndpoint(kv.second);
+      else
+        throw std::invalid_argument("unknown cluster-peer option '" + kv.first + "'");
+    }
+
+    if (peer.alternate.port() == 0)
+      throw std::invalid_argument("cluster-peer requires alternate=<address>:<port>");
+    cluster.peers.push_back(peer);
+  }
+
+  void parseClusterCapacity(std::istringstream& args, ClusterConfig& cluster)
+  {
+    std::string option;
+    while (args >> option)
+    {
+      const auto kv = parseOption(option);
+      if (kv.first == "allocations")
+        cluster.capacityAllocations = std::stoull(kv.second);
+      else if (kv.first == "rps")
+        cluster.capacityRps = std::stoull(kv.second);
+      else
+        throw std::invalid_argument("unknown cluster-capacity option '" + kv.first + "'");
+    }
+  }
+
+  // Adds the four UDP listeners, after the ones already configured
+  void parseDiscovery(std::istringstream& args, ServerConfig& config)
+  {
+    std::string primary, alternate;
+    if (!(args >> primary >> alternate))
+      throw std::invalid_argument("expected 'nat-discovery <address>:<port> <address>:<port>'");
+
+    auto& discovery     = config.discovery;
+    discovery.primary   = parseEndpoint(primary);
+    discovery.alternate = parseEndpoint(alternate);
+    if (discovery.primary.address() == discovery.alternate.address()
+        || discovery.primary.port() == discovery.alternate.port()
+        || discovery.primary.protocol() != discovery.alternate.protocol())
+      throw std::invalid_argument("nat-discovery addresses and ports must differ, in the same family");
+    if (discovery.primary.address().is_unspecified() || discovery.alternate.address().is_unspecified())
+      throw std::invalid_argument("nat-discovery needs the addresses clients reach");
+
+    for (unsigned slot = 0; slot < 4; ++slot)
+    {
+      ListenerConfig listener;
+      listener.address = discovery.endpoint(slot).address();
+      listener.port    = discovery.endpoint(slot).port();
+      config.listeners.push_back(listener);
+    }
+  }
+
+  ListenerConfig parseListener(std::istringstream& args)
+  {
+    std::string transport, hostPort;
+    if (!(args >> transport >> hostPort))
+      throw std::invalid_argument("expected 'listen <udp|tcp|tls|dtls> <address>:<port> [options]'");
+
+    ListenerConfig listener;
+    listener.transport = parseTransport(transport);
+    parseHostPort(hostPort, listener);
+
+    std::string option;
+    while (args >> option)
+    {
+      const auto kv     = parseOption(option);
+      const auto& key   = kv.first;
+      const auto& value = kv.second;
+      if (key == "cert")
+        listener.certFile = value;
+      else if (key == "key")
+        listener.keyFile = value;
+      else if (key == "sessions")
+        listener.sessionCache = std::stoul(value);
+      else if (key == "proxy")
+      {
+        if (value != "v2")
+          throw std::invalid_argument("only PROXY protocol v2 is supported");
+        listener.proxyProtocol = true;
+      }
+      else if (key == "proxy-trusted")
+        listener.proxyTrusted = AddressAcl::parse(value);
+      else if (key == "tenant")
+        listener.tenantRealm = value;
+      else
+        throw std::invalid_argument("unknown listener option '" + key + "'");
+    }
+
+    if (listener.transport == Transport::Tls && (listener.certFile.empty() || listener.keyFile.empty()))
+      throw std::invalid_argument("tls listener requires cert= and key=");
+    if (listener.transport == Transport::Dtls && (listener.certFile.empty() || listener.keyFile.empty()))
+      throw std::invalid_argument("dtls listener requires cert= and key=");
+    if (listener.proxyProtocol && listener.proxyTrusted.empty())
+      throw std::invalid_argument("proxy=v2 requires proxy-trusted=<cidr,...>");
+
+    return listener;
+  }
+}
+
+const char* transport2str(Transport transport)
+{
+  switch (transport)
+  {
+    case Transport::Udp:
+      return "udp";
+    case Transport::Tcp:
+      return "tcp";
+    case Transport::Tls:
+      return "tls";
+    case Transport::Dtls:
+      return "dtls";
+  }
+  return "?";
+}
+
+ServerConfig ServerConfig::defaults(uint16_t port)
+{
+  ServerConfig config;
+
+  ListenerConfig listener;
+  listener.address = boost::asio::ip::address_v4::any();
+  listener.port    = port;
+  config.listeners.push_back(listener);
+
+  return config;
+}
+
+boost::asio::ip::udp::endpoint DiscoveryConfig::endpoint(unsigned slot) const
+{
+  return {(slot & 2) ? alternate.address() : primary.address(), (slot & 1) ? alternate.port() : primary.port()};
+}
+
+bool ServerConfig::authEnabled() const
+{
+  if (!auth.tokenKeys.empty())
+    return true;
+  return std::any_of(tenants.begin(), tenants.end(),
+      [](const TenantConfig& tenant) { return !tenant.users.empty() || !tenant.authSocket.empty(); });
+}
+
+ServerConfig ServerConfig::load(const std::string& path)
+{
+  std::ifstream file(path);
+  if (!file)
+    throw std::runtime_error("cannot open config file " + path);
+
+  ServerConfig config;
+  std::string line;
+  unsigned lineNo = 0;
+
+  while (std::getline(file, line))
+  {
+    ++lineNo;
+    line = line.substr(0, line.find('#'));
+
+    std::istringstream args(line);
+    std::string directive;
+    if (!(args >> directive))
+      continue;
+
+    try
+    {
+      if (directive == "workers")
+      {
+        std::string value;
+        args >> value;
+        config.workers = value == "auto" ? std::max(1u, std::thread::hardware_concurrency())
+                                         : static_cast<unsigned>(std::stoul(value));
+        if (config.workers == 0)
+          throw std::invalid_argument("workers must be at least 1");
+      }
+      else if (directive == "listen")
+        config.listeners.push_back(parseListener(args));
+      else if (directive == "response-cache")
+      {
+        std::string value;
+        args >> value;
+        config.responseCacheEntries = std::stoul(value);
+      }
+      else if (directive == "realm")
+      {
+        if (!(args >> config.tenants[DEFAULT_TENANT].realm))
+          throw std::invalid_argument("expected 'realm <name>'");
+      }
+      else if (directive == "tenant")
+        parseTenant(args, config.tenants);
+      else if (directive == "user")
+      {
+        std::string username, password, option;
+        if (!(args >> username >> password))
+          throw std::invalid_argument("expected 'user <name> <password> [realm=<realm>]'");
+        TenantId tenant = DEFAULT_TENANT;
+        if (args >> option)
+        {
+          const auto kv = parseOption(option);
+          if (kv.first != "realm")
+            throw std::invalid_argument("unknown user option '" + kv.first + "'");
+          tenant = findTenant(config.tenants, kv.second);
+        }
+        config.tenants[tenant].users.emplace_back(username, password);
+      }
+      else if (directive == "oauth-key")
+      {
+        std::string kid, key;
+        if (!(args >> kid >> key))
+          throw std::invalid_argument("expected 'oauth-key <kid> <base64 key>'");
+        key = decodeBase64(key);
+        if (key.size() != 16 && key.size() != 32)
+          throw std::invalid_argument("oauth-key must be a 128 or 256 bit key");
+        config.auth.tokenKeys.emplace_back(kid, key);
+      }
+      else if (directive == "oauth-server")
+      {
+        if (!(args >> config.auth.tokenServer))
+          throw std::invalid_argument("expected 'oauth-server <name>'");
+      }
+      else if (directive == "token-cache")
+      {
+        std::string value;
+        args >> value;
+        config.auth.tokenCacheEntries = std::stoul(value);
+      }
+      else if (directive == "external-auth-cache")
+        parseExternalAuthCache(args, config.auth);
+      else if (directive == "crypto-workers")
+      {
+        std::string value;
+        args >> value;
+        config.cryptoWorkers = static_cast<unsigned>(std::stoul(value));
+      }
+      else if (directive == "log-level")
+      {
+        if (!(args >> config.logLevel))
+          throw std::invalid_argument("expected 'log-level <level>'");
+        if (config.logLevel != "off" && spdlog::level::from_str(config.logLevel) == spdlog::level::off)
+          throw std::invalid_argument("unknown log level '" + config.logLevel + "'");
+      }
+      else if (directive == "control")
+      {
+        if (!(args >> config.controlSocket))
+          throw std::invalid_argument("expected 'control <path>'");
+      }
+      else if (directive == "profile")
+      {
+        std::string value;
+        args >> value;
+        config.profileHz = static_cast<unsigned>(std::stoul(value));
+        if (config.profileHz == 0 || config.profileHz > 1000)
+          throw std::invalid_argument("expected 'profile <1-1000 Hz>'");
+      }
+      else if (directive == "capture")
+        parseCapture(args, config.capture);
+      else if (directive == "trace")
+        parseTrace(args, config.trace);
+      else if (directive == "turn-relay")
+        parseTurnRelay(args, config.turn);
+      else if (directive == "turn-allow-anonymous")
+        config.turn.allowAnonymous = true;
+      else if (directive == "turn-allowed-peers")
+      {
+        std::string list;
+        if (!(args >> list))
+          throw std::invalid_argument("expected 'turn-allowed-peers <cidr,...>'");
+        config.turn.allowedPeers = AddressAcl::parse(list);
+      }
+      else if (directive == "turn-max-permissions")
+      {
+        if (!(args >> config.turn.maxPermissions) || config.turn.maxPermissions == 0)
+          throw std::invalid_argument("expected 'turn-max-permissions <count>'");
+      }
+      else if (directive == "turn-pacing")
+        parseTurnPacing(args, config.turn);
+      else if (directive == "usage-log")
+        parseUsageLog(args, config.usage);
+      else if (directive == "cluster-listen")
+      {
+        std::string value;
+        args >> value;
+        config.cluster.listen = parseEndpoint(value);
+      }
+      else if (directive == "cluster-key")
+      {
+        std::string key;
+        if (!(args >> key))
+          throw std::invalid_argument("expected 'cluster-key <base64 key>'");
+        config.cluster.key = decodeBase64(key);
+        if (config.cluster.key.size() < 16)
+          throw std::invalid_argument("cluster-key must be at least 128 bits");
+      }
+      else if (directive == "cluster-peer")
+        parseClusterPeer(args, config.cluster);
+      else if (directive == "cluster-shed")
+      {
+        std::string flag;
+        if (!(args >> config.cluster.shedAbove))
+          throw std::invalid_argument("expected 'cluster-shed <load> [binding]'");
+        config.cluster.shedBinding = (args >> flag) && flag == "binding";
+      }
+      else if (directive == "cluster-capacity")
+        parseClusterCapacity(args, config.cluster);
+      else if (directive == "nat-discovery")
+        parseDiscovery(args, config);
+      else
+        throw std::invalid_argument("unknown directive '" + directive + "'");
+    }
+    catch (const std::exception& e)
+    {
+      fail(path, lineNo, e.what());
+    }
+  }
+
+  if (config.listeners.empty())
+    throw std::runtime_error(path + ": no listener configured");
+
+  // Resolved last, the default realm may be set after the listeners
+  for (auto& listener : config.listeners)
+  {
+    if (listener.tenantRealm.empty())
+      continue;
+    try
+    {
+      listener.tenant = findTenant(config.tenants, listener.tenantRealm);
+    }
+    catch (const std::exception& e)
+    {
+      throw std::runtime_error(path + ": " + e.what());
+    }
+  }
+
+  // An open relay reaches whatever the relay host reaches
+  if (config.turn.enabled && !config.authEnabled() && !config.turn.allowAnonymous)
+    throw std::runtime_error(path + ": turn-relay requires credentials or turn-allow-anonymous");
+
+  if (config.cluster.enabled() && config.cluster.listen.port() == 0)
+    throw std::runtime_error(path + ": cluster-peer requires cluster-listen");
+  if (config.cluster.enabled() && config.cluster.key.empty())
+    throw std::runtime_error(path + ": cluster-peer requires cluster-key");
+
+  return config;
+}
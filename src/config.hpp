@@ -0,0 +1,197 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include "addressAcl.hpp"
+
+enum class Transport
+{
+  Udp,
+  Tcp,
+  Tls,
+  Dtls // RFC 7350
+};
+
+const char* transport2str(Transport transport);
+
+// Index of a tenant (realm) in ServerConfig::tenants, 0 is the default one
+using TenantId = uint16_t;
+constexpr TenantId DEFAULT_TENANT = 0;
+constexpr TenantId INVALID_TENANT = 0xFFFF;
+
+struct ListenerConfig
+{
+  Transport transport = Transport::Udp;
+  boost::asio::ip::address address;
+  uint16_t port = 3478;
+  std::string certFile; // TLS and DTLS only
+  std::string keyFile; // TLS and DTLS only
+  std::size_t sessionCache = 20480; // DTLS sessions kept for resumption
+  bool proxyProtocol = false; // expect PROXY v2 headers from trusted sources
+  AddressAcl proxyTrusted;
+  std::string tenantRealm; // tenant challenging the requests without REALM
+  TenantId tenant = DEFAULT_TENANT;
+};
+
+struct TurnConfig
+{
+  bool enabled = false;
+  boost::asio::ip::address relayAddress; // where relay sockets are bound
+  boost::asio::ip::address externalAddress; // advertised in XOR-RELAYED-ADDRESS
+  uint32_t defaultLifetime = 600; // seconds
+  uint32_t maxLifetime     = 3600;
+  uint64_t pacingRate      = 0; // bytes per second per allocation towards peers, 0 disables
+  uint32_t pacingHorizon   = 100; // ms of backlog before packets are dropped
+  // Relaying without credentials has to be asked for explicitly
+  bool allowAnonymous = false;
+  // Loopback, unspecified, link-local, private, multicast and reserved peers
+  // are refused (403) unless listed here
+  AddressAcl allowedPeers;
+  uint32_t maxPermissions = 64; // peers per allocation, 508 beyond
+  // No relay sockets: relayed addresses are made up and data towards peers
+  // is only accounted. Set by the simulation harness, never from the file.
+  bool virtualRelays = false;
+};
+
+struct UsageConfig
+{
+  std::string path; // empty disables usage records
+  uint64_t rotateBytes = 64ull << 20;
+};
+
+struct ClusterPeerConfig
+{
+  boost::asio::ip::udp::endpoint gossip; // heartbeat endpoint
+  boost::asio::ip::udp::endpoint alternate; // STUN/TURN endpoint sent in ALTERNATE-SERVER
+};
+
+struct ClusterConfig
+{
+  boost::asio::ip::udp::endpoint listen;
+  std::vector<ClusterPeerConfig> peers;
+  std::string key; // HMAC-SHA256 key shared by every node, signs the heartbeats
+  double shedAbove     = 0.8; // load from which new clients are redirected
+  bool shedBinding     = false; // redirect Binding requests too, not only Allocate
+  uint64_t capacityAllocations = 0; // 0 leaves the metric out of the load
+  uint64_t capacityRps         = 0;
+
+  bool enabled() const { return !peers.empty(); }
+};
+
+// A realm with its own credentials, limits and relay ports
+struct TenantConfig
+{
+  std::string realm = "ustun";
+  std::vector<std::pair<std::string, std::string>> users; // username, password
+  uint16_t relayPortMin = 0; // 0 lets the kernel pick relay ports
+  uint16_t relayPortMax = 0;
+  uint64_t maxAllocations = 0; // 0 is unlimited
+  double requestRate      = 0; // requests per second, 0 is unlimited
+  double requestBurst     = 0; // defaults to one second worth of requests
+  std::string authSocket; // external credential service, for users not listed here
+};
+
+struct AuthConfig
+{
+  std::vector<std::pair<std::string, std::string>> tokenKeys; // kid, AES-GCM key (RFC 7635)
+  std::string tokenServer; // AEAD associated data, advertised in THIRD-PARTY-AUTHORIZATION
+  std::size_t tokenCacheEntries = 1024; // decrypted access tokens per worker, 0 disables
+  std::size_t externalCacheEntries = 4096; // external lookups per worker
+  uint32_t externalTtl             = 300; // seconds a key found externally is reused
+  uint32_t externalNegativeTtl     = 30; // seconds an unknown user is remembered
+  std::size_t externalMaxPending   = 1024; // requests waiting on one service per worker
+};
+
+struct TraceConfig
+{
+  unsigned sampleEvery = 0; // one request in sampleEvery is traced, 0 disables
+  std::size_t spans    = 65536; // kept per worker
+};
+
+struct CaptureConfig
+{
+  std::string path; // empty disables capture, one file per worker
+  std::size_t bytes    = 64ull << 20; // ring size per worker
+  unsigned sampleEvery = 0; // one datagram in sampleEvery, 0 disables sampling
+  AddressAcl prefixes; // client addresses always captured
+  std::vector<std::array<uint8_t, 12>> transactions; // transaction IDs always captured
+  bool errors = false; // error responses, with their request when answered inline
+};
+
+// RFC 5780 NAT behaviour discovery: UDP listeners on the four combinations
+// of two addresses and two ports, Binding responses carry OTHER-ADDRESS and
+// RESPONSE-ORIGIN and CHANGE-REQUEST is honoured by answering from another one
+struct DiscoveryConfig
+{
+  boost::asio::ip::udp::endpoint primary;
+  boost::asio::ip::udp::endpoint alternate; // differs in address and port
+
+  bool enabled() const { return alternate.port() != 0; }
+  // 0 primary, 1 primary address alternate port, 2 alternate address
+  // primary port, 3 alternate: bit 1 is the address, bit 0 the port
+  boost::asio::ip::udp::endpoint endpoint(unsigned slot) const;
+};
+
+struct ServerConfig
+{
+  unsigned workers = 1;
+  std::vector<ListenerConfig> listeners;
+  TurnConfig turn;
+  ClusterConfig cluster;
+  std::size_t responseCacheEntries = 4096; // per worker, 0 disables
+  std::vector<TenantConfig> tenants {TenantConfig()};
+  AuthConfig auth;
+  unsigned cryptoWorkers = 0; // 0 checks credentials on the I/O workers
+  std::string controlSocket;
+  std::string logLevel = "info"; // spdlog level name
+  unsigned profileHz = 0; // samples per second of CPU time per worker, 0 disables
+  TraceConfig trace;
+  CaptureConfig capture;
+  UsageConfig usage;
+  DiscoveryConfig discovery;
+
+  bool authEnabled() const;
+
+  // Single UDP listener on all IPv4 interfaces, the historical behaviour
+  static ServerConfig defaults(uint16_t port);
+
+  // Line based format, one directive per line, '#' starts a comment:
+  //   workers 4
+  //   log-level debug
+  //   listen udp 0.0.0.0:3478
+  //   listen tcp [::]:3478
+  //   listen tls 0.0.0.0:5349 cert=/etc/ustun/cert.pem key=/etc/ustun/key.pem
+  //   listen udp 0.0.0.0:3478 proxy=v2 proxy-trusted=10.0.0.0/8
+  //   turn-relay 0.0.0.0 203.0.113.1
+  //   turn-max-permissions 64
+  //   turn-pacing 4000 horizon=100
+  //   usage-log /var/log/ustun/usage.csv rotate=64
+  //   response-cache 4096
+  //   realm example.org
+  //   user alice secret
+  //   tenant acme.com ports=50000-50999 allocations=1000 rps=200 burst=400
+  //   user bob secret realm=acme.com
+  //   tenant partner.net auth=/run/partner-auth.sock
+  //   external-auth-cache 4096 ttl=300 negative-ttl=30 pending=1024
+  //   listen udp 0.0.0.0:3479 tenant=acme.com
+  //   oauth-key 2024-01 <base64 AES key>
+  //   oauth-server turn.example.org
+  //   token-cache 1024
+  //   crypto-workers 2
+  //   control /run/ustun.sock
+  //   profile 99
+  //   trace 1000 spans=65536
+  //   capture /var/tmp/ustun.pcapng size=64 sample=10000 prefix=192.0.2.0/24 errors
+  //   cluster-listen 0.0.0.0:7946
+  //   cluster-key MDEyMzQ1Njc4OWFiY2RlZjAxMjM0NTY3ODlhYmNkZWY=
+  //   cluster-peer 10.0.0.2:7946 alternate=203.0.113.2:3478
+  //   cluster-shed 0.8 binding
+  //   cluster-capacity allocations=100000 rps=500000
+  //   nat-discovery 192.0.2.1:3478 192.0.2.2:3479
+  static ServerConfig load(const std::string& path);
+};
@@ -0,0 +1,103 @@
+#include "controlServer.hpp"
+
+#include <cstdio>
+#include <memory>
+
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <spdlog/spdlog.h>
+
+using boost::asio::local::stream_protocol;
+
+ControlServer::ControlServer(boost::asio::io_context& io, const std::string& path)
+    : _path(path)
+    , _acceptor(io)
+{
+  std::remove(path.c_str());
+  _acceptor.open();
+  _acceptor.bind(stream_protocol::endpoint(path));
+  _acceptor.listen();
+
+  addCommand("help", [this](const std::string&) {
+    std::string out;
+    for (const auto& command : _commands)
+      out += command.first + "\n";
+    return out;
+  });
+
+  spdlog::info("Control socket on {}", path);
+  startAccept();
+}
+
+ControlServer::~ControlServer()
+{
+  stop();
+}
+
+void ControlServer::addCommand(const std::string& name, Handler handler)
+{
+  _commands[name] = std::move(handler);
+}
+
+void ControlServer::stop()
+{
+  if (!_acceptor.is_open())
+    return;
+
+  boost::system::error_code ec;
+  _acceptor.close(ec);
+  std::remove(_path.c_str());
+}
+
+std::string ControlServer::dispatch(const std::string& line) const
+{
+  const auto space = line.find(' ');
+  const auto name  = line.substr(0, space);
+  const auto args  = space == std::string::npos ? std::string() : line.substr(space + 1);
+
+  const auto it = _commands.find(name);
+  if (it == _commands.end())
+    return "unknown command '" + name + "', try help\n";
+
+  try
+  {
+    return it->second(args);
+  }
+  catch (const std::exception& e)
+  {
+    return std::string("error: ") + e.what() + "\n";
+  }
+}
+
+void ControlServer::startAccept()
+{
+  _acceptor.async_accept([this](boost::system::error_code ec, stream_protocol::socket socket) {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    if (!ec)
+    {
+      auto client = std::make_shared<stream_protocol::socket>(std::move(socket));
+      auto input  = std::make_shared<boost::asio::streambuf>(4096);
+
+      boost::asio::async_read_until(*client, *input, '\n',
+          [this, client, input](boost::system::error_code ec, std::size_t) {
+            if (ec && ec != boost::asio::error::eof)
+              return;
+
+            std::string line;
+            std::istream stream(input.get());
+            std::getline(stream, line);
+            if (!line.empty() && line.back() == '\r')
+              line.pop_back();
+
+            auto reply = std::make_shared<std::string>(dispatch(line));
+            boost::asio::async_write(*client, boost::asio::buffer(*reply),
+                [client, reply](boost::system::error_code, std::size_t) {});
+          });
+    }
+
+    startAccept();
+  });
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+// Local administration socket. A client writes one command line and reads
+// the reply until the server closes the connection:
+//   echo stats | socat - UNIX-CONNECT:/run/ustun.sock
+class ControlServer {
+  public:
+    using Handler = std::function<std::string(const std::string& args)>;
+
+    ControlServer(boost::asio::io_context& io, const std::string& path);
+    ~ControlServer();
+
+    // Handlers run on the thread of io
+    void addCommand(const std::string& name, Handler handler);
+    void stop();
+
+  private:
+    void startAccept();
+    std::string dispatch(const std::string& line) const;
+
+  private:
+    std::string _path;
+    boost::asio::local::stream_protocol::acceptor _acceptor;
+    std::map<std::string, Handler> _commands;
+};
@@ -0,0 +1,184 @@
+#include "cryptoPool.hpp"
+#include "stunMessage.hpp"
+#include "worker.hpp"
+
+#include <cstring>
+
+#include <boost/asio/post.hpp>
+#include <spdlog/spdlog.h>
+
+constexpr std::size_t CryptoPool::JOBS_PER_WORKER;
+
+namespace
+{
+  std::size_t nextPow2(std::size_t n)
+  {
+    std::size_t p = 2;
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+  uint64_t elapsedNs(CryptoJob::Clock::time_point from, CryptoJob::Clock::time_point to)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+  }
+}
+
+CryptoPool::WorkerSlot::WorkerSlot(Worker& worker)
+    : worker(worker)
+    , jobs(JOBS_PER_WORKER)
+    , done(nextPow2(JOBS_PER_WORKER))
+{
+  free.reserve(jobs.size());
+  for (auto& job : jobs)
+    free.push_back(&job);
+}
+
+CryptoPool::CryptoPool(unsigned threads, const std::vector<Worker*>& workers,
+    const LongTermAuth& auth, Stats& stats, Completion completion)
+    : _threadCount(threads)
+    , _auth(auth)
+    , _stats(stats)
+    , _completion(std::move(completion))
+    , _requests(nextPow2(JOBS_PER_WORKER * workers.size()))
+{
+  for (auto* worker : workers)
+    _slots.emplace_back(new WorkerSlot(*worker));
+}
+
+CryptoPool::~CryptoPool()
+{
+  stop();
+}
+
+void CryptoPool::start()
+{
+  for (unsigned i = 0; i < _threadCount; ++i)
+    _threads.emplace_back([this, i] { run(i); });
+  spdlog::info("Crypto pipeline with {} thread(s)", _threadCount);
+}
+
+void CryptoPool::stop()
+{
+  _stopping = true;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wakeup.notify_all();
+  }
+  for (auto& thread : _threads)
+    thread.join();
+  _threads.clear();
+}
+
+std::size_t CryptoPool::completionQueueDepth() const
+{
+  std::size_t depth = 0;
+  for (const auto& slot : _slots)
+    depth += slot->done.size();
+  return depth;
+}
+
+bool CryptoPool::submit(
+    const RequestContext& ctx, const StunMessage& msg, const AccessToken& token, const AuthKey* userKey)
+{
+  auto& slot = *_slots[ctx.worker.index()];
+  if (slot.free.empty() || msg.size() > sizeof(CryptoJob::data))
+  {
+    statsInc(_stats.cryptoInline);
+    return false;
+  }
+
+  CryptoJob* job = slot.free.back();
+  slot.free.pop_back();
+
+  job->worker    = ctx.worker.index();
+  job->transport = ctx.transport;
+  job->remote    = ctx.remote;
+  job->peer      = ctx.peer;
+  job->sender    = ctx.sender->retain();
+  job->tenant    = ctx.tenant;
+  job->charged   = ctx.charged;
+  job->trace     = ctx.trace;
+  job->token     = token;
+  job->external  = userKey != nullptr;
+  job->size      = msg.size();
+  std::memcpy(job->data.data(), msg.data(), msg.size());
+  job->queued = CryptoJob::Clock::now();
+  if (userKey)
+    job->key = *userKey;
+
+  // Sized so that every job fits, cannot fail
+  _requests.push(job);
+  statsInc(_stats.cryptoJobs);
+
+  // Pairs with the fence in run(): either the sleeper sees this job, or this
+  // thread sees the sleeper and notifies under the mutex it holds until waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_sleepers.load(std::memory_order_relaxed) > 0)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wakeup.notify_one();
+  }
+  return true;
+}
+
+void CryptoPool::run(unsigned thread)
+{
+  CryptoJob* job;
+  while (!_stopping.load(std::memory_order_relaxed))
+  {
+    if (_requests.pop(job))
+    {
+      process(*job, thread);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    ++_sleepers;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    _wakeup.wait(lock, [this] { return _stopping.load() || _requests.size() > 0; });
+    --_sleepers;
+  }
+}
+
+void CryptoPool::process(CryptoJob& job, unsigned thread)
+{
+  job.started = CryptoJob::Clock::now();
+  job.thread  = thread;
+
+  StunMessage msg;
+  if (msg.parse(job.data.data(), job.size))
+    job.result = job.external ? _auth.verifyKey(msg, job.tenant, &job.key)
+                              : _auth.verify(msg, job.tenant, job.key, job.token);
+  else
+    job.result = AuthResult::BadRequest;
+
+  job.finished = CryptoJob::Clock::now();
+
+  auto& slot = *_slots[job.worker];
+  slot.done.push(&job);
+
+  // One wakeup per batch of results, not per result
+  if (!slot.drainPending.exchange(true))
+    boost::asio::post(slot.worker.io(), [this, &slot] { drain(slot); });
+}
+
+void CryptoPool::drain(WorkerSlot& slot)
+{
+  slot.drainPending = false;
+
+  CryptoJob* job;
+  while (slot.done.pop(job))
+  {
+    const auto now = CryptoJob::Clock::now();
+    statsInc(_stats.cryptoQueueWaitNs, elapsedNs(job->queued, job->started));
+    statsInc(_stats.cryptoProcessNs, elapsedNs(job->started, job->finished));
+    statsInc(_stats.cryptoReturnNs, elapsedNs(job->finished, now));
+
+    _completion(slot.worker, *job);
+
+    job->sender.reset();
+    slot.free.push_back(job);
+  }
+}
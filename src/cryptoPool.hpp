@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "auth.hpp"
+#include "listener.hpp"
+#include "mpmcQueue.hpp"
+#include "stats.hpp"
+
+class StunMessage;
+
+// An authenticated request travelling through the pipeline. Jobs are owned
+// by the I/O worker that received the request and always come back to it.
+struct CryptoJob
+{
+  using Clock = std::chrono::steady_clock;
+
+  unsigned worker;
+  Transport transport;
+  boost::asio::ip::udp::endpoint remote;
+  boost::asio::ip::udp::endpoint peer;
+  std::shared_ptr<ClientSender> sender; // kept alive until the response is sent
+  TenantId tenant;
+  TenantId charged;
+  uint64_t trace; // Tracer request id
+  std::size_t size;
+  std::array<uint8_t, 2048> data;
+
+  AuthResult result;
+  AuthKey key; // input as well when external
+  bool external; // key was found by ExternalAuth
+  AccessToken token; // cached by the worker, or decrypted by the crypto stage
+
+  Clock::time_point queued;
+  Clock::time_point started;
+  Clock::time_point finished;
+  unsigned thread; // crypto thread that processed it
+};
+
+// Second pipeline stage: I/O workers hand requests needing an HMAC check to
+// a pool of crypto threads, the verdict is queued back to the owning worker
+// which finishes the request and sends the response. Binding requests never
+// wait behind credential checks this way.
+class CryptoPool {
+  public:
+    using Completion = std::function<void(Worker&, CryptoJob&)>;
+
+    static constexpr std::size_t JOBS_PER_WORKER = 256;
+
+    CryptoPool(unsigned threads, const std::vector<Worker*>& workers, const LongTermAuth& auth,
+        Stats& stats, Completion completion);
+    ~CryptoPool();
+
+    void start();
+    void stop();
+
+    // Called on the I/O worker, false when its jobs are exhausted. userKey
+    // is the key of a user known to an external service.
+    bool submit(const RequestContext& ctx, const StunMessage& msg, const AccessToken& token,
+        const AuthKey* userKey = nullptr);
+
+    std::size_t requestQueueDepth() const { return _requests.size(); }
+    std::size_t completionQueueDepth() const;
+
+  private:
+    struct WorkerSlot
+    {
+      explicit WorkerSlot(Worker& worker);
+
+      Worker& worker;
+      std::vector<CryptoJob> jobs;
+      std::vector<CryptoJob*> free; // owner thread only
+      MpmcQueue<CryptoJob*> done;
+      std::atomic<bool> drainPending {false};
+    };
+
+    void run(unsigned thread);
+    void process(CryptoJob& job, unsigned thread);
+    void drain(WorkerSlot& slot);
+
+  private:
+    unsigned _threadCount;
+    const LongTermAuth& _auth;
+    Stats& _stats;
+    Completion _completion;
+    std::vector<std::unique_ptr<WorkerSlot>> _slots;
+    MpmcQueue<CryptoJob*> _requests;
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _stopping {false};
+    std::atomic<unsigned> _sleepers {0};
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+};
@@ -0,0 +1,556 @@
+#include "dtlsListener.hpp"
+#include "memoryAccounting.hpp"
+#include "stunServer.hpp"
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+namespace
+{
+  constexpr unsigned COOKIE_PERIOD       = 60; // seconds, a cookie is good for one to two periods
+  constexpr long SESSION_LIFETIME        = 3600; // seconds in the session cache
+  constexpr long DTLS_MTU                = 1200; // record layer, fits tunnels and IPv6 minimum links
+  constexpr long DATAGRAM_OVERHEAD       = 48; // IPv6 and UDP headers
+  constexpr std::size_t FREE_CONNECTIONS = 4096; // per worker, beyond that they are freed
+  constexpr auto HANDSHAKE_TIMEOUT       = std::chrono::seconds(10);
+  // As long as the default allocation lifetime, refreshes keep TURN clients
+  constexpr auto IDLE_TIMEOUT = std::chrono::minutes(10);
+  constexpr auto SWEEP_PERIOD = std::chrono::seconds(1);
+
+  const unsigned char SESSION_CONTEXT[] = "ustun-dtls";
+
+  // Record header, then handshake type 1 in the clear: only epoch 0 carries it
+  bool isClientHello(const uint8_t* data, std::size_t bytes)
+  {
+    return bytes > 25 && data[0] == 22 && data[3] == 0 && data[4] == 0 && data[13] == 1;
+  }
+
+  uint64_t nowSeconds()
+  {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+}
+
+// One client, or the spare one unknown sources go through. The SSL object
+// reads and writes datagrams through a BIO of its own, fed one received
+// datagram at a time and writing straight to the listener socket.
+class DtlsConnection : public ClientSender, public std::enable_shared_from_this<DtlsConnection> {
+  public:
+    using Clock = DtlsListener::Clock;
+
+    explicit DtlsConnection(DtlsListener& listener)
+        : _listener(listener)
+        , _ssl(SSL_new(listener._context.get()))
+    {
+      if (!_ssl)
+        throw std::runtime_error("cannot create DTLS session");
+
+      BIO* bio = BIO_new(bioMethod());
+      BIO_set_data(bio, this);
+      BIO_set_init(bio, 1);
+      SSL_set_bio(_ssl, bio, bio);
+      SSL_set_app_data(_ssl, this);
+      // No socket to ask, the BIO only knows datagrams
+      SSL_set_options(_ssl, SSL_OP_NO_QUERY_MTU);
+      SSL_set_mtu(_ssl, DTLS_MTU);
+      MemoryAccounting::add(MemoryTag::Buffers, sizeof(*this));
+    }
+
+    ~DtlsConnection() override
+    {
+      SSL_free(_ssl);
+      MemoryAccounting::sub(MemoryTag::Buffers, sizeof(*this));
+    }
+
+    DtlsConnection(const DtlsConnection&) = delete;
+    DtlsConnection& operator=(const DtlsConnection&) = delete;
+
+    const udp::endpoint& peer() const { return _peer; }
+    bool established() const { return _established; }
+    StunServer& server() { return _listener._server; }
+
+    // 1 once the datagram is a ClientHello with a valid cookie, the SSL
+    // object then carries on with the handshake; nothing is kept otherwise
+    int listen(const udp::endpoint& peer, const uint8_t* data, std::size_t bytes, BIO_ADDR* address)
+    {
+      _peer        = peer;
+      _established = false;
+      _closed      = false;
+      setInput(data, bytes);
+      const int verified = DTLSv1_listen(_ssl, address);
+      _input             = nullptr;
+      if (verified <= 0)
+        ERR_clear_error();
+      return verified;
+    }
+
+    // False once the connection is to be closed
+    bool start(Clock::time_point now)
+    {
+      _started = _lastActive = now;
+      return handshake();
+    }
+
+    bool receive(const uint8_t* data, std::size_t bytes, Clock::time_point now)
+    {
+      _lastActive = now;
+      setInput(data, bytes);
+      if (!_established && !handshake())
+        return false;
+      return _established ? readRecords() : true;
+    }
+
+    // Handshake retransmissions and timeouts
+    bool expire(Clock::time_point now)
+    {
+      if (_established)
+        return now - _lastActive < IDLE_TIMEOUT;
+      if (now - _started >= HANDSHAKE_TIMEOUT || DTLSv1_handle_timeout(_ssl) < 0)
+      {
+        statsInc(server().stats().dtlsHandshakeErrors);
+        ERR_clear_error();
+        return false;
+      }
+      return true;
+    }
+
+    // Whatever this connection owns (TURN allocations) goes with it
+    void close()
+    {
+      _closed = true;
+      server().clientClosed(_listener._worker, this);
+    }
+
+    // Back to the version flexible method of the context, which starts the
+    // DTLS state over and forgets the MTU
+    void recycle()
+    {
+      SSL_clear(_ssl);
+      SSL_set_mtu(_ssl, DTLS_MTU);
+    }
+
+    void sendToClient(const uint8_t* data, std::size_t bytes, const udp::endpoint&) override
+    {
+      // One record per message, as RFC 7350 section 4.1 expects
+      if (_closed || !_established)
+        return;
+      if (SSL_write(_ssl, data, static_cast<int>(bytes)) <= 0)
+      {
+        statsInc(server().stats().sendErrors);
+        ERR_clear_error();
+      }
+      else
+        statsInc(server().stats().responsesSent);
+    }
+
+    std::shared_ptr<ClientSender> retain() override { return shared_from_this(); }
+    bool alive() const override { return !_closed; }
+
+    static BIO_METHOD* bioMethod()
+    {
+      static BIO_METHOD* method = [] {
+        BIO_METHOD* m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "ustun datagram");
+        BIO_meth_set_write(m, &DtlsConnection::bioWrite);
+        BIO_meth_set_read(m, &DtlsConnection::bioRead);
+        BIO_meth_set_ctrl(m, &DtlsConnection::bioCtrl);
+        return m;
+      }();
+      return method;
+    }
+
+  private:
+    void setInput(const uint8_t* data, std::size_t bytes)
+    {
+      _input     = data;
+      _inputSize = bytes;
+    }
+
+    bool handshake()
+    {
+      const int result = SSL_do_handshake(_ssl);
+      if (result <= 0)
+      {
+        _input = nullptr;
+        if (SSL_get_error(_ssl, result) == SSL_ERROR_WANT_READ)
+          return true;
+        statsInc(server().stats().dtlsHandshakeErrors);
+        spdlog::debug("DTLS handshake with {} failed: {}", StunServer::endpoint2str(_peer),
+            ERR_reason_error_string(ERR_peek_last_error()) ? ERR_reason_error_string(ERR_peek_last_error())
+                                                           : "unknown error");
+        ERR_clear_error();
+        return false;
+      }
+
+      _established = true;
+      statsInc(server().stats().dtlsHandshakes);
+      if (SSL_session_reused(_ssl))
+        statsInc(server().stats().dtlsResumed);
+      return true;
+    }
+
+    // Each record holds a STUN message or ChannelData, several of them may
+    // share a datagram
+    bool readRecords()
+    {
+      auto& response = _listener._response;
+      for (;;)
+      {
+        const int bytes = SSL_read(_ssl, _plain.data(), static_cast<int>(_plain.size()));
+        if (bytes <= 0)
+        {
+          _input          = nullptr;
+          const int error = SSL_get_error(_ssl, bytes);
+          if (error == SSL_ERROR_WANT_READ)
+            return true;
+          // close_notify gets one back
+          if (error == SSL_ERROR_ZERO_RETURN)
+            SSL_shutdown(_ssl);
+          ERR_clear_error();
+          return false;
+        }
+
+        RequestContext ctx {_listener._worker, Transport::Dtls, _peer, _peer, this, _listener._config.tenant};
+        if (!server().handleMessage(ctx, _plain.data(), static_cast<std::size_t>(bytes), response))
+          continue;
+
+        TraceScope trace(server().tracer(), ctx, TraceStage::Send);
+        sendToClient(response.data(), response.size(), _peer);
+        trace.finish();
+      }
+    }
+
+    static int bioWrite(BIO* bio, const char* data, int length)
+    {
+      BIO_clear_retry_flags(bio);
+      auto* connection = static_cast<DtlsConnection*>(BIO_get_data(bio));
+      connection->_listener.send(reinterpret_cast<const uint8_t*>(data), static_cast<std::size_t>(length),
+          connection->_peer);
+      return length;
+    }
+
+    // The datagram being processed, then nothing until the next one
+    static int bioRead(BIO* bio, char* out, int size)
+    {
+      BIO_clear_retry_flags(bio);
+      auto* connection = static_cast<DtlsConnection*>(BIO_get_data(bio));
+      if (!connection->_input)
+      {
+        BIO_set_retry_read(bio);
+        return -1;
+      }
+      const auto bytes = std::min(static_cast<std::size_t>(size), connection->_inputSize);
+      std::memcpy(out, connection->_input, bytes);
+      connection->_input = nullptr;
+      return static_cast<int>(bytes);
+    }
+
+    static long bioCtrl(BIO*, int command, long, void*)
+    {
+      switch (command)
+      {
+        case BIO_CTRL_FLUSH:
+          return 1;
+        case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD:
+          return DATAGRAM_OVERHEAD;
+        default:
+          return 0;
+      }
+    }
+
+  private:
+    DtlsListener& _listener;
+    SSL* _ssl;
+    udp::endpoint _peer;
+    const uint8_t* _input  = nullptr; // datagram not read by the SSL object yet
+    std::size_t _inputSize = 0;
+    bool _established      = false;
+    bool _closed           = false;
+    Clock::time_point _started;
+    Clock::time_point _lastActive;
+    std::array<uint8_t, 2048> _plain;
+};
+
+namespace
+{
+  DtlsContext& contextOf(SSL* ssl)
+  {
+    return *static_cast<DtlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  }
+
+  int generateCookie(SSL* ssl, unsigned char* cookie, unsigned int* length)
+  {
+    auto* connection = static_cast<DtlsConnection*>(SSL_get_app_data(ssl));
+    statsInc(connection->server().stats().dtlsCookieChallenges);
+    *length = contextOf(ssl).makeCookie(connection->peer(), cookie);
+    return 1;
+  }
+
+  int verifyCookie(SSL* ssl, const unsigned char* cookie, unsigned int length)
+  {
+    auto* connection = static_cast<DtlsConnection*>(SSL_get_app_data(ssl));
+    return contextOf(ssl).checkCookie(connection->peer(), cookie, length) ? 1 : 0;
+  }
+}
+
+DtlsContext::DtlsContext(const ListenerConfig& config)
+    : _ctx(SSL_CTX_new(DTLS_server_method()))
+{
+  if (!_ctx)
+    throw std::runtime_error("cannot create DTLS context");
+  if (SSL_CTX_use_certificate_chain_file(_ctx, config.certFile.c_str()) != 1
+      || SSL_CTX_use_PrivateKey_file(_ctx, config.keyFile.c_str(), SSL_FILETYPE_PEM) != 1
+      || RAND_bytes(_cookieSecret.data(), _cookieSecret.size()) != 1)
+  {
+    SSL_CTX_free(_ctx);
+    throw std::runtime_error("cannot load DTLS certificate " + config.certFile + " or key " + config.keyFile);
+  }
+
+  SSL_CTX_set_min_proto_version(_ctx, DTLS1_2_VERSION);
+  SSL_CTX_set_app_data(_ctx, this);
+  SSL_CTX_set_cookie_generate_cb(_ctx, generateCookie);
+  SSL_CTX_set_cookie_verify_cb(_ctx, verifyCookie);
+
+  // Resumption from the server cache rather than tickets: the cache is
+  // bounded and a restart invalidates every session
+  SSL_CTX_set_options(_ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(_ctx, static_cast<long>(config.sessionCache));
+  SSL_CTX_set_session_id_context(_ctx, SESSION_CONTEXT, sizeof(SESSION_CONTEXT) - 1);
+  SSL_CTX_set_timeout(_ctx, SESSION_LIFETIME);
+}
+
+DtlsContext::~DtlsContext()
+{
+  SSL_CTX_free(_ctx);
+}
+
+unsigned DtlsContext::makeCookie(const udp::endpoint& peer, uint8_t* out) const
+{
+  return cookie(peer, nowSeconds() / COOKIE_PERIOD, out);
+}
+
+bool DtlsContext::checkCookie(const udp::endpoint& peer, const uint8_t* cookie, unsigned length) const
+{
+  // This period or the previous one, the client answers within a round trip
+  const uint64_t epoch = nowSeconds() / COOKIE_PERIOD;
+  for (uint64_t e : {epoch, epoch - 1})
+  {
+    uint8_t expected[EVP_MAX_MD_SIZE];
+    if (this->cookie(peer, e, expected) == length && CRYPTO_memcmp(expected, cookie, length) == 0)
+      return true;
+  }
+  return false;
+}
+
+unsigned DtlsContext::cookie(const udp::endpoint& peer, uint64_t epoch, uint8_t* out) const
+{
+  uint8_t input[8 + 16 + 2];
+  std::size_t size = 0;
+  for (int i = 0; i < 8; ++i)
+    input[size++] = static_cast<uint8_t>(epoch >> (56 - 8 * i));
+  if (peer.address().is_v4())
+  {
+    const auto bytes = peer.address().to_v4().to_bytes();
+    std::memcpy(input + size, bytes.data(), bytes.size());
+    size += bytes.size();
+  }
+  else
+  {
+    const auto bytes = peer.address().to_v6().to_bytes();
+    std::memcpy(input + size, bytes.data(), bytes.size());
+    size += bytes.size();
+  }
+  input[size++] = static_cast<uint8_t>(peer.port() >> 8);
+  input[size++] = static_cast<uint8_t>(peer.port());
+
+  unsigned length = 0;
+  HMAC(EVP_sha1(), _cookieSecret.data(), _cookieSecret.size(), input, size, out, &length);
+  return length;
+}
+
+std::size_t DtlsListener::EndpointHash::operator()(const udp::endpoint& endpoint) const
+{
+  // FNV-1a over the address bytes and the port
+  uint64_t h = 1469598103934665603ull;
+  auto mix   = [&h](const uint8_t* p, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i)
+      h = (h ^ p[i]) * 1099511628211ull;
+  };
+
+  if (endpoint.address().is_v4())
+  {
+    const auto bytes = endpoint.address().to_v4().to_bytes();
+    mix(bytes.data(), bytes.size());
+  }
+  else
+  {
+    const auto bytes = endpoint.address().to_v6().to_bytes();
+    mix(bytes.data(), bytes.size());
+  }
+  const uint16_t port = endpoint.port();
+  mix(reinterpret_cast<const uint8_t*>(&port), sizeof(port));
+  return static_cast<std::size_t>(h);
+}
+
+DtlsListener::DtlsListener(Worker& worker, StunServer& server, const ListenerConfig& config, DtlsContext& context)
+    : _worker(worker)
+    , _server(server)
+    , _config(config)
+    , _context(context)
+    , _socket(worker.io())
+    , _sweepTimer(worker.io())
+    , _listenPeer(BIO_ADDR_new())
+{
+  const udp::endpoint local(config.address, config.port);
+
+  _socket.open(local.protocol());
+  _socket.set_option(udp::socket::reuse_address(true));
+  _socket.set_option(reuse_port(true));
+  if (local.address().is_v6())
+    _socket.set_option(boost::asio::ip::v6_only(true));
+  _socket.bind(local);
+
+  MemoryAccounting::add(MemoryTag::Buffers, sizeof(*this));
+  startReceive();
+  startSweep();
+}
+
+DtlsListener::~DtlsListener()
+{
+  BIO_ADDR_free(_listenPeer);
+  MemoryAccounting::sub(MemoryTag::Buffers, sizeof(*this));
+}
+
+void DtlsListener::stop()
+{
+  _stopped = true;
+  boost::system::error_code ec;
+  _sweepTimer.cancel(ec);
+  _socket.close(ec);
+  if (ec)
+    spdlog::warn("Error while closing socket: {}", ec.message());
+}
+
+void DtlsListener::startReceive()
+{
+  _socket.async_receive_from(boost::asio::buffer(_buffer), _remote,
+      [this](boost::system::error_code ec, std::size_t bytes) {
+        if (ec == boost::asio::error::operation_aborted)
+          return;
+        if (!ec)
+          handlePacket(bytes);
+        startReceive();
+      });
+}
+
+void DtlsListener::handlePacket(std::size_t bytes)
+{
+  const auto it = _connections.find(_remote);
+
+  // A ClientHello on a known address is a client that started over: the
+  // cookie exchange runs again and replaces the connection if it succeeds
+  if (it != _connections.end() && !(it->second->established() && isClientHello(_buffer.data(), bytes)))
+  {
+    if (!it->second->receive(_buffer.data(), bytes, Clock::now()))
+      close(it->second);
+    return;
+  }
+
+  if (!isClientHello(_buffer.data(), bytes))
+  {
+    statsInc(_server.stats().invalidPackets);
+    return;
+  }
+  accept(bytes);
+}
+
+void DtlsListener::accept(std::size_t bytes)
+{
+  if (!_candidate)
+    _candidate = takeConnection();
+  if (_candidate->listen(_remote, _buffer.data(), bytes, _listenPeer) <= 0)
+    return;
+
+  const auto it = _connections.find(_remote);
+  if (it != _connections.end())
+    close(it->second);
+
+  std::shared_ptr<DtlsConnection> connection = std::move(_candidate);
+  _connections.emplace(_remote, connection);
+  statsInc(_server.stats().dtlsConnections);
+  if (!connection->start(Clock::now()))
+    close(connection);
+}
+
+void DtlsListener::close(std::shared_ptr<DtlsConnection> connection)
+{
+  connection->close();
+  _connections.erase(connection->peer());
+  statsDec(_server.stats().dtlsConnections);
+
+  // Reused unless an asynchronous request still holds it
+  if (connection.use_count() == 1 && _free.size() < FREE_CONNECTIONS)
+  {
+    connection->recycle();
+    _free.push_back(std::move(connection));
+  }
+}
+
+std::shared_ptr<DtlsConnection> DtlsListener::takeConnection()
+{
+  if (_free.empty())
+    return std::make_shared<DtlsConnection>(*this);
+  auto connection = std::move(_free.back());
+  _free.pop_back();
+  return connection;
+}
+
+void DtlsListener::startSweep()
+{
+  _sweepTimer.expires_after(SWEEP_PERIOD);
+  _sweepTimer.async_wait([this](const boost::system::error_code& ec) {
+    if (ec || _stopped)
+      return;
+    sweep();
+    startSweep();
+  });
+}
+
+void DtlsListener::sweep()
+{
+  const auto now = Clock::now();
+  std::vector<std::shared_ptr<DtlsConnection>> expired;
+  for (const auto& entry : _connections)
+  {
+    if (!entry.second->expire(now))
+      expired.push_back(entry.second);
+  }
+  for (auto& connection : expired)
+    close(std::move(connection));
+}
+
+void DtlsListener::send(const uint8_t* data, std::size_t bytes, const udp::endpoint& peer)
+{
+  // Datagram sockets rarely block, send inline as UdpListener does
+  boost::system::error_code ec;
+  _socket.send_to(boost::asio::buffer(data, bytes), peer, 0, ec);
+  if (ec)
+  {
+    statsInc(_server.stats().sendErrors);
+    spdlog::warn("Failed to send to {}: {}", StunServer::endpoint2str(peer), ec.message());
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <openssl/ssl.h>
+
+#include "listener.hpp"
+
+class DtlsConnection;
+class StunServer;
+
+// Certificate, session cache and cookie secret of a DTLS listener, shared by
+// the sockets of every worker
+class DtlsContext {
+  public:
+    explicit DtlsContext(const ListenerConfig& config);
+    ~DtlsContext();
+
+    DtlsContext(const DtlsContext&) = delete;
+    DtlsContext& operator=(const DtlsContext&) = delete;
+
+    SSL_CTX* get() const { return _ctx; }
+
+    // HMAC of the peer address and the current minute: the cookie of a
+    // HelloVerifyRequest, checked again without any per-peer state
+    unsigned makeCookie(const boost::asio::ip::udp::endpoint& peer, uint8_t* out) const;
+    bool checkCookie(const boost::asio::ip::udp::endpoint& peer, const uint8_t* cookie, unsigned length) const;
+
+  private:
+    unsigned cookie(const boost::asio::ip::udp::endpoint& peer, uint64_t epoch, uint8_t* out) const;
+
+  private:
+    SSL_CTX* _ctx;
+    std::array<uint8_t, 32> _cookieSecret;
+};
+
+// STUN over DTLS (RFC 7350) on one UDP socket per worker.
+//
+// Datagrams are demultiplexed by source address. Unknown sources only reach
+// DTLSv1_listen() on a spare connection: a ClientHello without a valid
+// cookie gets a HelloVerifyRequest and leaves nothing behind, so spoofed
+// handshakes cost a HMAC and a datagram. Connections come from a free list
+// and keep their SSL object across clients; full sessions are cached by the
+// context for abbreviated handshakes.
+class DtlsListener : public Listener {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    DtlsListener(Worker& worker, StunServer& server, const ListenerConfig& config, DtlsContext& context);
+    ~DtlsListener() override;
+
+    void stop() override;
+
+  private:
+    friend class DtlsConnection;
+
+    void startReceive();
+    void handlePacket(std::size_t bytes);
+    void accept(std::size_t bytes);
+    void close(std::shared_ptr<DtlsConnection> connection);
+    std::shared_ptr<DtlsConnection> takeConnection();
+    // Handshake retransmissions and idle connections
+    void startSweep();
+    void sweep();
+    void send(const uint8_t* data, std::size_t bytes, const boost::asio::ip::udp::endpoint& peer);
+
+    struct EndpointHash
+    {
+      std::size_t operator()(const boost::asio::ip::udp::endpoint& endpoint) const;
+    };
+
+  private:
+    Worker& _worker;
+    StunServer& _server;
+    ListenerConfig _config;
+    DtlsContext& _context;
+    boost::asio::ip::udp::socket _socket;
+    boost::asio::steady_timer _sweepTimer;
+    boost::asio::ip::udp::endpoint _remote;
+    std::array<uint8_t, 2048> _buffer{};
+    std::vector<uint8_t> _response;
+    std::unordered_map<boost::asio::ip::udp::endpoint, std::shared_ptr<DtlsConnection>, EndpointHash> _connections;
+    std::shared_ptr<DtlsConnection> _candidate; // runs DTLSv1_listen() for unknown sources
+    std::vector<std::shared_ptr<DtlsConnection>> _free;
+    BIO_ADDR* _listenPeer;
+    bool _stopped = false;
+};
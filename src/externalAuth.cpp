@@ -0,0 +1,355 @@
+#include "externalAuth.hpp"
+#include "worker.hpp"
+
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+
+#include <spdlog/spdlog.h>
+
+constexpr std::chrono::seconds ExternalAuth::TIMEOUT;
+constexpr std::chrono::seconds ExternalAuth::RETRY_DELAY;
+
+namespace
+{
+  int hexValue(char c)
+  {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+
+  bool parseKey(const std::string& hex, AuthKey& key)
+  {
+    if (hex.empty() || hex.size() % 2 != 0 || hex.size() / 2 > AuthKey::MAX_SIZE)
+      return false;
+    for (std::size_t i = 0; i < hex.size() / 2; ++i)
+    {
+      const int hi = hexValue(hex[2 * i]);
+      const int lo = hexValue(hex[2 * i + 1]);
+      if (hi < 0 || lo < 0)
+        return false;
+      key.bytes[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    key.length = hex.size() / 2;
+    return true;
+  }
+}
+
+ExternalAuth::Backend::Backend(boost::asio::io_context& io, TenantId tenant, const TenantConfig& config)
+    : tenant(tenant)
+    , realm(config.realm)
+    , path(config.authSocket)
+    , socket(io)
+{
+}
+
+ExternalAuth::ExternalAuth(
+    Worker& worker, const std::vector<TenantConfig>& tenants, const AuthConfig& config, Stats& stats)
+    : _worker(worker)
+    , _config(config)
+    , _stats(stats)
+    , _timer(worker.io())
+{
+  _backends.resize(tenants.size());
+  for (std::size_t id = 0; id < tenants.size(); ++id)
+  {
+    if (!tenants[id].authSocket.empty())
+      _backends[id].reset(new Backend(worker.io(), static_cast<TenantId>(id), tenants[id]));
+  }
+
+  std::size_t size = 1;
+  while (size < config.externalCacheEntries)
+    size <<= 1;
+  _cache.resize(size);
+
+  scheduleTimeouts();
+}
+
+ExternalAuth::~ExternalAuth()
+{
+  boost::system::error_code ec;
+  _timer.cancel(ec);
+  for (auto& backend : _backends)
+  {
+    if (backend)
+      backend->socket.close(ec);
+  }
+}
+
+std::string ExternalAuth::cacheKey(TenantId tenant, const std::string& username)
+{
+  std::string key(reinterpret_cast<const char*>(&tenant), sizeof(tenant));
+  key += username;
+  return key;
+}
+
+bool ExternalAuth::cached(TenantId tenant, const std::string& username, Status& status, AuthKey& key)
+{
+  const std::string ck = cacheKey(tenant, username);
+  const auto& entry    = _cache[std::hash<std::string>()(ck) & (_cache.size() - 1)];
+  if (entry.key != ck || entry.expiry <= Clock::now())
+    return false;
+
+  statsInc(_stats.externalAuthCacheHits);
+  status = entry.found ? Status::Found : Status::NotFound;
+  key    = entry.userKey;
+  return true;
+}
+
+ExternalAuth::Status ExternalAuth::lookup(TenantId tenant, const std::string& username, Callback done)
+{
+  auto& backend        = *_backends[tenant];
+  const auto now       = Clock::now();
+  const std::string ck = cacheKey(tenant, username);
+
+  // A slow or stuck service must not pile up requests and request lines
+  if (backend.waiting >= _config.externalMaxPending)
+  {
+    statsInc(_stats.externalAuthFailures);
+    return Status::Unavailable;
+  }
+
+  auto it = _pending.find(ck);
+  if (it != _pending.end())
+  {
+    statsInc(_stats.externalAuthCoalesced);
+    it->second.waiters.push_back(std::move(done));
+    ++backend.waiting;
+    return Status::Pending;
+  }
+
+  // The protocol is line based, such a name cannot be asked for
+  if (username.find_first_of("\r\n") != std::string::npos)
+    return Status::NotFound;
+  if (!backend.connected && !backend.connecting && now < backend.retryAfter)
+  {
+    statsInc(_stats.externalAuthFailures);
+    return Status::Unavailable;
+  }
+
+  const uint64_t id = _nextId++;
+  _pending.emplace(ck, Pending {tenant, id, now + TIMEOUT, false, {std::move(done)}});
+  _ids.emplace(id, ck);
+  backend.queued += fmt::format("{} {} {}\n", id, backend.realm, username);
+  backend.queuedIds.push_back(id);
+  ++backend.waiting;
+  statsInc(_stats.externalAuthLookups);
+
+  if (backend.connected)
+    scheduleFlush(backend);
+  else if (!backend.connecting)
+    connect(backend);
+  return Status::Pending;
+}
+
+void ExternalAuth::connect(Backend& backend)
+{
+  backend.connecting = true;
+  backend.socket.async_connect(boost::asio::local::stream_protocol::endpoint(backend.path),
+      [this, &backend](boost::system::error_code ec) {
+        backend.connecting = false;
+        if (ec)
+        {
+          spdlog::warn("Cannot connect to the auth service of {} at {}: {}", backend.realm, backend.path,
+              ec.message());
+          fail(backend);
+          return;
+        }
+        backend.connected = true;
+        startRead(backend);
+        flush(backend);
+      });
+}
+
+// Deferred to the end of the current batch of events, so that the lookups of
+// every request received meanwhile share one write. Nothing is written while
+// the service still works on the previous batch, the lookups queue up instead.
+void ExternalAuth::scheduleFlush(Backend& backend)
+{
+  if (backend.flushQueued || backend.writing || backend.inFlight > 0)
+    return;
+  backend.flushQueued = true;
+  boost::asio::post(_worker.io(), [this, &backend] {
+    backend.flushQueued = false;
+    flush(backend);
+  });
+}
+
+void ExternalAuth::flush(Backend& backend)
+{
+  if (!backend.connected || backend.writing || backend.inFlight > 0 || backend.queued.empty())
+    return;
+
+  for (const auto id : backend.queuedIds)
+  {
+    const auto it = _ids.find(id);
+    if (it == _ids.end())
+      continue; // timed out while queued, its answer will be ignored
+    _pending[it->second].sent = true;
+    ++backend.inFlight;
+  }
+  backend.queuedIds.clear();
+
+  backend.writing = true;
+  backend.written.swap(backend.queued);
+  backend.queued.clear();
+  statsInc(_stats.externalAuthBatches);
+  boost::asio::async_write(backend.socket, boost::asio::buffer(backend.written),
+      [this, &backend](boost::system::error_code ec, std::size_t) {
+        backend.writing = false;
+        backend.written.clear();
+        // Aborted by fail(), which already let the waiters go
+        if (ec && ec != boost::asio::error::operation_aborted)
+        {
+          fail(backend);
+          return;
+        }
+        flush(backend);
+      });
+}
+
+void ExternalAuth::startRead(Backend& backend)
+{
+  boost::asio::async_read_until(backend.socket, backend.input, '\n',
+      [this, &backend](boost::system::error_code ec, std::size_t) {
+        if (ec)
+        {
+          if (ec != boost::asio::error::operation_aborted)
+            fail(backend);
+          return;
+        }
+
+        // Every complete line, a partial one stays for the next read
+        const auto data = backend.input.data();
+        const std::string text(boost::asio::buffers_begin(data), boost::asio::buffers_end(data));
+        const auto end = text.rfind('\n') + 1;
+        backend.input.consume(end);
+
+        for (std::size_t start = 0; start < end;)
+        {
+          const auto eol = text.find('\n', start);
+          handleLine(text.substr(start, eol - start));
+          start = eol + 1;
+        }
+        startRead(backend);
+      });
+}
+
+void ExternalAuth::handleLine(const std::string& line)
+{
+  const auto space = line.find(' ');
+  if (space == std::string::npos)
+    return;
+
+  uint64_t id;
+  try
+  {
+    id = std::stoull(line.substr(0, space));
+  }
+  catch (const std::exception&)
+  {
+    return;
+  }
+
+  const auto it = _ids.find(id);
+  if (it == _ids.end())
+    return; // timed out meanwhile
+  const std::string key = it->second;
+  _ids.erase(it);
+
+  std::string value = line.substr(space + 1);
+  if (!value.empty() && value.back() == '\r')
+    value.pop_back();
+
+  AuthKey userKey;
+  if (value == "-")
+    complete(key, Status::NotFound, userKey);
+  else if (parseKey(value, userKey))
+    complete(key, Status::Found, userKey);
+  else
+  {
+    spdlog::warn("Malformed answer from an auth service: {}", line);
+    complete(key, Status::Unavailable, userKey);
+  }
+}
+
+void ExternalAuth::complete(const std::string& key, Status status, const AuthKey& userKey)
+{
+  auto it = _pending.find(key);
+  if (it == _pending.end())
+    return;
+
+  if (status != Status::Unavailable)
+  {
+    const auto ttl = std::chrono::seconds(status == Status::Found ? _config.externalTtl : _config.externalNegativeTtl);
+    auto& entry    = _cache[std::hash<std::string>()(key) & (_cache.size() - 1)];
+    entry.key      = key;
+    entry.found    = status == Status::Found;
+    entry.userKey  = userKey;
+    entry.expiry   = Clock::now() + ttl;
+  }
+  else
+    statsInc(_stats.externalAuthFailures);
+
+  // Waiters may start new lookups, leave the map consistent first
+  auto waiters    = std::move(it->second.waiters);
+  auto& backend   = *_backends[it->second.tenant];
+  const bool sent = it->second.sent;
+  _ids.erase(it->second.id);
+  _pending.erase(it);
+  backend.waiting -= waiters.size();
+  for (auto& waiter : waiters)
+    waiter(status, userKey);
+
+  // Last answer of the batch in flight, the next one can go
+  if (sent && backend.inFlight > 0 && --backend.inFlight == 0)
+    scheduleFlush(backend);
+}
+
+void ExternalAuth::fail(Backend& backend)
+{
+  boost::system::error_code ec;
+  backend.socket.close(ec);
+  backend.connected  = false;
+  backend.inFlight   = 0;
+  backend.retryAfter = Clock::now() + RETRY_DELAY;
+  backend.queued.clear();
+  backend.queuedIds.clear();
+  backend.input.consume(backend.input.size());
+
+  std::vector<std::string> keys;
+  for (const auto& pending : _pending)
+  {
+    if (pending.second.tenant == backend.tenant)
+      keys.push_back(pending.first);
+  }
+  for (const auto& key : keys)
+    complete(key, Status::Unavailable, AuthKey());
+}
+
+void ExternalAuth::scheduleTimeouts()
+{
+  _timer.expires_after(std::chrono::seconds(1));
+  _timer.async_wait([this](boost::system::error_code ec) {
+    if (ec)
+      return;
+
+    const auto now = Clock::now();
+    std::vector<std::string> expired;
+    for (const auto& pending : _pending)
+    {
+      if (pending.second.deadline <= now)
+        expired.push_back(pending.first);
+    }
+    for (const auto& key : expired)
+      complete(key, Status::Unavailable, AuthKey());
+
+    scheduleTimeouts();
+  });
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/streambuf.hpp>
+
+#include "auth.hpp"
+#include "config.hpp"
+#include "memoryAccounting.hpp"
+#include "stats.hpp"
+
+class Worker;
+
+// Client of the external credential services of one worker, for the tenants
+// configured with auth=<socket>. Lookups go over a persistent Unix stream
+// connection per tenant, one line each way:
+//   request:  <id> <realm> <username>\n
+//   response: <id> <hex of MD5(username:realm:password)>\n, or <id> -\n
+// One batch of lookups is in flight per service at a time: those arriving
+// while it is answered are written together when it is.
+// Answers are cached (unknown users too, with a shorter TTL), and requests
+// for a user already being looked up wait for the same answer. Past
+// externalMaxPending waiting requests, a service is reported unavailable.
+class ExternalAuth {
+  public:
+    enum class Status
+    {
+      Found,
+      NotFound,
+      Unavailable, // service down or too slow
+      Pending // the callback will be called on the worker
+    };
+    using Callback = std::function<void(Status, const AuthKey&)>;
+
+    static constexpr auto TIMEOUT     = std::chrono::seconds(2);
+    static constexpr auto RETRY_DELAY = std::chrono::seconds(1);
+
+    ExternalAuth(Worker& worker, const std::vector<TenantConfig>& tenants, const AuthConfig& config,
+        Stats& stats);
+    ~ExternalAuth();
+
+    bool enabled(TenantId tenant) const { return tenant < _backends.size() && _backends[tenant]; }
+
+    // False when the answer is not cached
+    bool cached(TenantId tenant, const std::string& username, Status& status, AuthKey& key);
+    // Pending once the lookup is queued or joined an identical one
+    Status lookup(TenantId tenant, const std::string& username, Callback done);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Backend
+    {
+      Backend(boost::asio::io_context& io, TenantId tenant, const TenantConfig& config);
+
+      TenantId tenant;
+      std::string realm;
+      std::string path;
+      boost::asio::local::stream_protocol::socket socket;
+      bool connected   = false;
+      bool connecting  = false;
+      bool writing     = false;
+      bool flushQueued = false;
+      std::size_t inFlight = 0; // written lookups not answered yet
+      std::size_t waiting  = 0; // requests waiting for an answer, queued or not
+      Clock::time_point retryAfter;
+      std::string queued; // requests not written yet
+      std::vector<uint64_t> queuedIds;
+      std::string written; // requests being written
+      boost::asio::streambuf input;
+    };
+
+    struct Pending
+    {
+      TenantId tenant;
+      uint64_t id;
+      Clock::time_point deadline;
+      bool sent = false;
+      std::vector<Callback> waiters;
+    };
+
+    struct CacheEntry
+    {
+      std::string key; // tenant and username, empty when unused
+      bool found = false;
+      AuthKey userKey;
+      Clock::time_point expiry;
+    };
+
+    static std::string cacheKey(TenantId tenant, const std::string& username);
+
+    void connect(Backend& backend);
+    void scheduleFlush(Backend& backend);
+    void flush(Backend& backend);
+    void startRead(Backend& backend);
+    void handleLine(const std::string& line);
+    void fail(Backend& backend);
+    void complete(const std::string& key, Status status, const AuthKey& userKey);
+    void scheduleTimeouts();
+
+  private:
+    Worker& _worker;
+    const AuthConfig& _config;
+    Stats& _stats;
+    std::vector<std::unique_ptr<Backend>> _backends; // indexed by tenant, null without auth=
+    TaggedVector<CacheEntry, MemoryTag::Caches> _cache; // direct mapped
+    std::unordered_map<std::string, Pending> _pending; // by cache key
+    std::unordered_map<uint64_t, std::string> _ids; // request id, cache key
+    uint64_t _nextId = 1;
+    boost::asio::steady_timer _timer;
+};
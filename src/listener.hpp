@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "config.hpp"
+
+class Worker;
+
+// Path back to a client for messages produced outside of a request, such as
+// relayed data. peer is the socket peer the client traffic comes from.
+class ClientSender {
+  public:
+    virtual ~ClientSender() = default;
+
+    virtual void sendToClient(const uint8_t* data, std::size_t bytes,
+        const boost::asio::ip::udp::endpoint& peer) = 0;
+
+    // Keeps the sender valid while a request is processed asynchronously
+    virtual std::shared_ptr<ClientSender> retain() = 0;
+    // False once the underlying connection is gone
+    virtual bool alive() const { return true; }
+};
+
+// Where a STUN message came from, independently of the listener type
+struct RequestContext
+{
+  Worker& worker;
+  Transport transport;
+  boost::asio::ip::udp::endpoint remote; // client, as announced by the PROXY header if any
+  boost::asio::ip::udp::endpoint peer; // socket peer, where replies go
+  ClientSender* sender;
+  TenantId tenant; // listener default, then the tenant named by REALM
+  uint64_t trace = 0; // Tracer request id, 0 when the request is not sampled
+  TenantId charged = INVALID_TENANT; // tenant whose budget already paid for the request
+};
+
+class Listener {
+  public:
+    virtual ~Listener() = default;
+
+    virtual void stop() = 0;
+};
@@ -8,12 +8,16 @@ int main(int argc, char* argv[])
 {
   try
   {
-    uint16_t port = (argc > 1) ? static_cast<uint16_t>(std::stoi(argv[1])) : 3478;
+    // Either a port number (single UDP listener) or a config file
+    const std::string arg = (argc > 1) ? argv[1] : "3478";
+    const bool isPort     = arg.find_first_not_of("0123456789") == std::string::npos;
+    const auto config     = isPort ? ServerConfig::defaults(static_cast<uint16_t>(std::stoi(arg)))
+                                   : ServerConfig::load(arg);
 
-    spdlog::set_level(spdlog::level::debug);
+    spdlog::set_level(spdlog::level::from_str(config.logLevel));
 
     boost::asio::io_context io;
-    StunServer server(io, port);
+    StunServer server(config);
 
     boost::asio::signal_set signals(io, SIGINT, SIGTERM);
     signals.async_wait([&](const boost::system::error_code&, int signal) {
@@ -22,6 +26,7 @@ int main(int argc, char* argv[])
       io.stop();
     });
 
+    server.start();
     spdlog::info("Server ready. Press Ctrl+C to stop.");
     io.run();
     spdlog::info("Server stopped.");
@@ -0,0 +1,36 @@
+#include "memoryAccounting.hpp"
+
+#include <spdlog/fmt/fmt.h>
+
+std::atomic<uint64_t> MemoryAccounting::_bytes[static_cast<std::size_t>(MemoryTag::Count)] {};
+
+const char* MemoryAccounting::name(MemoryTag tag)
+{
+  switch (tag)
+  {
+    case MemoryTag::Buffers:
+      return "buffers";
+    case MemoryTag::Turn:
+      return "turn";
+    case MemoryTag::Caches:
+      return "caches";
+    case MemoryTag::Logging:
+      return "logging";
+    case MemoryTag::Profiler:
+      return "profiler";
+    case MemoryTag::Count:
+      break;
+  }
+  return "unknown";
+}
+
+std::string MemoryAccounting::render()
+{
+  std::string out;
+  for (std::size_t i = 0; i < static_cast<std::size_t>(MemoryTag::Count); ++i)
+  {
+    const auto tag = static_cast<MemoryTag>(i);
+    out += fmt::format("ustun_memory_bytes{{subsystem=\"{}\"}} {}\n", name(tag), bytes(tag));
+  }
+  return out;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Subsystems whose memory is accounted
+enum class MemoryTag : uint8_t
+{
+  Buffers, // listener, connection and relay receive buffers
+  Turn, // allocation table, pools, permission sets
+  Caches, // response, token and external credential caches
+  Logging, // usage record batches
+  Profiler, // sampled stacks
+  Count
+};
+
+// Bytes held per subsystem, process wide, exported as
+// ustun_memory_bytes{subsystem="..."}. Containers of the long-lived
+// structures allocate through TaggedAllocator so that growth is accounted
+// where it happens; slabs and fixed buffers are added explicitly. Kernel
+// socket memory is not included.
+class MemoryAccounting {
+  public:
+    static void add(MemoryTag tag, std::size_t bytes)
+    {
+      _bytes[static_cast<std::size_t>(tag)].fetch_add(bytes, std::memory_order_relaxed);
+    }
+    static void sub(MemoryTag tag, std::size_t bytes)
+    {
+      _bytes[static_cast<std::size_t>(tag)].fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    static uint64_t bytes(MemoryTag tag) { return _bytes[static_cast<std::size_t>(tag)].load(std::memory_order_relaxed); }
+
+    static const char* name(MemoryTag tag);
+    static std::string render();
+
+  private:
+    static std::atomic<uint64_t> _bytes[static_cast<std::size_t>(MemoryTag::Count)];
+};
+
+// Standard allocator charging its subsystem
+template<typename T, MemoryTag Tag>
+struct TaggedAllocator
+{
+  using value_type = T;
+
+  template<typename U>
+  struct rebind
+  {
+    using other = TaggedAllocator<U, Tag>;
+  };
+
+  TaggedAllocator() = default;
+  template<typename U>
+  TaggedAllocator(const TaggedAllocator<U, Tag>&)
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    T* p = std::allocator<T>().allocate(n);
+    MemoryAccounting::add(Tag, n * sizeof(T));
+    return p;
+  }
+
+  void deallocate(T* p, std::size_t n)
+  {
+    MemoryAccounting::sub(Tag, n * sizeof(T));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template<typename U>
+  bool operator==(const TaggedAllocator<U, Tag>&) const
+  {
+    return true;
+  }
+  template<typename U>
+  bool operator!=(const TaggedAllocator<U, Tag>&) const
+  {
+    return false;
+  }
+};
+
+template<typename T, MemoryTag Tag>
+using TaggedVector = std::vector<T, TaggedAllocator<T, Tag>>;
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov). Every
+// cell carries a sequence number telling whether it is ready to be written
+// or read for the current lap, so producers and consumers only contend on
+// their own position counter.
+template<typename T>
+class MpmcQueue {
+  public:
+    explicit MpmcQueue(std::size_t capacity)
+        : _cells(new Cell[capacity])
+        , _mask(capacity - 1)
+    {
+      if (capacity < 2 || (capacity & _mask) != 0)
+        throw std::invalid_argument("MpmcQueue capacity must be a power of 2");
+      for (std::size_t i = 0; i < capacity; ++i)
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    // False when full
+    bool push(const T& value)
+    {
+      std::size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+      for (;;)
+      {
+        Cell& cell         = _cells[pos & _mask];
+        const auto seq     = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (dif == 0)
+        {
+          if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            cell.data = value;
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (dif < 0)
+          return false;
+        else
+          pos = _enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    // False when empty
+    bool pop(T& value)
+    {
+      std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+      for (;;)
+      {
+        Cell& cell         = _cells[pos & _mask];
+        const auto seq     = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        if (dif == 0)
+        {
+          if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            value = cell.data;
+            cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (dif < 0)
+          return false;
+        else
+          pos = _dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    // Approximate, for metrics
+    std::size_t size() const
+    {
+      const auto enq = _enqueuePos.load(std::memory_order_relaxed);
+      const auto deq = _dequeuePos.load(std::memory_order_relaxed);
+      return enq > deq ? enq - deq : 0;
+    }
+
+  private:
+    struct Cell
+    {
+      std::atomic<std::size_t> sequence;
+      T data;
+    };
+
+    // Padding keeps both counters on their own cache line
+    std::unique_ptr<Cell[]> _cells;
+    const std::size_t _mask;
+    char _pad0[64];
+    std::atomic<std::size_t> _enqueuePos {0};
+    char _pad1[64];
+    std::atomic<std::size_t> _dequeuePos {0};
+    char _pad2[64];
+};
@@ -0,0 +1,300 @@
+#include "packetCapture.hpp"
+#include "stunMessage.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  // pcapng blocks (draft-ietf-opsawg-pcapng)
+  constexpr uint32_t SECTION_HEADER  = 0x0A0D0D0A;
+  constexpr uint32_t INTERFACE       = 0x00000001;
+  constexpr uint32_t ENHANCED_PACKET = 0x00000006;
+  constexpr uint32_t PADDING         = 0x80000000; // local use range, skipped by readers
+  constexpr uint16_t LINKTYPE_RAW    = 101;
+
+  constexpr uint16_t OPT_END     = 0;
+  constexpr uint16_t OPT_COMMENT = 1;
+  constexpr uint16_t EPB_FLAGS   = 2;
+
+  constexpr uint32_t SECTION_HEADER_SIZE   = 28;
+  constexpr uint32_t INTERFACE_SIZE        = 20;
+  constexpr uint32_t DATA_START            = SECTION_HEADER_SIZE + INTERFACE_SIZE;
+  constexpr uint32_t PACKET_HEADER_SIZE    = 28;
+  constexpr uint32_t PACKET_OPTIONS_SIZE   = 12; // epb_flags and opt_endofopt
+  constexpr uint32_t MIN_BLOCK             = 12;
+  constexpr std::size_t IPV4_HEADERS       = 20 + 8;
+  constexpr std::size_t IPV6_HEADERS       = 40 + 8;
+
+  uint8_t* put32(uint8_t* p, uint32_t value)
+  {
+    std::memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+  }
+
+  uint8_t* put16(uint8_t* p, uint16_t value)
+  {
+    std::memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+  }
+
+  uint8_t* putOption(uint8_t* p, uint16_t code, uint16_t length)
+  {
+    return put16(put16(p, code), length);
+  }
+
+  // Network order, for the made up headers
+  uint8_t* putBe16(uint8_t* p, uint16_t value)
+  {
+    p[0] = static_cast<uint8_t>(value >> 8);
+    p[1] = static_cast<uint8_t>(value);
+    return p + 2;
+  }
+
+  uint32_t sum16(const uint8_t* data, std::size_t bytes, uint32_t sum = 0)
+  {
+    for (std::size_t i = 0; i + 1 < bytes; i += 2)
+      sum += uint32_t(data[i]) << 8 | data[i + 1];
+    if (bytes & 1)
+      sum += uint32_t(data[bytes - 1]) << 8;
+    return sum;
+  }
+
+  uint16_t fold(uint32_t sum)
+  {
+    while (sum >> 16)
+      sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+  }
+
+  // IP and UDP headers in front of the payload at p
+  uint8_t* putHeaders(uint8_t* p, const udp::endpoint& from, const udp::endpoint& to, const uint8_t* payload,
+      std::size_t bytes)
+  {
+    const uint16_t udpLength = static_cast<uint16_t>(8 + bytes);
+    if (from.address().is_v4())
+    {
+      const auto src = from.address().to_v4().to_bytes();
+      const auto dst = to.address().to_v4().to_bytes();
+      uint8_t* ip    = p;
+      *p++           = 0x45;
+      *p++           = 0;
+      p              = putBe16(p, static_cast<uint16_t>(20 + udpLength));
+      p              = putBe16(p, 0);
+      p              = putBe16(p, 0x4000); // don't fragment
+      *p++           = 64;
+      *p++           = 17;
+      p              = putBe16(p, 0);
+      p              = std::copy(src.begin(), src.end(), p);
+      p              = std::copy(dst.begin(), dst.end(), p);
+      putBe16(ip + 10, fold(sum16(ip, 20)));
+
+      p = putBe16(p, from.port());
+      p = putBe16(p, to.port());
+      p = putBe16(p, udpLength);
+      return putBe16(p, 0); // optional over IPv4
+    }
+
+    const auto src = from.address().to_v6().to_bytes();
+    const auto dst = to.address().to_v6().to_bytes();
+    *p++           = 0x60;
+    *p++           = 0;
+    p              = putBe16(p, 0); // no traffic class or flow label
+    p              = putBe16(p, udpLength);
+    *p++           = 17;
+    *p++           = 64;
+    p              = std::copy(src.begin(), src.end(), p);
+    p              = std::copy(dst.begin(), dst.end(), p);
+
+    // Mandatory over IPv6: pseudo header, UDP header, payload
+    uint32_t sum = sum16(src.data(), src.size());
+    sum          = sum16(dst.data(), dst.size(), sum);
+    sum += udpLength + 17;
+    sum += from.port() + to.port() + udpLength;
+    sum                     = sum16(payload, bytes, sum);
+    const uint16_t checksum = fold(sum);
+
+    p = putBe16(p, from.port());
+    p = putBe16(p, to.port());
+    p = putBe16(p, udpLength);
+    return putBe16(p, checksum ? checksum : 0xFFFF);
+  }
+
+  std::string workerPath(const std::string& path, unsigned worker)
+  {
+    const auto slash = path.rfind('/');
+    const auto dot   = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == slash + 1)
+      return path + "." + std::to_string(worker);
+    return path.substr(0, dot) + "." + std::to_string(worker) + path.substr(dot);
+  }
+}
+
+PacketCapture::PacketCapture(const CaptureConfig& config, unsigned worker, Stats& stats)
+    : _config(config)
+    , _stats(stats)
+    , _path(workerPath(config.path, worker))
+    , _size(config.bytes & ~uint64_t(3))
+{
+  const int fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("cannot open capture file " + _path + ": " + std::strerror(errno));
+  if (ftruncate(fd, static_cast<off_t>(_size)) != 0)
+  {
+    const int error = errno;
+    close(fd);
+    throw std::runtime_error("cannot size capture file " + _path + ": " + std::strerror(error));
+  }
+  void* map = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  const int error = errno;
+  close(fd);
+  if (map == MAP_FAILED)
+    throw std::runtime_error("cannot map capture file " + _path + ": " + std::strerror(error));
+  _map = static_cast<uint8_t*>(map);
+
+  uint8_t* p = _map;
+  p          = put32(p, SECTION_HEADER);
+  p          = put32(p, SECTION_HEADER_SIZE);
+  p          = put32(p, 0x1A2B3C4D); // byte order magic
+  p          = put16(p, 1);
+  p          = put16(p, 0);
+  std::memset(p, 0xFF, 8); // section length unknown
+  p += 8;
+  p = put32(p, SECTION_HEADER_SIZE);
+
+  p = put32(p, INTERFACE);
+  p = put32(p, INTERFACE_SIZE);
+  p = put16(p, LINKTYPE_RAW);
+  p = put16(p, 0);
+  p = put32(p, 65535); // snap length
+  put32(p, INTERFACE_SIZE);
+
+  // The ring starts as one padding block
+  writePadding(DATA_START, static_cast<uint32_t>(_size - DATA_START));
+  _write = DATA_START;
+}
+
+PacketCapture::~PacketCapture()
+{
+  munmap(_map, _size);
+}
+
+bool PacketCapture::sample()
+{
+  if (_config.sampleEvery == 0)
+    return false;
+  if (_countdown > 0)
+  {
+    --_countdown;
+    return false;
+  }
+  _countdown = _config.sampleEvery - 1;
+  return true;
+}
+
+bool PacketCapture::matches(const udp::endpoint& remote, const uint8_t* data, std::size_t bytes) const
+{
+  if (!_config.prefixes.empty() && _config.prefixes.contains(remote.address()))
+    return true;
+  if (bytes < STUN_HEADER_SIZE || isChannelData(data, bytes))
+    return false;
+
+  const auto* header = reinterpret_cast<const StunHeader*>(data);
+  if (_config.errors && (ntohs(header->type) & CLASS_ERROR) == CLASS_ERROR)
+    return true;
+  return std::any_of(_config.transactions.begin(), _config.transactions.end(),
+      [header](const std::array<uint8_t, 12>& id) { return std::memcmp(id.data(), header->trans_id, 12) == 0; });
+}
+
+void PacketCapture::record(Direction direction, const udp::endpoint& local, const udp::endpoint& remote,
+    const uint8_t* data, std::size_t bytes)
+{
+  const std::size_t captured = (remote.address().is_v4() ? IPV4_HEADERS : IPV6_HEADERS) + bytes;
+  const uint32_t padded      = static_cast<uint32_t>((captured + 3) & ~std::size_t(3));
+  uint32_t length            = PACKET_HEADER_SIZE + padded + PACKET_OPTIONS_SIZE + 4;
+  if (length > _size - DATA_START)
+    return;
+
+  const uint32_t extra = reserve(length);
+  length += extra;
+
+  const auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+
+  uint8_t* p = _map + _write;
+  p          = put32(p, ENHANCED_PACKET);
+  p          = put32(p, length);
+  p          = put32(p, 0); // interface
+  p          = put32(p, static_cast<uint32_t>(uint64_t(now) >> 32));
+  p          = put32(p, static_cast<uint32_t>(now));
+  p          = put32(p, static_cast<uint32_t>(captured));
+  p          = put32(p, static_cast<uint32_t>(captured));
+  if (direction == Direction::Received)
+    p = putHeaders(p, remote, local, data, bytes);
+  else
+    p = putHeaders(p, local, remote, data, bytes);
+  std::memcpy(p, data, bytes);
+  p += bytes;
+  std::memset(p, 0, padded - captured);
+  p += padded - captured;
+
+  p = putOption(p, EPB_FLAGS, 4);
+  p = put32(p, direction == Direction::Received ? 1 : 2);
+  // Empty comments fill what would be too small for a padding block
+  for (uint32_t i = 0; i < extra; i += 4)
+    p = putOption(p, OPT_COMMENT, 0);
+  p = putOption(p, OPT_END, 0);
+  put32(p, length);
+
+  _write += length;
+  statsInc(_stats.capturedPackets);
+}
+
+uint32_t PacketCapture::reserve(uint32_t length)
+{
+  // The end of the file is tiled with blocks too, it becomes one padding block
+  if (_write + length > _size)
+  {
+    if (_write < _size)
+      writePadding(_write, static_cast<uint32_t>(_size - _write));
+    _write = DATA_START;
+  }
+
+  uint64_t covered = _write;
+  while (covered < _write + length)
+    covered += blockLength(covered);
+
+  uint64_t left = covered - (_write + length);
+  if (left > 0 && left < MIN_BLOCK)
+    return static_cast<uint32_t>(left);
+  if (left > 0)
+    writePadding(_write + length, static_cast<uint32_t>(left));
+  return 0;
+}
+
+void PacketCapture::writePadding(uint64_t offset, uint32_t length)
+{
+  put32(_map + offset, PADDING);
+  put32(_map + offset + 4, length);
+  put32(_map + offset + length - 4, length);
+}
+
+uint32_t PacketCapture::blockLength(uint64_t offset) const
+{
+  uint32_t length;
+  std::memcpy(&length, _map + offset + 4, sizeof(length));
+  return length;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "config.hpp"
+#include "stats.hpp"
+
+// Copies a subset of the datagrams of one worker, selected by sampling or by
+// filters, into a pcapng file mapped in memory and used as a ring. Only the
+// worker writes to it. The datagrams get made up IP and UDP headers
+// (LINKTYPE_RAW) so that Wireshark decodes them as STUN.
+//
+// The file always reads as a valid pcapng: blocks are overwritten oldest
+// first and the bytes left over from the old ones are covered by padding
+// blocks, which readers skip. Once the ring has wrapped, the newest packets
+// come first in the file.
+class PacketCapture {
+  public:
+    enum class Direction
+    {
+      Received,
+      Sent
+    };
+
+    // The file of worker 3 for "/tmp/ustun.pcapng" is "/tmp/ustun.3.pcapng"
+    PacketCapture(const CaptureConfig& config, unsigned worker, Stats& stats);
+    ~PacketCapture();
+
+    PacketCapture(const PacketCapture&) = delete;
+    PacketCapture& operator=(const PacketCapture&) = delete;
+
+    // True for one datagram in sampleEvery
+    bool sample();
+    // Prefix, transaction ID and error class filters
+    bool matches(const boost::asio::ip::udp::endpoint& remote, const uint8_t* data, std::size_t bytes) const;
+
+    void record(Direction direction, const boost::asio::ip::udp::endpoint& local,
+        const boost::asio::ip::udp::endpoint& remote, const uint8_t* data, std::size_t bytes);
+
+    const std::string& path() const { return _path; }
+
+  private:
+    // Room for a block of length bytes at _write, the old blocks it
+    // overlaps are replaced by padding. Returns the bytes the block has to
+    // grow by, when the space left after it is too small for padding.
+    uint32_t reserve(uint32_t length);
+    void writePadding(uint64_t offset, uint32_t length);
+    uint32_t blockLength(uint64_t offset) const;
+
+  private:
+    const CaptureConfig& _config;
+    Stats& _stats;
+    std::string _path;
+    uint8_t* _map   = nullptr;
+    uint64_t _size  = 0;
+    uint64_t _write = 0; // where the next block goes
+    unsigned _countdown = 0; // datagrams until the next sample
+};
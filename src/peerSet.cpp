@@ -0,0 +1,265 @@
+#include "peerSet.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+constexpr std::size_t PeerSet::INLINE;
+constexpr uint32_t PeerSet::NONE;
+
+namespace
+{
+  uint64_t hashAddress(const std::array<uint8_t, 16>& address)
+  {
+    uint64_t hi, lo;
+    std::memcpy(&hi, address.data(), 8);
+    std::memcpy(&lo, address.data() + 8, 8);
+    // v4-mapped addresses have zero low bits, fold the high half in
+    const uint64_t h = (hi * 0x9E3779B97F4A7C15ull) ^ (lo * 0xC2B2AE3D27D4EB4Full);
+    return h ^ (h >> 32);
+  }
+
+  uint32_t v4Key(const boost::asio::ip::address& peer)
+  {
+    const auto bytes = peer.to_v4().to_bytes();
+    uint32_t key;
+    std::memcpy(&key, bytes.data(), 4);
+    return key;
+  }
+}
+
+PeerSet::V6 PeerSet::mapped(const boost::asio::ip::address& peer)
+{
+  if (peer.is_v6())
+    return peer.to_v6().to_bytes();
+
+  // ::ffff:a.b.c.d
+  V6 bytes {};
+  bytes[10] = 0xFF;
+  bytes[11] = 0xFF;
+  const auto v4 = peer.to_v4().to_bytes();
+  std::memcpy(bytes.data() + 12, v4.data(), 4);
+  return bytes;
+}
+
+int PeerSet::findV4(uint32_t address) const
+{
+#if defined(__AVX2__)
+  const __m256i key   = _mm256_set1_epi32(static_cast<int>(address));
+  const __m256i lanes = _mm256_load_si256(reinterpret_cast<const __m256i*>(_v4));
+  const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lanes, key))))
+      & ((1u << _v4Count) - 1);
+  return mask ? __builtin_ctz(mask) : -1;
+#elif defined(__SSE2__)
+  const __m128i key   = _mm_set1_epi32(static_cast<int>(address));
+  const __m128i low   = _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(_v4)), key);
+  const __m128i high  = _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(_v4 + 4)), key);
+  const uint32_t mask = (static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(low)))
+                            | static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(high))) << 4)
+      & ((1u << _v4Count) - 1);
+  return mask ? __builtin_ctz(mask) : -1;
+#else
+  for (int i = 0; i < _v4Count; ++i)
+  {
+    if (_v4[i] == address)
+      return i;
+  }
+  return -1;
+#endif
+}
+
+int PeerSet::findV6(const V6& address) const
+{
+#if defined(__SSE2__)
+  const __m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(address.data()));
+  for (int i = 0; i < _v6Count; ++i)
+  {
+    const __m128i entry = _mm_load_si128(reinterpret_cast<const __m128i*>(_v6[i].data()));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(entry, key)) == 0xFFFF)
+      return i;
+  }
+  return -1;
+#else
+  for (int i = 0; i < _v6Count; ++i)
+  {
+    if (_v6[i] == address)
+      return i;
+  }
+  return -1;
+#endif
+}
+
+bool PeerSet::contains(const boost::asio::ip::address& peer) const
+{
+  if (peer.is_v4())
+  {
+    if (findV4(v4Key(peer)) >= 0)
+      return true;
+  }
+  else if (findV6(peer.to_v6().to_bytes()) >= 0)
+    return true;
+
+  return _spill && _spill->find(mapped(peer));
+}
+
+void PeerSet::insert(const boost::asio::ip::address& peer, uint32_t expiry)
+{
+  if (peer.is_v4())
+  {
+    const uint32_t key = v4Key(peer);
+    const int i        = findV4(key);
+    if (i >= 0)
+    {
+      _v4Expiry[i] = expiry;
+      return;
+    }
+    if (_v4Count < INLINE)
+    {
+      _v4[_v4Count]       = key;
+      _v4Expiry[_v4Count] = expiry;
+      ++_v4Count;
+      return;
+    }
+  }
+  else
+  {
+    const V6 key = peer.to_v6().to_bytes();
+    const int i  = findV6(key);
+    if (i >= 0)
+    {
+      _v6Expiry[i] = expiry;
+      return;
+    }
+    if (_v6Count < INLINE)
+    {
+      _v6[_v6Count]       = key;
+      _v6Expiry[_v6Count] = expiry;
+      ++_v6Count;
+      return;
+    }
+  }
+
+  if (!_spill)
+    _spill.reset(new Spill());
+  _spill->insert(mapped(peer), expiry);
+}
+
+uint32_t PeerSet::prune(uint32_t now)
+{
+  // Compacted in place, order does not matter
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < _v4Count; ++i)
+  {
+    if (_v4Expiry[i] > now)
+    {
+      _v4[kept]       = _v4[i];
+      _v4Expiry[kept] = _v4Expiry[i];
+      ++kept;
+    }
+  }
+  _v4Count = kept;
+
+  kept = 0;
+  for (uint8_t i = 0; i < _v6Count; ++i)
+  {
+    if (_v6Expiry[i] > now)
+    {
+      _v6[kept]       = _v6[i];
+      _v6Expiry[kept] = _v6Expiry[i];
+      ++kept;
+    }
+  }
+  _v6Count = kept;
+
+  if (_spill)
+  {
+    Spill survivors;
+    for (const auto& entry : _spill->entries)
+    {
+      if (entry.expiry != NONE && entry.expiry > now)
+        survivors.insert(entry.address, entry.expiry);
+    }
+    if (survivors.used == 0)
+      _spill.reset();
+    else
+      *_spill = std::move(survivors);
+  }
+
+  return earliestExpiry();
+}
+
+uint32_t PeerSet::earliestExpiry() const
+{
+  uint32_t earliest = NONE;
+  for (uint8_t i = 0; i < _v4Count; ++i)
+    earliest = std::min(earliest, _v4Expiry[i]);
+  for (uint8_t i = 0; i < _v6Count; ++i)
+    earliest = std::min(earliest, _v6Expiry[i]);
+  if (_spill)
+  {
+    for (const auto& entry : _spill->entries)
+      earliest = std::min(earliest, entry.expiry);
+  }
+  return earliest;
+}
+
+std::size_t PeerSet::size() const
+{
+  return _v4Count + _v6Count + (_spill ? _spill->used : 0);
+}
+
+const PeerSet::Spill::Entry* PeerSet::Spill::find(const V6& address) const
+{
+  if (entries.empty())
+    return nullptr;
+
+  const std::size_t mask = entries.size() - 1;
+  for (std::size_t i = hashAddress(address) & mask;; i = (i + 1) & mask)
+  {
+    const auto& entry = entries[i];
+    if (entry.expiry == NONE)
+      return nullptr;
+    if (entry.address == address)
+      return &entry;
+  }
+}
+
+PeerSet::Spill::Entry* PeerSet::Spill::find(const V6& address)
+{
+  return const_cast<Entry*>(static_cast<const Spill*>(this)->find(address));
+}
+
+void PeerSet::Spill::insert(const V6& address, uint32_t expiry)
+{
+  if (auto* entry = find(address))
+  {
+    entry->expiry = expiry;
+    return;
+  }
+
+  // At most half full
+  if ((used + 1) * 2 > entries.size())
+    rehash(std::max<std::size_t>(16, entries.size() * 2));
+
+  const std::size_t mask = entries.size() - 1;
+  std::size_t i          = hashAddress(address) & mask;
+  while (entries[i].expiry != NONE)
+    i = (i + 1) & mask;
+  entries[i] = {address, expiry};
+  ++used;
+}
+
+void PeerSet::Spill::rehash(std::size_t size)
+{
+  decltype(entries) old(size);
+  old.swap(entries);
+  used = 0;
+  for (const auto& entry : old)
+  {
+    if (entry.expiry != NONE)
+      insert(entry.address, entry.expiry);
+  }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+
+#include "memoryAccounting.hpp"
+
+// Peer addresses with a permission on one allocation (RFC 5766 §8), with
+// their expiry. Checked for every relayed packet: the first INLINE addresses
+// of each family are packed in fixed-width arrays searched with SIMD
+// compares (all IPv4 entries at once, one compare per IPv6 entry), and
+// larger sets spill to an open-addressing hash set.
+class PeerSet {
+  public:
+    static constexpr std::size_t INLINE = 8;
+    static constexpr uint32_t NONE      = 0xFFFFFFFF;
+
+    PeerSet() = default;
+    PeerSet(const PeerSet&) = delete;
+    PeerSet& operator=(const PeerSet&) = delete;
+
+    bool contains(const boost::asio::ip::address& peer) const;
+
+    // Adds the peer, or refreshes its expiry
+    void insert(const boost::asio::ip::address& peer, uint32_t expiry);
+
+    // Drops the peers expired at now, returns the earliest expiry left
+    uint32_t prune(uint32_t now);
+    uint32_t earliestExpiry() const;
+
+    std::size_t size() const;
+
+  private:
+    using V6 = std::array<uint8_t, 16>;
+
+    // Hash set of v4-mapped IPv6 addresses, for the peers past INLINE
+    struct Spill
+    {
+      struct Entry
+      {
+        V6 address;
+        uint32_t expiry = NONE; // NONE when empty
+      };
+
+      TaggedVector<Entry, MemoryTag::Turn> entries;
+      std::size_t used = 0;
+
+      Entry* find(const V6& address);
+      const Entry* find(const V6& address) const;
+      void insert(const V6& address, uint32_t expiry);
+      void rehash(std::size_t size);
+    };
+
+    static V6 mapped(const boost::asio::ip::address& peer);
+
+    int findV4(uint32_t address) const;
+    int findV6(const V6& address) const;
+
+  private:
+    uint8_t _v4Count = 0;
+    uint8_t _v6Count = 0;
+    alignas(32) uint32_t _v4[INLINE] {}; // network byte order
+    uint32_t _v4Expiry[INLINE] {};
+    alignas(16) V6 _v6[INLINE] {};
+    uint32_t _v6Expiry[INLINE] {};
+    std::unique_ptr<Spill> _spill;
+};
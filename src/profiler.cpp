@@ -0,0 +1,390 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+// Older glibc only has the union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+constexpr std::size_t Profiler::MAX_FRAMES;
+constexpr std::size_t Profiler::SLOTS;
+
+std::atomic<Profiler*> Profiler::_instance {nullptr};
+thread_local Profiler::Table* Profiler::_threadTable = nullptr;
+
+namespace
+{
+  // Protocol buffers encoding, enough for profile.proto
+  class ProtoWriter {
+    public:
+      void varint(uint64_t value)
+      {
+        while (value >= 0x80)
+        {
+          out += static_cast<char>((value & 0x7F) | 0x80);
+          value >>= 7;
+        }
+        out += static_cast<char>(value);
+      }
+
+      void integer(uint32_t field, uint64_t value)
+      {
+        varint(field << 3);
+        varint(value);
+      }
+
+      void bytes(uint32_t field, const std::string& value)
+      {
+        varint((field << 3) | 2);
+        varint(value.size());
+        out += value;
+      }
+
+      void packed(uint32_t field, const std::vector<uint64_t>& values)
+      {
+        ProtoWriter inner;
+        for (const auto value : values)
+          inner.varint(value);
+        bytes(field, inner.out);
+      }
+
+      std::string out;
+  };
+
+  // Interned strings of a profile.proto, index 0 is the empty string
+  class StringTable {
+    public:
+      StringTable() { index(""); }
+
+      uint64_t index(const std::string& value)
+      {
+        const auto it = _indices.find(value);
+        if (it != _indices.end())
+          return it->second;
+        _strings.push_back(value);
+        return _indices[value] = _strings.size() - 1;
+      }
+
+      const std::vector<std::string>& strings() const { return _strings; }
+
+    private:
+      std::vector<std::string> _strings;
+      std::unordered_map<std::string, uint64_t> _indices;
+  };
+
+  uint64_t hashFrames(const uintptr_t* frames, std::size_t depth)
+  {
+    uint64_t h = 1469598103934665603ull;
+    for (std::size_t i = 0; i < depth; ++i)
+      h = (h ^ frames[i]) * 1099511628211ull;
+    return h ? h : 1;
+  }
+
+  // Function name, or module+offset for addresses without a (dynamic)
+  // symbol covering them; ustun is linked with -rdynamic
+  std::string symbolize(uintptr_t address)
+  {
+    Dl_info info {};
+    void* entry = nullptr;
+    if (!dladdr1(reinterpret_cast<void*>(address), &info, &entry, RTLD_DL_SYMENT))
+      return fmt::format("0x{:x}", address);
+
+    const auto* symbol = static_cast<const ElfW(Sym)*>(entry);
+    const auto start   = reinterpret_cast<uintptr_t>(info.dli_saddr);
+    if (info.dli_sname && symbol && address >= start && address < start + symbol->st_size)
+    {
+      int status      = 0;
+      char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      std::string name(status == 0 && demangled ? demangled : info.dli_sname);
+      std::free(demangled);
+      return name;
+    }
+
+    const char* module = info.dli_fname ? std::strrchr(info.dli_fname, '/') : nullptr;
+    module             = module ? module + 1 : (info.dli_fname ? info.dli_fname : "?");
+    return fmt::format("{}+0x{:x}", module, address - reinterpret_cast<uintptr_t>(info.dli_fbase));
+  }
+}
+
+Profiler::Profiler(unsigned hz, unsigned workers, Stats& stats)
+    : _hz(hz)
+    , _stats(stats)
+{
+  Profiler* expected = nullptr;
+  if (!_instance.compare_exchange_strong(expected, this))
+    throw std::logic_error("only one profiler per process");
+
+  for (unsigned i = 0; i < workers; ++i)
+  {
+    _tables.emplace_back(new Table());
+    _tables.back()->baseline.assign(SLOTS, 0);
+  }
+
+  struct sigaction action {};
+  action.sa_sigaction = handleSignal;
+  action.sa_flags     = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, nullptr) != 0)
+    throw std::runtime_error(std::string("cannot install the SIGPROF handler: ") + std::strerror(errno));
+
+  spdlog::info("Sampling profiler at {} Hz per worker", hz);
+}
+
+Profiler::~Profiler()
+{
+  for (auto& table : _tables)
+  {
+    if (table->timerCreated)
+      timer_delete(table->timer);
+  }
+  // Signals still pending are discarded, the tables can go
+  signal(SIGPROF, SIG_IGN);
+  _instance.store(nullptr);
+}
+
+void Profiler::attach(unsigned worker)
+{
+  auto& table = *_tables[worker];
+
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0)
+  {
+    void* base       = nullptr;
+    std::size_t size = 0;
+    pthread_attr_getstack(&attr, &base, &size);
+    pthread_attr_destroy(&attr);
+    table.stackLow  = reinterpret_cast<uintptr_t>(base);
+    table.stackHigh = table.stackLow + size;
+  }
+  _threadTable = &table;
+
+  sigevent event {};
+  event.sigev_notify           = SIGEV_THREAD_ID;
+  event.sigev_signo            = SIGPROF;
+  event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &table.timer) != 0)
+  {
+    spdlog::warn("Cannot profile worker {}: {}", worker, std::strerror(errno));
+    return;
+  }
+  table.timerCreated = true;
+
+  const long interval = 1000000000L / _hz;
+  itimerspec spec {};
+  spec.it_interval.tv_sec  = interval / 1000000000L;
+  spec.it_interval.tv_nsec = interval % 1000000000L;
+  spec.it_value            = spec.it_interval;
+  timer_settime(table.timer, 0, &spec, nullptr);
+}
+
+// Async-signal context: no allocation, no locks, only this thread's table
+void Profiler::handleSignal(int, siginfo_t*, void* context)
+{
+  Profiler* profiler = _instance.load(std::memory_order_relaxed);
+  if (profiler && _threadTable)
+  {
+    const int savedErrno = errno;
+    profiler->record(*_threadTable, context);
+    errno = savedErrno;
+  }
+}
+
+void Profiler::record(Table& table, const void* context)
+{
+  const auto* uc = static_cast<const ucontext_t*>(context);
+  uintptr_t frames[MAX_FRAMES];
+  std::size_t depth = 0;
+
+#if defined(__x86_64__)
+  frames[depth++] = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+  uintptr_t fp    = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]);
+#elif defined(__aarch64__)
+  frames[depth++] = static_cast<uintptr_t>(uc->uc_mcontext.pc);
+  uintptr_t fp    = static_cast<uintptr_t>(uc->uc_mcontext.regs[29]);
+#else
+  (void)uc;
+  statsInc(_stats.profileDropped);
+  return;
+#endif
+
+  // Each frame starts with the caller's frame pointer then the return
+  // address; stop on anything outside the stack or not going up
+  while (depth < MAX_FRAMES && fp >= table.stackLow && fp + 2 * sizeof(uintptr_t) <= table.stackHigh
+      && fp % sizeof(uintptr_t) == 0)
+  {
+    const auto* frame       = reinterpret_cast<const uintptr_t*>(fp);
+    const uintptr_t next    = frame[0];
+    const uintptr_t address = frame[1];
+    if (address == 0)
+      break;
+    frames[depth++] = address - 1; // inside the call instruction
+    if (next <= fp)
+      break;
+    fp = next;
+  }
+
+  const uint64_t hash = hashFrames(frames, depth);
+  for (std::size_t probe = 0, i = hash & (SLOTS - 1); probe < SLOTS / 8; ++probe, i = (i + 1) & (SLOTS - 1))
+  {
+    auto& slot           = table.slots[i];
+    const uint64_t taken = slot.hash.load(std::memory_order_relaxed);
+    if (taken == 0)
+    {
+      // Single writer: publish the frames with the hash
+      slot.depth = static_cast<uint32_t>(depth);
+      std::memcpy(slot.frames, frames, depth * sizeof(uintptr_t));
+      slot.hash.store(hash, std::memory_order_release);
+    }
+    else if (taken != hash || slot.depth != depth
+        || std::memcmp(slot.frames, frames, depth * sizeof(uintptr_t)) != 0)
+      continue;
+
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    statsInc(_stats.profileSamples);
+    return;
+  }
+  statsInc(_stats.profileDropped);
+}
+
+template<typename F>
+void Profiler::forEachStack(F f) const
+{
+  for (unsigned worker = 0; worker < _tables.size(); ++worker)
+  {
+    const auto& table = *_tables[worker];
+    for (std::size_t i = 0; i < SLOTS; ++i)
+    {
+      const auto& slot = table.slots[i];
+      if (slot.hash.load(std::memory_order_acquire) == 0)
+        continue;
+      const uint64_t count = slot.count.load(std::memory_order_relaxed) - table.baseline[i];
+      if (count > 0)
+        f(worker, slot.frames, slot.depth, count);
+    }
+  }
+}
+
+void Profiler::reset()
+{
+  for (auto& table : _tables)
+  {
+    for (std::size_t i = 0; i < SLOTS; ++i)
+      table->baseline[i] = table->slots[i].count.load(std::memory_order_relaxed);
+  }
+}
+
+std::string Profiler::folded() const
+{
+  std::unordered_map<uintptr_t, std::string> names;
+  std::string out;
+  forEachStack([&](unsigned worker, const uintptr_t* frames, std::size_t depth, uint64_t count) {
+    out += fmt::format("worker{}", worker);
+    for (std::size_t i = depth; i-- > 0;)
+    {
+      auto it = names.find(frames[i]);
+      if (it == names.end())
+      {
+        std::string name = symbolize(frames[i]);
+        std::replace(name.begin(), name.end(), ';', ':');
+        it = names.emplace(frames[i], std::move(name)).first;
+      }
+      out += ';';
+      out += it->second;
+    }
+    out += fmt::format(" {}\n", count);
+  });
+  return out;
+}
+
+std::string Profiler::pprof() const
+{
+  const uint64_t period = 1000000000ull / _hz;
+  StringTable strings;
+  std::map<uintptr_t, uint64_t> locations; // address, id
+  std::map<std::string, uint64_t> functions; // name, id
+  std::unordered_map<uintptr_t, uint64_t> locationFunction;
+  ProtoWriter profile;
+
+  auto valueType = [&](uint32_t field, const char* type, const char* unit) {
+    ProtoWriter value;
+    value.integer(1, strings.index(type));
+    value.integer(2, strings.index(unit));
+    profile.bytes(field, value.out);
+  };
+  valueType(1, "samples", "count");
+  valueType(1, "cpu", "nanoseconds");
+
+  forEachStack([&](unsigned worker, const uintptr_t* frames, std::size_t depth, uint64_t count) {
+    std::vector<uint64_t> ids;
+    for (std::size_t i = 0; i < depth; ++i)
+    {
+      auto it = locations.find(frames[i]);
+      if (it == locations.end())
+      {
+        const std::string name = symbolize(frames[i]);
+        auto fn                = functions.find(name);
+        if (fn == functions.end())
+          fn = functions.emplace(name, functions.size() + 1).first;
+        it = locations.emplace(frames[i], locations.size() + 1).first;
+        locationFunction[frames[i]] = fn->second;
+      }
+      ids.push_back(it->second);
+    }
+
+    ProtoWriter sample;
+    sample.packed(1, ids);
+    sample.packed(2, {count, count * period});
+    ProtoWriter label;
+    label.integer(1, strings.index("worker"));
+    label.integer(2, strings.index(std::to_string(worker)));
+    sample.bytes(3, label.out);
+    profile.bytes(2, sample.out);
+  });
+
+  for (const auto& location : locations)
+  {
+    ProtoWriter line;
+    line.integer(1, locationFunction[location.first]);
+    ProtoWriter entry;
+    entry.integer(1, location.second);
+    entry.integer(3, location.first);
+    entry.bytes(4, line.out);
+    profile.bytes(4, entry.out);
+  }
+  for (const auto& function : functions)
+  {
+    ProtoWriter entry;
+    entry.integer(1, function.second);
+    entry.integer(2, strings.index(function.first));
+    entry.integer(3, strings.index(function.first));
+    profile.bytes(5, entry.out);
+  }
+
+  ProtoWriter periodType;
+  periodType.integer(1, strings.index("cpu"));
+  periodType.integer(2, strings.index("nanoseconds"));
+
+  // The string table has to come after every index() call
+  for (const auto& value : strings.strings())
+    profile.bytes(6, value);
+  profile.bytes(11, periodType.out);
+  profile.integer(12, period);
+  return profile.out;
+}
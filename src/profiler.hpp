@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <time.h>
+
+#include "memoryAccounting.hpp"
+#include "stats.hpp"
+
+// Sampling CPU profiler of the workers, needing no privileges: every worker
+// thread gets a timer on its own CPU time raising SIGPROF at the configured
+// rate, and the handler walks the frame pointers of the interrupted code.
+// Stacks are counted in a fixed hash table per worker, written only by the
+// signal handler of its thread and read without locks by the dumps, which
+// run on the control socket.
+class Profiler {
+  public:
+    static constexpr std::size_t MAX_FRAMES = 32;
+    static constexpr std::size_t SLOTS      = 4096; // distinct stacks per worker, a power of 2
+
+    Profiler(unsigned hz, unsigned workers, Stats& stats);
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Starts sampling the calling thread, to be run on the worker
+    void attach(unsigned worker);
+
+    // Samples since the last reset, one "worker0;outer;...;leaf count" line
+    // per stack (flame graph folded format)
+    std::string folded() const;
+    // Same samples as a pprof profile.proto, uncompressed
+    std::string pprof() const;
+    void reset();
+
+  private:
+    struct Slot
+    {
+      std::atomic<uint64_t> hash {0}; // 0 while free, set once the frames are in
+      std::atomic<uint64_t> count {0};
+      uint32_t depth = 0;
+      uintptr_t frames[MAX_FRAMES]; // leaf first, return addresses minus one
+    };
+
+    struct Table
+    {
+      TaggedVector<Slot, MemoryTag::Profiler> slots {SLOTS};
+      std::vector<uint64_t> baseline; // counts at the last reset, dumps only
+      uintptr_t stackLow  = 0;
+      uintptr_t stackHigh = 0;
+      timer_t timer {};
+      bool timerCreated = false;
+    };
+
+    static void handleSignal(int, siginfo_t*, void* context);
+    void record(Table& table, const void* context);
+
+    // Calls f(worker, frames, depth, count) for every stack sampled since
+    // the last reset
+    template<typename F>
+    void forEachStack(F f) const;
+
+  private:
+    static std::atomic<Profiler*> _instance;
+    static thread_local Table* _threadTable;
+
+    unsigned _hz;
+    Stats& _stats;
+    std::vector<std::unique_ptr<Table>> _tables; // by worker
+};
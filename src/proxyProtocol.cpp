@@ -0,0 +1,76 @@
+#include "proxyProtocol.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+  constexpr uint8_t SIGNATURE[12] = {
+      0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A};
+
+  constexpr uint8_t CMD_LOCAL = 0x20;
+  constexpr uint8_t CMD_PROXY = 0x21;
+
+  constexpr uint8_t AF_INET_  = 0x1;
+  constexpr uint8_t AF_INET6_ = 0x2;
+
+  uint16_t read16(const uint8_t* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+}
+
+ProxyParseResult parseProxyV2(
+    const uint8_t* data, std::size_t bytes, ProxyTransport transport, ProxyHeader& out)
+{
+  if (bytes < PROXY_V2_HEADER_SIZE)
+    return std::memcmp(data, SIGNATURE, std::min(bytes, sizeof(SIGNATURE))) == 0
+        ? ProxyParseResult::Incomplete
+        : ProxyParseResult::Invalid;
+
+  if (std::memcmp(data, SIGNATURE, sizeof(SIGNATURE)) != 0)
+    return ProxyParseResult::Invalid;
+
+  const uint8_t verCmd  = data[12];
+  const uint8_t family  = data[13] >> 4;
+  const uint8_t proto   = data[13] & 0x0F;
+  const std::size_t len = read16(data + 14);
+
+  if (verCmd != CMD_LOCAL && verCmd != CMD_PROXY)
+    return ProxyParseResult::Invalid;
+  if (bytes < PROXY_V2_HEADER_SIZE + len)
+    return ProxyParseResult::Incomplete;
+
+  out.length = PROXY_V2_HEADER_SIZE + len;
+  out.local  = verCmd == CMD_LOCAL;
+  if (out.local)
+    return ProxyParseResult::Ok;
+
+  // A STREAM header on a UDP listener (or the reverse) is a misconfigured
+  // balancer, or a client trying its luck
+  if (proto != static_cast<uint8_t>(transport))
+    return ProxyParseResult::Invalid;
+
+  // TLVs after the address block are skipped
+  const uint8_t* addr = data + PROXY_V2_HEADER_SIZE;
+  if (family == AF_INET_ && len >= 12)
+  {
+    boost::asio::ip::address_v4::bytes_type src, dst;
+    std::memcpy(src.data(), addr, 4);
+    std::memcpy(dst.data(), addr + 4, 4);
+    out.source      = {boost::asio::ip::address_v4(src), read16(addr + 8)};
+    out.destination = {boost::asio::ip::address_v4(dst), read16(addr + 10)};
+  }
+  else if (family == AF_INET6_ && len >= 36)
+  {
+    boost::asio::ip::address_v6::bytes_type src, dst;
+    std::memcpy(src.data(), addr, 16);
+    std::memcpy(dst.data(), addr + 16, 16);
+    out.source      = {boost::asio::ip::address_v6(src), read16(addr + 32)};
+    out.destination = {boost::asio::ip::address_v6(dst), read16(addr + 34)};
+  }
+  else
+  {
+    // AF_UNSPEC or AF_UNIX, no usable client address
+    return ProxyParseResult::Invalid;
+  }
+
+  return ProxyParseResult::Ok;
+}
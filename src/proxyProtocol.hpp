@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/asio/ip/udp.hpp>
+
+// PROXY protocol v2 (haproxy proxy-protocol.txt §2.2)
+constexpr std::size_t PROXY_V2_HEADER_SIZE = 16;
+
+// Transport of the proxied connection, low nibble of the family byte
+enum class ProxyTransport : uint8_t
+{
+  Stream = 0x1, // TCP and TLS listeners
+  Dgram  = 0x2 // UDP listeners
+};
+
+enum class ProxyParseResult
+{
+  Ok,
+  Incomplete, // need more bytes, only meaningful on streams
+  Invalid
+};
+
+struct ProxyHeader
+{
+  std::size_t length = 0; // total header size, the payload starts right after it
+  bool local         = false; // LOCAL command, health checks from the balancer itself
+  boost::asio::ip::udp::endpoint source;
+  boost::asio::ip::udp::endpoint destination;
+};
+
+// Parses the header in place, nothing is copied but the addresses. A PROXY
+// command announcing another transport than the listener's is invalid.
+ProxyParseResult parseProxyV2(
+    const uint8_t* data, std::size_t bytes, ProxyTransport transport, ProxyHeader& out);
@@ -0,0 +1,146 @@
+#include "responseCache.hpp"
+
+#include <cstring>
+
+using boost::asio::ip::udp;
+
+constexpr std::size_t ResponseCache::MAX_RESPONSE_SIZE;
+constexpr std::chrono::seconds ResponseCache::TTL;
+
+ResponseCache::ResponseCache(std::size_t capacity)
+    : _entries(capacity)
+{
+  // Index at most half full to keep the probe sequences short
+  std::size_t size = 1;
+  while (size < capacity * 2)
+    size <<= 1;
+  _index.assign(size, -1);
+  _indexMask = size - 1;
+}
+
+uint64_t ResponseCache::hashKey(ClientSender* sender, const udp::endpoint& client,
+    const uint8_t trans_id[12])
+{
+  uint64_t h = 1469598103934665603ull;
+  auto mix   = [&h](const void* data, std::size_t n) {
+    const auto* p = static_cast<const uint8_t*>(data);
+    for (std::size_t i = 0; i < n; ++i)
+      h = (h ^ p[i]) * 1099511628211ull;
+  };
+
+  mix(trans_id, 12);
+  mix(&sender, sizeof(sender));
+  mix(client.data(), client.size());
+  return h;
+}
+
+int32_t ResponseCache::findSlot(uint64_t hash, ClientSender* sender, const udp::endpoint& client,
+    const uint8_t trans_id[12]) const
+{
+  for (std::size_t i = hash & _indexMask;; i = (i + 1) & _indexMask)
+  {
+    const int32_t slot = _index[i];
+    if (slot < 0)
+      return -1;
+
+    const auto& entry = _entries[slot];
+    if (entry.hash == hash && entry.sender == sender && entry.client == client
+        && std::memcmp(entry.trans_id, trans_id, 12) == 0)
+      return slot;
+  }
+}
+
+bool ResponseCache::lookup(ClientSender* sender, const udp::endpoint& client,
+    const uint8_t trans_id[12], std::vector<uint8_t>& out)
+{
+  if (_entries.empty())
+    return false;
+
+  const int32_t slot = findSlot(hashKey(sender, client, trans_id), sender, client, trans_id);
+  if (slot < 0)
+    return false;
+
+  auto& entry = _entries[slot];
+  if (entry.expiry <= Clock::now())
+    return false;
+
+  entry.referenced = true;
+  out.assign(entry.response, entry.response + entry.length);
+  return true;
+}
+
+void ResponseCache::insert(ClientSender* sender, const udp::endpoint& client,
+    const uint8_t trans_id[12], const std::vector<uint8_t>& response)
+{
+  if (_entries.empty() || response.size() > MAX_RESPONSE_SIZE)
+    return;
+
+  const auto now      = Clock::now();
+  const uint64_t hash = hashKey(sender, client, trans_id);
+
+  int32_t slot = findSlot(hash, sender, client, trans_id);
+  if (slot < 0)
+  {
+    slot = static_cast<int32_t>(evict(now));
+
+    std::size_t i = hash & _indexMask;
+    while (_index[i] >= 0)
+      i = (i + 1) & _indexMask;
+    _index[i] = slot;
+  }
+
+  auto& entry      = _entries[slot];
+  entry.hash       = hash;
+  entry.sender     = sender;
+  entry.client     = client;
+  std::memcpy(entry.trans_id, trans_id, 12);
+  entry.expiry     = now + TTL;
+  entry.used       = true;
+  entry.referenced = false;
+  entry.length     = static_cast<uint16_t>(response.size());
+  std::memcpy(entry.response, response.data(), response.size());
+}
+
+// CLOCK: the hand skips (and clears) recently hit entries, empty or expired
+// entries are taken right away
+std::size_t ResponseCache::evict(Clock::time_point now)
+{
+  for (;;)
+  {
+    const std::size_t slot = _hand;
+    _hand = (_hand + 1) % _entries.size();
+
+    auto& entry = _entries[slot];
+    if (!entry.used)
+      return slot;
+    if (entry.referenced && entry.expiry > now)
+    {
+      entry.referenced = false;
+      continue;
+    }
+
+    unindex(slot);
+    entry.used = false;
+    return slot;
+  }
+}
+
+// Backward shift deletion, keeps the probe sequences free of holes
+void ResponseCache::unindex(std::size_t slot)
+{
+  std::size_t i = _entries[slot].hash & _indexMask;
+  while (_index[i] != static_cast<int32_t>(slot))
+    i = (i + 1) & _indexMask;
+
+  for (std::size_t j = (i + 1) & _indexMask; _index[j] >= 0; j = (j + 1) & _indexMask)
+  {
+    const std::size_t home = _entries[_index[j]].hash & _indexMask;
+    // Move j into the hole at i unless its home lies cyclically in (i, j]
+    if (((j - home) & _indexMask) >= ((j - i) & _indexMask))
+    {
+      _index[i] = _index[j];
+      i         = j;
+    }
+  }
+  _index[i] = -1;
+}
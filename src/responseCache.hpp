@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "memoryAccounting.hpp"
+#include "serverClock.hpp"
+
+class ClientSender;
+
+// Recent responses keyed by (5-tuple, transaction ID), so that retransmitted
+// requests get the same answer without running the handler again (RFC 5389
+// §7.3.1). Memory is allocated once; entries live for the client transaction
+// timeout and are evicted with the CLOCK algorithm when the cache is full.
+class ResponseCache {
+  public:
+    using Clock = ServerClock;
+
+    static constexpr std::size_t MAX_RESPONSE_SIZE = 256;
+    static constexpr auto TTL = std::chrono::seconds(40); // Ti = 39.5s
+
+    explicit ResponseCache(std::size_t capacity);
+
+    // Copies the cached response into out, false on miss
+    bool lookup(ClientSender* sender, const boost::asio::ip::udp::endpoint& client,
+        const uint8_t trans_id[12], std::vector<uint8_t>& out);
+    void insert(ClientSender* sender, const boost::asio::ip::udp::endpoint& client,
+        const uint8_t trans_id[12], const std::vector<uint8_t>& response);
+
+  private:
+    struct Entry
+    {
+      uint64_t hash = 0;
+      ClientSender* sender = nullptr;
+      boost::asio::ip::udp::endpoint client;
+      uint8_t trans_id[12] {};
+      Clock::time_point expiry;
+      bool used       = false;
+      bool referenced = false;
+      uint16_t length = 0;
+      uint8_t response[MAX_RESPONSE_SIZE];
+    };
+
+    static uint64_t hashKey(ClientSender* sender, const boost::asio::ip::udp::endpoint& client,
+        const uint8_t trans_id[12]);
+
+    int32_t findSlot(uint64_t hash, ClientSender* sender,
+        const boost::asio::ip::udp::endpoint& client, const uint8_t trans_id[12]) const;
+    std::size_t evict(Clock::time_point now);
+    void unindex(std::size_t slot);
+
+  private:
+    TaggedVector<Entry, MemoryTag::Caches> _entries;
+    TaggedVector<int32_t, MemoryTag::Caches> _index; // open addressing, linear probing, -1 when empty
+    std::size_t _indexMask;
+    std::size_t _hand = 0;
+};
@@ -0,0 +1,25 @@
+#include "serverClock.hpp"
+
+bool ServerClock::_virtual = false;
+std::atomic<ServerClock::rep> ServerClock::_virtualNow {0};
+int64_t ServerClock::_virtualUnixStart = 0;
+
+int64_t ServerClock::unixTime()
+{
+  if (_virtual)
+    return _virtualUnixStart
+        + std::chrono::duration_cast<std::chrono::seconds>(duration(_virtualNow.load(std::memory_order_relaxed))).count();
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void ServerClock::useVirtualTime(int64_t unixStart)
+{
+  _virtual          = true;
+  _virtualUnixStart = unixStart;
+  _virtualNow.store(0, std::memory_order_relaxed);
+}
+
+void ServerClock::advance(duration elapsed)
+{
+  _virtualNow.fetch_add(elapsed.count(), std::memory_order_relaxed);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Time source of the expiry, quota, rate limit and nonce logic: a steady
+// clock, real by default. The simulation harness switches it to virtual time
+// that only moves when told to, so hours of allocation lifetimes run in
+// seconds and every run with the same input gives the same result.
+// Kernel facing times (SO_TXTIME) and measured latencies stay real.
+class ServerClock {
+  public:
+    using duration   = std::chrono::steady_clock::duration;
+    using rep        = duration::rep;
+    using period     = duration::period;
+    using time_point = std::chrono::time_point<ServerClock>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+      if (_virtual)
+        return time_point(duration(_virtualNow.load(std::memory_order_relaxed)));
+      return time_point(std::chrono::steady_clock::now().time_since_epoch());
+    }
+
+    // Seconds since the Unix epoch, on the same time base
+    static int64_t unixTime();
+
+    // Switches to virtual time, starting at unixStart; to be called before
+    // any time is taken and before the workers start
+    static void useVirtualTime(int64_t unixStart);
+    static void advance(duration elapsed);
+
+  private:
+    static bool _virtual;
+    static std::atomic<rep> _virtualNow;
+    static int64_t _virtualUnixStart;
+};
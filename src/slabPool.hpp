@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "memoryAccounting.hpp"
+
+// Reference to a pooled object. The generation changes every time a slot is
+// reused, so a handle to a destroyed object resolves to null instead of
+// aliasing whatever took its place.
+struct PoolHandle
+{
+  static constexpr uint32_t INVALID = 0xFFFFFFFF;
+
+  uint32_t index      = INVALID;
+  uint32_t generation = 0;
+
+  explicit operator bool() const { return index != INVALID; }
+  bool operator==(const PoolHandle& other) const
+  {
+    return index == other.index && generation == other.generation;
+  }
+  bool operator!=(const PoolHandle& other) const { return !(*this == other); }
+};
+
+// Typed object pool for one worker (not thread safe). Objects live in
+// fixed-size slabs mapped straight from the kernel; new objects go to the
+// partially used slab with the lowest index, so that churn drains the high
+// slabs, and a slab is unmapped as soon as it is empty while another empty
+// one is kept around. Objects never move: pointers stay valid until destroy.
+// Slabs and bookkeeping are charged to the Tag subsystem.
+template<typename T, MemoryTag Tag = MemoryTag::Turn>
+class SlabPool {
+  public:
+    static constexpr std::size_t SLAB_BYTES = 64 * 1024;
+    static constexpr uint32_t SLAB_OBJECTS  = sizeof(T) < SLAB_BYTES ? SLAB_BYTES / sizeof(T) : 1;
+
+    // Gauges summed over the pools of every worker: objects alive, object
+    // slots mapped, and bytes mapped
+    SlabPool(std::atomic<uint64_t>& live, std::atomic<uint64_t>& capacity, std::atomic<uint64_t>& bytes)
+        : _liveGauge(live)
+        , _capacityGauge(capacity)
+        , _bytesGauge(bytes)
+    {
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    ~SlabPool()
+    {
+      for (uint32_t index = 0; index < _slots.size(); ++index)
+      {
+        if (_slots[index].generation & 1)
+          destroy({index, _slots[index].generation});
+      }
+      for (uint32_t slab = 0; slab < _slabs.size(); ++slab)
+        unmap(slab);
+    }
+
+    template<typename... Args>
+    PoolHandle create(Args&&... args)
+    {
+      auto& s              = _slabs[partialSlab()];
+      const uint32_t index = s.freeHead;
+      auto& slot           = _slots[index];
+      s.freeHead           = slot.nextFree;
+
+      new (object(index)) T(std::forward<Args>(args)...);
+      ++slot.generation; // odd while alive
+      ++s.live;
+      ++_live;
+      _liveGauge.fetch_add(1, std::memory_order_relaxed);
+      return {index, slot.generation};
+    }
+
+    void destroy(PoolHandle handle)
+    {
+      if (!get(handle))
+        return;
+
+      const uint32_t index = handle.index;
+      const uint32_t slab  = index / SLAB_OBJECTS;
+      auto& s              = _slabs[slab];
+      auto& slot           = _slots[index];
+
+      object(index)->~T();
+      ++slot.generation;
+      slot.nextFree = s.freeHead;
+      s.freeHead    = index;
+      --_live;
+      _liveGauge.fetch_sub(1, std::memory_order_relaxed);
+
+      if (s.live-- == SLAB_OBJECTS)
+        pushPartial(slab);
+      if (s.live == 0 && ++_emptySlabs > 1)
+      {
+        // Keep one empty slab to absorb churn, give the rest back
+        unmap(slab);
+        --_emptySlabs;
+      }
+    }
+
+    T* get(PoolHandle handle) const
+    {
+      if (handle.index >= _slots.size() || _slots[handle.index].generation != handle.generation
+          || !(handle.generation & 1))
+        return nullptr;
+      return object(handle.index);
+    }
+
+    std::size_t live() const { return _live; }
+    std::size_t capacity() const { return _mapped * std::size_t(SLAB_OBJECTS); }
+
+  private:
+    struct Slot
+    {
+      uint32_t generation = 0; // odd while alive, survives the slab unmapping
+      uint32_t nextFree   = PoolHandle::INVALID;
+    };
+
+    struct Slab
+    {
+      uint8_t* memory   = nullptr; // null once unmapped
+      uint32_t live     = 0;
+      uint32_t freeHead = PoolHandle::INVALID;
+      bool queued       = false; // in the partial heap
+    };
+
+    T* object(uint32_t index) const
+    {
+      const auto& slab = _slabs[index / SLAB_OBJECTS];
+      return reinterpret_cast<T*>(slab.memory + (index % SLAB_OBJECTS) * sizeof(T));
+    }
+
+    // Lowest partial slab, mapping a new one when every slab is full. The
+    // heap is cleaned lazily: slabs filled up or unmapped since they were
+    // pushed are dropped when they reach the top.
+    uint32_t partialSlab()
+    {
+      while (!_partial.empty())
+      {
+        const uint32_t slab = _partial.front();
+        auto& s             = _slabs[slab];
+        if (s.memory && s.freeHead != PoolHandle::INVALID)
+        {
+          if (s.live == 0)
+            --_emptySlabs;
+          return slab;
+        }
+        popPartial();
+        s.queued = false;
+      }
+
+      const uint32_t slab = map();
+      pushPartial(slab);
+      --_emptySlabs;
+      return slab;
+    }
+
+    void pushPartial(uint32_t slab)
+    {
+      if (_slabs[slab].queued)
+        return;
+      _slabs[slab].queued = true;
+      _partial.push_back(slab);
+      std::push_heap(_partial.begin(), _partial.end(), std::greater<uint32_t>());
+    }
+
+    void popPartial()
+    {
+      std::pop_heap(_partial.begin(), _partial.end(), std::greater<uint32_t>());
+      _partial.pop_back();
+    }
+
+    uint32_t map()
+    {
+      // Reuse the index of an unmapped slab so that handles stay compact
+      uint32_t slab = 0;
+      while (slab < _slabs.size() && _slabs[slab].memory)
+        ++slab;
+      if (slab == _slabs.size())
+      {
+        _slabs.emplace_back();
+        _slots.resize(_slots.size() + SLAB_OBJECTS);
+      }
+
+      void* memory = mmap(nullptr, SLAB_OBJECTS * sizeof(T), PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+
+      auto& s    = _slabs[slab];
+      s.memory   = static_cast<uint8_t*>(memory);
+      s.live     = 0;
+      s.freeHead = PoolHandle::INVALID;
+      for (uint32_t i = SLAB_OBJECTS; i-- > 0;)
+      {
+        const uint32_t index   = slab * SLAB_OBJECTS + i;
+        _slots[index].nextFree = s.freeHead;
+        s.freeHead             = index;
+      }
+
+      ++_mapped;
+      ++_emptySlabs;
+      _capacityGauge.fetch_add(SLAB_OBJECTS, std::memory_order_relaxed);
+      _bytesGauge.fetch_add(SLAB_OBJECTS * sizeof(T), std::memory_order_relaxed);
+      MemoryAccounting::add(Tag, SLAB_OBJECTS * sizeof(T));
+      return slab;
+    }
+
+    void unmap(uint32_t slab)
+    {
+      auto& s = _slabs[slab];
+      if (!s.memory)
+        return;
+      munmap(s.memory, SLAB_OBJECTS * sizeof(T));
+      s.memory   = nullptr;
+      s.freeHead = PoolHandle::INVALID;
+      --_mapped;
+      _capacityGauge.fetch_sub(SLAB_OBJECTS, std::memory_order_relaxed);
+      _bytesGauge.fetch_sub(SLAB_OBJECTS * sizeof(T), std::memory_order_relaxed);
+      MemoryAccounting::sub(Tag, SLAB_OBJECTS * sizeof(T));
+    }
+
+  private:
+    std::atomic<uint64_t>& _liveGauge;
+    std::atomic<uint64_t>& _capacityGauge;
+    std::atomic<uint64_t>& _bytesGauge;
+    TaggedVector<Slab, Tag> _slabs;
+    TaggedVector<Slot, Tag> _slots; // indexed by handle index
+    TaggedVector<uint32_t, Tag> _partial; // min-heap of the slabs with free slots
+    std::size_t _live       = 0;
+    std::size_t _mapped     = 0;
+    std::size_t _emptySlabs = 0;
+};
+
+template<typename T, MemoryTag Tag>
+constexpr std::size_t SlabPool<T, Tag>::SLAB_BYTES;
+template<typename T, MemoryTag Tag>
+constexpr uint32_t SlabPool<T, Tag>::SLAB_OBJECTS;
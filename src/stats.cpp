@@ -0,0 +1,74 @@
+#include "stats.hpp"
+
+#include <spdlog/fmt/fmt.h>
+
+namespace
+{
+  struct Field
+  {
+    const char* name;
+    std::atomic<uint64_t> Stats::*counter;
+  };
+
+  const Field FIELDS[] = {
+      {"packets_received", &Stats::packetsReceived},
+      {"binding_requests", &Stats::bindingRequests},
+      {"responses_sent", &Stats::responsesSent},
+      {"invalid_packets", &Stats::invalidPackets},
+      {"send_errors", &Stats::sendErrors},
+      {"tcp_connections", &Stats::tcpConnections},
+      {"tcp_outbox_dropped", &Stats::tcpOutboxDropped},
+      {"tcp_timeouts", &Stats::tcpTimeouts},
+      {"tls_handshake_errors", &Stats::tlsHandshakeErrors},
+      {"dtls_connections", &Stats::dtlsConnections},
+      {"dtls_handshakes", &Stats::dtlsHandshakes},
+      {"dtls_resumed", &Stats::dtlsResumed},
+      {"dtls_cookie_challenges", &Stats::dtlsCookieChallenges},
+      {"dtls_handshake_errors", &Stats::dtlsHandshakeErrors},
+      {"proxy_headers", &Stats::proxyHeaders},
+      {"proxy_errors", &Stats::proxyErrors},
+      {"turn_allocations", &Stats::turnAllocations},
+      {"turn_requests", &Stats::turnRequests},
+      {"relayed_to_peer", &Stats::relayedToPeer},
+      {"relayed_to_client", &Stats::relayedToClient},
+      {"relay_dropped", &Stats::relayDropped},
+      {"relay_paced", &Stats::relayPaced},
+      {"pacing_dropped", &Stats::pacingDropped},
+      {"usage_records", &Stats::usageRecords},
+      {"usage_bytes_written", &Stats::usageBytesWritten},
+      {"usage_write_errors", &Stats::usageWriteErrors},
+      {"redirects", &Stats::redirects},
+      {"cluster_rejected", &Stats::clusterRejected},
+      {"change_requests", &Stats::changeRequests},
+      {"retransmit_hits", &Stats::retransmitHits},
+      {"auth_rejected", &Stats::authRejected},
+      {"crypto_jobs", &Stats::cryptoJobs},
+      {"crypto_inline", &Stats::cryptoInline},
+      {"crypto_queue_wait_ns_total", &Stats::cryptoQueueWaitNs},
+      {"crypto_process_ns_total", &Stats::cryptoProcessNs},
+      {"crypto_return_ns_total", &Stats::cryptoReturnNs},
+      {"token_decrypts", &Stats::tokenDecrypts},
+      {"token_cache_hits", &Stats::tokenCacheHits},
+      {"external_auth_lookups", &Stats::externalAuthLookups},
+      {"external_auth_batches", &Stats::externalAuthBatches},
+      {"external_auth_cache_hits", &Stats::externalAuthCacheHits},
+      {"external_auth_coalesced", &Stats::externalAuthCoalesced},
+      {"external_auth_failures", &Stats::externalAuthFailures},
+      {"profile_samples", &Stats::profileSamples},
+      {"profile_dropped", &Stats::profileDropped},
+      {"captured_packets", &Stats::capturedPackets},
+      {"pool_allocations", &Stats::poolAllocations},
+      {"pool_allocation_capacity", &Stats::poolAllocationCapacity},
+      {"pool_channels", &Stats::poolChannels},
+      {"pool_channel_capacity", &Stats::poolChannelCapacity},
+      {"pool_bytes", &Stats::poolBytes},
+  };
+}
+
+std::string renderStats(const Stats& stats)
+{
+  std::string out;
+  for (const auto& field : FIELDS)
+    out += fmt::format("ustun_{} {}\n", field.name, (stats.*field.counter).load(std::memory_order_relaxed));
+  return out;
+}
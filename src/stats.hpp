@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Counters shared by every listener and worker
+struct Stats
+{
+  std::atomic<uint64_t> packetsReceived {0};
+  std::atomic<uint64_t> bindingRequests {0};
+  std::atomic<uint64_t> responsesSent {0};
+  std::atomic<uint64_t> invalidPackets {0};
+  std::atomic<uint64_t> sendErrors {0};
+  std::atomic<uint64_t> tcpConnections {0};
+  std::atomic<uint64_t> tcpOutboxDropped {0}; // messages for a TCP/TLS client not reading
+  std::atomic<uint64_t> tcpTimeouts {0}; // handshake or idle deadline
+  std::atomic<uint64_t> tlsHandshakeErrors {0};
+  std::atomic<uint64_t> dtlsConnections {0}; // gauge
+  std::atomic<uint64_t> dtlsHandshakes {0};
+  std::atomic<uint64_t> dtlsResumed {0}; // abbreviated handshakes, from the session cache
+  std::atomic<uint64_t> dtlsCookieChallenges {0}; // HelloVerifyRequests, no state kept
+  std::atomic<uint64_t> dtlsHandshakeErrors {0};
+  std::atomic<uint64_t> proxyHeaders {0};
+  std::atomic<uint64_t> proxyErrors {0};
+  std::atomic<uint64_t> turnAllocations {0}; // gauge
+  std::atomic<uint64_t> turnRequests {0};
+  std::atomic<uint64_t> relayedToPeer {0};
+  std::atomic<uint64_t> relayedToClient {0};
+  std::atomic<uint64_t> relayDropped {0};
+  std::atomic<uint64_t> relayPaced {0};
+  std::atomic<uint64_t> pacingDropped {0};
+  std::atomic<uint64_t> usageRecords {0};
+  std::atomic<uint64_t> usageBytesWritten {0};
+  std::atomic<uint64_t> usageWriteErrors {0};
+  std::atomic<uint64_t> redirects {0};
+  std::atomic<uint64_t> clusterRejected {0}; // heartbeats with a bad tag or a stale timestamp
+  std::atomic<uint64_t> changeRequests {0}; // answered from another NAT discovery listener
+  std::atomic<uint64_t> retransmitHits {0};
+  std::atomic<uint64_t> authRejected {0};
+  std::atomic<uint64_t> cryptoJobs {0};
+  std::atomic<uint64_t> cryptoInline {0}; // pipeline full, verified on the I/O worker
+  std::atomic<uint64_t> cryptoQueueWaitNs {0};
+  std::atomic<uint64_t> cryptoProcessNs {0};
+  std::atomic<uint64_t> cryptoReturnNs {0};
+  std::atomic<uint64_t> tokenDecrypts {0};
+  std::atomic<uint64_t> tokenCacheHits {0};
+  std::atomic<uint64_t> externalAuthLookups {0};
+  std::atomic<uint64_t> externalAuthBatches {0};
+  std::atomic<uint64_t> externalAuthCacheHits {0};
+  std::atomic<uint64_t> externalAuthCoalesced {0};
+  std::atomic<uint64_t> externalAuthFailures {0};
+  std::atomic<uint64_t> profileSamples {0};
+  std::atomic<uint64_t> profileDropped {0}; // stack table full, or no unwinder for the CPU
+  std::atomic<uint64_t> capturedPackets {0};
+  std::atomic<uint64_t> poolAllocations {0}; // gauges, see SlabPool
+  std::atomic<uint64_t> poolAllocationCapacity {0};
+  std::atomic<uint64_t> poolChannels {0};
+  std::atomic<uint64_t> poolChannelCapacity {0};
+  std::atomic<uint64_t> poolBytes {0};
+};
+
+// One "ustun_<name> <value>" line per counter
+std::string renderStats(const Stats& stats);
+
+inline void statsInc(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void statsDec(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+  counter.fetch_sub(n, std::memory_order_relaxed);
+}
@@ -0,0 +1,133 @@
+#include "stunMessage.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace ustun::protocol;
+
+namespace
+{
+  ustun::Address toAddress(const boost::asio::ip::udp::endpoint& endpoint)
+  {
+    ustun::Address address;
+    address.port = endpoint.port();
+    if (endpoint.address().is_v4())
+    {
+      const auto ip  = endpoint.address().to_v4().to_bytes();
+      address.family = FAMILY_IPV4;
+      std::copy(ip.begin(), ip.end(), address.bytes);
+    }
+    else
+    {
+      const auto ip  = endpoint.address().to_v6().to_bytes();
+      address.family = FAMILY_IPV6;
+      std::copy(ip.begin(), ip.end(), address.bytes);
+    }
+    return address;
+  }
+
+  std::size_t addressLength(const boost::asio::ip::udp::endpoint& endpoint)
+  {
+    return endpoint.address().is_v4() ? 8 : 20;
+  }
+}
+
+bool StunMessage::xorAddress(uint16_t type, boost::asio::ip::udp::endpoint& out) const
+{
+  StunAttribute attr;
+  return find(type, attr) && xorAddress(attr, out);
+}
+
+bool StunMessage::xorAddress(const StunAttribute& attr, boost::asio::ip::udp::endpoint& out) const
+{
+  ustun::Address address;
+  if (!_view.xorAddress(attr, address))
+    return false;
+
+  if (address.family == FAMILY_IPV4)
+  {
+    boost::asio::ip::address_v4::bytes_type ip;
+    std::copy(address.bytes, address.bytes + ip.size(), ip.begin());
+    out = {boost::asio::ip::address_v4(ip), address.port};
+  }
+  else
+  {
+    boost::asio::ip::address_v6::bytes_type ip;
+    std::copy(address.bytes, address.bytes + ip.size(), ip.begin());
+    out = {boost::asio::ip::address_v6(ip), address.port};
+  }
+  return true;
+}
+
+StunMessageBuilder::StunMessageBuilder(
+    std::vector<uint8_t>& out, uint16_t type, const uint8_t trans_id[12])
+    : _out(out)
+    , _start(out.size())
+{
+  ustun::encodeHeader(grow(STUN_HEADER_SIZE), type, 0, trans_id);
+}
+
+void StunMessageBuilder::addAttribute(uint16_t type, const void* value, uint16_t length)
+{
+  ustun::encodeAttribute(grow(ustun::attributeSize(length)), type, static_cast<const uint8_t*>(value), length);
+  updateLength();
+}
+
+void StunMessageBuilder::addUint32(uint16_t type, uint32_t value)
+{
+  const uint8_t be[4] = {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+      static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)};
+  addAttribute(type, be, sizeof(be));
+}
+
+void StunMessageBuilder::addAddress(uint16_t type, const boost::asio::ip::udp::endpoint& endpoint)
+{
+  ustun::encodeAddress(grow(ustun::attributeSize(addressLength(endpoint))), type, toAddress(endpoint));
+  updateLength();
+}
+
+void StunMessageBuilder::addXorAddress(
+    uint16_t type, const boost::asio::ip::udp::endpoint& endpoint)
+{
+  uint8_t* p = grow(ustun::attributeSize(addressLength(endpoint)));
+  ustun::encodeAddress(p, type, toAddress(endpoint), _out.data() + _start + 8);
+  updateLength();
+}
+
+void StunMessageBuilder::addErrorCode(unsigned code, const char* reason)
+{
+  const uint16_t reasonLength = static_cast<uint16_t>(std::min<std::size_t>(std::strlen(reason), 128));
+  ustun::encodeErrorCode(grow(ustun::attributeSize(4 + reasonLength)), code, reason, reasonLength);
+  updateLength();
+}
+
+void StunMessageBuilder::addAttributeHeader(uint16_t type, uint16_t length)
+{
+  uint8_t* p = grow(4);
+  p[0]       = static_cast<uint8_t>(type >> 8);
+  p[1]       = static_cast<uint8_t>(type);
+  p[2]       = static_cast<uint8_t>(length >> 8);
+  p[3]       = static_cast<uint8_t>(length);
+  updateLength(ustun::attributeSize(length) - 4);
+}
+
+uint8_t* StunMessageBuilder::grow(std::size_t bytes)
+{
+  _out.resize(_out.size() + bytes);
+  return _out.data() + _out.size() - bytes;
+}
+
+void StunMessageBuilder::updateLength(std::size_t extra)
+{
+  const std::size_t length = _out.size() + extra - _start - STUN_HEADER_SIZE;
+  _out[_start + 2]         = static_cast<uint8_t>(length >> 8);
+  _out[_start + 3]         = static_cast<uint8_t>(length);
+}
+
+void buildErrorResponse(
+    std::vector<uint8_t>& out, const StunMessage& req, unsigned code, const char* reason)
+{
+  out.clear();
+  StunMessageBuilder resp(out, messageType(req.method(), CLASS_ERROR), req.transactionId());
+  resp.addErrorCode(code, reason);
+}
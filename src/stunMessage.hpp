@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include <ustun/stunCodec.hpp>
+
+// The protocol constants and helpers (MAGIC_COOKIE, METHOD_*, CLASS_*, ATTR_*,
+// messageType(), isChannelData()...) come from the codec, in ustun::protocol
+
+// Hard limits of the parser, they bound the cost of a message: every
+// attribute lookup walks the attribute chain. They hold for every transport,
+// stream listeners close the connection on a larger STUN message.
+constexpr std::size_t STUN_MAX_MESSAGE_SIZE = ustun::Limits().maxSize;
+constexpr std::size_t STUN_MAX_ATTRIBUTES   = ustun::Limits().maxAttributes;
+
+#pragma pack(push, 1)
+struct StunHeader
+{
+  uint16_t type;
+  uint16_t length;
+  uint32_t cookie;
+  uint8_t trans_id[12];
+};
+
+struct ChannelDataHeader
+{
+  uint16_t channel;
+  uint16_t length;
+};
+#pragma pack(pop)
+
+using StunAttribute = ustun::Attribute;
+
+// Read-only view over a received message, attributes are not copied
+class StunMessage {
+  public:
+    // Validates the header and the attribute chain, within
+    // STUN_MAX_MESSAGE_SIZE and STUN_MAX_ATTRIBUTES
+    bool parse(const uint8_t* data, std::size_t bytes) { return _view.parse(data, bytes); }
+
+    uint16_t type() const { return _view.type(); }
+    uint16_t method() const { return _view.method(); }
+    uint16_t cls() const { return _view.cls(); }
+    const uint8_t* transactionId() const { return _view.transactionId(); }
+    const uint8_t* data() const { return _view.data(); }
+    std::size_t size() const { return _view.size(); }
+    const ustun::MessageView& view() const { return _view; }
+
+    // First attribute of the given type, false when absent. Only FINGERPRINT
+    // is looked for past MESSAGE-INTEGRITY
+    bool find(uint16_t type, StunAttribute& out) const { return _view.find(type, out); }
+
+    // Calls f(const StunAttribute&) for every attribute of the given type
+    template<typename F>
+    void forEach(uint16_t type, F f) const
+    {
+      _view.forEach(type, f);
+    }
+
+    // Decodes an XOR-*-ADDRESS attribute
+    bool xorAddress(uint16_t type, boost::asio::ip::udp::endpoint& out) const;
+    bool xorAddress(const StunAttribute& attr, boost::asio::ip::udp::endpoint& out) const;
+
+  private:
+    ustun::MessageView _view;
+};
+
+// Appends a message to a caller owned buffer, the header length is kept up to
+// date after every attribute
+class StunMessageBuilder {
+  public:
+    StunMessageBuilder(std::vector<uint8_t>& out, uint16_t type, const uint8_t trans_id[12]);
+
+    void addAttribute(uint16_t type, const void* value, uint16_t length);
+    void addUint32(uint16_t type, uint32_t value);
+    void addAddress(uint16_t type, const boost::asio::ip::udp::endpoint& endpoint);
+    void addXorAddress(uint16_t type, const boost::asio::ip::udp::endpoint& endpoint);
+    void addErrorCode(unsigned code, const char* reason);
+    // Header of a last attribute whose value (and padding) the caller lays
+    // out right after the message, counted in the message length
+    void addAttributeHeader(uint16_t type, uint16_t length);
+
+  private:
+    // Room for bytes more at the end of the message
+    uint8_t* grow(std::size_t bytes);
+    void updateLength(std::size_t extra = 0);
+
+  private:
+    std::vector<uint8_t>& _out;
+    std::size_t _start;
+};
+
+// Error response with ERROR-CODE, replaces the content of out
+void buildErrorResponse(std::vector<uint8_t>& out, const StunMessage& req, unsigned code,
+    const char* reason);
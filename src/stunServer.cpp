@@ -1,71 +1,252 @@
 #include "stunServer.hpp"
+#include "cluster.hpp"
+#include "controlServer.hpp"
+#include "cryptoPool.hpp"
+#include "dtlsListener.hpp"
+#include "memoryAccounting.hpp"
+#include "packetCapture.hpp"
+#include "profiler.hpp"
+#include "responseCache.hpp"
+#include "stunMessage.hpp"
+#include "tcpListener.hpp"
+#include "tenantTable.hpp"
+#include "tokenCache.hpp"
+#include "tracer.hpp"
+#include "turnServer.hpp"
+#include "udpListener.hpp"
+#include "usageLog.hpp"
 
-#include <spdlog/spdlog.h>
+#include <algorithm>
 
+#include <spdlog/spdlog.h>
 
 using boost::asio::ip::udp;
+using namespace ustun::protocol;
 
-constexpr uint32_t MAGIC_COOKIE         = 0x2112A442;
-constexpr uint16_t BINDING_REQUEST      = 0x0001;
-constexpr uint16_t BINDING_SUCCESS_RESP = 0x0101;
-constexpr uint16_t XOR_MAPPED_ADDRESS   = 0x0020;
-
-#pragma pack(push, 1)
-struct StunHeader
+namespace
 {
-  uint16_t type;
-  uint16_t length;
-  uint32_t cookie;
-  uint8_t trans_id[12];
-};
-#pragma pack(pop)
+  // Discovery slot the response leaves from, as CHANGE-REQUEST asks
+  unsigned originSlot(unsigned slot, const StunMessage& msg)
+  {
+    StunAttribute change;
+    if (!msg.find(ATTR_CHANGE_REQUEST, change) || change.length != 4)
+      return slot;
+    const uint8_t flags = change.value[3];
+    return slot ^ ((flags & CHANGE_IP) ? 2 : 0) ^ ((flags & CHANGE_PORT) ? 1 : 0);
+  }
+}
 
-#pragma pack(push, 1)
-struct XorMappedAddressHeader
+StunServer::StunServer(const ServerConfig& config)
+    : _config(config)
 {
-  uint16_t type; // always 0x0020
-  uint16_t length; // 8 (IPv4) or 20 (IPv6)
-  uint8_t reserved; // always 0x00
-  uint8_t family; // 0x01 = IPv4, 0x02 = IPv6
-  uint16_t xport; // XORed port
-};
+  for (unsigned i = 0; i < _config.workers; ++i)
+    _workers.emplace_back(new Worker(i));
 
-struct XorMappedAddressIPv4
-{
-  XorMappedAddressHeader hdr;
-  uint32_t xaddr; // XORed IPv4 address
-};
+  if (!_config.capture.path.empty())
+  {
+    for (unsigned i = 0; i < _config.workers; ++i)
+      _captures.emplace_back(new PacketCapture(_config.capture, i, _stats));
+    spdlog::info("Capturing datagrams to {} ({} MB per worker)", _captures.front()->path(),
+        _config.capture.bytes >> 20);
+  }
+
+  _workerStates.resize(_workers.size());
+  for (const auto& listenerConfig : _config.listeners)
+  {
+    boost::asio::ssl::context* tls = nullptr;
+    if (listenerConfig.transport == Transport::Tls)
+    {
+      _tlsContexts.emplace_back(new boost::asio::ssl::context(boost::asio::ssl::context::tls_server));
+      tls = _tlsContexts.back().get();
+      tls->set_options(boost::asio::ssl::context::default_workarounds
+          | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3
+          | boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1);
+      tls->use_certificate_chain_file(listenerConfig.certFile);
+      tls->use_private_key_file(listenerConfig.keyFile, boost::asio::ssl::context::pem);
+    }
+    DtlsContext* dtls = nullptr;
+    if (listenerConfig.transport == Transport::Dtls)
+    {
+      _dtlsContexts.emplace_back(new DtlsContext(listenerConfig));
+      dtls = _dtlsContexts.back().get();
+    }
+
+    int slot = -1;
+    for (unsigned i = 0; i < 4 && _config.discovery.enabled() && listenerConfig.transport == Transport::Udp; ++i)
+    {
+      if (_config.discovery.endpoint(i) == udp::endpoint(listenerConfig.address, listenerConfig.port))
+        slot = static_cast<int>(i);
+    }
+
+    // One socket per worker and listener, the kernel spreads the load
+    for (auto& worker : _workers)
+    {
+      if (listenerConfig.transport == Transport::Udp)
+      {
+        auto listener = std::make_shared<UdpListener>(*worker, *this, listenerConfig);
+        if (slot >= 0)
+          _workerStates[worker->index()].discovery[slot] = listener.get();
+        _listeners.push_back(listener);
+      }
+      else if (dtls)
+        _listeners.push_back(std::make_shared<DtlsListener>(*worker, *this, listenerConfig, *dtls));
+      else
+        _listeners.push_back(TcpListener::create(*worker, *this, listenerConfig, tls));
+    }
+
+    spdlog::info("STUN server listening on {} {}:{} ({} worker(s))",
+        transport2str(listenerConfig.transport), listenerConfig.address.to_string(),
+        listenerConfig.port, _workers.size());
+  }
+
+  _tenants.reset(new TenantTable(_config.tenants, _config.workers));
+
+  if (_config.turn.enabled && !_config.usage.path.empty())
+    _usage.reset(new UsageLog(_config.usage, _stats));
+
+  for (auto& worker : _workers)
+  {
+    auto& state = _workerStates[worker->index()];
+    state.responseCache.reset(new ResponseCache(_config.responseCacheEntries));
+    state.tokenCache.reset(new TokenCache(
+        _config.auth.tokenKeys.empty() ? 0 : _config.auth.tokenCacheEntries));
+    if (std::any_of(_config.tenants.begin(), _config.tenants.end(),
+            [](const TenantConfig& tenant) { return !tenant.authSocket.empty(); }))
+      state.externalAuth.reset(new ExternalAuth(*worker, _config.tenants, _config.auth, _stats));
+    if (_config.turn.enabled)
+      state.turn.reset(new TurnServer(*worker, _config.turn, *_tenants, _stats, _usage.get()));
+  }
+
+  if (_config.turn.enabled)
+  {
+    spdlog::info("TURN relay on {}, advertised as {}", _config.turn.relayAddress.to_string(),
+        _config.turn.externalAddress.to_string());
+    if (!_config.authEnabled())
+      spdlog::warn("TURN relay without credentials: anybody can allocate (turn-allow-anonymous)");
+  }
+
+  if (_config.cluster.enabled())
+    _cluster.reset(new Cluster(_workers.front()->io(), _config.cluster, _stats));
+
+  if (_config.authEnabled())
+  {
+    _auth.reset(new LongTermAuth());
+    for (std::size_t id = 0; id < _config.tenants.size(); ++id)
+    {
+      _auth->addTenant(_config.tenants[id].realm);
+      for (const auto& user : _config.tenants[id].users)
+        _auth->addUser(static_cast<TenantId>(id), user.first, user.second);
+    }
+    for (const auto& tokenKey : _config.auth.tokenKeys)
+      _auth->addTokenKey(tokenKey.first, tokenKey.second);
+    _auth->setTokenServer(_config.auth.tokenServer);
+
+    if (_config.cryptoWorkers > 0)
+    {
+      std::vector<Worker*> workers;
+      for (auto& worker : _workers)
+        workers.push_back(worker.get());
+      _crypto.reset(new CryptoPool(_config.cryptoWorkers, workers, *_auth, _stats,
+          [this](Worker& worker, CryptoJob& job) { completeAuth(worker, job); }));
+    }
+  }
+
+  if (!_config.controlSocket.empty())
+  {
+    _control.reset(new ControlServer(_workers.front()->io(), _config.controlSocket));
+    _control->addCommand("stats", [this](const std::string&) { return renderMetrics(); });
+  }
 
-struct XorMappedAddressIPv6
+  if (_config.profileHz > 0)
+  {
+    _profiler.reset(new Profiler(_config.profileHz, _config.workers, _stats));
+    for (auto& worker : _workers)
+      boost::asio::post(worker->io(), [this, index = worker->index()] { _profiler->attach(index); });
+
+    if (_control)
+    {
+      _control->addCommand("profile", [this](const std::string& args) {
+        if (args.empty() || args == "folded")
+          return _profiler->folded();
+        if (args == "pprof")
+          return _profiler->pprof();
+        if (args == "reset")
+        {
+          _profiler->reset();
+          return std::string("ok\n");
+        }
+        return std::string("usage: profile [folded|pprof|reset]\n");
+      });
+    }
+    else
+      spdlog::warn("Profiling without a control socket, the samples cannot be read");
+  }
+
+  if (_config.trace.sampleEvery > 0)
+  {
+    _tracer.reset(new Tracer(_config.trace, _config.workers));
+    if (_control)
+    {
+      _control->addCommand("trace", [this](const std::string& args) {
+        if (args.empty())
+          return _tracer->chromeJson();
+        if (args == "reset")
+        {
+          _tracer->reset();
+          return std::string("ok\n");
+        }
+        return std::string("usage: trace [reset]\n");
+      });
+    }
+    else
+      spdlog::warn("Tracing without a control socket, the traces cannot be read");
+  }
+}
+
+std::string StunServer::renderMetrics() const
 {
-  XorMappedAddressHeader hdr;
-  uint8_t xaddr[16]; // XORed IPv6 address
-};
-#pragma pack(pop)
+  std::string out = renderStats(_stats) + _tenants->render() + MemoryAccounting::render();
+  if (_crypto)
+  {
+    out += fmt::format("ustun_crypto_request_queue_depth {}\n", _crypto->requestQueueDepth());
+    out += fmt::format("ustun_crypto_completion_queue_depth {}\n", _crypto->completionQueueDepth());
+  }
+  return out;
+}
 
-StunServer::StunServer(boost::asio::io_context& io, const uint16_t port)
-    : _socket(io, udp::endpoint(udp::v4(), port))
+StunServer::~StunServer()
 {
-  spdlog::info("STUN server listening on UDP port {}", port);
-  startReceive();
+  stop();
 }
 
-void StunServer::stop()
+void StunServer::start()
 {
-  boost::system::error_code ec;
-  _socket.close(ec);
-  if (ec)
-    spdlog::warn("Error while closing socket: {}", ec.message());
+  if (_crypto)
+    _crypto->start();
+  for (auto& worker : _workers)
+    worker->start();
 }
 
-void StunServer::startReceive()
+void StunServer::stop()
 {
-  _socket.async_receive_from(boost::asio::buffer(_buffer), _remote,
-      [this](boost::system::error_code ec, std::size_t bytes) {
-        if (!ec)
-          handlePacket(bytes);
-        startReceive();
-      });
+  if (_stopped)
+    return;
+  _stopped = true;
+
+  if (_crypto)
+    _crypto->stop();
+  // Sockets belong to the worker threads, they are only closed once those
+  // are gone
+  for (auto& worker : _workers)
+    worker->stop();
+  for (auto& worker : _workers)
+    worker->join();
+  for (auto& listener : _listeners)
+    listener->stop();
+  if (_cluster)
+    _cluster->stop();
+  if (_control)
+    _control->stop();
 }
 
 std::string StunServer::endpoint2str(const boost::asio::ip::udp::endpoint& remote)
@@ -73,90 +254,355 @@ std::string StunServer::endpoint2str(const boost::asio::ip::udp::endpoint& remot
   return fmt::format("{}:{}", remote.address().to_string(), remote.port());
 }
 
-void StunServer::handlePacket(const std::size_t bytes)
+void StunServer::clientClosed(Worker& worker, ClientSender* sender)
 {
-  if (bytes < sizeof(StunHeader))
-    return;
+  if (_config.turn.enabled)
+    _workerStates[worker.index()].turn->clientClosed(sender);
+}
 
-  const auto* hdr   = reinterpret_cast<const StunHeader*>(_buffer.data());
-  uint16_t msg_type = ntohs(hdr->type);
-  uint32_t cookie   = ntohl(hdr->cookie);
+bool StunServer::handleMessage(RequestContext& ctx, const uint8_t* data,
+    const std::size_t bytes, std::vector<uint8_t>& resp)
+{
+  statsInc(_stats.packetsReceived);
+
+  if (isChannelData(data, bytes))
+  {
+    if (_config.turn.enabled)
+      _workerStates[ctx.worker.index()].turn->handleChannelData(ctx, data, bytes);
+    return false;
+  }
 
-  const auto remoteStr = endpoint2str(_remote);
+  ctx.trace = _tracer ? _tracer->sample(ctx.worker.index()) : 0;
 
-  if (msg_type != BINDING_REQUEST || cookie != MAGIC_COOKIE)
+  TraceScope receive(_tracer.get(), ctx, TraceStage::Receive);
+  StunMessage msg;
+  if (!msg.parse(data, bytes))
   {
-    spdlog::debug("Ignoring non-Binding or invalid STUN packet from {}", remoteStr);
-    return;
+    // Hostile traffic lands here, the address is only formatted when logged
+    statsInc(_stats.invalidPackets);
+    if (spdlog::should_log(spdlog::level::debug))
+      spdlog::debug("Ignoring invalid STUN packet from {}", endpoint2str(ctx.remote));
+    return false;
+  }
+  receive.finish();
+
+  TraceScope classify(_tracer.get(), ctx, TraceStage::Classify);
+  auto& cache = *_workerStates[ctx.worker.index()].responseCache;
+  if (isCacheable(msg) && cache.lookup(ctx.sender, ctx.remote, msg.transactionId(), resp))
+  {
+    statsInc(_stats.retransmitHits);
+    return true;
+  }
+
+  if (msg.cls() != CLASS_REQUEST)
+  {
+    classify.finish();
+    return respond(ctx, msg, AuthResult::Ok, nullptr, nullptr, resp);
   }
 
-  spdlog::info("Received Binding Request from {}", remoteStr);
+  // The tenant is resolved once here, the rest of the request works on its id
+  RequestContext tenantCtx = ctx;
+  StunAttribute realm;
+  if (msg.find(ATTR_REALM, realm))
+  {
+    const TenantId tenant = _tenants->find(realm.value, realm.length);
+    if (tenant != INVALID_TENANT)
+      tenantCtx.tenant = tenant;
+  }
+  classify.finish();
+
+  // REALM is not authenticated yet: the listener's tenant pays for the
+  // request, the tenant it names only once MESSAGE-INTEGRITY is verified
+  TraceScope admission(_tracer.get(), ctx, TraceStage::Admission);
+  if (!_tenants->admitRequest(ctx.worker.index(), ctx.tenant))
+    return false;
+  tenantCtx.charged = ctx.tenant;
+  admission.finish();
+
+  return handleRequest(tenantCtx, msg, resp);
+}
+
+bool StunServer::handleRequest(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  if (_auth && requiresAuth(msg))
+  {
+    TraceScope auth(_tracer.get(), ctx, TraceStage::Auth);
 
-  std::vector<uint8_t> attrs;
-  buildXorMappedAttr(attrs, _remote, hdr->trans_id);
+    // Challenges are cheap, only the HMAC checks go through the pipeline
+    StunAttribute integrity;
+    if (!msg.find(ATTR_MESSAGE_INTEGRITY, integrity))
+    {
+      auth.finish();
+      return respond(ctx, msg, AuthResult::Unauthorized, nullptr, nullptr, resp);
+    }
 
-  StunHeader resp_hdr {};
-  resp_hdr.type   = htons(BINDING_SUCCESS_RESP);
-  resp_hdr.length = htons(attrs.size());
-  resp_hdr.cookie = htonl(MAGIC_COOKIE);
-  std::memcpy(resp_hdr.trans_id, hdr->trans_id, 12);
+    // A known access token skips the decryption, only the HMAC remains
+    AccessToken token;
+    StunAttribute username, accessToken;
+    if (msg.find(ATTR_ACCESS_TOKEN, accessToken) && msg.find(ATTR_USERNAME, username)
+        && _workerStates[ctx.worker.index()].tokenCache->lookup(username, accessToken, token))
+      statsInc(_stats.tokenCacheHits);
+
+    // Users unknown locally may be known to the tenant's own service
+    const auto& external = _workerStates[ctx.worker.index()].externalAuth;
+    if (external && external->enabled(ctx.tenant) && !msg.find(ATTR_ACCESS_TOKEN, accessToken)
+        && msg.find(ATTR_USERNAME, username))
+    {
+      const std::string name(reinterpret_cast<const char*>(username.value), username.length);
+      if (!_auth->hasUser(ctx.tenant, name))
+      {
+        auth.finish();
+        return lookupExternal(ctx, msg, name, resp);
+      }
+    }
+
+    if (_crypto && _crypto->submit(ctx, msg, token))
+      return false;
+
+    AuthKey key;
+    const auto result = _auth->verify(msg, ctx.tenant, key, token);
+    auth.finish();
+    return respond(ctx, msg, result, &key, &token, resp);
+  }
+
+  return respond(ctx, msg, AuthResult::Ok, nullptr, nullptr, resp);
+}
+
+bool StunServer::lookupExternal(
+    const RequestContext& ctx, const StunMessage& msg, const std::string& username, std::vector<uint8_t>& resp)
+{
+  auto& external = *_workerStates[ctx.worker.index()].externalAuth;
 
-  std::vector<uint8_t> resp(sizeof(resp_hdr));
-  std::memcpy(resp.data(), &resp_hdr, sizeof(resp_hdr));
-  resp.insert(resp.end(), attrs.begin(), attrs.end());
+  ExternalAuth::Status status;
+  AuthKey key;
+  if (external.cached(ctx.tenant, username, status, key))
+    return verifyExternal(ctx, msg, status, key, resp);
 
-  _socket.async_send_to(boost::asio::buffer(resp), _remote,
-      [remote = _remote, remoteStr](boost::system::error_code ec, std::size_t) {
-        if (ec)
-          spdlog::warn("Failed to send response to {}: {}", remoteStr, ec.message());
-        else
-          spdlog::debug("Sent Binding Success to {}", remoteStr);
+  // The request is kept until the answer comes back, the worker moves on
+  Worker& worker       = ctx.worker;
+  const auto sender    = ctx.sender->retain();
+  const auto copy      = std::make_shared<std::vector<uint8_t>>(msg.data(), msg.data() + msg.size());
+  const RequestContext saved {worker, ctx.transport, ctx.remote, ctx.peer, nullptr, ctx.tenant, ctx.trace, ctx.charged};
+  const uint64_t asked = ctx.trace ? Tracer::now() : 0;
+  status = external.lookup(ctx.tenant, username,
+      [this, sender, copy, saved, asked](ExternalAuth::Status status, const AuthKey& key) {
+        if (saved.trace && _tracer)
+        {
+          _tracer->record(saved.worker.index(), saved.trace, TraceStage::ExternalAuth, asked, Tracer::now(),
+              saved.worker.index());
+        }
+
+        StunMessage pending;
+        if (!sender->alive() || !pending.parse(copy->data(), copy->size()))
+          return;
+
+        RequestContext ctx = saved;
+        ctx.sender         = sender.get();
+        auto& out          = _workerStates[ctx.worker.index()].response;
+        if (verifyExternal(ctx, pending, status, key, out))
+        {
+          TraceScope send(_tracer.get(), ctx, TraceStage::Send);
+          sender->sendToClient(out.data(), out.size(), ctx.peer);
+        }
       });
+
+  if (status == ExternalAuth::Status::Pending)
+    return false;
+  return verifyExternal(ctx, msg, status, key, resp);
+}
+
+bool StunServer::verifyExternal(const RequestContext& ctx, const StunMessage& msg, ExternalAuth::Status status,
+    const AuthKey& key, std::vector<uint8_t>& resp)
+{
+  if (status == ExternalAuth::Status::Unavailable)
+    return respond(ctx, msg, AuthResult::Unavailable, nullptr, nullptr, resp);
+
+  // An unknown user still gets the nonce and realm checks, for the right error
+  const AuthKey* userKey = status == ExternalAuth::Status::Found ? &key : nullptr;
+  AccessToken token;
+  if (userKey && _crypto && _crypto->submit(ctx, msg, token, userKey))
+    return false;
+  return respond(ctx, msg, _auth->verifyKey(msg, ctx.tenant, userKey), userKey, nullptr, resp);
 }
 
-void StunServer::buildXorMappedAttr(
-    std::vector<uint8_t>& out, const udp::endpoint& src, const uint8_t trans_id[12])
+// Authenticated and TURN requests are not idempotent or not cheap, a
+// retransmission gets the response of the first transmission
+bool StunServer::isCacheable(const StunMessage& msg)
 {
-  const auto addr   = src.address();
-  uint16_t port_xor = src.port() ^ (MAGIC_COOKIE >> 16);
+  StunAttribute integrity;
+  return msg.cls() == CLASS_REQUEST
+      && (msg.method() != METHOD_BINDING || msg.find(ATTR_MESSAGE_INTEGRITY, integrity));
+}
+
+// TURN requests always, other requests when they carry credentials
+bool StunServer::requiresAuth(const StunMessage& msg) const
+{
+  StunAttribute integrity;
+  return msg.cls() == CLASS_REQUEST
+      && ((_config.turn.enabled && msg.method() != METHOD_BINDING)
+          || msg.find(ATTR_MESSAGE_INTEGRITY, integrity));
+}
+
+bool StunServer::respond(const RequestContext& ctx, const StunMessage& msg, AuthResult auth,
+    const AuthKey* key, const AccessToken* token, std::vector<uint8_t>& resp)
+{
+  TraceScope build(_tracer.get(), ctx, TraceStage::Build);
+
+  StunAttribute username, accessToken;
+  if (token && token->decrypted && msg.find(ATTR_ACCESS_TOKEN, accessToken)
+      && msg.find(ATTR_USERNAME, username))
+  {
+    statsInc(_stats.tokenDecrypts);
+    if (auth == AuthResult::Ok)
+      _workerStates[ctx.worker.index()].tokenCache->insert(username, accessToken, *token);
+  }
 
-  if (addr.is_v4())
+  if (auth != AuthResult::Ok)
+  {
+    statsInc(_stats.authRejected);
+    if (auth == AuthResult::BadRequest)
+      buildErrorResponse(resp, msg, 400, "Bad Request");
+    else if (auth == AuthResult::Unavailable)
+      buildErrorResponse(resp, msg, 500, "Server Error");
+    else
+      _auth->challenge(resp, msg, auth, ctx.tenant);
+  }
+  else
   {
-    uint32_t ip = addr.to_v4().to_uint() ^ MAGIC_COOKIE;
+    if (key && ctx.tenant != ctx.charged && !_tenants->admitRequest(ctx.worker.index(), ctx.tenant))
+      return false;
+    if (!processMessage(ctx, msg, resp))
+      return false;
+    if (key)
+      LongTermAuth::sign(resp, *key);
+
+    // CHANGE-REQUEST: sent from the other listener, never cached, a
+    // retransmission is answered again
+    const int slot = discoverySlot(ctx);
+    if (slot >= 0 && msg.type() == BINDING_REQUEST)
+    {
+      const unsigned origin = originSlot(static_cast<unsigned>(slot), msg);
+      if (origin != static_cast<unsigned>(slot))
+      {
+        statsInc(_stats.changeRequests);
+        _workerStates[ctx.worker.index()].discovery[origin]->sendToClient(resp.data(), resp.size(), ctx.peer);
+        return false;
+      }
+    }
+  }
+
+  // A retransmission may find the credential service back
+  if (isCacheable(msg) && auth != AuthResult::Unavailable)
+    _workerStates[ctx.worker.index()].responseCache->insert(
+        ctx.sender, ctx.remote, msg.transactionId(), resp);
+  return true;
+}
+
+// Back on the I/O worker with the verdict of the crypto stage
+void StunServer::completeAuth(Worker& worker, CryptoJob& job)
+{
+  if (!job.sender->alive())
+    return;
 
-    XorMappedAddressIPv4 attr {};
-    attr.hdr.type     = htons(XOR_MAPPED_ADDRESS);
-    attr.hdr.length   = htons(8);
-    attr.hdr.reserved = 0x00;
-    attr.hdr.family   = 0x01;
-    attr.hdr.xport    = htons(port_xor);
-    attr.xaddr        = htonl(ip);
+  StunMessage msg;
+  if (!msg.parse(job.data.data(), job.size))
+    return;
 
-    const uint8_t* p = reinterpret_cast<const uint8_t*>(&attr);
-    out.insert(out.end(), p, p + sizeof(attr));
+  const RequestContext ctx {worker, job.transport, job.remote, job.peer, job.sender.get(), job.tenant, job.trace, job.charged};
+  if (ctx.trace && _tracer)
+  {
+    _tracer->record(worker.index(), ctx.trace, TraceStage::Crypto, Tracer::nanoseconds(job.started),
+        Tracer::nanoseconds(job.finished), job.thread);
   }
-  else if (addr.is_v6())
+
+  auto& resp = _workerStates[worker.index()].response;
+  if (respond(ctx, msg, job.result, &job.key, &job.token, resp))
   {
-    auto ip6 = addr.to_v6().to_bytes();
+    TraceScope send(_tracer.get(), ctx, TraceStage::Send);
+    ctx.sender->sendToClient(resp.data(), resp.size(), ctx.peer);
+  }
+}
 
-    // XOR the first 4 bytes with the magic cookie,
-    // and the rest with the transaction ID (RFC 5389 §15.2)
-    uint8_t xor_mask[16];
-    std::memcpy(xor_mask, &MAGIC_COOKIE, 4);
-    std::memcpy(xor_mask + 4, trans_id, 12);
+bool StunServer::processMessage(const RequestContext& ctx, const StunMessage& msg,
+    std::vector<uint8_t>& resp)
+{
+  if (msg.type() == BINDING_REQUEST)
+  {
+    statsInc(_stats.bindingRequests);
+    if (spdlog::should_log(spdlog::level::debug))
+      spdlog::debug("Received Binding Request from {} over {}", endpoint2str(ctx.remote),
+          transport2str(ctx.transport));
+
+    if (_cluster && _cluster->shedBinding() && redirect(ctx, msg, resp))
+      return true;
+
+    // CHANGE-REQUEST is comprehension-required, only discovery listeners
+    // understand it
+    StunAttribute change;
+    const int slot = discoverySlot(ctx);
+    if (slot < 0 && msg.find(ATTR_CHANGE_REQUEST, change))
+    {
+      const uint8_t unknown[] = {ATTR_CHANGE_REQUEST >> 8, ATTR_CHANGE_REQUEST & 0xFF};
+      resp.clear();
+      StunMessageBuilder builder(resp, messageType(METHOD_BINDING, CLASS_ERROR), msg.transactionId());
+      builder.addErrorCode(420, "Unknown Attribute");
+      builder.addAttribute(ATTR_UNKNOWN_ATTRIBUTES, unknown, sizeof(unknown));
+      return true;
+    }
+
+    resp.clear();
+    StunMessageBuilder builder(resp, BINDING_SUCCESS_RESP, msg.transactionId());
+    builder.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, ctx.remote);
+    if (slot >= 0)
+    {
+      const auto origin = originSlot(static_cast<unsigned>(slot), msg);
+      builder.addAddress(ATTR_RESPONSE_ORIGIN, _config.discovery.endpoint(origin));
+      builder.addAddress(ATTR_OTHER_ADDRESS, _config.discovery.endpoint(static_cast<unsigned>(slot) ^ 3));
+    }
+    return true;
+  }
 
-    for (int i = 0; i < 16; i++)
-      ip6[i] ^= xor_mask[i];
+  if (_config.turn.enabled && msg.method() != METHOD_BINDING)
+  {
+    auto& turn = *_workerStates[ctx.worker.index()].turn;
 
-    XorMappedAddressIPv6 attr {};
-    attr.hdr.type     = htons(XOR_MAPPED_ADDRESS);
-    attr.hdr.length   = htons(20);
-    attr.hdr.reserved = 0x00;
-    attr.hdr.family   = 0x02;
-    attr.hdr.xport    = htons(port_xor);
-    std::memcpy(attr.xaddr, ip6.data(), 16);
+    // Only new clients are redirected, existing allocations stay here
+    if (msg.type() == messageType(METHOD_ALLOCATE, CLASS_REQUEST) && _cluster
+        && !turn.hasAllocation(ctx) && redirect(ctx, msg, resp))
+      return true;
 
-    const uint8_t* p = reinterpret_cast<const uint8_t*>(&attr);
-    out.insert(out.end(), p, p + sizeof(attr));
+    return turn.handleMessage(ctx, msg, resp);
   }
+
+  statsInc(_stats.invalidPackets);
+  if (spdlog::should_log(spdlog::level::debug))
+    spdlog::debug("Ignoring unsupported STUN message 0x{:04x} from {}", msg.type(),
+        endpoint2str(ctx.remote));
+  return false;
+}
+
+int StunServer::discoverySlot(const RequestContext& ctx) const
+{
+  if (!_config.discovery.enabled())
+    return -1;
+  const auto& slots = _workerStates[ctx.worker.index()].discovery;
+  const auto it     = std::find(slots.begin(), slots.end(), ctx.sender);
+  return it == slots.end() ? -1 : static_cast<int>(it - slots.begin());
+}
+
+bool StunServer::redirect(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  udp::endpoint alternate;
+  if (!_cluster->overloaded() || !_cluster->pickAlternate(ctx.remote, alternate))
+    return false;
+
+  statsInc(_stats.redirects);
+  if (spdlog::should_log(spdlog::level::debug))
+    spdlog::debug("Redirecting {} to {}", endpoint2str(ctx.remote), endpoint2str(alternate));
+
+  resp.clear();
+  StunMessageBuilder builder(resp, messageType(msg.method(), CLASS_ERROR), msg.transactionId());
+  builder.addErrorCode(300, "Try Alternate");
+  builder.addAddress(ATTR_ALTERNATE_SERVER, alternate);
+  return true;
 }
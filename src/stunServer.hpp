@@ -1,26 +1,114 @@
 #pragma once
 
 #include <array>
+#include <memory>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/asio/ssl/context.hpp>
+
+#include "auth.hpp"
+#include "config.hpp"
+#include "externalAuth.hpp"
+#include "listener.hpp"
+#include "stats.hpp"
+#include "worker.hpp"
+
+class Cluster;
+class ControlServer;
+class CryptoPool;
+class DtlsContext;
+struct CryptoJob;
+class PacketCapture;
+class Profiler;
+class ResponseCache;
+class StunMessage;
+class TenantTable;
+class TokenCache;
+class Tracer;
+class TurnServer;
+class UsageLog;
 
 class StunServer {
   public:
-    StunServer(boost::asio::io_context& io, const uint16_t port);
-    
-     void stop();
+    explicit StunServer(const ServerConfig& config);
+    ~StunServer();
 
-  private:
-    void startReceive();
-    void handlePacket(const std::size_t bytes);
-    void buildXorMappedAttr(std::vector<uint8_t>& out, const boost::asio::ip::udp::endpoint& src,
-        const uint8_t trans_id[12]);
+    void start();
+    // Joins the workers before closing their sockets, later calls do nothing
+    void stop();
+
+    // Processes one STUN message, returns false when nothing has to be sent
+    // back. Sets ctx.trace when the request is sampled by the tracer.
+    bool handleMessage(RequestContext& ctx, const uint8_t* data, std::size_t bytes,
+        std::vector<uint8_t>& resp);
+
+    // The client behind sender is gone, drop what it owned
+    void clientClosed(Worker& worker, ClientSender* sender);
+
+    Stats& stats() { return _stats; }
+    Tracer* tracer() { return _tracer.get(); } // null when tracing is disabled
+    // null when capture is disabled
+    PacketCapture* capture(const Worker& worker) { return _captures.empty() ? nullptr : _captures[worker.index()].get(); }
+    std::string renderMetrics() const;
 
     static std::string endpoint2str(const boost::asio::ip::udp::endpoint &remote);
-  
+
+  private:
+    // State owned by one worker, only touched from its thread
+    struct WorkerState
+    {
+      std::unique_ptr<TurnServer> turn;
+      std::unique_ptr<ResponseCache> responseCache;
+      std::unique_ptr<TokenCache> tokenCache;
+      std::unique_ptr<ExternalAuth> externalAuth; // null without external credential services
+      std::vector<uint8_t> response; // deferred responses
+      std::array<ClientSender*, 4> discovery {}; // UDP listeners by DiscoveryConfig slot
+    };
+
+    // Requests once their tenant is known
+    bool handleRequest(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp);
+
+    static bool isCacheable(const StunMessage& msg);
+    bool requiresAuth(const StunMessage& msg) const;
+
+    // Finishes a request once its credentials are checked: error response,
+    // or processing and signing, then caching
+    bool respond(const RequestContext& ctx, const StunMessage& msg, AuthResult auth,
+        const AuthKey* key, const AccessToken* token, std::vector<uint8_t>& resp);
+    void completeAuth(Worker& worker, CryptoJob& job);
+
+    // Users of a tenant with an external credential service, unknown locally
+    bool lookupExternal(const RequestContext& ctx, const StunMessage& msg, const std::string& username,
+        std::vector<uint8_t>& resp);
+    bool verifyExternal(const RequestContext& ctx, const StunMessage& msg, ExternalAuth::Status status,
+        const AuthKey& key, std::vector<uint8_t>& resp);
+
+    bool processMessage(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp);
+
+    // DiscoveryConfig slot of the listener the request came in on, -1 when
+    // it is not a NAT discovery listener
+    int discoverySlot(const RequestContext& ctx) const;
+
+    // 300 Try Alternate when the node is overloaded and a peer can take the client
+    bool redirect(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp);
+
   private:
-    boost::asio::ip::udp::socket _socket;
-    boost::asio::ip::udp::endpoint _remote;
-    std::array<uint8_t, 1024> _buffer{};
+    ServerConfig _config;
+    Stats _stats;
+    std::vector<std::unique_ptr<boost::asio::ssl::context>> _tlsContexts;
+    std::vector<std::unique_ptr<DtlsContext>> _dtlsContexts;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::unique_ptr<PacketCapture>> _captures; // by worker, before the listeners using them
+    std::vector<std::shared_ptr<Listener>> _listeners;
+    std::unique_ptr<TenantTable> _tenants;
+    std::unique_ptr<UsageLog> _usage; // outlives the TURN servers feeding it
+    std::vector<WorkerState> _workerStates; // indexed by worker
+    std::unique_ptr<Cluster> _cluster;
+    std::unique_ptr<LongTermAuth> _auth;
+    std::unique_ptr<CryptoPool> _crypto;
+    std::unique_ptr<ControlServer> _control;
+    std::unique_ptr<Profiler> _profiler;
+    std::unique_ptr<Tracer> _tracer;
+    bool _stopped = false;
 };
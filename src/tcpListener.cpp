@@ -0,0 +1,393 @@
+#include "tcpListener.hpp"
+#include "memoryAccounting.hpp"
+#include "proxyProtocol.hpp"
+#include "stunMessage.hpp"
+#include "stunServer.hpp"
+#include "tracer.hpp"
+
+#include <deque>
+
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::tcp;
+using namespace ustun::protocol;
+
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+namespace
+{
+  // Responses and relayed data waiting for a client that does not read,
+  // beyond that new messages are dropped whole so the framing stays intact
+  constexpr std::size_t MAX_OUTBOX_BYTES = 256 * 1024;
+
+  // PROXY header and TLS handshake together, then the longest gap between two
+  // reads: a client trickling bytes cannot hold a connection forever
+  constexpr auto HANDSHAKE_TIMEOUT = std::chrono::seconds(10);
+  // As long as the default allocation lifetime, refreshes keep TURN clients
+  constexpr auto IDLE_TIMEOUT = std::chrono::minutes(10);
+
+  // Size of the STUN or ChannelData message at the head of the stream,
+  // 0 while incomplete, SIZE_MAX when the stream is not STUN or announces a
+  // message the parser would refuse: it cannot be skipped, only closed
+  std::size_t frameSize(const uint8_t* data, std::size_t available)
+  {
+    if (available < 4)
+      return 0;
+
+    const std::size_t length = (data[2] << 8) | data[3];
+    std::size_t size;
+    if ((data[0] & 0xC0) == 0)
+    {
+      size = STUN_HEADER_SIZE + length;
+      if (size > STUN_MAX_MESSAGE_SIZE)
+        return SIZE_MAX;
+    }
+    else if ((data[0] & 0xC0) == 0x40)
+      size = CHANNEL_DATA_HEADER_SIZE + ((length + 3) & ~std::size_t(3)); // padded over streams
+    else
+      return SIZE_MAX;
+
+    return size <= available ? size : 0;
+  }
+
+  tcp::socket& lowestLayer(tcp::socket& socket) { return socket; }
+  tcp::socket& lowestLayer(boost::asio::ssl::stream<tcp::socket>& stream)
+  {
+    return stream.next_layer();
+  }
+
+  // Plain TCP has nothing to negotiate
+  template<typename Handler>
+  void asyncHandshake(tcp::socket&, Handler&& handler)
+  {
+    handler(boost::system::error_code());
+  }
+
+  template<typename Handler>
+  void asyncHandshake(boost::asio::ssl::stream<tcp::socket>& stream, Handler&& handler)
+  {
+    stream.async_handshake(boost::asio::ssl::stream_base::server, std::forward<Handler>(handler));
+  }
+
+  template<typename Stream>
+  class Connection : public std::enable_shared_from_this<Connection<Stream>>, public ClientSender
+  {
+    public:
+      template<typename... Args>
+      Connection(Worker& worker, StunServer& server, Transport transport, TenantId tenant,
+          const AddressAcl* proxyTrusted, Args&&... args)
+          : _worker(worker)
+          , _server(server)
+          , _transport(transport)
+          , _tenant(tenant)
+          , _proxyTrusted(proxyTrusted)
+          , _stream(std::forward<Args>(args)...)
+          , _deadline(worker.io())
+      {
+        MemoryAccounting::add(MemoryTag::Buffers, sizeof(*this));
+      }
+
+      ~Connection() override { MemoryAccounting::sub(MemoryTag::Buffers, sizeof(*this)); }
+
+      void start()
+      {
+        boost::system::error_code ec;
+        const auto remote = lowestLayer(_stream).remote_endpoint(ec);
+        if (ec)
+          return;
+        _remote = boost::asio::ip::udp::endpoint(remote.address(), remote.port());
+
+        statsInc(_server.stats().tcpConnections);
+        spdlog::debug("Accepted {} connection from {}", transport2str(_transport),
+            StunServer::endpoint2str(_remote));
+
+        _lastActive = Clock::now();
+        scheduleDeadline(_lastActive + HANDSHAKE_TIMEOUT);
+
+        if (_proxyTrusted && _proxyTrusted->contains(_remote.address()))
+          readProxyHeader();
+        else
+          handshake();
+      }
+
+      void sendToClient(
+          const uint8_t* data, std::size_t bytes, const boost::asio::ip::udp::endpoint&) override
+      {
+        if (_closed)
+          return;
+        if (_outboxBytes + bytes > MAX_OUTBOX_BYTES)
+        {
+          statsInc(_server.stats().tcpOutboxDropped);
+          return;
+        }
+        _outboxBytes += bytes;
+        _outbox.emplace_back(data, data + bytes);
+        if (_outbox.size() == 1)
+          startWrite();
+      }
+
+      std::shared_ptr<ClientSender> retain() override { return this->shared_from_this(); }
+      bool alive() const override { return !_closed; }
+
+    private:
+      using Clock = std::chrono::steady_clock;
+
+      // The timer only holds a weak reference, a closed connection goes away
+      // without waiting for it
+      void scheduleDeadline(Clock::time_point deadline)
+      {
+        std::weak_ptr<Connection> weak = this->shared_from_this();
+        _deadline.expires_at(deadline);
+        _deadline.async_wait([this, weak](boost::system::error_code ec) {
+          const auto self = weak.lock();
+          if (ec || !self || _closed)
+            return;
+
+          // Reads only move _lastActive, the timer catches up here
+          const auto idleDeadline = _lastActive + IDLE_TIMEOUT;
+          if (_established && idleDeadline > Clock::now())
+          {
+            scheduleDeadline(idleDeadline);
+            return;
+          }
+
+          statsInc(_server.stats().tcpTimeouts);
+          spdlog::debug("{} connection from {} timed out, closing", transport2str(_transport),
+              StunServer::endpoint2str(_remote));
+          close();
+        });
+      }
+
+      // The header precedes the TLS handshake, read exactly its size from the
+      // raw socket so that no TLS record is consumed
+      void readProxyHeader()
+      {
+        auto self = this->shared_from_this();
+        boost::asio::async_read(lowestLayer(_stream),
+            boost::asio::buffer(_buffer.data(), PROXY_V2_HEADER_SIZE),
+            [this, self](boost::system::error_code ec, std::size_t) {
+              if (ec)
+                return;
+
+              const std::size_t len = (_buffer[14] << 8) | _buffer[15];
+              if (len > _buffer.size() - PROXY_V2_HEADER_SIZE)
+              {
+                statsInc(_server.stats().proxyErrors);
+                return;
+              }
+
+              boost::asio::async_read(lowestLayer(_stream),
+                  boost::asio::buffer(_buffer.data() + PROXY_V2_HEADER_SIZE, len),
+                  [this, self, len](boost::system::error_code ec, std::size_t) {
+                    if (ec)
+                      return;
+
+                    ProxyHeader proxy;
+                    const auto result = parseProxyV2(
+                        _buffer.data(), PROXY_V2_HEADER_SIZE + len, ProxyTransport::Stream, proxy);
+                    if (result != ProxyParseResult::Ok)
+                    {
+                      statsInc(_server.stats().proxyErrors);
+                      spdlog::debug("Invalid PROXY header from {}, closing",
+                          StunServer::endpoint2str(_remote));
+                      return;
+                    }
+
+                    statsInc(_server.stats().proxyHeaders);
+                    if (!proxy.local)
+                      _remote = proxy.source;
+                    handshake();
+                  });
+            });
+      }
+
+      void handshake()
+      {
+        auto self = this->shared_from_this();
+        asyncHandshake(_stream, [this, self](boost::system::error_code ec) {
+          if (ec)
+          {
+            statsInc(_server.stats().tlsHandshakeErrors);
+            spdlog::debug("TLS handshake with {} failed: {}", StunServer::endpoint2str(_remote),
+                ec.message());
+            return;
+          }
+          _established = true;
+          _lastActive  = Clock::now();
+          startRead();
+        });
+      }
+
+      // Whatever this connection owns (TURN allocations) goes with it. The
+      // socket is closed too, so pending operations complete and release it
+      void close()
+      {
+        if (_closed)
+          return;
+        _closed = true;
+        _server.clientClosed(_worker, this);
+
+        boost::system::error_code ec;
+        _deadline.cancel(ec);
+        lowestLayer(_stream).close(ec);
+      }
+
+      void startRead()
+      {
+        if (_used == _buffer.size())
+        {
+          spdlog::debug("Oversized message from {}, closing", StunServer::endpoint2str(_remote));
+          close();
+          return;
+        }
+
+        auto self = this->shared_from_this();
+        _stream.async_read_some(boost::asio::buffer(_buffer.data() + _used, _buffer.size() - _used),
+            [this, self](boost::system::error_code ec, std::size_t bytes) {
+              if (ec)
+              {
+                close();
+                return;
+              }
+              _used += bytes;
+              _lastActive = Clock::now();
+              if (processFrames())
+                startRead();
+            });
+      }
+
+      bool processFrames()
+      {
+        RequestContext ctx {_worker, _transport, _remote, _remote, this, _tenant};
+        std::size_t offset = 0;
+
+        for (;;)
+        {
+          const auto size = frameSize(_buffer.data() + offset, _used - offset);
+          if (size == SIZE_MAX)
+          {
+            statsInc(_server.stats().invalidPackets);
+            spdlog::debug("Non-STUN data or oversized message from {}, closing",
+                StunServer::endpoint2str(_remote));
+            close();
+            return false;
+          }
+          if (size == 0)
+            break;
+
+          if (_server.handleMessage(ctx, _buffer.data() + offset, size, _response))
+          {
+            TraceScope send(_server.tracer(), ctx, TraceStage::Send);
+            sendToClient(_response.data(), _response.size(), _remote);
+          }
+          offset += size;
+        }
+
+        // Keep the partial message at the front of the buffer
+        std::memmove(_buffer.data(), _buffer.data() + offset, _used - offset);
+        _used -= offset;
+        return true;
+      }
+
+      void startWrite()
+      {
+        auto self = this->shared_from_this();
+        boost::asio::async_write(_stream, boost::asio::buffer(_outbox.front()),
+            [this, self](boost::system::error_code ec, std::size_t) {
+              if (ec)
+              {
+                statsInc(_server.stats().sendErrors);
+                spdlog::debug("Failed to send response to {}: {}",
+                    StunServer::endpoint2str(_remote), ec.message());
+                close();
+                return;
+              }
+              statsInc(_server.stats().responsesSent);
+              _outboxBytes -= _outbox.front().size();
+              _outbox.pop_front();
+              if (!_outbox.empty())
+                startWrite();
+            });
+      }
+
+    private:
+      Worker& _worker;
+      StunServer& _server;
+      Transport _transport;
+      TenantId _tenant;
+      const AddressAcl* _proxyTrusted; // null when PROXY protocol is disabled
+      Stream _stream;
+      boost::asio::ip::udp::endpoint _remote;
+      std::array<uint8_t, 4096> _buffer {};
+      std::size_t _used = 0;
+      std::vector<uint8_t> _response;
+      std::deque<std::vector<uint8_t>> _outbox;
+      std::size_t _outboxBytes = 0;
+      boost::asio::steady_timer _deadline;
+      Clock::time_point _lastActive;
+      bool _established = false; // PROXY header and TLS handshake done
+      bool _closed      = false;
+  };
+}
+
+std::shared_ptr<TcpListener> TcpListener::create(Worker& worker, StunServer& server,
+    const ListenerConfig& config, boost::asio::ssl::context* tls)
+{
+  std::shared_ptr<TcpListener> listener(new TcpListener(worker, server, config, tls));
+  listener->startAccept();
+  return listener;
+}
+
+TcpListener::TcpListener(Worker& worker, StunServer& server, const ListenerConfig& config,
+    boost::asio::ssl::context* tls)
+    : _worker(worker)
+    , _server(server)
+    , _tls(tls)
+    , _config(config)
+    , _acceptor(worker.io())
+{
+  const tcp::endpoint local(config.address, config.port);
+
+  _acceptor.open(local.protocol());
+  _acceptor.set_option(tcp::acceptor::reuse_address(true));
+  _acceptor.set_option(reuse_port(true));
+  if (local.address().is_v6())
+    _acceptor.set_option(boost::asio::ip::v6_only(true));
+  _acceptor.bind(local);
+  _acceptor.listen();
+}
+
+void TcpListener::stop()
+{
+  boost::system::error_code ec;
+  _acceptor.close(ec);
+  if (ec)
+    spdlog::warn("Error while closing acceptor: {}", ec.message());
+}
+
+void TcpListener::startAccept()
+{
+  auto self = shared_from_this();
+  _acceptor.async_accept([this, self](boost::system::error_code ec, tcp::socket socket) {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    if (!ec)
+    {
+      socket.set_option(tcp::no_delay(true), ec);
+      const auto* proxyTrusted = _config.proxyProtocol ? &_config.proxyTrusted : nullptr;
+      if (_tls)
+        std::make_shared<Connection<boost::asio::ssl::stream<tcp::socket>>>(
+            _worker, _server, Transport::Tls, _config.tenant, proxyTrusted, std::move(socket), *_tls)
+            ->start();
+      else
+        std::make_shared<Connection<tcp::socket>>(
+            _worker, _server, Transport::Tcp, _config.tenant, proxyTrusted, std::move(socket))
+            ->start();
+    }
+
+    startAccept();
+  });
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+
+#include "listener.hpp"
+
+class StunServer;
+
+// STUN over TCP (RFC 5389 §7.2.2), optionally wrapped in TLS
+class TcpListener : public Listener, public std::enable_shared_from_this<TcpListener> {
+  public:
+    static std::shared_ptr<TcpListener> create(Worker& worker, StunServer& server,
+        const ListenerConfig& config, boost::asio::ssl::context* tls);
+
+    void stop() override;
+
+  private:
+    TcpListener(Worker& worker, StunServer& server, const ListenerConfig& config,
+        boost::asio::ssl::context* tls);
+
+    void startAccept();
+
+  private:
+    Worker& _worker;
+    StunServer& _server;
+    boost::asio::ssl::context* _tls;
+    ListenerConfig _config;
+    boost::asio::ip::tcp::acceptor _acceptor;
+};
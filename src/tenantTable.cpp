@@ -0,0 +1,124 @@
+#include "tenantTable.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <spdlog/fmt/fmt.h>
+
+TenantTable::TenantTable(const std::vector<TenantConfig>& tenants, unsigned workers)
+    : _tenants(tenants)
+    , _usage(new Usage[tenants.size()])
+    , _buckets(tenants.size() * workers)
+{
+  std::size_t size = 2;
+  while (size < _tenants.size() * 2)
+    size <<= 1;
+  _index.assign(size, INVALID_TENANT);
+  _indexMask = size - 1;
+
+  for (std::size_t id = 0; id < _tenants.size(); ++id)
+  {
+    const auto& realm = _tenants[id].realm;
+    std::size_t i     = hashRealm(reinterpret_cast<const uint8_t*>(realm.data()), realm.size()) & _indexMask;
+    while (_index[i] != INVALID_TENANT)
+      i = (i + 1) & _indexMask;
+    _index[i] = static_cast<TenantId>(id);
+  }
+
+  const auto now = Clock::now();
+  for (std::size_t i = 0; i < _buckets.size(); ++i)
+  {
+    const auto& tenant = _tenants[i % _tenants.size()];
+    auto& bucket       = _buckets[i];
+    bucket.rate        = tenant.requestRate / workers;
+    bucket.burst       = std::max(1.0, (tenant.requestBurst > 0 ? tenant.requestBurst : tenant.requestRate) / workers);
+    bucket.tokens      = bucket.burst;
+    bucket.last        = now;
+  }
+}
+
+uint64_t TenantTable::hashRealm(const uint8_t* realm, std::size_t length)
+{
+  uint64_t h = 1469598103934665603ull;
+  for (std::size_t i = 0; i < length; ++i)
+    h = (h ^ realm[i]) * 1099511628211ull;
+  return h;
+}
+
+TenantId TenantTable::find(const uint8_t* realm, std::size_t length) const
+{
+  for (std::size_t i = hashRealm(realm, length) & _indexMask;; i = (i + 1) & _indexMask)
+  {
+    const TenantId id = _index[i];
+    if (id == INVALID_TENANT)
+      return INVALID_TENANT;
+
+    const auto& name = _tenants[id].realm;
+    if (name.size() == length && std::memcmp(name.data(), realm, length) == 0)
+      return id;
+  }
+}
+
+bool TenantTable::admitRequest(unsigned worker, TenantId tenant)
+{
+  statsInc(_usage[tenant].requests);
+
+  auto& bucket = _buckets[worker * _tenants.size() + tenant];
+  if (bucket.rate <= 0)
+    return true;
+
+  const auto now       = Clock::now();
+  const double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+  bucket.last          = now;
+  bucket.tokens        = std::min(bucket.burst, bucket.tokens + elapsed * bucket.rate);
+  if (bucket.tokens < 1)
+  {
+    statsInc(_usage[tenant].rateLimited);
+    return false;
+  }
+  bucket.tokens -= 1;
+  return true;
+}
+
+bool TenantTable::acquireAllocation(TenantId tenant)
+{
+  auto& allocations  = _usage[tenant].allocations;
+  const uint64_t max = _tenants[tenant].maxAllocations;
+  if (max == 0)
+  {
+    statsInc(allocations);
+    return true;
+  }
+
+  uint64_t current = allocations.load(std::memory_order_relaxed);
+  do
+  {
+    if (current >= max)
+    {
+      statsInc(_usage[tenant].quotaRejected);
+      return false;
+    }
+  } while (!allocations.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+  return true;
+}
+
+void TenantTable::releaseAllocation(TenantId tenant)
+{
+  statsDec(_usage[tenant].allocations);
+}
+
+std::string TenantTable::render() const
+{
+  std::string out;
+  for (std::size_t id = 0; id < _tenants.size(); ++id)
+  {
+    const auto& usage = _usage[id];
+    const auto& realm = _tenants[id].realm;
+    out += fmt::format("ustun_tenant_allocations{{realm=\"{}\"}} {}\n", realm, usage.allocations.load());
+    out += fmt::format("ustun_tenant_requests{{realm=\"{}\"}} {}\n", realm, usage.requests.load());
+    out += fmt::format("ustun_tenant_rate_limited{{realm=\"{}\"}} {}\n", realm, usage.rateLimited.load());
+    out += fmt::format("ustun_tenant_quota_rejected{{realm=\"{}\"}} {}\n", realm, usage.quotaRejected.load());
+    out += fmt::format("ustun_tenant_relayed_bytes{{realm=\"{}\"}} {}\n", realm, usage.relayedBytes.load());
+  }
+  return out;
+}
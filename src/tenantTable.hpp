@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "serverClock.hpp"
+#include "stats.hpp"
+
+// Runtime state of the tenants, indexed by TenantId. The REALM of a request
+// is resolved once, everything after that is a flat array access.
+//
+// Request rates are enforced per worker with token buckets holding an equal
+// share of the tenant rate: the kernel spreads clients evenly over workers,
+// and the buckets then need no synchronisation. Allocation quotas are global.
+class TenantTable {
+  public:
+    using Clock = ServerClock;
+
+    TenantTable(const std::vector<TenantConfig>& tenants, unsigned workers);
+
+    std::size_t size() const { return _tenants.size(); }
+    const TenantConfig& config(TenantId tenant) const { return _tenants[tenant]; }
+
+    // INVALID_TENANT when the realm is unknown
+    TenantId find(const uint8_t* realm, std::size_t length) const;
+
+    // Takes a token from the tenant bucket of the worker, false when empty
+    bool admitRequest(unsigned worker, TenantId tenant);
+
+    // Counts an allocation against the tenant quota, false when it is reached
+    bool acquireAllocation(TenantId tenant);
+    void releaseAllocation(TenantId tenant);
+
+    void addRelayedBytes(TenantId tenant, uint64_t bytes) { statsInc(_usage[tenant].relayedBytes, bytes); }
+
+    // Per tenant metrics, labelled with the realm
+    std::string render() const;
+
+  private:
+    struct Usage
+    {
+      std::atomic<uint64_t> allocations {0};
+      std::atomic<uint64_t> requests {0};
+      std::atomic<uint64_t> rateLimited {0};
+      std::atomic<uint64_t> quotaRejected {0};
+      std::atomic<uint64_t> relayedBytes {0}; // updated by the TURN sweeps
+    };
+
+    struct Bucket
+    {
+      double tokens = 0;
+      double rate   = 0; // tokens per second, 0 is unlimited
+      double burst  = 0;
+      Clock::time_point last;
+    };
+
+    static uint64_t hashRealm(const uint8_t* realm, std::size_t length);
+
+  private:
+    std::vector<TenantConfig> _tenants;
+    std::vector<TenantId> _index; // open addressing on the realm hash
+    std::size_t _indexMask = 0;
+    std::unique_ptr<Usage[]> _usage;
+    std::vector<Bucket> _buckets; // [worker * size() + tenant], owned by the worker
+};
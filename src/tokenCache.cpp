@@ -0,0 +1,73 @@
+#include "tokenCache.hpp"
+#include "stunMessage.hpp"
+
+#include <cstring>
+
+constexpr std::size_t TokenCache::MAX_KEY_SIZE;
+
+TokenCache::TokenCache(std::size_t capacity)
+{
+  if (capacity == 0)
+    return;
+
+  std::size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  _entries.resize(size);
+  _mask = size - 1;
+}
+
+bool TokenCache::fits(const StunAttribute& kid, const StunAttribute& token)
+{
+  return token.length > 0 && kid.length + token.length <= MAX_KEY_SIZE;
+}
+
+uint64_t TokenCache::hashKey(const StunAttribute& kid, const StunAttribute& token)
+{
+  uint64_t h = 1469598103934665603ull;
+  auto mix   = [&h](const uint8_t* p, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i)
+      h = (h ^ p[i]) * 1099511628211ull;
+  };
+
+  mix(kid.value, kid.length);
+  mix(token.value, token.length);
+  return h;
+}
+
+bool TokenCache::matches(const Entry& entry, const StunAttribute& kid, const StunAttribute& token)
+{
+  return entry.kidSize == kid.length && entry.size == kid.length + token.length
+      && std::memcmp(entry.key, kid.value, kid.length) == 0
+      && std::memcmp(entry.key + kid.length, token.value, token.length) == 0;
+}
+
+bool TokenCache::lookup(const StunAttribute& kid, const StunAttribute& token, AccessToken& out) const
+{
+  if (_entries.empty() || !fits(kid, token))
+    return false;
+
+  const uint64_t hash = hashKey(kid, token);
+  const auto& entry   = _entries[hash & _mask];
+  if (entry.hash != hash || !matches(entry, kid, token))
+    return false;
+
+  out = entry.token;
+  return true;
+}
+
+void TokenCache::insert(const StunAttribute& kid, const StunAttribute& token, const AccessToken& value)
+{
+  if (_entries.empty() || !fits(kid, token))
+    return;
+
+  const uint64_t hash = hashKey(kid, token);
+  auto& entry         = _entries[hash & _mask];
+  entry.hash          = hash;
+  entry.kidSize       = kid.length;
+  entry.size          = static_cast<uint16_t>(kid.length + token.length);
+  std::memcpy(entry.key, kid.value, kid.length);
+  std::memcpy(entry.key + kid.length, token.value, token.length);
+  entry.token           = value;
+  entry.token.decrypted = false;
+}
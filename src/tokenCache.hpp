@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "auth.hpp"
+#include "memoryAccounting.hpp"
+
+namespace ustun
+{
+  struct Attribute;
+}
+using StunAttribute = ustun::Attribute;
+
+// Decrypted access tokens of one worker, keyed by the key id (USERNAME) and
+// the ACCESS-TOKEN bytes, so that the Refresh, CreatePermission and
+// ChannelBind requests following an Allocate skip the AES-GCM decryption.
+// Direct mapped: a colliding token replaces the previous one. Expiry is
+// checked by LongTermAuth::verify.
+class TokenCache {
+  public:
+    static constexpr std::size_t MAX_KEY_SIZE = 256;
+
+    // Rounded up to a power of 2, 0 disables the cache
+    explicit TokenCache(std::size_t capacity);
+
+    bool lookup(const StunAttribute& kid, const StunAttribute& token, AccessToken& out) const;
+    void insert(const StunAttribute& kid, const StunAttribute& token, const AccessToken& value);
+
+  private:
+    struct Entry
+    {
+      uint64_t hash     = 0;
+      uint16_t kidSize  = 0;
+      uint16_t size     = 0; // kid and token, 0 when empty
+      uint8_t key[MAX_KEY_SIZE];
+      AccessToken token;
+    };
+
+    static bool fits(const StunAttribute& kid, const StunAttribute& token);
+    static uint64_t hashKey(const StunAttribute& kid, const StunAttribute& token);
+    static bool matches(const Entry& entry, const StunAttribute& kid, const StunAttribute& token);
+
+  private:
+    TaggedVector<Entry, MemoryTag::Caches> _entries;
+    std::size_t _mask = 0;
+};
@@ -0,0 +1,180 @@
+#include "tracer.hpp"
+#include "worker.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <set>
+
+#include <fmt/format.h>
+
+namespace
+{
+  // Crypto threads are shown after the workers
+  constexpr unsigned CRYPTO_TID = 1000;
+
+  const char* stage2str(TraceStage stage)
+  {
+    switch (stage)
+    {
+      case TraceStage::Receive:
+        return "receive";
+      case TraceStage::Classify:
+        return "classify";
+      case TraceStage::Admission:
+        return "rate limit";
+      case TraceStage::Auth:
+        return "auth";
+      case TraceStage::ExternalAuth:
+        return "external auth";
+      case TraceStage::Crypto:
+        return "crypto";
+      case TraceStage::Build:
+        return "response build";
+      case TraceStage::Send:
+        return "send";
+    }
+    return "?";
+  }
+}
+
+Tracer::Tracer(const TraceConfig& config, unsigned workers)
+    : _sampleEvery(config.sampleEvery)
+{
+  for (unsigned i = 0; i < workers; ++i)
+    _rings.emplace_back(new Ring(config.spans));
+}
+
+uint64_t Tracer::sample(unsigned worker)
+{
+  auto& ring = *_rings[worker];
+  if (ring.countdown > 0)
+  {
+    --ring.countdown;
+    return 0;
+  }
+  ring.countdown = _sampleEvery - 1;
+  return ++ring.requests * _rings.size() + worker;
+}
+
+void Tracer::record(unsigned worker, uint64_t request, TraceStage stage, uint64_t begin, uint64_t end,
+    unsigned thread)
+{
+  auto& ring = *_rings[worker];
+  std::lock_guard<std::mutex> lock(ring.mutex);
+  ring.spans[ring.written++ % ring.spans.size()]
+      = Span {request, begin, end, static_cast<uint16_t>(thread), stage};
+}
+
+void Tracer::reset()
+{
+  for (auto& ring : _rings)
+  {
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    ring->written = 0;
+  }
+}
+
+std::string Tracer::chromeJson() const
+{
+  struct Event
+  {
+    Span span;
+    unsigned tid;
+  };
+
+  std::vector<Event> events;
+  for (std::size_t worker = 0; worker < _rings.size(); ++worker)
+  {
+    const auto& ring = *_rings[worker];
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    const uint64_t count = std::min<uint64_t>(ring.written, ring.spans.size());
+    for (uint64_t i = ring.written - count; i < ring.written; ++i)
+    {
+      const Span& span = ring.spans[i % ring.spans.size()];
+      const unsigned tid
+          = span.stage == TraceStage::Crypto ? CRYPTO_TID + span.thread : static_cast<unsigned>(worker);
+      events.push_back(Event {span, tid});
+    }
+  }
+
+  // Grouped by request, stages in the order they ran
+  std::sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+    return a.span.request != b.span.request ? a.span.request < b.span.request : a.span.begin < b.span.begin;
+  });
+
+  uint64_t origin = UINT64_MAX;
+  std::set<unsigned> tids;
+  for (const auto& event : events)
+  {
+    origin = std::min(origin, event.span.begin);
+    tids.insert(event.tid);
+  }
+  const auto micros = [origin](uint64_t ns) { return (ns - origin) / 1000.0; };
+
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                    "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"ustun\"}}";
+  auto it = std::back_inserter(out);
+  for (const unsigned tid : tids)
+  {
+    fmt::format_to(it, ",\n{{\"ph\":\"M\",\"pid\":1,\"tid\":{},\"name\":\"thread_name\",\"args\":{{\"name\":\"{} {}\"}}}}",
+        tid, tid >= CRYPTO_TID ? "crypto" : "worker", tid >= CRYPTO_TID ? tid - CRYPTO_TID : tid);
+  }
+
+  uint64_t flow = 0;
+  for (std::size_t i = 0; i < events.size(); ++i)
+  {
+    const Span& span = events[i].span;
+    const unsigned tid = events[i].tid;
+
+    // The wait overlaps the other requests of the worker, it gets its own async track
+    if (span.stage == TraceStage::ExternalAuth)
+    {
+      fmt::format_to(it,
+          ",\n{{\"ph\":\"b\",\"cat\":\"request\",\"name\":\"{}\",\"id\":{},\"pid\":1,\"tid\":{},\"ts\":{:.3f}}}"
+          ",\n{{\"ph\":\"e\",\"cat\":\"request\",\"name\":\"{}\",\"id\":{},\"pid\":1,\"tid\":{},\"ts\":{:.3f}}}",
+          stage2str(span.stage), span.request, tid, micros(span.begin), stage2str(span.stage), span.request, tid,
+          micros(span.end));
+    }
+    else
+    {
+      fmt::format_to(it,
+          ",\n{{\"ph\":\"X\",\"cat\":\"request\",\"name\":\"{}\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},"
+          "\"args\":{{\"request\":{}}}}}",
+          stage2str(span.stage), tid, micros(span.begin), (span.end - span.begin) / 1000.0, span.request);
+    }
+
+    // Handoff to another thread: an arrow from this stage to the next one
+    if (i + 1 < events.size() && events[i + 1].span.request == span.request && events[i + 1].tid != tid)
+    {
+      // The next stage may start before this one ends, a crypto thread can
+      // take the job while the worker is still waking it up
+      const Span& next     = events[i + 1].span;
+      const uint64_t start = std::min(span.begin + (span.end - span.begin) / 2, next.begin);
+      ++flow;
+      fmt::format_to(it,
+          ",\n{{\"ph\":\"s\",\"cat\":\"handoff\",\"name\":\"handoff\",\"id\":{},\"pid\":1,\"tid\":{},\"ts\":{:.3f}}}"
+          ",\n{{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"handoff\",\"name\":\"handoff\",\"id\":{},\"pid\":1,\"tid\":{},"
+          "\"ts\":{:.3f}}}",
+          flow, tid, micros(start), flow, events[i + 1].tid, micros(next.begin));
+    }
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+TraceScope::TraceScope(Tracer* tracer, const RequestContext& ctx, TraceStage stage)
+    : _tracer(ctx.trace ? tracer : nullptr)
+    , _ctx(ctx)
+    , _stage(stage)
+{
+  if (_tracer)
+    _begin = Tracer::now();
+}
+
+void TraceScope::finish()
+{
+  if (!_tracer)
+    return;
+  _tracer->record(_ctx.worker.index(), _ctx.trace, _stage, _begin, Tracer::now(), _ctx.worker.index());
+  _tracer = nullptr;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "listener.hpp"
+#include "memoryAccounting.hpp"
+
+enum class TraceStage : uint8_t
+{
+  Receive, // STUN parsing
+  Classify, // retransmission lookup, message class, tenant
+  Admission, // tenant rate limit
+  Auth, // up to the verdict, or to the handoff to a crypto thread
+  ExternalAuth, // wait for the tenant credential service
+  Crypto, // HMAC check on a crypto thread
+  Build, // processing, signing and caching of the response
+  Send
+};
+
+// Lifecycle of one request in every 'sampleEvery', for latency
+// investigations: the stages a sampled request goes through are kept in a
+// ring per worker, oldest overwritten first, and exported on demand as
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev). Stages run on
+// another thread are recorded by the worker once the request comes back,
+// so every ring has a single writer; the mutex only keeps the dumps out.
+class Tracer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    Tracer(const TraceConfig& config, unsigned workers);
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static uint64_t now() { return nanoseconds(Clock::now()); }
+    static uint64_t nanoseconds(Clock::time_point time)
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    // Id to trace a new request with, 0 when it is not sampled
+    uint64_t sample(unsigned worker);
+
+    // thread is the crypto thread for TraceStage::Crypto, the worker otherwise
+    void record(unsigned worker, uint64_t request, TraceStage stage, uint64_t begin, uint64_t end,
+        unsigned thread);
+
+    // Every span still in the rings, with flow arrows between the stages of
+    // a request run on different threads
+    std::string chromeJson() const;
+    void reset();
+
+  private:
+    struct Span
+    {
+      uint64_t request;
+      uint64_t begin; // steady clock ns
+      uint64_t end;
+      uint16_t thread;
+      TraceStage stage;
+    };
+
+    struct Ring
+    {
+      explicit Ring(std::size_t size) : spans(size) {}
+
+      mutable std::mutex mutex;
+      TaggedVector<Span, MemoryTag::Profiler> spans;
+      uint64_t written   = 0;
+      uint64_t countdown = 0; // requests until the next sample, worker only
+      uint64_t requests  = 0; // sampled so far, worker only
+    };
+
+  private:
+    unsigned _sampleEvery;
+    std::vector<std::unique_ptr<Ring>> _rings; // by worker
+};
+
+// Records one stage of a traced request over the scope, or until finish()
+class TraceScope {
+  public:
+    TraceScope(Tracer* tracer, const RequestContext& ctx, TraceStage stage);
+    ~TraceScope() { finish(); }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    void finish();
+
+  private:
+    Tracer* _tracer; // null when the request is not traced
+    const RequestContext& _ctx;
+    TraceStage _stage;
+    uint64_t _begin = 0;
+};
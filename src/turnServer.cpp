@@ -0,0 +1,813 @@
+#include "turnServer.hpp"
+#include "stunMessage.hpp"
+#include "stunServer.hpp"
+#include "tenantTable.hpp"
+#include "worker.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+
+#include <linux/net_tstamp.h>
+#include <sys/socket.h>
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  constexpr uint8_t TRANSPORT_UDP = 17;
+
+  constexpr uint32_t PERMISSION_LIFETIME = 300; // seconds
+  constexpr uint32_t CHANNEL_LIFETIME    = 600;
+
+  constexpr uint16_t CHANNEL_MIN = 0x4000;
+  constexpr uint16_t CHANNEL_MAX = 0x7FFE;
+
+  uint16_t read16(const uint8_t* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+  uint32_t read32(const uint8_t* p) { return (uint32_t(read16(p)) << 16) | read16(p + 2); }
+
+  // Addresses of the relay host itself and of the networks behind it, and
+  // anything that is not a single global host: multicast, broadcast, reserved
+  bool isRestricted(const boost::asio::ip::address& address)
+  {
+    if (address.is_v6() && address.to_v6().is_v4_mapped())
+      return isRestricted(boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6()));
+    if (address.is_v6())
+    {
+      const auto v6    = address.to_v6();
+      const auto bytes = v6.to_bytes();
+      // NAT64 (RFC 6052): the well-known prefix reaches the IPv4 address in
+      // the last 32 bits, the local-use one (RFC 8215) is the operator's own
+      static const uint8_t wellKnown[12] = {0x00, 0x64, 0xFF, 0x9B}; // 64:ff9b::/96
+      static const uint8_t localUse[6]   = {0x00, 0x64, 0xFF, 0x9B, 0x00, 0x01}; // 64:ff9b:1::/48
+      if (std::equal(wellKnown, wellKnown + 12, bytes.begin()))
+        return isRestricted(boost::asio::ip::address_v4(boost::asio::ip::address_v4::bytes_type {
+            {bytes[12], bytes[13], bytes[14], bytes[15]}}));
+      if (std::equal(localUse, localUse + 6, bytes.begin()))
+        return true;
+      return v6.is_loopback() || v6.is_unspecified() || v6.is_link_local() || v6.is_site_local()
+          || v6.is_multicast() // ff00::/8
+          || (bytes[0] & 0xFE) == 0xFC; // unique local, fc00::/7
+    }
+    const uint32_t v4 = address.to_v4().to_uint();
+    return (v4 >> 24) == 127 || (v4 >> 24) == 0 || (v4 >> 24) == 10 // loopback, "this network", 10/8
+        || (v4 >> 16) == 0xA9FE // link-local 169.254/16
+        || (v4 >> 20) == 0xAC1 // 172.16/12
+        || (v4 >> 16) == 0xC0A8 // 192.168/16
+        || (v4 >> 22) == 0x191 // shared address space 100.64/10
+        || (v4 >> 28) >= 0xE; // multicast 224/4, reserved 240/4 and broadcast 255.255.255.255
+  }
+
+  // Unlinks and destroys the expired entries of a channel list, returns the
+  // earliest expiry left
+  template<typename T>
+  uint32_t pruneExpired(SlabPool<T>& pool, PoolHandle& head, uint32_t now)
+  {
+    uint32_t earliest = AllocationTable::NONE;
+    PoolHandle* link  = &head;
+    while (T* entry = pool.get(*link))
+    {
+      if (entry->expiry <= now)
+      {
+        const PoolHandle dead = *link;
+        *link                 = entry->next;
+        pool.destroy(dead);
+      }
+      else
+      {
+        earliest = std::min(earliest, entry->expiry);
+        link     = &entry->next;
+      }
+    }
+    return earliest;
+  }
+
+  template<typename T>
+  void destroyList(SlabPool<T>& pool, PoolHandle head)
+  {
+    while (T* entry = pool.get(head))
+    {
+      const PoolHandle next = entry->next;
+      pool.destroy(head);
+      head = next;
+    }
+  }
+}
+
+constexpr std::size_t TurnServer::RELAY_HEADROOM;
+constexpr std::size_t TurnServer::RELAY_TAILROOM;
+constexpr std::size_t TurnServer::RELAY_PAYLOAD;
+
+uint64_t TurnServer::hashKey(const AllocationKey& key)
+{
+  // FNV-1a over the address bytes, the port and the sender
+  uint64_t h = 1469598103934665603ull;
+  auto mix   = [&h](const uint8_t* p, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i)
+      h = (h ^ p[i]) * 1099511628211ull;
+  };
+
+  if (key.client.address().is_v4())
+  {
+    const auto bytes = key.client.address().to_v4().to_bytes();
+    mix(bytes.data(), bytes.size());
+  }
+  else
+  {
+    const auto bytes = key.client.address().to_v6().to_bytes();
+    mix(bytes.data(), bytes.size());
+  }
+  const uint16_t port = key.client.port();
+  mix(reinterpret_cast<const uint8_t*>(&port), sizeof(port));
+  mix(reinterpret_cast<const uint8_t*>(&key.sender), sizeof(key.sender));
+  return h;
+}
+
+TurnServer::TurnServer(
+    Worker& worker, const TurnConfig& config, TenantTable& tenants, Stats& stats, UsageLog* usage)
+    : _worker(worker)
+    , _config(config)
+    , _stats(stats)
+    , _tenants(tenants)
+    , _usage(usage)
+    , _allocationPool(stats.poolAllocations, stats.poolAllocationCapacity, stats.poolBytes)
+    , _channelPool(stats.poolChannels, stats.poolChannelCapacity, stats.poolBytes)
+    , _epoch(Clock::now())
+    , _tenantBytes(tenants.size())
+    , _sweepTimer(worker.io())
+{
+  MemoryAccounting::add(MemoryTag::Buffers, sizeof(_buffer));
+  scheduleSweep();
+}
+
+TurnServer::~TurnServer()
+{
+  clear();
+  MemoryAccounting::sub(MemoryTag::Buffers, sizeof(_buffer));
+}
+
+void TurnServer::clear()
+{
+  boost::system::error_code ec;
+  _sweepTimer.cancel(ec);
+  while (_table.size() > 0)
+    erase(_table.size() - 1);
+  flushUsage();
+}
+
+uint32_t TurnServer::now() const
+{
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - _epoch).count());
+}
+
+TurnServer::Allocation* TurnServer::find(const RequestContext& ctx) const
+{
+  const AllocationKey key {ctx.sender, ctx.remote};
+  const uint32_t row = _table.find(hashKey(key),
+      [this, &key](PoolHandle handle) { return _allocationPool.get(handle)->key == key; });
+  return row == AllocationTable::NONE ? nullptr : _allocationPool.get(_table.object(row));
+}
+
+void TurnServer::erase(uint32_t row)
+{
+  const PoolHandle handle = _table.object(row);
+  auto* alloc             = _allocationPool.get(handle);
+  const TenantId tenant   = _table.tenant(row);
+
+  statsDec(_stats.turnAllocations);
+  _tenants.releaseAllocation(tenant);
+  _tenants.addRelayedBytes(tenant, _table.uncollectedBytes(row));
+  if (_usage)
+    recordUsage(*alloc, row);
+  destroyList(_channelPool, alloc->channels);
+  _allocationPool.destroy(handle);
+
+  if (auto* moved = _allocationPool.get(_table.remove(row)))
+    moved->row = row;
+}
+
+void TurnServer::recordUsage(const Allocation& alloc, uint32_t row)
+{
+  const auto ended = ServerClock::unixTime();
+
+  auto out = std::back_inserter(_usageBatch);
+  fmt::format_to(out, "{},{},", alloc.started, ended);
+  UsageLog::appendField(_usageBatch, _tenants.config(_table.tenant(row)).realm);
+  _usageBatch += ',';
+  UsageLog::appendField(_usageBatch, alloc.username);
+  fmt::format_to(out, ",{},{},{},{},{},{}\n", StunServer::endpoint2str(alloc.key.client),
+      StunServer::endpoint2str(alloc.relayed), _table.bytesToPeer(row), _table.packetsToPeer(row),
+      _table.bytesToClient(row), _table.packetsToClient(row));
+  statsInc(_stats.usageRecords);
+
+  if (_usageBatch.size() >= UsageLog::BATCH_BYTES)
+    flushUsage();
+}
+
+void TurnServer::flushUsage()
+{
+  if (!_usage || _usageBatch.empty())
+    return;
+  _usage->submit(std::move(_usageBatch));
+  _usageBatch.clear();
+  _usageBatch.reserve(UsageLog::BATCH_BYTES + 512);
+}
+
+// The table tracks the earliest list expiry so that sweeps only visit the
+// allocations with something to prune
+void TurnServer::updateListExpiry(Allocation& alloc)
+{
+  uint32_t earliest = alloc.permissions.earliestExpiry();
+  for (PoolHandle h = alloc.channels; const Channel* channel = _channelPool.get(h); h = channel->next)
+    earliest = std::min(earliest, channel->expiry);
+  _table.setListExpiry(alloc.row, earliest);
+}
+
+bool TurnServer::hasAllocation(const RequestContext& ctx) const
+{
+  return find(ctx) != nullptr;
+}
+
+void TurnServer::clientClosed(ClientSender* sender)
+{
+  // Backwards, erasing moves the last row into the hole
+  for (uint32_t row = _table.size(); row-- > 0;)
+  {
+    if (_allocationPool.get(_table.object(row))->key.sender == sender)
+      erase(row);
+  }
+}
+
+bool TurnServer::handleMessage(
+    const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  if (msg.cls() == CLASS_INDICATION)
+  {
+    if (msg.method() == METHOD_SEND)
+    {
+      if (auto* alloc = find(ctx))
+        handleSend(*alloc, msg);
+    }
+    return false;
+  }
+
+  if (msg.cls() != CLASS_REQUEST)
+    return false;
+
+  statsInc(_stats.turnRequests);
+
+  if (msg.method() == METHOD_ALLOCATE)
+  {
+    handleAllocate(ctx, msg, resp);
+    return true;
+  }
+
+  auto* alloc = find(ctx);
+  if (!alloc)
+  {
+    buildErrorResponse(resp, msg, 437, "Allocation Mismatch");
+    return true;
+  }
+
+  switch (msg.method())
+  {
+    case METHOD_REFRESH:
+      handleRefresh(*alloc, msg, resp);
+      break;
+    case METHOD_CREATE_PERMISSION:
+      handleCreatePermission(*alloc, msg, resp);
+      break;
+    case METHOD_CHANNEL_BIND:
+      handleChannelBind(*alloc, msg, resp);
+      break;
+    default:
+      buildErrorResponse(resp, msg, 400, "Bad Request");
+      break;
+  }
+  return true;
+}
+
+void TurnServer::handleAllocate(
+    const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  if (find(ctx))
+  {
+    buildErrorResponse(resp, msg, 437, "Allocation Mismatch");
+    return;
+  }
+
+  StunAttribute transport;
+  if (!msg.find(ATTR_REQUESTED_TRANSPORT, transport) || transport.length != 4)
+  {
+    buildErrorResponse(resp, msg, 400, "Bad Request");
+    return;
+  }
+  if (transport.value[0] != TRANSPORT_UDP)
+  {
+    buildErrorResponse(resp, msg, 442, "Unsupported Transport Protocol");
+    return;
+  }
+
+  if (!_tenants.acquireAllocation(ctx.tenant))
+  {
+    buildErrorResponse(resp, msg, 486, "Allocation Quota Reached");
+    return;
+  }
+
+  const PoolHandle handle = _allocationPool.create(_worker.io());
+  auto* alloc             = _allocationPool.get(handle);
+  alloc->key              = {ctx.sender, ctx.remote};
+  alloc->transport        = ctx.transport;
+  alloc->peerLink         = ctx.peer;
+
+  if (_config.virtualRelays)
+    alloc->relayed = udp::endpoint(_config.externalAddress, static_cast<uint16_t>(1024 + _portSeq++ % 64512));
+  else
+  {
+    if (!bindRelay(alloc->relay, ctx.tenant))
+    {
+      _allocationPool.destroy(handle);
+      _tenants.releaseAllocation(ctx.tenant);
+      buildErrorResponse(resp, msg, 508, "Insufficient Capacity");
+      return;
+    }
+    alloc->relayed = udp::endpoint(_config.externalAddress, alloc->relay.local_endpoint().port());
+    if (_config.pacingRate)
+      alloc->paced = enablePacing(alloc->relay);
+  }
+
+  StunAttribute username;
+  if (msg.find(ATTR_USERNAME, username))
+    alloc->username.assign(reinterpret_cast<const char*>(username.value), username.length);
+  alloc->started = ServerClock::unixTime();
+
+  uint32_t lifetime = _config.defaultLifetime;
+  StunAttribute requested;
+  if (msg.find(ATTR_LIFETIME, requested) && requested.length == 4)
+    lifetime = std::min(_config.maxLifetime, std::max(_config.defaultLifetime, read32(requested.value)));
+
+  resp.clear();
+  StunMessageBuilder builder(resp, messageType(METHOD_ALLOCATE, CLASS_SUCCESS), msg.transactionId());
+  builder.addXorAddress(ATTR_XOR_RELAYED_ADDRESS, alloc->relayed);
+  builder.addUint32(ATTR_LIFETIME, lifetime);
+  builder.addXorAddress(ATTR_XOR_MAPPED_ADDRESS, ctx.remote);
+
+  spdlog::debug("Allocated relay {} for {}", StunServer::endpoint2str(alloc->relayed),
+      StunServer::endpoint2str(ctx.remote));
+
+  alloc->row = _table.insert(hashKey(alloc->key), handle, ctx.tenant, now() + lifetime);
+  statsInc(_stats.turnAllocations);
+  if (!_config.virtualRelays)
+    startRelayReceive(handle);
+}
+
+bool TurnServer::bindRelay(udp::socket& relay, TenantId tenant)
+{
+  const auto& config = _tenants.config(tenant);
+
+  boost::system::error_code ec;
+  relay.open(_config.relayAddress.is_v6() ? udp::v6() : udp::v4(), ec);
+  if (!ec)
+    relay.non_blocking(true, ec);
+  if (ec)
+  {
+    spdlog::warn("Cannot open relay socket: {}", ec.message());
+    return false;
+  }
+
+  if (config.relayPortMin == 0)
+  {
+    relay.bind(udp::endpoint(_config.relayAddress, 0), ec);
+    if (ec)
+      spdlog::warn("Cannot bind relay socket: {}", ec.message());
+    return !ec;
+  }
+
+  // Every worker probes the range from its own position, the kernel settles
+  // the conflicts
+  const uint32_t range = config.relayPortMax - config.relayPortMin + 1u;
+  for (uint32_t i = 0; i < range; ++i)
+  {
+    const auto port = static_cast<uint16_t>(config.relayPortMin + (_portSeq++ + _worker.index() * 7919u) % range);
+    relay.bind(udp::endpoint(_config.relayAddress, port), ec);
+    if (!ec)
+      return true;
+  }
+  spdlog::warn("No relay port left in {}-{} for realm {}", config.relayPortMin, config.relayPortMax, config.realm);
+  return false;
+}
+
+void TurnServer::handleRefresh(Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  uint32_t lifetime = _config.defaultLifetime;
+  StunAttribute requested;
+  if (msg.find(ATTR_LIFETIME, requested) && requested.length == 4)
+  {
+    lifetime = read32(requested.value);
+    if (lifetime != 0)
+      lifetime = std::min(_config.maxLifetime, std::max(_config.defaultLifetime, lifetime));
+  }
+
+  resp.clear();
+  StunMessageBuilder builder(resp, messageType(METHOD_REFRESH, CLASS_SUCCESS), msg.transactionId());
+  builder.addUint32(ATTR_LIFETIME, lifetime);
+
+  if (lifetime == 0)
+    erase(alloc.row);
+  else
+    _table.setExpiry(alloc.row, now() + lifetime);
+}
+
+void TurnServer::handleCreatePermission(
+    Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  std::vector<udp::endpoint> peers;
+  bool valid = true;
+  msg.forEach(ATTR_XOR_PEER_ADDRESS, [&](const StunAttribute& attr) {
+    udp::endpoint peer;
+    if (msg.xorAddress(attr, peer))
+      peers.push_back(peer);
+    else
+      valid = false;
+  });
+
+  if (!valid || peers.empty())
+  {
+    buildErrorResponse(resp, msg, 400, "Bad Request");
+    return;
+  }
+  for (const auto& peer : peers)
+  {
+    if (!peerAllowed(peer.address()))
+    {
+      buildErrorResponse(resp, msg, 403, "Forbidden");
+      return;
+    }
+  }
+
+  // All or nothing: only the peers without a permission yet take room
+  if (alloc.permissions.size() + peers.size() > _config.maxPermissions)
+  {
+    std::size_t added = 0;
+    for (std::size_t i = 0; i < peers.size(); ++i)
+    {
+      const auto& address = peers[i].address();
+      if (alloc.permissions.contains(address))
+        continue;
+      if (std::none_of(peers.begin(), peers.begin() + i,
+              [&address](const udp::endpoint& other) { return other.address() == address; }))
+        ++added;
+    }
+    if (!permissionRoom(alloc, added))
+    {
+      buildErrorResponse(resp, msg, 508, "Insufficient Capacity");
+      return;
+    }
+  }
+
+  for (const auto& peer : peers)
+    installPermission(alloc, peer.address());
+
+  resp.clear();
+  StunMessageBuilder(resp, messageType(METHOD_CREATE_PERMISSION, CLASS_SUCCESS), msg.transactionId());
+}
+
+void TurnServer::handleChannelBind(Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp)
+{
+  StunAttribute channelAttr;
+  udp::endpoint peer;
+  if (!msg.find(ATTR_CHANNEL_NUMBER, channelAttr) || channelAttr.length != 4
+      || !msg.xorAddress(ATTR_XOR_PEER_ADDRESS, peer))
+  {
+    buildErrorResponse(resp, msg, 400, "Bad Request");
+    return;
+  }
+
+  const uint16_t number = read16(channelAttr.value);
+  if (number < CHANNEL_MIN || number > CHANNEL_MAX)
+  {
+    buildErrorResponse(resp, msg, 400, "Bad Request");
+    return;
+  }
+  if (!peerAllowed(peer.address()))
+  {
+    buildErrorResponse(resp, msg, 403, "Forbidden");
+    return;
+  }
+
+  // A channel is bound to one peer and a peer to one channel
+  Channel* bound = nullptr;
+  for (PoolHandle h = alloc.channels; Channel* channel = _channelPool.get(h); h = channel->next)
+  {
+    if ((channel->number == number) != (channel->peer == peer))
+    {
+      buildErrorResponse(resp, msg, 400, "Bad Request");
+      return;
+    }
+    if (channel->number == number)
+      bound = channel;
+  }
+
+  if (!alloc.permissions.contains(peer.address()) && !permissionRoom(alloc, 1))
+  {
+    buildErrorResponse(resp, msg, 508, "Insufficient Capacity");
+    return;
+  }
+
+  const uint32_t expiry = now() + CHANNEL_LIFETIME;
+  if (bound)
+    bound->expiry = expiry;
+  else
+    alloc.channels = _channelPool.create(Channel {number, peer, expiry, alloc.channels});
+  installPermission(alloc, peer.address());
+  updateListExpiry(alloc);
+
+  resp.clear();
+  StunMessageBuilder(resp, messageType(METHOD_CHANNEL_BIND, CLASS_SUCCESS), msg.transactionId());
+}
+
+void TurnServer::handleSend(Allocation& alloc, const StunMessage& msg)
+{
+  udp::endpoint peer;
+  StunAttribute data;
+  if (!msg.xorAddress(ATTR_XOR_PEER_ADDRESS, peer) || !msg.find(ATTR_DATA, data))
+    return;
+
+  if (!alloc.permissions.contains(peer.address()))
+  {
+    statsInc(_stats.relayDropped);
+    return;
+  }
+
+  sendToPeer(alloc, data.value, data.length, peer);
+}
+
+void TurnServer::handleChannelData(const RequestContext& ctx, const uint8_t* data, std::size_t bytes)
+{
+  auto* alloc = find(ctx);
+  if (!alloc)
+    return;
+
+  const uint16_t number = read16(data);
+  const std::size_t len = read16(data + 2);
+  if (CHANNEL_DATA_HEADER_SIZE + len > bytes)
+    return;
+
+  for (PoolHandle h = alloc->channels; const Channel* channel = _channelPool.get(h); h = channel->next)
+  {
+    if (channel->number == number)
+    {
+      // Channels outlive their permission unless it is refreshed (RFC 5766 section 11.5)
+      if (!alloc->permissions.contains(channel->peer.address()))
+        break;
+      sendToPeer(*alloc, data + CHANNEL_DATA_HEADER_SIZE, len, channel->peer);
+      return;
+    }
+  }
+  statsInc(_stats.relayDropped);
+}
+
+bool TurnServer::peerAllowed(const boost::asio::ip::address& peer) const
+{
+  return !isRestricted(peer) || _config.allowedPeers.contains(peer);
+}
+
+// Expired peers linger until the sweep, they are dropped first when the
+// allocation looks full
+bool TurnServer::permissionRoom(Allocation& alloc, std::size_t added)
+{
+  if (alloc.permissions.size() + added <= _config.maxPermissions)
+    return true;
+  alloc.permissions.prune(now());
+  return alloc.permissions.size() + added <= _config.maxPermissions;
+}
+
+void TurnServer::installPermission(Allocation& alloc, const boost::asio::ip::address& peer)
+{
+  // Refreshing can only push the expiry later, the sweep catches up
+  const uint32_t expiry = now() + PERMISSION_LIFETIME;
+  alloc.permissions.insert(peer, expiry);
+  _table.setListExpiry(alloc.row, std::min(_table.listExpiry(alloc.row), expiry));
+}
+
+void TurnServer::sendToPeer(
+    Allocation& alloc, const uint8_t* data, std::size_t bytes, const udp::endpoint& peer)
+{
+  if (alloc.paced)
+  {
+    if (!sendPaced(alloc, data, bytes, peer))
+      return;
+  }
+  else if (!_config.virtualRelays)
+  {
+    boost::system::error_code ec;
+    alloc.relay.send_to(boost::asio::buffer(data, bytes), peer, 0, ec);
+    if (ec)
+    {
+      statsInc(_stats.sendErrors);
+      return;
+    }
+  }
+
+  statsInc(_stats.relayedToPeer);
+  _table.addBytesToPeer(alloc.row, bytes);
+}
+
+bool TurnServer::enablePacing(udp::socket& relay)
+{
+#ifdef SO_TXTIME
+  sock_txtime txtime {};
+  txtime.clockid = CLOCK_MONOTONIC;
+  if (setsockopt(relay.native_handle(), SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == 0)
+    return true;
+  const std::string error = std::strerror(errno);
+#else
+  (void)relay;
+  const std::string error = "SO_TXTIME not supported";
+#endif
+
+  if (!_pacingWarned)
+  {
+    spdlog::warn("Relay pacing disabled: {}", error);
+    _pacingWarned = true;
+  }
+  return false;
+}
+
+// Each packet carries its departure time, spaced by the pacing rate; the fq
+// qdisc holds it until then, so there is no timer on our side. Without fq
+// the time is ignored and packets leave immediately.
+bool TurnServer::sendPaced(Allocation& alloc, const uint8_t* data, std::size_t bytes, const udp::endpoint& peer)
+{
+#ifdef SO_TXTIME
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t current   = uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+  const uint64_t departure = std::max(current, alloc.nextDeparture);
+
+  // fq drops packets too far in the future anyway, do not queue a backlog
+  if (departure - current > uint64_t(_config.pacingHorizon) * 1000000ull)
+  {
+    statsInc(_stats.pacingDropped);
+    return false;
+  }
+
+  iovec iov {const_cast<uint8_t*>(data), bytes};
+  alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint64_t))] = {};
+  msghdr hdr {};
+  hdr.msg_name       = const_cast<sockaddr*>(peer.data());
+  hdr.msg_namelen    = static_cast<socklen_t>(peer.size());
+  hdr.msg_iov        = &iov;
+  hdr.msg_iovlen     = 1;
+  hdr.msg_control    = control;
+  hdr.msg_controllen = sizeof(control);
+
+  cmsghdr* cmsg    = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_TXTIME;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+  std::memcpy(CMSG_DATA(cmsg), &departure, sizeof(departure));
+
+  if (sendmsg(alloc.relay.native_handle(), &hdr, 0) < 0)
+  {
+    statsInc(_stats.sendErrors);
+    return false;
+  }
+
+  alloc.nextDeparture = departure + bytes * 1000000000ull / _config.pacingRate;
+  statsInc(_stats.relayPaced);
+  return true;
+#else
+  (void)alloc, (void)data, (void)bytes, (void)peer;
+  return false;
+#endif
+}
+
+void TurnServer::startRelayReceive(PoolHandle handle)
+{
+  // Wait for readability only, the datagrams are then read into the buffer
+  // shared by every allocation of the worker
+  auto& relay = _allocationPool.get(handle)->relay;
+  relay.async_wait(udp::socket::wait_read, [this, handle](boost::system::error_code ec) {
+    auto* alloc = _allocationPool.get(handle);
+    if (ec || !alloc)
+      return;
+
+    // Bounded so that one busy allocation cannot starve the others
+    udp::endpoint from;
+    for (int i = 0; i < 64; ++i)
+    {
+      uint8_t* payload = _buffer.data() + RELAY_HEADROOM;
+      const auto bytes = alloc->relay.receive_from(boost::asio::buffer(payload, RELAY_PAYLOAD), from, 0, ec);
+      if (ec)
+        break;
+      relayToClient(*alloc, payload, bytes, from);
+    }
+    startRelayReceive(handle);
+  });
+}
+
+void TurnServer::relayToClient(Allocation& alloc, uint8_t* payload, std::size_t bytes, const udp::endpoint& from)
+{
+  if (!alloc.permissions.contains(from.address()))
+  {
+    statsInc(_stats.relayDropped);
+    return;
+  }
+
+  // The header is written in the headroom, the payload never moves
+  static_assert(RELAY_HEADROOM >= STUN_HEADER_SIZE + 24 + 4, "Data indication header does not fit");
+  uint8_t* message   = nullptr;
+  std::size_t length = 0;
+  for (PoolHandle h = alloc.channels; const Channel* channel = _channelPool.get(h); h = channel->next)
+  {
+    if (channel->peer == from)
+    {
+      message    = payload - CHANNEL_DATA_HEADER_SIZE;
+      message[0] = static_cast<uint8_t>(channel->number >> 8);
+      message[1] = static_cast<uint8_t>(channel->number);
+      message[2] = static_cast<uint8_t>(bytes >> 8);
+      message[3] = static_cast<uint8_t>(bytes);
+      length     = CHANNEL_DATA_HEADER_SIZE + bytes;
+
+      // Over streams ChannelData is padded to a multiple of 4
+      if (alloc.transport == Transport::Tcp || alloc.transport == Transport::Tls)
+        length = (length + 3) & ~std::size_t(3);
+      break;
+    }
+  }
+
+  if (!message)
+  {
+    // Indications only need distinct transaction IDs
+    uint8_t trans_id[12] = {static_cast<uint8_t>(_worker.index())};
+    ++_indicationSeq;
+    std::memcpy(trans_id + 4, &_indicationSeq, sizeof(_indicationSeq));
+
+    _header.clear();
+    StunMessageBuilder indication(_header, messageType(METHOD_DATA, CLASS_INDICATION), trans_id);
+    indication.addXorAddress(ATTR_XOR_PEER_ADDRESS, from);
+    indication.addAttributeHeader(ATTR_DATA, static_cast<uint16_t>(bytes));
+
+    message = payload - _header.size();
+    std::memcpy(message, _header.data(), _header.size());
+    length = _header.size() + ((bytes + 3) & ~std::size_t(3));
+  }
+
+  // Padding, if any, goes in the tailroom
+  std::memset(payload + bytes, 0, message + length - payload - bytes);
+
+  alloc.key.sender->sendToClient(message, length, alloc.peerLink);
+  statsInc(_stats.relayedToClient);
+  _table.addBytesToClient(alloc.row, bytes);
+}
+
+void TurnServer::scheduleSweep()
+{
+  _sweepTimer.expires_after(std::chrono::seconds(1));
+  _sweepTimer.async_wait([this](boost::system::error_code ec) {
+    if (ec)
+      return;
+    sweep();
+    scheduleSweep();
+  });
+}
+
+// Only the expiry columns are scanned, allocation objects are touched when
+// something actually expired
+void TurnServer::sweep()
+{
+  const uint32_t current = now();
+
+  // Backwards, erasing moves the last row into the hole
+  _table.collectExpired(current, _expired);
+  for (auto it = _expired.rbegin(); it != _expired.rend(); ++it)
+  {
+    spdlog::debug("Allocation {} expired",
+        StunServer::endpoint2str(_allocationPool.get(_table.object(*it))->relayed));
+    erase(*it);
+  }
+
+  _table.collectListExpired(current, _expired);
+  for (const uint32_t row : _expired)
+  {
+    auto& alloc = *_allocationPool.get(_table.object(row));
+    _table.setListExpiry(
+        row, std::min(alloc.permissions.prune(current), pruneExpired(_channelPool, alloc.channels, current)));
+  }
+
+  std::fill(_tenantBytes.begin(), _tenantBytes.end(), 0);
+  _table.collectBytes(_tenantBytes);
+  for (TenantId tenant = 0; tenant < _tenantBytes.size(); ++tenant)
+  {
+    if (_tenantBytes[tenant])
+      _tenants.addRelayedBytes(tenant, _tenantBytes[tenant]);
+  }
+
+  // At least once a second, so records do not linger on quiet workers
+  flushUsage();
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "allocationTable.hpp"
+#include "config.hpp"
+#include "listener.hpp"
+#include "peerSet.hpp"
+#include "serverClock.hpp"
+#include "slabPool.hpp"
+#include "stats.hpp"
+#include "usageLog.hpp"
+
+class StunMessage;
+class TenantTable;
+class Worker;
+
+// TURN relay (RFC 5766) for the clients of one worker, UDP relaying only.
+// Allocations are keyed by the client transport address and the listener or
+// connection it came through, and count against the quota of their tenant.
+// Allocations and channels live in per-worker slab pools and refer to each
+// other by handle; channels are an intrusive list hanging off their
+// allocation, permissions a PeerSet inside it. The fields touched by sweeps
+// and accounting live in an AllocationTable row.
+class TurnServer {
+  public:
+    using Clock = ServerClock;
+
+    // usage is null when usage records are disabled
+    TurnServer(Worker& worker, const TurnConfig& config, TenantTable& tenants, Stats& stats, UsageLog* usage);
+    ~TurnServer();
+
+    // Allocate, Refresh, CreatePermission, ChannelBind requests and Send
+    // indications, returns false when there is no response
+    bool handleMessage(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp);
+    void handleChannelData(const RequestContext& ctx, const uint8_t* data, std::size_t bytes);
+
+    bool hasAllocation(const RequestContext& ctx) const;
+    void clientClosed(ClientSender* sender);
+    void clear();
+
+    // Expiries and byte accounting, run every second by a timer
+    void sweep();
+
+  private:
+    struct AllocationKey
+    {
+      ClientSender* sender;
+      boost::asio::ip::udp::endpoint client;
+
+      bool operator==(const AllocationKey& other) const
+      {
+        return sender == other.sender && client == other.client;
+      }
+    };
+
+    struct Channel
+    {
+      uint16_t number;
+      boost::asio::ip::udp::endpoint peer;
+      uint32_t expiry;
+      PoolHandle next;
+    };
+
+    struct Allocation
+    {
+      explicit Allocation(boost::asio::io_context& io) : relay(io) {}
+
+      AllocationKey key;
+      uint32_t row; // in the allocation table
+      Transport transport;
+      boost::asio::ip::udp::endpoint peerLink; // where to send to the client
+      boost::asio::ip::udp::socket relay;
+      boost::asio::ip::udp::endpoint relayed; // advertised relay address
+      PeerSet permissions;
+      PoolHandle channels; // list head
+      bool paced             = false; // relay socket has SO_TXTIME
+      uint64_t nextDeparture = 0; // CLOCK_MONOTONIC ns
+      std::string username; // for usage records
+      int64_t started = 0; // unix time
+    };
+
+    static uint64_t hashKey(const AllocationKey& key);
+
+    // Seconds since the server was created, the time base of expiries
+    uint32_t now() const;
+
+    Allocation* find(const RequestContext& ctx) const;
+    void erase(uint32_t row);
+    void recordUsage(const Allocation& alloc, uint32_t row);
+    void flushUsage();
+    void updateListExpiry(Allocation& alloc);
+
+    // Binds in the relay port range of the tenant, if it has one
+    bool bindRelay(boost::asio::ip::udp::socket& relay, TenantId tenant);
+    // Lets the fq qdisc release relayed packets at their departure time
+    bool enablePacing(boost::asio::ip::udp::socket& relay);
+
+    void handleAllocate(const RequestContext& ctx, const StunMessage& msg, std::vector<uint8_t>& resp);
+    void handleRefresh(Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp);
+    void handleCreatePermission(Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp);
+    void handleChannelBind(Allocation& alloc, const StunMessage& msg, std::vector<uint8_t>& resp);
+    void handleSend(Allocation& alloc, const StunMessage& msg);
+
+    // Permissions and channels towards the relay host and private networks
+    // need turn-allowed-peers
+    bool peerAllowed(const boost::asio::ip::address& peer) const;
+    bool permissionRoom(Allocation& alloc, std::size_t added);
+    void installPermission(Allocation& alloc, const boost::asio::ip::address& peer);
+
+    void startRelayReceive(PoolHandle handle);
+    // payload sits in _buffer after RELAY_HEADROOM bytes, it is wrapped in
+    // place
+    void relayToClient(Allocation& alloc, uint8_t* payload, std::size_t bytes,
+        const boost::asio::ip::udp::endpoint& from);
+    void sendToPeer(Allocation& alloc, const uint8_t* data, std::size_t bytes,
+        const boost::asio::ip::udp::endpoint& peer);
+    bool sendPaced(Allocation& alloc, const uint8_t* data, std::size_t bytes,
+        const boost::asio::ip::udp::endpoint& peer);
+
+    void scheduleSweep();
+
+  private:
+    // Room for the largest encapsulation header in front of relayed data: a
+    // Data indication with an IPv6 XOR-PEER-ADDRESS (20 + 24 + 4 bytes), and
+    // for the padding to 4 bytes after it
+    static constexpr std::size_t RELAY_HEADROOM = 48;
+    static constexpr std::size_t RELAY_TAILROOM = 3;
+    static constexpr std::size_t RELAY_PAYLOAD  = 2048;
+
+    Worker& _worker;
+    const TurnConfig& _config;
+    Stats& _stats;
+    TenantTable& _tenants;
+    UsageLog* _usage;
+    UsageBatch _usageBatch; // records not handed to the usage log yet
+    SlabPool<Allocation> _allocationPool;
+    SlabPool<Channel> _channelPool;
+    AllocationTable _table;
+    Clock::time_point _epoch;
+    std::vector<uint32_t> _expired; // sweep scratch
+    std::vector<uint64_t> _tenantBytes;
+    boost::asio::steady_timer _sweepTimer;
+    // Relay receive, shared by every allocation
+    std::array<uint8_t, RELAY_HEADROOM + RELAY_PAYLOAD + RELAY_TAILROOM> _buffer {};
+    std::vector<uint8_t> _header; // Data indication scratch
+    uint64_t _indicationSeq = 0;
+    uint32_t _portSeq       = 0;
+    bool _pacingWarned      = false;
+};
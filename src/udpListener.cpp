@@ -0,0 +1,139 @@
+#include "udpListener.hpp"
+#include "memoryAccounting.hpp"
+#include "packetCapture.hpp"
+#include "proxyProtocol.hpp"
+#include "stunServer.hpp"
+#include "tracer.hpp"
+
+#include <spdlog/spdlog.h>
+
+using boost::asio::ip::udp;
+
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+UdpListener::UdpListener(Worker& worker, StunServer& server, const ListenerConfig& config)
+    : _worker(worker)
+    , _server(server)
+    , _config(config)
+    , _socket(worker.io())
+    , _capture(server.capture(worker))
+{
+  const udp::endpoint local(config.address, config.port);
+
+  _socket.open(local.protocol());
+  _socket.set_option(udp::socket::reuse_address(true));
+  _socket.set_option(reuse_port(true));
+  if (local.address().is_v6())
+    _socket.set_option(boost::asio::ip::v6_only(true));
+  _socket.bind(local);
+  _local = _socket.local_endpoint();
+
+  MemoryAccounting::add(MemoryTag::Buffers, sizeof(*this));
+  startReceive();
+}
+
+UdpListener::~UdpListener()
+{
+  MemoryAccounting::sub(MemoryTag::Buffers, sizeof(*this));
+}
+
+void UdpListener::stop()
+{
+  boost::system::error_code ec;
+  _socket.close(ec);
+  if (ec)
+    spdlog::warn("Error while closing socket: {}", ec.message());
+}
+
+void UdpListener::startReceive()
+{
+  _socket.async_receive_from(boost::asio::buffer(_buffer), _remote,
+      [this](boost::system::error_code ec, std::size_t bytes) {
+        if (ec == boost::asio::error::operation_aborted)
+          return;
+        if (!ec)
+          handlePacket(bytes);
+        startReceive();
+      });
+}
+
+void UdpListener::handlePacket(const std::size_t bytes)
+{
+  RequestContext ctx {_worker, Transport::Udp, _remote, _remote, this, _config.tenant};
+  const uint8_t* data = _buffer.data();
+  std::size_t length  = bytes;
+  udp::endpoint local = _local;
+
+  // Behind a balancer every datagram carries its own header, the reply still
+  // goes to the balancer but the request is processed on behalf of the client
+  if (_config.proxyProtocol && _config.proxyTrusted.contains(_remote.address()))
+  {
+    ProxyHeader proxy;
+    if (parseProxyV2(data, length, ProxyTransport::Dgram, proxy) != ProxyParseResult::Ok)
+    {
+      statsInc(_server.stats().proxyErrors);
+      if (spdlog::should_log(spdlog::level::debug))
+        spdlog::debug("Dropping datagram without valid PROXY header from {}",
+            StunServer::endpoint2str(_remote));
+      return;
+    }
+
+    statsInc(_server.stats().proxyHeaders);
+    data += proxy.length;
+    length -= proxy.length;
+    if (!proxy.local)
+    {
+      ctx.remote = proxy.source;
+      local      = proxy.destination;
+    }
+  }
+
+  // Recorded as exchanged between the client and the address it targeted,
+  // without the PROXY header, so that the made up headers match the payload
+  bool captured = _capture && (_capture->sample() || _capture->matches(ctx.remote, data, length));
+  if (captured)
+    _capture->record(PacketCapture::Direction::Received, local, ctx.remote, data, length);
+
+  if (!_server.handleMessage(ctx, data, length, _response))
+    return;
+
+  TraceScope trace(_server.tracer(), ctx, TraceStage::Send);
+  send(_response.data(), _response.size(), _remote);
+  trace.finish();
+
+  // The response of a captured request, or an error response and its request
+  if (_capture && !captured && _capture->matches(ctx.remote, _response.data(), _response.size()))
+  {
+    _capture->record(PacketCapture::Direction::Received, local, ctx.remote, data, length);
+    captured = true;
+  }
+  if (captured)
+    _capture->record(PacketCapture::Direction::Sent, local, ctx.remote, _response.data(), _response.size());
+}
+
+void UdpListener::sendToClient(const uint8_t* data, std::size_t bytes, const udp::endpoint& peer)
+{
+  send(data, bytes, peer);
+  if (_capture && (_capture->sample() || _capture->matches(peer, data, bytes)))
+    _capture->record(PacketCapture::Direction::Sent, _local, peer, data, bytes);
+}
+
+void UdpListener::send(const uint8_t* data, std::size_t bytes, const udp::endpoint& peer)
+{
+  // Datagram sockets rarely block, send inline and keep the receive path simple
+  boost::system::error_code ec;
+  _socket.send_to(boost::asio::buffer(data, bytes), peer, 0, ec);
+  if (ec)
+  {
+    statsInc(_server.stats().sendErrors);
+    spdlog::warn("Failed to send to {}: {}", StunServer::endpoint2str(peer), ec.message());
+  }
+  else
+    statsInc(_server.stats().responsesSent);
+}
+
+std::shared_ptr<ClientSender> UdpListener::retain()
+{
+  // Listeners live as long as the server, no ownership needed
+  return std::shared_ptr<ClientSender>(std::shared_ptr<ClientSender>(), this);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "listener.hpp"
+
+class PacketCapture;
+class StunServer;
+
+class UdpListener : public Listener, public ClientSender {
+  public:
+    UdpListener(Worker& worker, StunServer& server, const ListenerConfig& config);
+    ~UdpListener() override;
+
+    void stop() override;
+
+    void sendToClient(const uint8_t* data, std::size_t bytes,
+        const boost::asio::ip::udp::endpoint& peer) override;
+    std::shared_ptr<ClientSender> retain() override;
+
+  private:
+    void startReceive();
+    void handlePacket(const std::size_t bytes);
+    void send(const uint8_t* data, std::size_t bytes, const boost::asio::ip::udp::endpoint& peer);
+
+  private:
+    Worker& _worker;
+    StunServer& _server;
+    ListenerConfig _config;
+    boost::asio::ip::udp::socket _socket;
+    boost::asio::ip::udp::endpoint _local;
+    PacketCapture* _capture; // null when capture is disabled
+    boost::asio::ip::udp::endpoint _remote;
+    std::array<uint8_t, 2048> _buffer{};
+    std::vector<uint8_t> _response;
+};
@@ -0,0 +1,223 @@
+#include "usageLog.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+constexpr std::size_t UsageLog::BATCH_BYTES;
+constexpr std::size_t UsageLog::MAX_PENDING;
+constexpr const char* UsageLog::HEADER;
+constexpr std::size_t UsageLog::BLOCK;
+
+UsageLog::UsageLog(const UsageConfig& config, Stats& stats)
+    : _config(config)
+    , _stats(stats)
+{
+  // Large enough to take several worker batches between two flushes
+  _capacity = 16 * BATCH_BYTES;
+  void* buffer;
+  if (posix_memalign(&buffer, BLOCK, _capacity) != 0)
+    throw std::bad_alloc();
+  _buffer = static_cast<uint8_t*>(buffer);
+  MemoryAccounting::add(MemoryTag::Logging, _capacity);
+
+  if (!open())
+    throw std::runtime_error("cannot open usage log " + _config.path + ": " + std::strerror(errno));
+  _thread = std::thread([this] { run(); });
+}
+
+UsageLog::~UsageLog()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _wakeup.notify_one();
+  _thread.join();
+
+  if (_fd >= 0)
+    close(_fd);
+  std::free(_buffer);
+  MemoryAccounting::sub(MemoryTag::Logging, _capacity);
+}
+
+void UsageLog::submit(UsageBatch&& batch)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_pending.size() >= MAX_PENDING)
+    {
+      // The disk does not keep up, memory would grow without end
+      statsInc(_stats.usageWriteErrors);
+      return;
+    }
+    _pending.push_back(std::move(batch));
+  }
+  _wakeup.notify_one();
+}
+
+void UsageLog::appendField(UsageBatch& line, const std::string& value)
+{
+  if (value.find_first_of(",\"\r\n") == std::string::npos)
+  {
+    line.append(value.data(), value.size());
+    return;
+  }
+
+  line += '"';
+  for (const char c : value)
+  {
+    if (c == '"')
+      line += '"';
+    line += c;
+  }
+  line += '"';
+}
+
+void UsageLog::run()
+{
+  std::vector<UsageBatch> batches;
+  for (;;)
+  {
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _wakeup.wait_for(lock, std::chrono::seconds(1), [this] { return _stopping || !_pending.empty(); });
+      batches.swap(_pending);
+      stopping = _stopping;
+    }
+
+    for (const auto& batch : batches)
+      write(batch);
+    if (!batches.empty())
+      flush();
+    batches.clear();
+
+    if (stopping)
+      break;
+  }
+}
+
+void UsageLog::write(const UsageBatch& batch)
+{
+  std::size_t done = 0;
+  while (done < batch.size())
+  {
+    const std::size_t bytes = std::min(batch.size() - done, _capacity - _used);
+    std::memcpy(_buffer + _used, batch.data() + done, bytes);
+    _used += bytes;
+    done += bytes;
+    if (_used == _capacity)
+      flush();
+  }
+}
+
+void UsageLog::flush()
+{
+  if (_fd < 0)
+  {
+    // Reopening failed after a rotation, drop the records
+    _used = 0;
+    return;
+  }
+
+  // Whole blocks, the tail one padded with zeroes then cut off
+  const std::size_t full   = _used / BLOCK * BLOCK;
+  const std::size_t padded = (_used + BLOCK - 1) / BLOCK * BLOCK;
+  std::memset(_buffer + _used, 0, padded - _used);
+
+  struct stat st;
+  const uint64_t before = fstat(_fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : _offset;
+
+  std::size_t written = 0;
+  while (written < padded)
+  {
+    const ssize_t n = pwrite(_fd, _buffer + written, padded - written, static_cast<off_t>(_offset + written));
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      statsInc(_stats.usageWriteErrors);
+      spdlog::warn("Cannot write usage log {}: {}", _config.path, std::strerror(errno));
+      break;
+    }
+    written += static_cast<std::size_t>(n);
+  }
+  if (ftruncate(_fd, static_cast<off_t>(_offset + _used)) != 0)
+    statsInc(_stats.usageWriteErrors);
+
+  if (_offset + _used > before)
+    statsInc(_stats.usageBytesWritten, _offset + _used - before);
+
+  std::memmove(_buffer, _buffer + full, _used - full);
+  _offset += full;
+  _used -= full;
+
+  if (_offset + _used >= _config.rotateBytes)
+  {
+    rotate();
+    if (!open())
+    {
+      statsInc(_stats.usageWriteErrors);
+      spdlog::error("Cannot reopen usage log {}: {}", _config.path, std::strerror(errno));
+    }
+  }
+}
+
+bool UsageLog::open()
+{
+  // Never append to a previous file: its size need not be block aligned
+  struct stat st;
+  if (stat(_config.path.c_str(), &st) == 0 && st.st_size > 0)
+    rotate();
+
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  _direct         = true;
+  _fd             = ::open(_config.path.c_str(), flags | O_DIRECT, 0644);
+  if (_fd < 0 && errno == EINVAL)
+  {
+    // tmpfs and a few others
+    _direct = false;
+    _fd     = ::open(_config.path.c_str(), flags, 0644);
+  }
+  if (_fd < 0)
+    return false;
+
+  _offset = 0;
+  _used   = std::strlen(HEADER);
+  std::memcpy(_buffer, HEADER, _used);
+  spdlog::info("Usage records in {}{}", _config.path, _direct ? "" : " (buffered I/O)");
+  return true;
+}
+
+void UsageLog::rotate()
+{
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+
+  char suffix[32];
+  const std::time_t now = std::time(nullptr);
+  std::tm tm;
+  gmtime_r(&now, &tm);
+  std::strftime(suffix, sizeof(suffix), ".%Y%m%dT%H%M%SZ", &tm);
+
+  std::string target = _config.path + suffix;
+  for (int i = 1; access(target.c_str(), F_OK) == 0; ++i)
+    target = _config.path + suffix + "." + std::to_string(i);
+  if (std::rename(_config.path.c_str(), target.c_str()) != 0)
+    spdlog::warn("Cannot rotate usage log {}: {}", _config.path, std::strerror(errno));
+}
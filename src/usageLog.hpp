@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+#include "memoryAccounting.hpp"
+#include "stats.hpp"
+
+// CSV lines handed over by a worker
+using UsageBatch = std::basic_string<char, std::char_traits<char>, TaggedAllocator<char, MemoryTag::Logging>>;
+
+// Usage records of ended allocations, as CSV lines. Workers format records
+// into their own batch and hand whole batches over; a background thread
+// appends them to the file with O_DIRECT (plain writes where the filesystem
+// refuses it) and rotates the file by size, renaming it with a timestamp.
+//
+// Direct I/O only writes whole blocks: the last, partial block stays in
+// memory and is written padded then truncated to the real size, so the file
+// is always complete up to the last batch.
+class UsageLog {
+  public:
+    static constexpr std::size_t BATCH_BYTES = 64 * 1024; // per worker, before a handover
+    static constexpr std::size_t MAX_PENDING = 64; // batches waiting for the writer
+    static constexpr const char* HEADER
+        = "start,end,realm,username,client,relayed,bytes_to_peer,packets_to_peer,bytes_to_client,"
+          "packets_to_client\n";
+
+    UsageLog(const UsageConfig& config, Stats& stats);
+    ~UsageLog();
+
+    UsageLog(const UsageLog&) = delete;
+    UsageLog& operator=(const UsageLog&) = delete;
+
+    // Called on the workers, never waits for the disk: past MAX_PENDING
+    // batches, the new one is dropped and counted as a write error
+    void submit(UsageBatch&& batch);
+
+    // Appends a CSV field, quoted when needed
+    static void appendField(UsageBatch& line, const std::string& value);
+
+  private:
+    static constexpr std::size_t BLOCK = 4096;
+
+    void run();
+    void write(const UsageBatch& batch);
+    void flush();
+    bool open();
+    // Closes the file and renames it with a timestamp
+    void rotate();
+
+  private:
+    const UsageConfig& _config;
+    Stats& _stats;
+
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::vector<UsageBatch> _pending;
+    bool _stopping = false;
+
+    // Writer thread only
+    int _fd          = -1;
+    bool _direct     = false;
+    uint64_t _offset = 0; // start of the block being filled
+    uint8_t* _buffer = nullptr; // block aligned
+    std::size_t _capacity = 0;
+    std::size_t _used     = 0;
+
+    std::thread _thread;
+};
@@ -0,0 +1,37 @@
+#include "worker.hpp"
+
+#include <spdlog/spdlog.h>
+
+Worker::Worker(unsigned index)
+    : _index(index)
+    , _work(boost::asio::make_work_guard(_io))
+{
+}
+
+void Worker::start()
+{
+  _thread = std::thread([this] {
+    spdlog::debug("Worker {} started", _index);
+    try
+    {
+      _io.run();
+    }
+    catch (const std::exception& e)
+    {
+      spdlog::error("Worker {} crashed: {}", _index, e.what());
+    }
+    spdlog::debug("Worker {} stopped", _index);
+  });
+}
+
+void Worker::stop()
+{
+  _work.reset();
+  _io.stop();
+}
+
+void Worker::join()
+{
+  if (_thread.joinable())
+    _thread.join();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <thread>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+// One event loop run by a single thread, with no CPU affinity set. Listeners
+// are instantiated once per worker (SO_REUSEPORT), so the kernel keeps a
+// given 5-tuple on the same worker and per-worker state needs no locking.
+class Worker {
+  public:
+    explicit Worker(unsigned index);
+    Worker(const Worker&) = delete;
+    Worker& operator=(const Worker&) = delete;
+
+    void start();
+    void stop();
+    void join();
+
+    unsigned index() const { return _index; }
+    boost::asio::io_context& io() { return _io; }
+
+  private:
+    unsigned _index;
+    boost::asio::io_context _io;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
+    std::thread _thread;
+};
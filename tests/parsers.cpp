@@ -0,0 +1,261 @@
+// Known-good and known-bad inputs for the two parsers fed by the network:
+// the PROXY v2 header and the STUN message (header, attribute chain, limits
+// and XOR-*-ADDRESS decoding).
+//
+//   test-parsers
+
+#include "proxyProtocol.hpp"
+#include "stunMessage.hpp"
+
+#include <cstdio>
+#include <initializer_list>
+#include <vector>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  const uint8_t SIGNATURE[12] = {0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A};
+
+  int failures = 0;
+
+  void check(bool ok, const char* what)
+  {
+    if (ok)
+      return;
+    std::fprintf(stderr, "%s\n", what);
+    ++failures;
+  }
+
+  std::vector<uint8_t> proxyHeader(uint8_t verCmd, uint8_t familyProto, std::initializer_list<uint8_t> body)
+  {
+    std::vector<uint8_t> out(SIGNATURE, SIGNATURE + sizeof(SIGNATURE));
+    out.push_back(verCmd);
+    out.push_back(familyProto);
+    out.push_back(static_cast<uint8_t>(body.size() >> 8));
+    out.push_back(static_cast<uint8_t>(body.size()));
+    out.insert(out.end(), body);
+    return out;
+  }
+
+  // 192.0.2.1:1234 to 198.51.100.1:3478
+  const std::initializer_list<uint8_t> IPV4_ADDRESSES
+      = {192, 0, 2, 1, 198, 51, 100, 1, 0x04, 0xD2, 0x0D, 0x96};
+
+  ProxyParseResult parseProxy(const std::vector<uint8_t>& data, ProxyTransport transport, ProxyHeader& out)
+  {
+    return parseProxyV2(data.data(), data.size(), transport, out);
+  }
+
+  void checkProxyGood()
+  {
+    ProxyHeader proxy;
+    auto data = proxyHeader(0x21, 0x12, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Ok, "PROXY: IPv4 DGRAM");
+    check(proxy.length == 28 && !proxy.local, "PROXY: IPv4 DGRAM length");
+    check(proxy.source == udp::endpoint(boost::asio::ip::make_address("192.0.2.1"), 1234)
+            && proxy.destination == udp::endpoint(boost::asio::ip::make_address("198.51.100.1"), 3478),
+        "PROXY: IPv4 addresses");
+
+    data = proxyHeader(0x21, 0x11, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Ok, "PROXY: IPv4 STREAM");
+
+    // 2001:db8::1:1234 to 2001:db8::2:3478
+    data = proxyHeader(0x21, 0x21, {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0x20, 0x01, 0x0d, 0xb8,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0x04, 0xD2, 0x0D, 0x96});
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Ok, "PROXY: IPv6 STREAM");
+    check(proxy.source == udp::endpoint(boost::asio::ip::make_address("2001:db8::1"), 1234),
+        "PROXY: IPv6 source");
+
+    // TLVs after the addresses are part of the header
+    data = proxyHeader(0x21, 0x12, {192, 0, 2, 1, 198, 51, 100, 1, 0x04, 0xD2, 0x0D, 0x96, 0x04, 0x00, 0x01, 0x00});
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Ok && proxy.length == 32,
+        "PROXY: TLV skipped");
+
+    // LOCAL carries no address, whatever its family and transport
+    data = proxyHeader(0x20, 0x00, {});
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Ok && proxy.local,
+        "PROXY: LOCAL");
+
+    // The payload follows the header
+    data = proxyHeader(0x21, 0x12, IPV4_ADDRESSES);
+    data.insert(data.end(), {0x00, 0x01, 0x00, 0x00});
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Ok && proxy.length == 28,
+        "PROXY: payload after the header");
+  }
+
+  void checkProxyBad()
+  {
+    ProxyHeader proxy;
+    auto data = proxyHeader(0x21, 0x12, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Invalid,
+        "PROXY: DGRAM accepted on a stream");
+    data = proxyHeader(0x21, 0x11, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: STREAM accepted on datagrams");
+    data = proxyHeader(0x21, 0x10, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: UNSPEC transport accepted");
+
+    data = proxyHeader(0x21, 0x12, IPV4_ADDRESSES);
+    data[3] ^= 0xFF;
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: bad signature accepted");
+
+    data = proxyHeader(0x11, 0x12, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: version 1 accepted");
+    data = proxyHeader(0x22, 0x12, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: unknown command accepted");
+
+    // Address block shorter than the family needs
+    data = proxyHeader(0x21, 0x12, {192, 0, 2, 1, 198, 51, 100, 1});
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: short IPv4 block accepted");
+    data = proxyHeader(0x21, 0x22, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: short IPv6 block accepted");
+
+    // AF_UNIX and AF_UNSPEC have no client address
+    data = proxyHeader(0x21, 0x31, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Invalid,
+        "PROXY: AF_UNIX accepted");
+    data = proxyHeader(0x21, 0x01, IPV4_ADDRESSES);
+    check(parseProxy(data, ProxyTransport::Stream, proxy) == ProxyParseResult::Invalid,
+        "PROXY: AF_UNSPEC accepted");
+
+    // Truncated: a signature prefix waits for more, anything else is invalid
+    data = proxyHeader(0x21, 0x12, IPV4_ADDRESSES);
+    check(parseProxyV2(data.data(), 8, ProxyTransport::Dgram, proxy) == ProxyParseResult::Incomplete,
+        "PROXY: signature prefix not incomplete");
+    check(parseProxyV2(data.data(), 20, ProxyTransport::Dgram, proxy) == ProxyParseResult::Incomplete,
+        "PROXY: truncated addresses not incomplete");
+    const uint8_t stun[8] = {0x00, 0x01, 0x00, 0x00, 0x21, 0x12, 0xA4, 0x42};
+    check(parseProxyV2(stun, sizeof(stun), ProxyTransport::Dgram, proxy) == ProxyParseResult::Invalid,
+        "PROXY: STUN taken for a header");
+  }
+
+  std::vector<uint8_t> stunMessage(uint16_t type, std::initializer_list<uint8_t> attributes)
+  {
+    std::vector<uint8_t> out = {static_cast<uint8_t>(type >> 8), static_cast<uint8_t>(type),
+        static_cast<uint8_t>(attributes.size() >> 8), static_cast<uint8_t>(attributes.size()), 0x21, 0x12, 0xA4,
+        0x42, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    out.insert(out.end(), attributes);
+    return out;
+  }
+
+  bool parses(const std::vector<uint8_t>& data)
+  {
+    StunMessage msg;
+    return msg.parse(data.data(), data.size());
+  }
+
+  void checkStunGood()
+  {
+    StunMessage msg;
+    auto data = stunMessage(0x0001, {});
+    check(msg.parse(data.data(), data.size()) && msg.method() == METHOD_BINDING && msg.cls() == CLASS_REQUEST,
+        "STUN: Binding request");
+
+    // SOFTWARE "ab", padded, then XOR-MAPPED-ADDRESS 192.0.2.1:32853
+    data = stunMessage(0x0101, {0x80, 0x22, 0x00, 0x02, 'a', 'b', 0, 0, 0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xA1, 0x47,
+        0xE1, 0x12, 0xA6, 0x43});
+    udp::endpoint mapped;
+    check(msg.parse(data.data(), data.size()) && msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped)
+            && mapped == udp::endpoint(boost::asio::ip::make_address("192.0.2.1"), 32853),
+        "STUN: XOR-MAPPED-ADDRESS");
+
+    StunAttribute software;
+    check(msg.find(ATTR_SOFTWARE, software) && software.length == 2, "STUN: SOFTWARE");
+
+    // Bytes past the announced length are not part of the message
+    data = stunMessage(0x0001, {});
+    data.insert(data.end(), {0xFF, 0xFF, 0xFF, 0xFF});
+    check(msg.parse(data.data(), data.size()) && msg.size() == STUN_HEADER_SIZE, "STUN: trailing bytes");
+
+    // Exactly at the limits
+    std::vector<uint8_t> attributes;
+    for (std::size_t i = 0; i < STUN_MAX_ATTRIBUTES; ++i)
+      attributes.insert(attributes.end(), {0x80, 0x22, 0x00, 0x00});
+    data = stunMessage(0x0001, {});
+    data.insert(data.end(), attributes.begin(), attributes.end());
+    data[2] = static_cast<uint8_t>(attributes.size() >> 8);
+    data[3] = static_cast<uint8_t>(attributes.size());
+    check(parses(data), "STUN: STUN_MAX_ATTRIBUTES attributes");
+  }
+
+  void checkStunBad()
+  {
+    check(!parses(std::vector<uint8_t>(STUN_HEADER_SIZE - 1, 0)), "STUN: short header accepted");
+
+    auto data = stunMessage(0x0001, {});
+    data[0] |= 0x40;
+    check(!parses(data), "STUN: ChannelData taken for STUN");
+
+    data = stunMessage(0x0001, {});
+    data[4] ^= 0xFF;
+    check(!parses(data), "STUN: bad magic cookie accepted");
+
+    data = stunMessage(0x0001, {0x80, 0x22, 0x00, 0x00});
+    data[3] = 2;
+    check(!parses(data), "STUN: unaligned length accepted");
+
+    data = stunMessage(0x0001, {0x80, 0x22, 0x00, 0x00});
+    data[3] = 8;
+    check(!parses(data), "STUN: length past the datagram accepted");
+
+    // Attribute longer than what is left of the message
+    data = stunMessage(0x0001, {0x80, 0x22, 0x00, 0x08, 'a', 'b', 'c', 'd'});
+    check(!parses(data), "STUN: overrunning attribute accepted");
+
+    // One attribute too many
+    std::vector<uint8_t> attributes;
+    for (std::size_t i = 0; i <= STUN_MAX_ATTRIBUTES; ++i)
+      attributes.insert(attributes.end(), {0x80, 0x22, 0x00, 0x00});
+    data = stunMessage(0x0001, {});
+    data.insert(data.end(), attributes.begin(), attributes.end());
+    data[2] = static_cast<uint8_t>(attributes.size() >> 8);
+    data[3] = static_cast<uint8_t>(attributes.size());
+    check(!parses(data), "STUN: too many attributes accepted");
+
+    // Larger than STUN_MAX_MESSAGE_SIZE, in one attribute
+    const std::size_t length = STUN_MAX_MESSAGE_SIZE - STUN_HEADER_SIZE;
+    data = stunMessage(0x0001, {0x80, 0x22, static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length)});
+    data.resize(STUN_HEADER_SIZE + 4 + length);
+    data[2] = static_cast<uint8_t>((length + 4) >> 8);
+    data[3] = static_cast<uint8_t>(length + 4);
+    check(!parses(data), "STUN: oversized message accepted");
+
+    // Address attributes whose length does not match the family
+    StunMessage msg;
+    udp::endpoint mapped;
+    data = stunMessage(0x0101, {0x00, 0x20, 0x00, 0x14, 0x00, 0x01, 0xA1, 0x47, 0xE1, 0x12, 0xA6, 0x43, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0});
+    check(msg.parse(data.data(), data.size()) && !msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped),
+        "STUN: IPv4 address with an IPv6 length accepted");
+    data = stunMessage(0x0101, {0x00, 0x20, 0x00, 0x08, 0x00, 0x02, 0xA1, 0x47, 0xE1, 0x12, 0xA6, 0x43});
+    check(msg.parse(data.data(), data.size()) && !msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped),
+        "STUN: IPv6 address with an IPv4 length accepted");
+    data = stunMessage(0x0101, {0x00, 0x20, 0x00, 0x08, 0x00, 0x03, 0xA1, 0x47, 0xE1, 0x12, 0xA6, 0x43});
+    check(msg.parse(data.data(), data.size()) && !msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped),
+        "STUN: unknown address family accepted");
+  }
+}
+
+int main()
+{
+  checkProxyGood();
+  checkProxyBad();
+  checkStunGood();
+  checkStunBad();
+
+  if (failures)
+  {
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  std::printf("PROXY and STUN parsers ok\n");
+  return 0;
+}
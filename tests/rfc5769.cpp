@@ -0,0 +1,214 @@
+// RFC 5769 test vectors through the server code: StunMessage parsing,
+// LongTermAuth::checkIntegrity and LongTermAuth::sign on the codec's HMAC,
+// FINGERPRINT, and the attributes ignored after MESSAGE-INTEGRITY
+// (RFC 5389 §15.4).
+//
+//   test-rfc5769
+
+#include "auth.hpp"
+#include "stunMessage.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+using boost::asio::ip::udp;
+using namespace ustun::protocol;
+
+namespace
+{
+  // 2.1, short-term credentials: ICE connectivity check
+  const uint8_t SAMPLE_REQUEST[] = {0x00, 0x01, 0x00, 0x58, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01, 0xbc,
+      0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x10, 0x53, 0x54, 0x55, 0x4e, 0x20, 0x74, 0x65,
+      0x73, 0x74, 0x20, 0x63, 0x6c, 0x69, 0x65, 0x6e, 0x74, 0x00, 0x24, 0x00, 0x04, 0x6e, 0x00, 0x01, 0xff, 0x80,
+      0x29, 0x00, 0x08, 0x93, 0x2f, 0xf9, 0xb1, 0x51, 0x26, 0x3b, 0x36, 0x00, 0x06, 0x00, 0x09, 0x65, 0x76, 0x74,
+      0x6a, 0x3a, 0x68, 0x36, 0x76, 0x59, 0x20, 0x20, 0x20, 0x00, 0x08, 0x00, 0x14, 0x9a, 0xea, 0xa7, 0x0c, 0xbf,
+      0xd8, 0xcb, 0x56, 0x78, 0x1e, 0xf2, 0xb5, 0xb2, 0xd3, 0xf2, 0x49, 0xc1, 0xb5, 0x71, 0xa2, 0x80, 0x28, 0x00,
+      0x04, 0xe5, 0x7a, 0x3b, 0xcf};
+
+  // 2.2, success response with an IPv4 XOR-MAPPED-ADDRESS
+  const uint8_t SAMPLE_IPV4_RESPONSE[] = {0x01, 0x01, 0x00, 0x3c, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+      0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x0b, 0x74, 0x65, 0x73, 0x74, 0x20, 0x76,
+      0x65, 0x63, 0x74, 0x6f, 0x72, 0x20, 0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xa1, 0x47, 0xe1, 0x12, 0xa6, 0x43,
+      0x00, 0x08, 0x00, 0x14, 0x2b, 0x91, 0xf5, 0x99, 0xfd, 0x9e, 0x90, 0xc3, 0x8c, 0x74, 0x89, 0xf9, 0x2a, 0xf9,
+      0xba, 0x53, 0xf0, 0x6b, 0xe7, 0xd7, 0x80, 0x28, 0x00, 0x04, 0xc0, 0x7d, 0x4c, 0x96};
+
+  // 2.3, success response with an IPv6 XOR-MAPPED-ADDRESS
+  const uint8_t SAMPLE_IPV6_RESPONSE[] = {0x01, 0x01, 0x00, 0x48, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+      0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x0b, 0x74, 0x65, 0x73, 0x74, 0x20, 0x76,
+      0x65, 0x63, 0x74, 0x6f, 0x72, 0x20, 0x00, 0x20, 0x00, 0x14, 0x00, 0x02, 0xa1, 0x47, 0x01, 0x13, 0xa9, 0xfa,
+      0xa5, 0xd3, 0xf1, 0x79, 0xbc, 0x25, 0xf4, 0xb5, 0xbe, 0xd2, 0xb9, 0xd9, 0x00, 0x08, 0x00, 0x14, 0xa3, 0x82,
+      0x95, 0x4e, 0x4b, 0xe6, 0x7b, 0xf1, 0x17, 0x84, 0xc9, 0x7c, 0x82, 0x92, 0xc2, 0x75, 0xbf, 0xe3, 0xed, 0x41,
+      0x80, 0x28, 0x00, 0x04, 0xc8, 0xfb, 0x0b, 0x4c};
+
+  // 2.4, long-term credentials, no FINGERPRINT
+  const uint8_t SAMPLE_LONG_TERM_REQUEST[] = {0x00, 0x01, 0x00, 0x60, 0x21, 0x12, 0xa4, 0x42, 0x78, 0xad, 0x34,
+      0x33, 0xc6, 0xad, 0x72, 0xc0, 0x29, 0xda, 0x41, 0x2e, 0x00, 0x06, 0x00, 0x12, 0xe3, 0x83, 0x9e, 0xe3, 0x83,
+      0x88, 0xe3, 0x83, 0xaa, 0xe3, 0x83, 0x83, 0xe3, 0x82, 0xaf, 0xe3, 0x82, 0xb9, 0x00, 0x00, 0x00, 0x15, 0x00,
+      0x1c, 0x66, 0x2f, 0x2f, 0x34, 0x39, 0x39, 0x6b, 0x39, 0x35, 0x34, 0x64, 0x36, 0x4f, 0x4c, 0x33, 0x34, 0x6f,
+      0x4c, 0x39, 0x46, 0x53, 0x54, 0x76, 0x79, 0x36, 0x34, 0x73, 0x41, 0x00, 0x14, 0x00, 0x0b, 0x65, 0x78, 0x61,
+      0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x6f, 0x72, 0x67, 0x00, 0x00, 0x08, 0x00, 0x14, 0xf6, 0x70, 0x24, 0x65, 0x6d,
+      0xd6, 0x4a, 0x3e, 0x02, 0xb8, 0xe0, 0x71, 0x2e, 0x85, 0xc9, 0xa2, 0x8c, 0xa8, 0x96, 0x66};
+
+  struct Vector
+  {
+    const char* name;
+    const uint8_t* data;
+    std::size_t size;
+    AuthKey key;
+    bool fingerprint;
+  };
+
+  int failures = 0;
+
+  void check(bool ok, const char* vector, const char* what)
+  {
+    if (ok)
+      return;
+    std::fprintf(stderr, "%s: %s\n", vector, what);
+    ++failures;
+  }
+
+  AuthKey shortTermKey(const std::string& password)
+  {
+    AuthKey key;
+    std::memcpy(key.bytes.data(), password.data(), password.size());
+    key.length = password.size();
+    return key;
+  }
+
+  // MD5(username:realm:password), as the server derives it for `user`
+  AuthKey longTermKey(const std::string& username, const std::string& realm, const std::string& password)
+  {
+    const std::string input = username + ":" + realm + ":" + password;
+    AuthKey key;
+    unsigned length = 0;
+    EVP_Digest(input.data(), input.size(), key.bytes.data(), &length, EVP_md5(), nullptr);
+    key.length = length;
+    return key;
+  }
+
+  // Offset of the first attribute of the given type, 0 when absent
+  std::size_t offsetOf(const StunMessage& msg, uint16_t type)
+  {
+    StunAttribute attr;
+    return msg.find(type, attr) ? static_cast<std::size_t>(attr.value - 4 - msg.data()) : 0;
+  }
+
+  void checkVector(const Vector& v)
+  {
+    StunMessage msg;
+    check(msg.parse(v.data, v.size), v.name, "does not parse");
+    if (!msg.data())
+      return;
+
+    check(LongTermAuth::checkIntegrity(msg, v.key.data(), v.key.size()), v.name, "MESSAGE-INTEGRITY rejected");
+    check(msg.view().checkFingerprint() == v.fingerprint, v.name, "FINGERPRINT check");
+
+    // The server signs a response built up to MESSAGE-INTEGRITY, FINGERPRINT
+    // goes last: both have to come out byte for byte
+    const std::size_t integrity = offsetOf(msg, ATTR_MESSAGE_INTEGRITY);
+    std::vector<uint8_t> rebuilt(v.data, v.data + integrity);
+    LongTermAuth::sign(rebuilt, v.key);
+    if (v.fingerprint)
+    {
+      const std::size_t bytes = rebuilt.size();
+      rebuilt.resize(bytes + ustun::attributeSize(4));
+      ustun::encodeFingerprint(rebuilt.data(), bytes);
+    }
+    check(rebuilt.size() == v.size && std::memcmp(rebuilt.data(), v.data, v.size) == 0, v.name,
+        "signed message differs from the vector");
+
+    // Any modified byte before MESSAGE-INTEGRITY breaks it, and FINGERPRINT
+    std::vector<uint8_t> tampered(v.data, v.data + v.size);
+    tampered[STUN_HEADER_SIZE + 4] ^= 0x01;
+    StunMessage bad;
+    check(bad.parse(tampered.data(), tampered.size()), v.name, "tampered copy does not parse");
+    check(!LongTermAuth::checkIntegrity(bad, v.key.data(), v.key.size()), v.name,
+        "MESSAGE-INTEGRITY accepted a modified message");
+    check(!bad.view().checkFingerprint(), v.name, "FINGERPRINT accepted a modified message");
+
+    // And a wrong key
+    AuthKey wrong = v.key;
+    wrong.bytes[0] ^= 0x01;
+    check(!LongTermAuth::checkIntegrity(msg, wrong.data(), wrong.size()), v.name,
+        "MESSAGE-INTEGRITY accepted a wrong key");
+  }
+
+  void checkMappedAddress(const uint8_t* data, std::size_t size, const char* name, const udp::endpoint& expected)
+  {
+    StunMessage msg;
+    udp::endpoint mapped;
+    check(msg.parse(data, size) && msg.xorAddress(ATTR_XOR_MAPPED_ADDRESS, mapped) && mapped == expected, name,
+        "XOR-MAPPED-ADDRESS");
+  }
+
+  // Attributes appended after MESSAGE-INTEGRITY are not authenticated:
+  // only FINGERPRINT may be found there
+  void checkAfterIntegrity(const AuthKey& key)
+  {
+    const char* name = "after MESSAGE-INTEGRITY";
+    std::vector<uint8_t> data(SAMPLE_LONG_TERM_REQUEST, SAMPLE_LONG_TERM_REQUEST + sizeof(SAMPLE_LONG_TERM_REQUEST));
+    const auto append = [&data](uint16_t type, const char* value) {
+      const auto length = static_cast<uint16_t>(std::strlen(value));
+      const std::size_t bytes = data.size();
+      data.resize(bytes + ustun::attributeSize(length));
+      ustun::encodeAttribute(data.data() + bytes, type, reinterpret_cast<const uint8_t*>(value), length);
+      ustun::detail::write16(data.data() + 2, static_cast<uint16_t>(data.size() - STUN_HEADER_SIZE));
+    };
+    append(ATTR_SOFTWARE, "injected");
+    append(ATTR_USERNAME, "mallory");
+    const std::size_t bytes = data.size();
+    data.resize(bytes + ustun::attributeSize(4));
+    ustun::encodeFingerprint(data.data(), bytes);
+
+    StunMessage msg;
+    check(msg.parse(data.data(), data.size()), name, "does not parse");
+
+    StunAttribute attr;
+    check(!msg.find(ATTR_SOFTWARE, attr), name, "SOFTWARE found past MESSAGE-INTEGRITY");
+    check(msg.find(ATTR_USERNAME, attr) && attr.length == 18, name, "USERNAME is not the authenticated one");
+    check(msg.find(ATTR_FINGERPRINT, attr), name, "FINGERPRINT not found");
+    check(msg.view().checkFingerprint(), name, "FINGERPRINT check");
+    check(LongTermAuth::checkIntegrity(msg, key.data(), key.size()), name, "MESSAGE-INTEGRITY rejected");
+
+    int usernames = 0;
+    msg.forEach(ATTR_USERNAME, [&usernames](const StunAttribute&) { ++usernames; });
+    check(usernames == 1, name, "forEach went past MESSAGE-INTEGRITY");
+  }
+}
+
+int main()
+{
+  const AuthKey shortTerm = shortTermKey("VOkJxbRl1RmTxUk/WvJxBt");
+  // 2.4 username and password, after SASLprep
+  const AuthKey longTerm  = longTermKey("\xe3\x83\x9e\xe3\x83\x88\xe3\x83\xaa\xe3\x83\x83\xe3\x82\xaf\xe3\x82\xb9",
+      "example.org", "TheMatrIX");
+
+  const Vector vectors[] = {
+      {"2.1 sample request", SAMPLE_REQUEST, sizeof(SAMPLE_REQUEST), shortTerm, true},
+      {"2.2 IPv4 response", SAMPLE_IPV4_RESPONSE, sizeof(SAMPLE_IPV4_RESPONSE), shortTerm, true},
+      {"2.3 IPv6 response", SAMPLE_IPV6_RESPONSE, sizeof(SAMPLE_IPV6_RESPONSE), shortTerm, true},
+      {"2.4 long-term request", SAMPLE_LONG_TERM_REQUEST, sizeof(SAMPLE_LONG_TERM_REQUEST), longTerm, false},
+  };
+  for (const auto& v : vectors)
+    checkVector(v);
+
+  checkMappedAddress(SAMPLE_IPV4_RESPONSE, sizeof(SAMPLE_IPV4_RESPONSE), vectors[1].name,
+      udp::endpoint(boost::asio::ip::make_address("192.0.2.1"), 32853));
+  checkMappedAddress(SAMPLE_IPV6_RESPONSE, sizeof(SAMPLE_IPV6_RESPONSE), vectors[2].name,
+      udp::endpoint(boost::asio::ip::make_address("2001:db8:1234:5678:11:2233:4455:6677"), 32853));
+
+  checkAfterIntegrity(longTerm);
+
+  if (failures)
+  {
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  std::printf("RFC 5769 vectors ok\n");
+  return 0;
+}